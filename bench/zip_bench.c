@@ -0,0 +1,506 @@
+/**
+ * \file
+ * ZIP compression - Benchmarks.
+ *
+ * Run with \c make \c bench. A case name can be given as argument to run only that case.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+/* include area */
+#include "zip.h"
+#include "zip_async.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/*-----------------------------------------------------------------------------
+   Internal definitions
+-----------------------------------------------------------------------------*/
+
+/** Size of the data compressed by the throughput cases. */
+#define STREAM_SIZE ( 64 << 20 )
+
+/** Number of threads of the concurrent cases. */
+#define NUM_THREADS 4
+
+/** Number of archives of the scheduler case. */
+#define NUM_ARCHIVES 64
+
+/** Number of entries written by the small entry cases. */
+#define NUM_SMALL_ENTRIES 200000
+
+/** Size of each entry of the small entry cases. */
+#define SMALL_ENTRY_SIZE 100
+
+/** Number of lines written by the latency cases. */
+#define NUM_LINES 2000
+
+/** Time between lines in the latency cases (ns). */
+#define LINE_INTERVAL_NS 250000
+
+
+/*-----------------------------------------------------------------------------
+   Internal data types
+-----------------------------------------------------------------------------*/
+
+/** A benchmark case. */
+struct bench_case
+{
+  /** Name of the case. */
+  const char *name;
+
+  /** Runs the case and prints its results. */
+  void ( *run )( void );
+};
+
+/** Times at which the output callback received data. */
+struct sink_times
+{
+  /** Timestamps (ns). */
+  uint64_t *times;
+
+  /** Number of timestamps. */
+  size_t num_times;
+
+  /** Capacity of \a times. */
+  size_t max_times;
+
+  /** Bytes received. */
+  size_t bytes;
+};
+
+
+/*-----------------------------------------------------------------------------
+   Helper functions
+-----------------------------------------------------------------------------*/
+
+/** Returns a monotonic timestamp.
+ *
+ *  \return Nanoseconds since an arbitrary point.
+ */
+static uint64_t _now_ns( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ( uint64_t )ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+
+/** Discards Zipped data.
+ *
+ *  \param cb_ctx Pointer to the number of bytes received.
+ *  \param data Zipped data.
+ *  \param data_len Zipped data length.
+ *  \return \c true.
+ */
+static bool _zip_to_null( void *cb_ctx, const uint8_t *data, size_t data_len )
+{
+  size_t *bytes = cb_ctx;
+  *bytes += data_len;
+  return true;
+}
+
+
+/** Records the time at which Zipped data is received.
+ *
+ *  \param cb_ctx Pointer to a \a sink_times.
+ *  \param data Zipped data.
+ *  \param data_len Zipped data length.
+ *  \return \c true.
+ */
+static bool _zip_to_times( void *cb_ctx, const uint8_t *data, size_t data_len )
+{
+  struct sink_times *sink = cb_ctx;
+  sink->bytes += data_len;
+  if( sink->num_times == sink->max_times )
+    return false;
+
+  sink->times[sink->num_times++] = _now_ns();
+  return true;
+}
+
+
+/** Compares two timestamps for \c qsort.
+ *
+ *  \param a First timestamp.
+ *  \param b Second timestamp.
+ *  \return Comparison result.
+ */
+static int _compare_times( const void *a, const void *b )
+{
+  uint64_t ta = *( const uint64_t * )a;
+  uint64_t tb = *( const uint64_t * )b;
+  return ( ta > tb ) - ( ta < tb );
+}
+
+
+/** Fills a buffer with compressible text.
+ *
+ *  \param buffer Output buffer.
+ *  \param buffer_len Size of \a buffer.
+ */
+static void _fill_text( char *buffer, size_t buffer_len )
+{
+  for( size_t i = 0; i < buffer_len; i++ )
+    buffer[i] = "lorem ipsum dolor sit amet, consectetur adipiscing elit\n"[i % 57];
+}
+
+
+/** Writes an entry of \a STREAM_SIZE / \a NUM_THREADS bytes through an entry handle.
+ *
+ *  \param arg ZIP context.
+ *  \return \c NULL.
+ */
+static void *_write_handle( void *arg )
+{
+  char chunk[64 << 10];
+  _fill_text( chunk, sizeof( chunk ) );
+
+  zip_entry_h *h = zip_entry_open( arg, "data", zip_get_datetime() );
+  for( size_t i = 0; i < STREAM_SIZE / NUM_THREADS; i += sizeof( chunk ) )
+    zip_entry_write( h, chunk, sizeof( chunk ) );
+  zip_entry_close( h );
+
+  return NULL;
+}
+
+
+/** Compresses \a STREAM_SIZE bytes of text into a single entry and prints the throughput.
+ *
+ *  \param name Name of the case.
+ *  \param opts ZIP options.
+ *  \param chunk_size Bytes given to each \a zip_entry_update.
+ */
+static void _throughput( const char *name, const zip_options_t *opts, size_t chunk_size )
+{
+  char *chunk = malloc( chunk_size );
+  _fill_text( chunk, chunk_size );
+
+  size_t bytes = 0;
+  zip_t z;
+  zip_init_ex( &z, _zip_to_null, &bytes, opts );
+
+  uint64_t start = _now_ns();
+  zip_entry_add( &z, "data", zip_get_datetime() );
+  for( size_t i = 0; i < STREAM_SIZE; i += chunk_size )
+    zip_entry_update( &z, chunk, chunk_size );
+  zip_entry_end( &z );
+  zip_end( &z );
+  uint64_t elapsed = _now_ns() - start;
+
+  zip_release( &z );
+  free( chunk );
+
+  printf( "%-28s %8.1f MiB/s  %10zu bytes\n", name, ( STREAM_SIZE / 1048576.0 ) / ( elapsed / 1e9 ), bytes );
+}
+
+
+/** Compresses \a STREAM_SIZE bytes of text through the compression thread and prints the
+ *  throughput and the time spent by the caller per submission (including the waits for a free
+ *  slot once the queue is full).
+ *
+ *  \param name Name of the case.
+ *  \param chunk_size Bytes given to each \a zip_async_entry_update.
+ */
+static void _async_throughput( const char *name, size_t chunk_size )
+{
+  char *chunk = malloc( chunk_size );
+  _fill_text( chunk, chunk_size );
+
+  size_t bytes = 0;
+  zip_t z;
+  zip_async_t a;
+  zip_init( &z, _zip_to_null, &bytes );
+  zip_async_init( &a, &z, 0 );
+
+  /* the chunk is never modified, so it can be queued many times without waiting for it */
+  uint64_t start = _now_ns();
+  zip_async_entry_add( &a, "data", zip_get_datetime() );
+  for( size_t i = 0; i < STREAM_SIZE; i += chunk_size )
+    zip_async_entry_update( &a, chunk, chunk_size, NULL, NULL );
+  zip_async_entry_end( &a, NULL, NULL );
+  uint64_t submitted = _now_ns() - start;
+
+  zip_async_wait( &a );
+  zip_end( &z );
+  uint64_t elapsed = _now_ns() - start;
+
+  zip_async_release( &a );
+  zip_release( &z );
+  free( chunk );
+
+  printf( "%-28s %8.1f MiB/s  %10zu bytes  caller %8.2f us/chunk\n", name,
+          ( STREAM_SIZE / 1048576.0 ) / ( elapsed / 1e9 ), bytes, submitted / 1e3 / ( STREAM_SIZE / chunk_size ) );
+}
+
+
+/** Writes \a NUM_SMALL_ENTRIES entries of \a SMALL_ENTRY_SIZE bytes and prints the entries
+ *  per second.
+ *
+ *  \param name Name of the case.
+ *  \param whole Whether the entries are added with \a zip_entry_add_data.
+ */
+static void _small_entries( const char *name, bool whole )
+{
+  size_t bytes = 0;
+  zip_t z;
+  zip_init( &z, _zip_to_null, &bytes );
+
+  /* the same timestamp for every entry, zip_get_datetime would dominate the results */
+  struct zip_datetime datetime = zip_get_datetime();
+
+  uint64_t start = _now_ns();
+  for( size_t i = 0; i < NUM_SMALL_ENTRIES; i++ )
+  {
+    char entry_name[32];
+    char data[SMALL_ENTRY_SIZE];
+    snprintf( entry_name, sizeof( entry_name ), "%zu.json", i );
+    _fill_text( data, sizeof( data ) );
+    data[0] = ( char )i;
+
+    if( whole )
+      zip_entry_add_data( &z, entry_name, datetime, data, sizeof( data ) );
+    else
+    {
+      zip_entry_add( &z, entry_name, datetime );
+      zip_entry_update( &z, data, sizeof( data ) );
+      zip_entry_end( &z );
+    }
+  }
+  zip_end( &z );
+  uint64_t elapsed = _now_ns() - start;
+
+  zip_release( &z );
+  printf( "%-28s %8.0f entries/s  %10zu bytes\n", name, NUM_SMALL_ENTRIES / ( elapsed / 1e9 ), bytes );
+}
+
+
+/** Writes \a NUM_LINES log lines into an entry at a fixed pace and prints the time to the first
+ *  byte of entry data and the time until each line is followed by output.
+ *
+ *  \param name Name of the case.
+ *  \param opts ZIP options.
+ *
+ *  \note The latency of a line is measured until the next output, which is a lower bound when
+ *        deflate doesn't flush (the output may not contain the line yet).
+ */
+static void _latency( const char *name, const zip_options_t *opts )
+{
+  /* several outputs per line at most, plus the headers and records */
+  struct sink_times sink = { .max_times = NUM_LINES * 4 + 64 };
+  sink.times = malloc( sink.max_times * sizeof( uint64_t ) );
+  uint64_t *line_times = malloc( NUM_LINES * sizeof( uint64_t ) );
+
+  zip_t z;
+  zip_init_ex( &z, _zip_to_times, &sink, opts );
+  zip_entry_add( &z, "log", zip_get_datetime() );
+  size_t header_outputs = sink.num_times;
+
+  const struct timespec interval = { .tv_nsec = LINE_INTERVAL_NS };
+  for( size_t i = 0; i < NUM_LINES; i++ )
+  {
+    char line[128];
+    int line_len = snprintf( line, sizeof( line ), "%zu INFO request served in %zu us by worker %zu\n", i,
+                             ( i * 7919 ) % 1000, i % 8 );
+
+    line_times[i] = _now_ns();
+    zip_entry_update( &z, line, line_len );
+    nanosleep( &interval, NULL );
+  }
+
+  zip_entry_end( &z );
+  uint64_t end = _now_ns();
+  zip_end( &z );
+  zip_release( &z );
+
+  uint64_t first_line = line_times[0];
+  uint64_t first_output = ( header_outputs < sink.num_times ) ? sink.times[header_outputs] : end;
+
+  /* each line waits for the first output after it, or for the end of the entry */
+  size_t next = header_outputs;
+  for( size_t i = 0; i < NUM_LINES; i++ )
+  {
+    while( next < sink.num_times && sink.times[next] < line_times[i] )
+      next++;
+    line_times[i] = ( ( next < sink.num_times ) ? sink.times[next] : end ) - line_times[i];
+  }
+
+  qsort( line_times, NUM_LINES, sizeof( uint64_t ), _compare_times );
+  printf( "%-28s ttfb %8.2f ms  p50 %8.2f ms  p99 %8.2f ms  max %8.2f ms  %zu outputs\n", name,
+          ( first_output - first_line ) / 1e6, line_times[NUM_LINES / 2] / 1e6,
+          line_times[NUM_LINES * 99 / 100] / 1e6, line_times[NUM_LINES - 1] / 1e6,
+          sink.num_times - header_outputs );
+
+  free( line_times );
+  free( sink.times );
+}
+
+
+/*-----------------------------------------------------------------------------
+   Benchmark cases
+-----------------------------------------------------------------------------*/
+
+static void _bench_stream( void )
+{
+  zip_options_t opts;
+  zip_options_init( &opts );
+  _throughput( "stream", &opts, 64 << 10 );
+}
+
+static void _bench_stream_flush( void )
+{
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.flush_bytes = 64 << 10;
+  _throughput( "stream_flush_64k", &opts, 4 << 10 );
+}
+
+static void _bench_stream_budget_small( void )
+{
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.memory_budget = 64 << 10;
+  _throughput( "stream_budget_64k", &opts, 64 << 10 );
+}
+
+static void _bench_stream_budget_large( void )
+{
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.memory_budget = 1 << 20;
+  _throughput( "stream_budget_1m", &opts, 64 << 10 );
+}
+
+static void _bench_handles( void )
+{
+  size_t bytes = 0;
+  zip_t z;
+  zip_init( &z, _zip_to_null, &bytes );
+
+  /* the same amount of data as the stream case, split in entries compressed concurrently */
+  uint64_t start = _now_ns();
+  pthread_t threads[NUM_THREADS];
+  for( size_t i = 0; i < NUM_THREADS; i++ )
+    pthread_create( &threads[i], NULL, _write_handle, &z );
+  for( size_t i = 0; i < NUM_THREADS; i++ )
+    pthread_join( threads[i], NULL );
+  zip_end( &z );
+  uint64_t elapsed = _now_ns() - start;
+
+  zip_release( &z );
+  printf( "%-28s %8.1f MiB/s  %10zu bytes\n", "handles_4_threads", ( STREAM_SIZE / 1048576.0 ) / ( elapsed / 1e9 ),
+          bytes );
+}
+
+static void _bench_async( void )
+{
+  _async_throughput( "async_stream", 64 << 10 );
+}
+
+static void _bench_sched( void )
+{
+  char *chunk = malloc( 64 << 10 );
+  _fill_text( chunk, 64 << 10 );
+
+  zip_sched_t s;
+  zip_sched_init( &s, NUM_THREADS );
+
+  /* the same amount of data as the stream case, split in archives sharing the threads */
+  size_t bytes[NUM_ARCHIVES] = { 0 };
+  zip_t *z = malloc( NUM_ARCHIVES * sizeof( zip_t ) );
+  zip_async_t *a = malloc( NUM_ARCHIVES * sizeof( zip_async_t ) );
+  uint64_t start = _now_ns();
+  for( size_t k = 0; k < NUM_ARCHIVES; k++ )
+  {
+    zip_init( &z[k], _zip_to_null, &bytes[k] );
+    zip_async_init_sched( &a[k], &z[k], 0, &s, 1 );
+    zip_async_entry_add( &a[k], "data", zip_get_datetime() );
+  }
+
+  for( size_t i = 0; i < STREAM_SIZE / NUM_ARCHIVES; i += 64 << 10 )
+    for( size_t k = 0; k < NUM_ARCHIVES; k++ )
+      zip_async_entry_update( &a[k], chunk, 64 << 10, NULL, NULL );
+
+  size_t total = 0;
+  for( size_t k = 0; k < NUM_ARCHIVES; k++ )
+  {
+    zip_async_entry_end( &a[k], NULL, NULL );
+    zip_async_wait( &a[k] );
+    zip_end( &z[k] );
+    zip_async_release( &a[k] );
+    zip_release( &z[k] );
+    total += bytes[k];
+  }
+  uint64_t elapsed = _now_ns() - start;
+
+  zip_sched_release( &s );
+  free( a );
+  free( z );
+  free( chunk );
+  printf( "%-28s %8.1f MiB/s  %10zu bytes\n", "sched_64_archives_4_threads",
+          ( STREAM_SIZE / 1048576.0 ) / ( elapsed / 1e9 ), total );
+}
+
+static void _bench_small_entries( void )
+{
+  _small_entries( "small_entries_100b", false );
+}
+
+static void _bench_small_entries_whole( void )
+{
+  _small_entries( "small_entries_100b_whole", true );
+}
+
+static void _bench_latency( void )
+{
+  zip_options_t opts;
+  zip_options_init( &opts );
+  _latency( "latency_no_flush", &opts );
+}
+
+static void _bench_latency_bytes( void )
+{
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.flush_bytes = 4 << 10;
+  _latency( "latency_flush_4k", &opts );
+}
+
+static void _bench_latency_time( void )
+{
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.flush_latency_ms = 10;
+  _latency( "latency_flush_10ms", &opts );
+}
+
+
+/** Benchmark cases in execution order. */
+static const struct bench_case _cases[] = {
+  { "stream", _bench_stream },
+  { "stream_flush_64k", _bench_stream_flush },
+  { "stream_budget_64k", _bench_stream_budget_small },
+  { "stream_budget_1m", _bench_stream_budget_large },
+  { "handles_4_threads", _bench_handles },
+  { "async_stream", _bench_async },
+  { "sched_64_archives_4_threads", _bench_sched },
+  { "small_entries_100b", _bench_small_entries },
+  { "small_entries_100b_whole", _bench_small_entries_whole },
+  { "latency_no_flush", _bench_latency },
+  { "latency_flush_4k", _bench_latency_bytes },
+  { "latency_flush_10ms", _bench_latency_time },
+};
+
+
+int main( int argc, char *argv[] )
+{
+  for( size_t i = 0; i < sizeof( _cases ) / sizeof( _cases[0] ); i++ )
+    if( argc < 2 || strcmp( argv[1], _cases[i].name ) == 0 )
+      _cases[i].run();
+
+  return EXIT_SUCCESS;
+}
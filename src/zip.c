@@ -3,20 +3,82 @@
  * ZIP compression - Implementation.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 /* include area */
 #include "string.h"
 #include "zip.h"
+#include "zip_map.h"
 #include "varray.h"
+#include <ctype.h>
 #include <time.h>
+#include <unistd.h>
 
 
 /*-----------------------------------------------------------------------------
    Definitions
 -----------------------------------------------------------------------------*/
 
-/** Size of the internal buffer of the zip_t structure. */
+/** Size of the internal buffer of the zip_t structure (see \a memory_budget for others). */
 #define ZIP_INTERNAL_BUFFER_SIZE ( 4 << 10 )
 
+/** Memory allocated by zlib for a deflate stream besides its window and hash tables. */
+#define ZIP_DEFLATE_STATE_SIZE ( 6 << 10 )
+
+/** Share of the memory budget taken by the verifier: its buffer, a full queue and the inflate
+ *  stream of one entry. */
+#define ZIP_VERIFY_BUDGET ( ZIP_VERIFY_BUFFER_SIZE + ZIP_VERIFY_QUEUE_SIZE + ZIP_VERIFY_INFLATE_SIZE )
+
+/** Largest entry compressed by the small entry path of \a zip_entry_add_data. */
+#define ZIP_SMALL_ENTRY_SIZE ( 4 << 10 )
+
+/** Window of the small entry stream (as large as the biggest small entry). */
+#define ZIP_SMALL_ENTRY_WINDOW_BITS 12
+
+/** Memory level of the small entry stream. It sets the size of the hash table that is cleared
+ *  on every reset, 4096 entries instead of 32768 with the default level. */
+#define ZIP_SMALL_ENTRY_MEM_LEVEL 5
+
+/** Data checksummed, hashed and deflated at a time when digests are computed, so it's still in
+ *  the cache for the second and third passes. */
+#define ZIP_DIGEST_BLOCK_SIZE ( 16 << 10 )
+
+/** Compressed data given to the output at a time by \a zip_entry_copy_raw, so the rate limit
+ *  and the volumes see regular writes. */
+#define ZIP_COPY_CHUNK_SIZE ( 1 << 20 )
+
+/** Size of the AES extra field of the encrypted entries. */
+#define ZIP_AES_EXTRA_SIZE 11
+
+/** Compression method in the headers of the encrypted entries (the real one is in their AES
+ *  extra field). */
+#define ZIP_AES_METHOD 99U
+
+/** Maximum size of a central directory record. */
+#define ZIP_CD_RECORD_MAX_SIZE ( 46 + ZIP_ENTRY_MAX_NAME_LEN + ZIP_AES_EXTRA_SIZE )
+
+/** Minimum size of a volume of split archives. */
+#define ZIP_VOLUME_MIN_SIZE ( 64 << 10 )
+
+/** Maximum size of a volume of split archives: the offsets in the records are relative to their
+ *  volume, in 32 bit fields. */
+#define ZIP_VOLUME_MAX_SIZE 0xffffffffU
+
+/** Longest sleep of the rate limit before checking it again (us). */
+#define ZIP_RATE_MAX_SLEEP_US 100000
+
+/** Time measured in deflate and the output before adjusting an adaptive level (us). */
+#define ZIP_ADAPTIVE_WINDOW_US 50000
+
+/** Largest burst of the rate limit (its tokens are kept in millionths of a byte). */
+#define ZIP_RATE_MAX_BURST ( INT64_MAX / 1000000 )
+
+/** Signature at the beginning of a checkpoint ("ZCK1"). */
+#define ZIP_CHECKPOINT_SIGNATURE 0x314b435aU
+
+/** Size of the fixed part of a checkpoint. */
+#define ZIP_CHECKPOINT_HEADER_SIZE ( 4 + 5 * 8 )
+
 
 /*-----------------------------------------------------------------------------
    Useful macros
@@ -31,12 +93,25 @@
  */
 #define WRITE_LE( count, cb, cb_ctx, n ) ( _write_le( count, cb, cb_ctx, &( n ), sizeof( n ) ) )
 
+/** Stores the little-endian representation of \a n into a buffer.
+ *
+ *  \param p Pointer to the output pointer, that is advanced past the bytes written.
+ *  \param n The number to convert.
+ */
+#define PUT_LE( p, n ) ( _put_le( p, &( n ), sizeof( n ) ) )
+
 /** Gets the current entry from the ZIP context.
  *
  *  \param z ZIP context.
  */
 #define CUR_ENTRY( z ) ( varray_last( ( z )->entries ) )
 
+/** Gets the heap memory allocated for a \a varray.
+ *
+ *  \param ptr The \a varray.
+ */
+#define VARRAY_MEMORY( ptr ) ( sizeof( varray_t ) + varray_capacity( ptr ) * sizeof( *( ptr ) ) )
+
 
 /*-----------------------------------------------------------------------------
    Internal data types
@@ -174,6 +249,132 @@ struct zip_eof_central_dir
 };
 
 
+/** ZIP64 end of the central directory record structure. */
+struct zip_eof_central_dir64
+{
+  /** ZIP64 end of central directory signature (0x06064b50). */
+  uint32_t signature;
+
+  /** Size of the remaining record. */
+  uint64_t record_size;
+
+  /** Version made by. */
+  uint16_t made_by;
+
+  /** Version needed to extract. */
+  uint16_t extract_version;
+
+  /** Number of this disk. */
+  uint32_t disk_num;
+
+  /** Number of the disk with the start of the central directory. */
+  uint32_t start_disk_num;
+
+  /** Total number of entries in the central directory on this disk. */
+  uint64_t num_entries_in_disk;
+
+  /** total number of entries in the central directory. */
+  uint64_t num_entries;
+
+  /** Size of the central directory. */
+  uint64_t central_dir_size;
+
+  /** Offset of start of central directory with respect to the starting disk number. */
+  uint64_t offset;
+
+  /** Excluded in this implementation: ZIP64 extensible data sector (variable size). */
+};
+
+
+/** ZIP64 end of the central directory locator structure. */
+struct zip_eof_central_dir64_locator
+{
+  /** ZIP64 end of central directory locator signature (0x07064b50). */
+  uint32_t signature;
+
+  /** Number of the disk with the start of the ZIP64 end of central directory. */
+  uint32_t start_disk_num;
+
+  /** Relative offset of the ZIP64 end of central directory record. */
+  uint64_t offset;
+
+  /** Total number of disks. */
+  uint32_t num_disks;
+};
+
+
+/** Deflate parameters and buffer size chosen for a memory budget. */
+struct zip_memory_profile
+{
+  /** Base two logarithm of the window size. */
+  int window_bits;
+
+  /** Memory level. */
+  int mem_level;
+
+  /** Size of the output buffer. */
+  size_t buffer_size;
+};
+
+/** Default rules: formats that are already compressed are stored. */
+static const zip_rule_t _default_rules[] = {
+  /* by extension */
+  { "*.jpg", NULL, 0, 0 },
+  { "*.jpeg", NULL, 0, 0 },
+  { "*.png", NULL, 0, 0 },
+  { "*.gif", NULL, 0, 0 },
+  { "*.webp", NULL, 0, 0 },
+  { "*.mp3", NULL, 0, 0 },
+  { "*.mp4", NULL, 0, 0 },
+  { "*.mkv", NULL, 0, 0 },
+  { "*.mov", NULL, 0, 0 },
+  { "*.woff", NULL, 0, 0 },
+  { "*.woff2", NULL, 0, 0 },
+  { "*.zip", NULL, 0, 0 },
+  { "*.jar", NULL, 0, 0 },
+  { "*.gz", NULL, 0, 0 },
+  { "*.tgz", NULL, 0, 0 },
+  { "*.bz2", NULL, 0, 0 },
+  { "*.xz", NULL, 0, 0 },
+  { "*.zst", NULL, 0, 0 },
+  { "*.7z", NULL, 0, 0 },
+
+  /* by contents */
+  { NULL, "\xff\xd8\xff", 3, 0 },                 /* JPEG */
+  { NULL, "\x89PNG", 4, 0 },                      /* PNG */
+  { NULL, "GIF8", 4, 0 },                         /* GIF */
+  { NULL, "PK\x03\x04", 4, 0 },                   /* ZIP */
+  { NULL, "\x1f\x8b", 2, 0 },                     /* gzip */
+  { NULL, "BZh", 3, 0 },                          /* bzip2 */
+  { NULL, "\xfd" "7zXZ", 5, 0 },                  /* xz */
+  { NULL, "\x28\xb5\x2f\xfd", 4, 0 },             /* zstd */
+  { NULL, "7z\xbc\xaf\x27\x1c", 6, 0 },           /* 7z */
+  { NULL, "wOF2", 4, 0 },                         /* WOFF2 */
+};
+
+/** Header of the blocks allocated for zlib. */
+union zip_alloc_header
+{
+  /** Size of the block (without the header). */
+  size_t size;
+
+  /** Keeps the block after the header aligned for any type. */
+  long double align;
+};
+
+/** Memory profiles from the largest to the smallest (the default one is the third). */
+static const struct zip_memory_profile _memory_profiles[] = {
+  { 15, 9, 64 << 10 },
+  { 15, 8, 16 << 10 },
+  { 15, 8, ZIP_INTERNAL_BUFFER_SIZE },
+  { 14, 7, 4 << 10 },
+  { 13, 6, 4 << 10 },
+  { 12, 5, 2 << 10 },
+  { 11, 4, 2 << 10 },
+  { 10, 3, 1 << 10 },
+};
+
+
 /** Writes a 16 bit integer in little-endian into the output.
  *
  *  \param out_cb Output callback.
@@ -242,6 +443,108 @@ static bool _write64_le( zip_out_cb_t out_cb, void *out_cb_ctx, uint64_t input )
 }
 
 
+/** Stores a 16 bit integer in little-endian into a buffer.
+ *
+ *  \param output Output buffer (at least 2 bytes).
+ *  \param input The number to convert.
+ */
+static void _put16_le( uint8_t *output, uint16_t input )
+{
+  output[0] = ( uint8_t )( input );
+  output[1] = ( uint8_t )( input >> 8 );
+}
+
+
+/** Stores a 32 bit integer in little-endian into a buffer.
+ *
+ *  \param output Output buffer (at least 4 bytes).
+ *  \param input The number to convert.
+ */
+static void _put32_le( uint8_t *output, uint32_t input )
+{
+  output[0] = ( uint8_t )( input );
+  output[1] = ( uint8_t )( input >> 8 );
+  output[2] = ( uint8_t )( input >> 16 );
+  output[3] = ( uint8_t )( input >> 24 );
+}
+
+
+/** Stores a 64 bit integer in little-endian into a buffer.
+ *
+ *  \param output Output buffer (at least 8 bytes).
+ *  \param input The number to convert.
+ */
+static void _put64_le( uint8_t *output, uint64_t input )
+{
+  _put32_le( output, ( uint32_t )input );
+  _put32_le( output + 4, ( uint32_t )( input >> 32 ) );
+}
+
+
+/** Reads a 16 bit little-endian integer from a buffer.
+ *
+ *  \param input Input buffer (at least 2 bytes).
+ *  \return The number read.
+ */
+static uint16_t _get16_le( const uint8_t *input )
+{
+  return ( uint16_t )( input[0] | ( input[1] << 8 ) );
+}
+
+
+/** Reads a 32 bit little-endian integer from a buffer.
+ *
+ *  \param input Input buffer (at least 4 bytes).
+ *  \return The number read.
+ */
+static uint32_t _get32_le( const uint8_t *input )
+{
+  return ( uint32_t )input[0] | ( ( uint32_t )input[1] << 8 ) | ( ( uint32_t )input[2] << 16 ) |
+         ( ( uint32_t )input[3] << 24 );
+}
+
+
+/** Reads a 64 bit little-endian integer from a buffer.
+ *
+ *  \param input Input buffer (at least 8 bytes).
+ *  \return The number read.
+ */
+static uint64_t _get64_le( const uint8_t *input )
+{
+  return _get32_le( input ) | ( ( uint64_t )_get32_le( input + 4 ) << 32 );
+}
+
+
+/** Stores a little endian representation of a given number into a buffer.
+ *
+ *  \param output Pointer to the output buffer pointer, which is advanced past the written bytes.
+ *  \param input Pointer to the number to convert.
+ *  \param input_size Size of \a input.
+ *
+ *  \note See \a PUT_LE macro.
+ */
+static void _put_le( uint8_t **output, const void *input, size_t input_size )
+{
+  /* calls the the corresponding function cased on the input size */
+  switch( input_size )
+  {
+    case 2:
+      _put16_le( *output, *( ( uint16_t * )input ) );
+      break;
+
+    case 4:
+      _put32_le( *output, *( ( uint32_t * )input ) );
+      break;
+
+    case 8:
+      _put64_le( *output, *( ( uint64_t * )input ) );
+      break;
+  }
+
+  *output += input_size;
+}
+
+
 /** Writes a little endian representation of a given number.
  *
  *  \param count Pointer to a counter of bytes written.
@@ -279,404 +582,3152 @@ static bool _write_le( size_t *count,
 }
 
 
-/** Deflates the input buffer until it's completely consumed. May output some data.
+/** Switches the output to the next volume.
  *
- *  \param z Compression context.
- *  \param flush Flush mode as described in libz.
- *  \param data Buffer of data to compress.
- *  \param data_len Bytes in \a data.
+ *  \param z ZIP context.
  *  \return \c false on error.
- *
- *  \note This function also updates the ZIP context.
  */
-static bool _deflate( zip_t *z, int flush, const void *data, size_t data_len )
+static bool _next_volume( zip_t *z )
 {
-  CUR_ENTRY( z ).size += data_len;
-
-  z->stream.avail_in = data_len;
-  z->stream.next_in = ( Bytef * )data;
+  /* disk numbers are 16 bit in the central directory records */
+  if( z->disk_num >= 0xfffeU || !z->opts.volume_cb( z->out_cb_ctx, z->disk_num + 1 ) )
+    return false;
 
-  /* run deflate until output buffer not full to make sure all input data was processed */
-  do
-  {
-    /* resets the output buffer to set it as empty */
-    z->stream.avail_out = ZIP_INTERNAL_BUFFER_SIZE;
-    z->stream.next_out = z->out_buffer;
+  z->disk_num++;
+  z->volume_written = 0;
+  z->volume_entries = 0;
+  return true;
+}
 
-    /* compresses the data. There are no possible errors when calling this function, so if
-     * it fails it's because an invalid memory state */
-    if( deflate( &z->stream, flush ) < 0 )
-      return false;
 
-    /* outputs compressed data */
-    size_t out_size = ZIP_INTERNAL_BUFFER_SIZE - z->stream.avail_out;
-    if( !z->out_cb( z->out_cb_ctx, z->out_buffer, out_size ) )
-      return false;
+/** Returns a monotonic timestamp.
+ *
+ *  \return Microseconds since an arbitrary point.
+ */
+static uint64_t _now_us( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ( uint64_t )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    CUR_ENTRY( z ).size_compressed += out_size;
-    z->bytes_written += out_size;
-  } while( z->stream.avail_out == 0 );
 
-  /* success */
-  return true;
+/** Returns a monotonic timestamp.
+ *
+ *  \return Milliseconds since an arbitrary point.
+ */
+static uint64_t _now_ms( void )
+{
+  return _now_us() / 1000;
 }
 
 
-/** Writes the Central Directory (CD) file header for an entry.
+/** Adds the tokens earned since the last refill to the rate limit bucket (the caller holds
+ *  \a rate_lock).
  *
  *  \param z ZIP context.
- *  \param entry_num Index of the entry.
- *  \return \c false on error.
+ *  \param now Current timestamp (us).
  */
-static bool _write_cd_file_header( zip_t *z, size_t entry_num )
+static void _rate_refill( zip_t *z, uint64_t now )
 {
-  size_t entry_name_len = strlen( z->entries[entry_num].name );
+  uint64_t elapsed = now - z->rate_refilled_us;
+  z->rate_refilled_us = now;
+  if( z->rate_limit == 0 )
+    return;
+
+  /* compares before multiplying, so long idle periods can't overflow */
+  int64_t max_credit = ( int64_t )( z->rate_burst * 1000000 );
+  uint64_t room = ( uint64_t )( max_credit - z->rate_credit );
+  if( elapsed >= room / z->rate_limit )
+    z->rate_credit = max_credit;
+  else
+    z->rate_credit += ( int64_t )( elapsed * z->rate_limit );
+}
 
-  /* writes the central directory record */
-  struct zip_central_dir central_data = {
-    .signature = 0x02014b50U,
-    .made_by = 0U,
-    .extract_version = 20U,
-    .flags = ( 1U << 3U ), /* bit 3 on to indicate streaming */
-    .method = 8U,          /* DEFLATE */
-    .modif_time = z->entries[entry_num].time,
-    .modif_date = z->entries[entry_num].date,
-    .crc = z->entries[entry_num].crc,
-    .compressed_size = z->entries[entry_num].size_compressed,
-    .uncompressed_size = z->entries[entry_num].size,
-    .fname_length = entry_name_len,
-    .extra_field_length = 0,
-    .comment_length = 0,      /* no comments */
-    .disk_num = 0,            /* no fragmentation supported */
-    .internal_attributes = 0, /* no attributes */
-    .external_attributes = 0, /* no attributes */
-    .local_header_offset = z->entries[entry_num].offset,
-  };
 
-  size_t cd_bytes_written = 0;
-  if( !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.signature ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.made_by ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.extract_version ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.flags ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.method ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.modif_time ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.modif_date ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.crc ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.compressed_size ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.uncompressed_size ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.fname_length ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.extra_field_length ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.comment_length ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.disk_num ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.internal_attributes ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.external_attributes ) ||
-      !WRITE_LE( &cd_bytes_written, z->out_cb, z->out_cb_ctx, central_data.local_header_offset ) )
-    return false;
+/** Returns how long the output must wait until the rate limit bucket is out of debt (the caller
+ *  holds \a rate_lock).
+ *
+ *  \param z ZIP context.
+ *  \return Microseconds to wait.
+ */
+static uint64_t _rate_delay( const zip_t *z )
+{
+  if( z->rate_limit == 0 || z->rate_credit >= 0 )
+    return 0;
+  return ( ( uint64_t )( -z->rate_credit ) + z->rate_limit - 1 ) / z->rate_limit;
+}
 
-  if( !z->out_cb( z->out_cb_ctx, ( uint8_t * ) z->entries[entry_num].name, entry_name_len ) )
-    return false;
 
-  z->bytes_written += cd_bytes_written;
-  z->bytes_written += entry_name_len;
+/** Waits until the output is allowed by the rate limit, then takes the tokens for the data.
+ *  Writes are never split: one that exceeds the tokens left puts the bucket in debt, and the
+ *  next one waits for it to be paid, so the average rate holds without delaying small writes.
+ *  The caller may hold \a out_lock but not \a lock, so the entry handles aren't blocked.
+ *
+ *  \param z ZIP context.
+ *  \param data_len Bytes about to be output.
+ */
+static void _pace( zip_t *z, size_t data_len )
+{
+  pthread_mutex_lock( &z->rate_lock );
+  z->rate_bytes += data_len;
+
+  while( z->rate_limit > 0 )
+  {
+    uint64_t now = _now_us();
+    _rate_refill( z, now );
+    uint64_t delay = _rate_delay( z );
+    if( delay == 0 )
+    {
+      z->rate_credit -= ( int64_t )data_len * 1000000;
+      break;
+    }
+
+    /* sleeps in slices, so a new limit takes effect soon */
+    if( delay > ZIP_RATE_MAX_SLEEP_US )
+      delay = ZIP_RATE_MAX_SLEEP_US;
+    pthread_mutex_unlock( &z->rate_lock );
+
+    struct timespec ts = { ( time_t )( delay / 1000000 ), ( long )( delay % 1000000 ) * 1000 };
+    nanosleep( &ts, NULL );
+
+    pthread_mutex_lock( &z->rate_lock );
+    z->rate_throttled_us += _now_us() - now;
+  }
 
-  /* success */
-  return true;
+  pthread_mutex_unlock( &z->rate_lock );
 }
 
 
-/** Writes the End of Central Directory record.
+/** Gives data to the output callback. On split archives the data is split across volumes when
+ *  the current one is full.
  *
  *  \param z ZIP context.
+ *  \param data Data to output.
+ *  \param data_len Bytes in \a data.
  *  \return \c false on error.
+ *
+ *  \note \a bytes_written is updated by the callers.
  */
-static bool _write_eocd( zip_t *z )
+static bool _out( zip_t *z, const uint8_t *data, size_t data_len )
 {
-  /* writes the end of central directory record */
-  struct zip_eof_central_dir eof_central_dir = {
-    .signature = 0x06054b50U,
-    .disk_num = 0,                         /* no multiple disks supported */
-    .start_disk_num = 0,                   /* always 1 disk */
-    .num_entries_in_disk = varray_len( z->entries ), /* only 1 entry supported */
-    .num_entries = varray_len( z->entries ),         /* only 1 entry supported */
-    .central_dir_size = z->bytes_written - z->central_dir_offset,
-    .offset = z->central_dir_offset, /* the offset from the beginning until the central dir */
-    .comment_length = 0,
-  };
+  _pace( z, data_len );
 
-  size_t bytes_written = 0;
-  if( !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, eof_central_dir.signature ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, eof_central_dir.disk_num ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, eof_central_dir.start_disk_num ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, eof_central_dir.num_entries_in_disk ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, eof_central_dir.num_entries ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, eof_central_dir.central_dir_size ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, eof_central_dir.offset ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, eof_central_dir.comment_length ) )
+  while( z->opts.volume_size > 0 && z->volume_written + data_len > z->opts.volume_size )
+  {
+    size_t n = z->opts.volume_size - z->volume_written;
+    if( ( n > 0 && !z->out_cb( z->out_cb_ctx, data, n ) ) || !_next_volume( z ) )
+      return false;
+
+    data += n;
+    data_len -= n;
+  }
+
+  if( data_len > 0 && !z->out_cb( z->out_cb_ctx, data, data_len ) )
     return false;
 
-  /* success */
+  z->volume_written += data_len;
   return true;
 }
 
 
-/** Converts a given datetime to MS-DOS time format.
+/** Output callback adapter for \a WRITE_LE.
  *
- *  \param dt Input datetime.
- *  \return Time in MS-DOS format.
+ *  \param cb_ctx ZIP context.
+ *  \param data Data to output.
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error.
  */
-static uint16_t _get_dos_time( struct zip_datetime dt )
+static bool _out_cb( void *cb_ctx, const uint8_t *data, size_t data_len )
 {
-  /* bit | 15 | 14 | 13 | 12 | 11 | 10 |  9 |  8 |  7 |  6 |  5 |  4 |  3 |  2 |  1 |  0 |
-   *     |          hours         |           minutes           |      pair seconds      |
-   *
-   * note: MS-DOS time represents a 2-second interval within some day.
-   */
-  uint16_t time = ( ( dt.seconds / 2 ) & 0x1f );
-  time |= ( dt.minutes & 0x3f ) << 5;
-  time |= ( dt.hours & 0x1f ) << 11;
-  return time;
+  return _out( cb_ctx, data, data_len );
 }
 
 
-/** Converts a given datetime to MS-DOS date format.
+/** Checks whether a record fits in the current volume.
  *
- *  \param dt Input datetime.
- *  \return Date in MS-DOS format.
+ *  \param z ZIP context.
+ *  \param record_len Size of the record.
+ *  \return \c true if it fits (always on single volume archives).
  */
-static uint16_t _get_dos_date( struct zip_datetime dt )
+static bool _fits( const zip_t *z, size_t record_len )
 {
-  /* bit | 15 | 14 | 13 | 12 | 11 | 10 |  9 |  8 |  7 |  6 |  5 |  4 |  3 |  2 |  1 |  0 |
-   *     |             year - 1980               |       month       |        day        |
-   */
-  uint16_t date = ( dt.day & 0x1f );
-  date |= ( ( dt.month ) & 0x0f ) << 5;
-  date |= ( ( dt.year - 1980 ) & 0x7f ) << 9;
-  return date;
+  return z->opts.volume_size == 0 || z->volume_written + record_len <= z->opts.volume_size;
 }
 
 
-/** Initializes the ZIP context.
+/** Makes sure a record is not split across volumes, starting a new one if it doesn't fit in
+ *  the current one. The first volume of split archives starts with the split signature.
  *
- *  \param z ZIP context to initialize.
- *  \param out_cb Output callback.
- *  \param out_cb_ctx Output callback context.
+ *  \param z ZIP context.
+ *  \param record_len Size of the record.
  *  \return \c false on error.
  */
-bool zip_init( zip_t *z, zip_out_cb_t out_cb, void *out_cb_ctx )
+static bool _reserve( zip_t *z, size_t record_len )
 {
-  if( out_cb == NULL )
-    return false;
+  if( z->opts.volume_size == 0 )
+    return true;
 
-  z->out_cb = out_cb;
-  z->out_cb_ctx = out_cb_ctx;
-  z->bytes_written = 0;
-  z->central_dir_offset = 0;
-  z->entry_opened = false;
-  z->out_buffer = malloc( ZIP_INTERNAL_BUFFER_SIZE );
+  if( z->disk_num == 0 && z->volume_written == 0 )
+  {
+    uint8_t signature[4];
+    _put32_le( signature, 0x08074b50U );
+    if( !_out( z, signature, sizeof( signature ) ) )
+      return false;
+  }
+
+  return _fits( z, record_len ) || _next_volume( z );
+}
+
+
+/** Gets the version needed to extract an entry.
+ *
+ *  \param entry The entry.
+ *  \return Version (5.1 for AES encryption, 2.0 otherwise).
+ */
+static uint16_t _extract_version( const zip_entry_t *entry )
+{
+  return entry->encrypted ? 51U : 20U;
+}
+
+
+/** Gets the CRC written in the headers of an entry. AE-2 encrypted entries leave it out, so it
+ *  doesn't leak information about the data, which is authenticated instead.
+ *
+ *  \param entry The entry.
+ *  \return The CRC to write.
+ */
+static uint32_t _header_crc( const zip_entry_t *entry )
+{
+  return entry->encrypted ? 0 : entry->crc;
+}
+
+
+/** Checks whether the sizes of an entry fit in the 32 bit fields of its records.
+ *
+ *  \param entry The entry.
+ *  \return \c true if they fit.
+ */
+static bool _sizes_fit( const zip_entry_t *entry )
+{
+  return entry->size <= 0xffffffffU && entry->size_compressed <= 0xffffffffU;
+}
+
+
+/** Encodes the AES extra field of an encrypted entry.
+ *
+ *  \param output Output buffer (at least \c ZIP_AES_EXTRA_SIZE bytes).
+ *  \param entry The entry.
+ *  \return Size of the extra field (0 if the entry is not encrypted).
+ */
+static size_t _put_aes_extra( uint8_t *output, const zip_entry_t *entry )
+{
+  if( !entry->encrypted )
+    return 0;
+
+  _put16_le( output, 0x9901U );
+  _put16_le( output + 2, ZIP_AES_EXTRA_SIZE - 4 );
+  _put16_le( output + 4, 2U ); /* AE-2 */
+  output[6] = 'A';
+  output[7] = 'E';
+  output[8] = 3U; /* AES-256 */
+  _put16_le( output + 9, entry->method );
+  return ZIP_AES_EXTRA_SIZE;
+}
+
+
+/** Writes the local file header for an entry.
+ *
+ *  \param z ZIP context.
+ *  \param entry The entry.
+ *  \return \c false on error.
+ */
+static bool _write_local_header( zip_t *z, zip_entry_t *entry )
+{
+  if( !_sizes_fit( entry ) )
+    return false;
+
+  /* the header is not split across volumes, and its offset is relative to its volume */
+  size_t entry_name_len = strlen( entry->name );
+  size_t extra_len = entry->encrypted ? ZIP_AES_EXTRA_SIZE : 0;
+  if( !_reserve( z, 30 + entry_name_len + extra_len ) )
+    return false;
+
+  /* without ZIP64 extra fields, the central directory record can't point past 4 GiB (only the
+   * central directory itself can start there, in the ZIP64 end records) */
+  if( z->volume_written > 0xffffffffU )
+    return false;
+
+  entry->offset = z->volume_written;
+  entry->disk = z->disk_num;
+
+  /* when streaming, the CRC and sizes are indicated in the data descriptor */
+  bool streamed = ( entry->flags & ( 1U << 3U ) ) != 0;
+
+  struct zip_local_file_header lf_header = {
+    .signature = 0x04034b50U,
+    .extract_version = _extract_version( entry ),
+    .flags = entry->flags,
+    .method = entry->encrypted ? ZIP_AES_METHOD : entry->method,
+    .modif_time = entry->time,
+    .modif_date = entry->date,
+    .crc = streamed ? 0 : _header_crc( entry ),
+    .compressed_size = streamed ? 0 : entry->size_compressed,
+    .uncompressed_size = streamed ? 0 : entry->size,
+    .fname_length = entry_name_len,  /* filename length (null character not included) */
+    .extra_field_length = extra_len, /* only the AES extra field */
+  };
+
+  /* encodes the header, so it's given to the output in a single call */
+  uint8_t header[30 + ZIP_ENTRY_MAX_NAME_LEN + ZIP_AES_EXTRA_SIZE];
+  uint8_t *p = header;
+  PUT_LE( &p, lf_header.signature );
+  PUT_LE( &p, lf_header.extract_version );
+  PUT_LE( &p, lf_header.flags );
+  PUT_LE( &p, lf_header.method );
+  PUT_LE( &p, lf_header.modif_time );
+  PUT_LE( &p, lf_header.modif_date );
+  PUT_LE( &p, lf_header.crc );
+  PUT_LE( &p, lf_header.compressed_size );
+  PUT_LE( &p, lf_header.uncompressed_size );
+  PUT_LE( &p, lf_header.fname_length );
+  PUT_LE( &p, lf_header.extra_field_length );
+
+  memcpy( p, entry->name, entry_name_len );
+  p += entry_name_len;
+  p += _put_aes_extra( p, entry );
+
+  if( !_out( z, header, p - header ) )
+    return false;
+
+  /* updates the number of bytes written */
+  z->bytes_written += p - header;
+
+  /* success */
+  return true;
+}
+
+
+/** Changes the method of an entry being verified, before any of its data was given to the
+ *  verifier.
+ *
+ *  \param v Verifier.
+ *  \param e Verification of the entry (\c NULL if it's not verified), replaced by a new one.
+ *  \param name Entry name.
+ *  \param method New compression method.
+ *  \return \c false on error.
+ */
+static bool _reverify( zip_verifier_t *v, zip_verify_entry_t **e, const char *name, uint16_t method )
+{
+  if( *e == NULL )
+    return true;
+
+  if( !zip_verifier_abort( v, *e ) )
+    return false;
+
+  *e = zip_verifier_entry( v, name, method );
+  return ( *e != NULL );
+}
+
+
+/** Writes the header and the data buffered for the current entry, which is streamed from now
+ *  on.
+ *
+ *  \param z ZIP context.
+ *  \return \c false on error.
+ */
+static bool _flush_entry_buffer( zip_t *z )
+{
+  z->entry_buffered = false;
+  CUR_ENTRY( z ).flags |= ( 1U << 3U );
+
+  if( !_write_local_header( z, &CUR_ENTRY( z ) ) ||
+      !_out( z, z->entry_buffer, varray_len( z->entry_buffer ) ) )
+    return false;
+
+  z->bytes_written += varray_len( z->entry_buffer );
+  varray_len( z->entry_buffer ) = 0;
+  return true;
+}
+
+
+/** Outputs data of the current entry, or buffers it while the entry is buffered.
+ *
+ *  \param z ZIP context.
+ *  \param data Entry data (compressed and encrypted if needed).
+ *  \param data_len Bytes in \a data.
+ *  \param timed Whether the time spent in the output is measured for the adaptive level.
+ *  \return \c false on error.
+ */
+static bool _output_entry_data( zip_t *z, const uint8_t *data, size_t data_len, bool timed )
+{
+  CUR_ENTRY( z ).size_compressed += data_len;
+
+  if( z->entry_buffered )
+  {
+    varray_append( z->entry_buffer, data, data_len );
+    return true;
+  }
+
+  uint64_t start = timed ? _now_us() : 0;
+  if( !_out( z, data, data_len ) )
+    return false;
+
+  z->bytes_written += data_len;
+  if( timed )
+    z->out_us += _now_us() - start;
+  return true;
+}
+
+
+/** Outputs the compressed data left in the output buffer by deflate. Verified entries tee it to
+ *  the verify thread first, and encrypted entries are encrypted right there, while the data is
+ *  still in the cache.
+ *
+ *  \param z ZIP context.
+ *  \param timed Whether the time spent in the output is measured for the adaptive level.
+ *  \return \c false on error.
+ */
+static bool _output_deflated( zip_t *z, bool timed )
+{
+  size_t out_size = z->buffer_size - z->stream.avail_out;
+  if( z->verify_entry != NULL && !zip_verifier_feed( &z->verifier, z->verify_entry, z->out_buffer, out_size ) )
+    return false;
+
+  if( CUR_ENTRY( z ).encrypted )
+    zip_aes_encrypt( &z->aes, z->out_buffer, out_size );
+
+  return _output_entry_data( z, z->out_buffer, out_size, timed );
+}
+
+
+/** Changes the compression level of the current entry. Deflate ends the current block first,
+ *  so the data given so far keeps the previous level.
+ *
+ *  \param z ZIP context.
+ *  \param level New compression level.
+ *  \return \c false on error.
+ */
+static bool _set_level( zip_t *z, int level )
+{
+  if( level == z->level )
+    return true;
+
+  /* the end of the block may not fit the output buffer at once */
+  int rv;
+  do
+  {
+    z->stream.avail_out = z->buffer_size;
+    z->stream.next_out = z->out_buffer;
+    rv = deflateParams( &z->stream, level, Z_DEFAULT_STRATEGY );
+    if( ( rv != Z_OK && rv != Z_BUF_ERROR ) || !_output_deflated( z, false ) )
+      return false;
+  } while( rv == Z_BUF_ERROR && z->stream.avail_out == 0 );
+
+  if( rv == Z_OK )
+    z->level = level;
+  return true;
+}
+
+
+/** Adjusts the level of an adaptive entry once a window of time was measured: it's raised while
+ *  the output takes longer than deflate (the extra CPU time is hidden by the output), and
+ *  lowered while deflate takes longer. Halving the measures keeps a sliding window.
+ *
+ *  \param z ZIP context.
+ *  \return \c false on error.
+ */
+static bool _adapt( zip_t *z )
+{
+  if( z->deflate_us + z->out_us < ZIP_ADAPTIVE_WINDOW_US )
+    return true;
+
+  int level = z->adaptive_level;
+  if( z->out_us * 2 > z->deflate_us * 3 && level < z->opts.max_level )
+    level++;
+  else if( z->deflate_us * 2 > z->out_us * 3 && level > z->opts.min_level )
+    level--;
+
+  z->deflate_us /= 2;
+  z->out_us /= 2;
+  z->adaptive_level = level;
+  return _set_level( z, level );
+}
+
+
+/** Deflates the input buffer until it's completely consumed. May output some data.
+ *
+ *  \param z Compression context.
+ *  \param flush Flush mode as described in libz.
+ *  \param data Buffer of data to compress.
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error.
+ *
+ *  \note This function also updates the ZIP context.
+ */
+static bool _deflate( zip_t *z, int flush, const void *data, size_t data_len )
+{
+  CUR_ENTRY( z ).size += data_len;
+
+  /* the entry is not small, so it's streamed */
+  if( z->entry_buffered && CUR_ENTRY( z ).size > z->opts.buffer_threshold &&
+      !_flush_entry_buffer( z ) )
+    return false;
+
+  z->stream.avail_in = data_len;
+  z->stream.next_in = ( Bytef * )data;
+
+  /* buffered entries don't reach the output, so they don't tell how fast it is */
+  bool timed = z->adaptive_entry && !z->entry_buffered;
+
+  /* run deflate until output buffer not full to make sure all input data was processed */
+  do
+  {
+    /* resets the output buffer to set it as empty */
+    z->stream.avail_out = z->buffer_size;
+    z->stream.next_out = z->out_buffer;
+
+    /* compresses the data. There are no possible errors when calling this function, so if
+     * it fails it's because an invalid memory state */
+    uint64_t start = timed ? _now_us() : 0;
+    if( deflate( &z->stream, flush ) < 0 )
+      return false;
+    if( timed )
+      z->deflate_us += _now_us() - start;
+
+    /* outputs compressed data */
+    if( !_output_deflated( z, timed ) )
+      return false;
+  } while( z->stream.avail_out == 0 );
+
+  /* between blocks, the level of adaptive entries follows the slowest of deflate and output */
+  return ( !timed || flush != Z_NO_FLUSH || _adapt( z ) );
+}
+
+
+/** Streams the current buffered entry from now on (see \a _flush_entry_buffer). A STORED entry
+ *  needs its sizes in the header, so the data it kept as is is deflated instead (with level 0).
+ *
+ *  \param z ZIP context.
+ *  \return \c false on error.
+ */
+static bool _stream_entry( zip_t *z )
+{
+  if( CUR_ENTRY( z ).method != 0U )
+    return _flush_entry_buffer( z );
+
+  size_t stored_len = CUR_ENTRY( z ).size;
+  CUR_ENTRY( z ).method = 8U; /* DEFLATE */
+  CUR_ENTRY( z ).size = 0;
+  CUR_ENTRY( z ).size_compressed -= stored_len;
+  varray_len( z->entry_buffer ) -= stored_len;
+
+  /* the buffer keeps its memory, so the stored data is still right after the data written */
+  size_t stored_at = varray_len( z->entry_buffer );
+  return _reverify( &z->verifier, &z->verify_entry, CUR_ENTRY( z ).name, 8U ) && _flush_entry_buffer( z ) &&
+         _deflate( z, Z_NO_FLUSH, z->entry_buffer + stored_at, stored_len );
+}
+
+
+/** Outputs data of a STORED entry, updating its size. While the entry is buffered, its data is
+ *  kept as is, so it can still be deflated if the entry gets too large; otherwise it's verified
+ *  and encrypted as it goes.
+ *
+ *  \param z ZIP context.
+ *  \param data Entry data.
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error.
+ */
+static bool _store( zip_t *z, const uint8_t *data, size_t data_len )
+{
+  if( z->entry_buffered )
+  {
+    /* the entry is not small, so it's streamed */
+    if( CUR_ENTRY( z ).size + data_len > z->opts.buffer_threshold )
+      return _stream_entry( z ) && _deflate( z, Z_NO_FLUSH, data, data_len );
+
+    CUR_ENTRY( z ).size += data_len;
+    return _output_entry_data( z, data, data_len, false );
+  }
+
+  CUR_ENTRY( z ).size += data_len;
+  for( size_t i = 0; i < data_len; i += z->buffer_size )
+  {
+    const uint8_t *block = data + i;
+    size_t block_len = ( data_len - i < z->buffer_size ) ? data_len - i : z->buffer_size;
+    if( z->verify_entry != NULL && !zip_verifier_feed( &z->verifier, z->verify_entry, block, block_len ) )
+      return false;
+
+    /* the data of the caller is encrypted in the output buffer */
+    if( CUR_ENTRY( z ).encrypted )
+    {
+      memcpy( z->out_buffer, block, block_len );
+      zip_aes_encrypt( &z->aes, z->out_buffer, block_len );
+      block = z->out_buffer;
+    }
+
+    if( !_output_entry_data( z, block, block_len, false ) )
+      return false;
+  }
+
+  return true;
+}
+
+
+/** Encodes the Central Directory (CD) file header for an entry.
+ *
+ *  \param entry The entry.
+ *  \param output Output buffer (at least \c ZIP_CD_RECORD_MAX_SIZE bytes).
+ *  \return The size of the record.
+ */
+static size_t _encode_cd_file_header( const zip_entry_t *entry, uint8_t *output )
+{
+  size_t entry_name_len = strlen( entry->name );
+
+  /* encodes the central directory record */
+  struct zip_central_dir central_data = {
+    .signature = 0x02014b50U,
+    .made_by = 0U,
+    .extract_version = _extract_version( entry ),
+    .flags = entry->flags,
+    .method = entry->encrypted ? ZIP_AES_METHOD : entry->method,
+    .modif_time = entry->time,
+    .modif_date = entry->date,
+    .crc = _header_crc( entry ),
+    .compressed_size = entry->size_compressed,
+    .uncompressed_size = entry->size,
+    .fname_length = entry_name_len,
+    .extra_field_length = entry->encrypted ? ZIP_AES_EXTRA_SIZE : 0,
+    .comment_length = 0,      /* no comments */
+    .disk_num = entry->disk,
+    .internal_attributes = 0, /* no attributes */
+    .external_attributes = 0, /* no attributes */
+    .local_header_offset = entry->offset,
+  };
+
+  uint8_t *p = output;
+  PUT_LE( &p, central_data.signature );
+  PUT_LE( &p, central_data.made_by );
+  PUT_LE( &p, central_data.extract_version );
+  PUT_LE( &p, central_data.flags );
+  PUT_LE( &p, central_data.method );
+  PUT_LE( &p, central_data.modif_time );
+  PUT_LE( &p, central_data.modif_date );
+  PUT_LE( &p, central_data.crc );
+  PUT_LE( &p, central_data.compressed_size );
+  PUT_LE( &p, central_data.uncompressed_size );
+  PUT_LE( &p, central_data.fname_length );
+  PUT_LE( &p, central_data.extra_field_length );
+  PUT_LE( &p, central_data.comment_length );
+  PUT_LE( &p, central_data.disk_num );
+  PUT_LE( &p, central_data.internal_attributes );
+  PUT_LE( &p, central_data.external_attributes );
+  PUT_LE( &p, central_data.local_header_offset );
+
+  memcpy( p, entry->name, entry_name_len );
+  p += entry_name_len;
+  p += _put_aes_extra( p, entry );
+
+  return p - output;
+}
+
+
+/** Finds an extra field of a Central Directory (CD) file header.
+ *
+ *  \param extra Extra fields of the record.
+ *  \param extra_len Bytes in \a extra.
+ *  \param id Header ID of the field.
+ *  \param min_size Minimum size of the field data.
+ *  \return The field, starting with its header (\c NULL if there is none).
+ */
+static const uint8_t *_find_extra_field( const uint8_t *extra, size_t extra_len, uint16_t id, size_t min_size )
+{
+  for( size_t i = 0; i + 4 <= extra_len; i += 4 + _get16_le( extra + i + 2 ) )
+  {
+    size_t size = _get16_le( extra + i + 2 );
+    if( _get16_le( extra + i ) == id && size >= min_size && i + 4 + size <= extra_len )
+      return extra + i;
+  }
+
+  return NULL;
+}
+
+
+/** Decodes a Central Directory (CD) file header encoded by \a _encode_cd_file_header, or kept
+ *  as it was by \a zip_open_append (with other extra fields and a comment).
+ *
+ *  \param input Encoded records.
+ *  \param input_len Bytes in \a input.
+ *  \param entry Output entry.
+ *  \return The size of the record (0 on error).
+ */
+static size_t _decode_cd_file_header( const uint8_t *input, size_t input_len, zip_entry_t *entry )
+{
+  if( input_len < 46 || _get32_le( input ) != 0x02014b50U )
+    return 0;
+
+  size_t entry_name_len = _get16_le( input + 28 );
+  size_t extra_len = _get16_le( input + 30 );
+  size_t comment_len = _get16_le( input + 32 );
+  if( entry_name_len > ZIP_ENTRY_MAX_NAME_LEN || input_len < 46 + entry_name_len + extra_len + comment_len )
+    return 0;
+
+  /* the method of the encrypted entries is in their AES extra field */
+  const uint8_t *aes = _find_extra_field( input + 46 + entry_name_len, extra_len, 0x9901U, 7 );
+  entry->encrypted = ( aes != NULL && _get16_le( input + 10 ) == ZIP_AES_METHOD );
+
+  entry->flags = _get16_le( input + 8 );
+  entry->method = entry->encrypted ? _get16_le( aes + 9 ) : _get16_le( input + 10 );
+  entry->time = _get16_le( input + 12 );
+  entry->date = _get16_le( input + 14 );
+  entry->crc = _get32_le( input + 16 );
+  entry->size_compressed = _get32_le( input + 20 );
+  entry->size = _get32_le( input + 24 );
+  entry->disk = _get16_le( input + 34 );
+  entry->offset = _get32_le( input + 42 );
+  memcpy( entry->name, input + 46, entry_name_len );
+  entry->name[entry_name_len] = '\0';
+  memset( entry->sha256, 0, sizeof( entry->sha256 ) );
+
+  return 46 + entry_name_len + extra_len + comment_len;
+}
+
+
+/** Encodes the Central Directory (CD) file header for an entry at the end of the CD buffer.
+ *
+ *  \param z ZIP context.
+ *  \param entry The entry.
+ */
+static void _append_cd_file_header( zip_t *z, const zip_entry_t *entry )
+{
+  uint8_t record[ZIP_CD_RECORD_MAX_SIZE];
+  size_t record_len = _encode_cd_file_header( entry, record );
+
+  varray_append( z->cd_buffer, record, record_len );
+}
+
+
+/** Appends the line of a finished entry to the manifest, as \c sha256sum prints it. An entry
+ *  without a digest (copied raw or kept from an old archive) gets a comment line instead, which
+ *  \c sha256sum -c skips.
+ *
+ *  \param z ZIP context.
+ *  \param entry The entry.
+ */
+static void _append_manifest_line( zip_t *z, const zip_entry_t *entry )
+{
+  static const char digits[] = "0123456789abcdef";
+  static const char no_digest[] = "# no digest";
+  static const uint8_t zero[ZIP_SHA256_SIZE];
+  char line[2 * ZIP_SHA256_SIZE + 2 + ZIP_ENTRY_MAX_NAME_LEN + 1];
+
+  char *p = line;
+  if( memcmp( entry->sha256, zero, ZIP_SHA256_SIZE ) == 0 )
+  {
+    memcpy( p, no_digest, sizeof( no_digest ) - 1 );
+    p += sizeof( no_digest ) - 1;
+  }
+  else
+  {
+    for( size_t i = 0; i < ZIP_SHA256_SIZE; i++ )
+    {
+      *p++ = digits[entry->sha256[i] >> 4];
+      *p++ = digits[entry->sha256[i] & 0xf];
+    }
+  }
+  *p++ = ' ';
+  *p++ = ' ';
+  size_t entry_name_len = strlen( entry->name );
+  memcpy( p, entry->name, entry_name_len );
+  p += entry_name_len;
+  *p++ = '\n';
+
+  varray_append( z->manifest, line, p - line );
+}
+
+
+/** Moves the central directory records in memory to the spill file, along with the finished
+ *  entries.
+ *
+ *  \param z ZIP context.
+ *  \return \c false on error.
+ */
+static bool _spill_central_dir( zip_t *z )
+{
+  if( z->spill_file == NULL && ( z->spill_file = tmpfile() ) == NULL )
+    return false;
+
+  size_t cd_len = varray_len( z->cd_buffer );
+  if( fwrite( z->cd_buffer, 1, cd_len, z->spill_file ) != cd_len )
+    return false;
+
+  z->spill_size += cd_len;
+  z->num_spilled += varray_len( z->entries );
+  varray_len( z->cd_buffer ) = 0;
+  varray_len( z->entries ) = 0;
+  return true;
+}
+
+
+/** Makes room for the record of a new entry, spilling the central directory when the spill
+ *  threshold is reached (the caller holds \a out_lock).
+ *
+ *  \param z ZIP context.
+ *  \return \c false on error.
+ */
+static bool _reserve_record( zip_t *z )
+{
+  /* bounds the memory used by the finished entries */
+  pthread_mutex_lock( &z->lock );
+  bool rv = ( z->opts.spill_threshold == 0 || varray_len( z->entries ) < z->opts.spill_threshold ||
+              _spill_central_dir( z ) );
+  pthread_mutex_unlock( &z->lock );
+
+  return rv;
+}
+
+
+/** Adds the records of an entry whose data was output (the caller holds \a out_lock).
+ *
+ *  \param z ZIP context.
+ *  \param entry Finished entry.
+ */
+static void _add_record( zip_t *z, const zip_entry_t *entry )
+{
+  pthread_mutex_lock( &z->lock );
+  varray_push( z->entries, *entry );
+  _append_cd_file_header( z, entry );
+  if( z->opts.manifest != NULL )
+    _append_manifest_line( z, entry );
+  pthread_mutex_unlock( &z->lock );
+}
+
+
+/** Returns the size of an encoded central directory record.
+ *
+ *  \param record The record.
+ *  \return Record size.
+ */
+static size_t _cd_record_len( const uint8_t *record )
+{
+  return 46 + _get16_le( record + 28 ) + _get16_le( record + 30 ) + _get16_le( record + 32 );
+}
+
+
+/** Writes encoded central directory records. Records are not split across volumes, so they are
+ *  written in runs that fit in the current one.
+ *
+ *  \param z ZIP context.
+ *  \param records Encoded records.
+ *  \param records_len Bytes in \a records (only whole records).
+ *  \return \c false on error.
+ */
+static bool _write_cd_records( zip_t *z, const uint8_t *records, size_t records_len )
+{
+  while( records_len > 0 )
+  {
+    size_t run_len = _cd_record_len( records );
+    size_t run_entries = 1;
+    if( !_reserve( z, run_len ) )
+      return false;
+
+    /* the central directory starts in the volume of its first record */
+    if( z->bytes_written == z->central_dir_offset )
+    {
+      z->central_dir_disk = z->disk_num;
+      z->central_dir_disk_offset = z->volume_written;
+    }
+
+    while( run_len < records_len && _fits( z, run_len + _cd_record_len( records + run_len ) ) )
+    {
+      run_len += _cd_record_len( records + run_len );
+      run_entries++;
+    }
+
+    if( !_out( z, records, run_len ) )
+      return false;
+
+    z->bytes_written += run_len;
+    z->volume_entries += run_entries;
+    records += run_len;
+    records_len -= run_len;
+  }
+
+  return true;
+}
+
+
+/** Writes the records spilled to disk at the beginning of the central directory.
+ *
+ *  \param z ZIP context.
+ *  \return \c false on error.
+ */
+static bool _write_spilled_central_dir( zip_t *z )
+{
+  if( fflush( z->spill_file ) != 0 || fseek( z->spill_file, 0, SEEK_SET ) != 0 )
+    return false;
+
+  /* the incomplete record at the end of each read is kept for the next one */
+  size_t kept = 0;
+  size_t n;
+  while( ( n = fread( z->out_buffer + kept, 1, z->buffer_size - kept, z->spill_file ) ) > 0 )
+  {
+    size_t len = kept + n;
+    size_t records_len = 0;
+    while( records_len + 46 <= len && records_len + _cd_record_len( z->out_buffer + records_len ) <= len )
+      records_len += _cd_record_len( z->out_buffer + records_len );
+
+    if( !_write_cd_records( z, z->out_buffer, records_len ) )
+      return false;
+
+    kept = len - records_len;
+    memmove( z->out_buffer, z->out_buffer + records_len, kept );
+  }
+
+  return !ferror( z->spill_file ) && kept == 0;
+}
+
+
+/** Writes the data descriptor record of the current entry.
+ *
+ *  \param z ZIP context.
+ *  \return \c false on error.
+ */
+static bool _write_data_descriptor( zip_t *z )
+{
+  const uint32_t data_desc_signature = 0x08074b50U;
+  uint32_t crc = _header_crc( &CUR_ENTRY( z ) );
+  uint32_t size_compressed = CUR_ENTRY( z ).size_compressed;
+  uint32_t size = CUR_ENTRY( z ).size;
+
+  /* writes the data descriptor record */
+  size_t bytes_written = 0;
+  if( !_reserve( z, 16 ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, data_desc_signature ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, crc ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, size_compressed ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, size ) )
+    return false;
+
+  /* updates the number of bytes written */
+  z->bytes_written += bytes_written;
+
+  /* success */
+  return true;
+}
+
+
+/** Checks whether the ZIP64 end of central directory records are required, because the values
+ *  don't fit in the EOCD fields. The records of the entries never need ZIP64 fields, their local
+ *  headers fail past 4 GiB.
+ *
+ *  \param num_entries Number of entries.
+ *  \param central_dir_size Size of the central directory.
+ *  \param central_dir_offset Offset of the central directory.
+ *  \return \c true if the ZIP64 records must be written.
+ */
+static bool _needs_eocd64( size_t num_entries, size_t central_dir_size, size_t central_dir_offset )
+{
+  return num_entries > 0xffffU || central_dir_size > 0xffffffffU || central_dir_offset > 0xffffffffU;
+}
+
+
+/** Writes the ZIP64 End of Central Directory record and locator.
+ *
+ *  \param z ZIP context.
+ *  \return \c false on error.
+ */
+static bool _write_eocd64( zip_t *z )
+{
+  struct zip_eof_central_dir64 eof_central_dir = {
+    .signature = 0x06064b50U,
+    .record_size = 44, /* the size of the record excluding the first 12 bytes */
+    .made_by = 45U,
+    .extract_version = 45U,
+    .disk_num = z->disk_num,
+    .start_disk_num = z->central_dir_disk,
+    .num_entries_in_disk = z->volume_entries,
+    .num_entries = zip_get_num_entries( z ),
+    .central_dir_size = z->bytes_written - z->central_dir_offset,
+    .offset = z->central_dir_disk_offset,
+  };
+
+  struct zip_eof_central_dir64_locator locator = {
+    .signature = 0x07064b50U,
+    .start_disk_num = z->disk_num,
+    .offset = z->volume_written,
+    .num_disks = z->disk_num + 1,
+  };
+
+  size_t bytes_written = 0;
+  if( !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.signature ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.record_size ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.made_by ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.extract_version ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.disk_num ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.start_disk_num ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.num_entries_in_disk ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.num_entries ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.central_dir_size ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.offset ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, locator.signature ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, locator.start_disk_num ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, locator.offset ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, locator.num_disks ) )
+    return false;
+
+  z->bytes_written += bytes_written;
+
+  /* success */
+  return true;
+}
+
+
+/** Writes the End of Central Directory record.
+ *
+ *  \param z ZIP context.
+ *  \return \c false on error.
+ */
+static bool _write_eocd( zip_t *z )
+{
+  size_t num_entries = zip_get_num_entries( z );
+  size_t central_dir_size = z->bytes_written - z->central_dir_offset;
+
+  bool zip64 = _needs_eocd64( num_entries, central_dir_size, z->central_dir_offset );
+
+  /* the end records are kept together in the last volume */
+  size_t comment_len = varray_len( z->comment );
+  if( !_reserve( z, ( zip64 ? 56 + 20 + 22 : 22 ) + comment_len ) || ( zip64 && !_write_eocd64( z ) ) )
+    return false;
+
+  /* writes the end of central directory record */
+  struct zip_eof_central_dir eof_central_dir = {
+    .signature = 0x06054b50U,
+    .disk_num = z->disk_num,
+    .start_disk_num = z->central_dir_disk,
+    .num_entries_in_disk = zip64 ? 0xffffU : z->volume_entries,
+    .num_entries = zip64 ? 0xffffU : num_entries,
+    .central_dir_size = zip64 ? 0xffffffffU : central_dir_size,
+    .offset = zip64 ? 0xffffffffU : z->central_dir_disk_offset, /* relative to its volume */
+    .comment_length = comment_len,
+  };
+
+  size_t bytes_written = 0;
+  if( !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.signature ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.disk_num ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.start_disk_num ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.num_entries_in_disk ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.num_entries ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.central_dir_size ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.offset ) ||
+      !WRITE_LE( &bytes_written, _out_cb, z, eof_central_dir.comment_length ) ||
+      ( comment_len > 0 && !_out( z, z->comment, comment_len ) ) )
+    return false;
+
+  z->bytes_written += bytes_written + comment_len;
+
+  /* success */
+  return true;
+}
+
+
+/** Converts a given datetime to MS-DOS time format.
+ *
+ *  \param dt Input datetime.
+ *  \return Time in MS-DOS format.
+ */
+static uint16_t _get_dos_time( struct zip_datetime dt )
+{
+  /* bit | 15 | 14 | 13 | 12 | 11 | 10 |  9 |  8 |  7 |  6 |  5 |  4 |  3 |  2 |  1 |  0 |
+   *     |          hours         |           minutes           |      pair seconds      |
+   *
+   * note: MS-DOS time represents a 2-second interval within some day.
+   */
+  uint16_t time = ( ( dt.seconds / 2 ) & 0x1f );
+  time |= ( dt.minutes & 0x3f ) << 5;
+  time |= ( dt.hours & 0x1f ) << 11;
+  return time;
+}
+
+
+/** Converts a given datetime to MS-DOS date format.
+ *
+ *  \param dt Input datetime.
+ *  \return Date in MS-DOS format.
+ */
+static uint16_t _get_dos_date( struct zip_datetime dt )
+{
+  /* bit | 15 | 14 | 13 | 12 | 11 | 10 |  9 |  8 |  7 |  6 |  5 |  4 |  3 |  2 |  1 |  0 |
+   *     |             year - 1980               |       month       |        day        |
+   */
+  uint16_t date = ( dt.day & 0x1f );
+  date |= ( ( dt.month ) & 0x0f ) << 5;
+  date |= ( ( dt.year - 1980 ) & 0x7f ) << 9;
+  return date;
+}
+
+
+/** Allocates memory for zlib, accounting it in \a zlib_memory.
+ *
+ *  \param opaque ZIP context.
+ *  \param items Number of items.
+ *  \param size Size of each item.
+ *  \return The allocated memory (\c Z_NULL on error).
+ */
+static voidpf _zalloc( voidpf opaque, uInt items, uInt size )
+{
+  /* the size is kept in front of the block for _zfree */
+  union zip_alloc_header *header = malloc( sizeof( union zip_alloc_header ) + ( size_t )items * size );
+  if( header == NULL )
+    return Z_NULL;
+
+  zip_t *z = opaque;
+  header->size = ( size_t )items * size;
+  pthread_mutex_lock( &z->lock );
+  z->zlib_memory += header->size;
+  pthread_mutex_unlock( &z->lock );
+  return header + 1;
+}
+
+
+/** Releases memory allocated by \a _zalloc.
+ *
+ *  \param opaque ZIP context.
+ *  \param address Memory to release.
+ */
+static void _zfree( voidpf opaque, voidpf address )
+{
+  union zip_alloc_header *header = ( union zip_alloc_header * )address - 1;
+
+  zip_t *z = opaque;
+  pthread_mutex_lock( &z->lock );
+  z->zlib_memory -= header->size;
+  pthread_mutex_unlock( &z->lock );
+  free( header );
+}
+
+
+/** Initializes a raw deflate stream.
+ *
+ *  \param z ZIP context (accounts the memory of the stream).
+ *  \param stream Stream to initialize.
+ *  \param window_bits Base two logarithm of the window size.
+ *  \param memlevel Memory used for the internal compression state (1 to 9).
+ *  \return \c false on error.
+ */
+static bool _deflate_init( zip_t *z, z_stream *stream, int window_bits, int memlevel )
+{
+  stream->opaque = z;
+  stream->zalloc = _zalloc;
+  stream->zfree = _zfree;
+  stream->next_in = NULL;
+  stream->data_type = Z_BINARY;
+
+  /* zlib initialization parameters */
+  const int strategy = Z_DEFAULT_STRATEGY;
+  const int method = Z_DEFLATED;
+  const int level = Z_DEFAULT_COMPRESSION;
+
+  /* negative window bits for raw deflate */
+  return ( deflateInit2( stream, level, method, -window_bits, memlevel, strategy ) == Z_OK );
+}
+
+
+/** Sets the default options.
+ *
+ *  \param opts Options to initialize.
+ */
+void zip_options_init( zip_options_t *opts )
+{
+  opts->pwrite_cb = NULL;
+  opts->buffer_threshold = 0;
+  opts->spill_threshold = 0;
+  opts->volume_cb = NULL;
+  opts->volume_size = 0;
+  opts->flush_bytes = 0;
+  opts->flush_latency_ms = 0;
+  opts->spool_size = 1 << 20;
+  opts->memory_budget = 0;
+  opts->rules = NULL;
+  opts->num_rules = 0;
+  opts->rate_limit = 0;
+  opts->rate_burst = 0;
+  opts->adaptive = false;
+  opts->min_level = 1;
+  opts->max_level = 9;
+  opts->password = NULL;
+  opts->verify = false;
+  opts->digest = false;
+  opts->manifest = NULL;
+}
+
+
+/** Returns the heap memory of the deflate streams and buffers of a memory profile.
+ *
+ *  \param profile Memory profile.
+ *  \return Memory in bytes.
+ */
+static size_t _profile_memory( const struct zip_memory_profile *profile )
+{
+  /* the main stream and the one of the small entries, see the zlib's deflateInit2 docs */
+  int small_window_bits = ( profile->window_bits < ZIP_SMALL_ENTRY_WINDOW_BITS ) ? profile->window_bits
+                                                                                 : ZIP_SMALL_ENTRY_WINDOW_BITS;
+  int small_mem_level = ( profile->mem_level < ZIP_SMALL_ENTRY_MEM_LEVEL ) ? profile->mem_level
+                                                                           : ZIP_SMALL_ENTRY_MEM_LEVEL;
+
+  return ( ( size_t )1 << ( profile->window_bits + 2 ) ) + ( ( size_t )1 << ( profile->mem_level + 9 ) ) +
+         ( ( size_t )1 << ( small_window_bits + 2 ) ) + ( ( size_t )1 << ( small_mem_level + 9 ) ) +
+         2 * ZIP_DEFLATE_STATE_SIZE + profile->buffer_size;
+}
+
+
+/** Chooses the largest memory profile that fits a budget.
+ *
+ *  \param budget Memory budget (0 for the default profile).
+ *  \return The memory profile (\c NULL if none fits).
+ */
+static const struct zip_memory_profile *_memory_profile( size_t budget )
+{
+  const size_t num_profiles = sizeof( _memory_profiles ) / sizeof( _memory_profiles[0] );
+  if( budget == 0 )
+    return &_memory_profiles[2];
+
+  for( size_t i = 0; i < num_profiles; i++ )
+    if( _profile_memory( &_memory_profiles[i] ) <= budget )
+      return &_memory_profiles[i];
+
+  return NULL;
+}
+
+
+/** Initializes the ZIP context with the default options.
+ *
+ *  \param z ZIP context to initialize.
+ *  \param out_cb Output callback.
+ *  \param out_cb_ctx Output callback context.
+ *  \return \c false on error.
+ */
+bool zip_init( zip_t *z, zip_out_cb_t out_cb, void *out_cb_ctx )
+{
+  return zip_init_ex( z, out_cb, out_cb_ctx, NULL );
+}
+
+
+/** Initializes the ZIP context.
+ *
+ *  \param z ZIP context to initialize.
+ *  \param out_cb Output callback.
+ *  \param out_cb_ctx Output callback context.
+ *  \param opts Options (\c NULL for the defaults).
+ *  \return \c false on error.
+ */
+bool zip_init_ex( zip_t *z, zip_out_cb_t out_cb, void *out_cb_ctx, const zip_options_t *opts )
+{
+  if( out_cb == NULL )
+    return false;
+
+  if( opts != NULL )
+    z->opts = *opts;
+  else
+    zip_options_init( &z->opts );
+
+  /* local header offsets are relative to each volume, so they can't be patched with pwrite */
+  if( z->opts.volume_size > 0 && ( z->opts.volume_cb == NULL || z->opts.pwrite_cb != NULL ||
+                                   z->opts.volume_size < ZIP_VOLUME_MIN_SIZE ||
+                                   z->opts.volume_size > ZIP_VOLUME_MAX_SIZE ) )
+    return false;
+
+  /* the verifier takes its share of the budget first (entry handles take one more inflate stream
+   * each, like their deflate streams) */
+  size_t budget = z->opts.memory_budget;
+  if( budget > 0 && z->opts.verify )
+  {
+    if( budget <= ZIP_VERIFY_BUDGET )
+      return false;
+    budget -= ZIP_VERIFY_BUDGET;
+  }
+
+  const struct zip_memory_profile *profile = _memory_profile( budget );
+  if( profile == NULL || ( z->opts.num_rules > 0 && z->opts.rules == NULL ) )
+    return false;
+
+  for( size_t i = 0; i < z->opts.num_rules; i++ )
+    if( z->opts.rules[i].level < Z_DEFAULT_COMPRESSION || z->opts.rules[i].level > 9 ||
+        ( z->opts.rules[i].magic != NULL && z->opts.rules[i].magic_len > ZIP_RULE_MAX_MAGIC_LEN ) )
+      return false;
+
+  uint64_t rate_burst = ( z->opts.rate_burst > 0 ) ? z->opts.rate_burst : z->opts.rate_limit;
+  if( rate_burst > ZIP_RATE_MAX_BURST )
+    return false;
+
+  if( z->opts.adaptive &&
+      ( z->opts.min_level < 0 || z->opts.min_level > z->opts.max_level || z->opts.max_level > 9 ) )
+    return false;
+
+  if( z->opts.manifest != NULL )
+    z->opts.digest = true;
+
+  z->out_cb = out_cb;
+  z->out_cb_ctx = out_cb_ctx;
+  z->window_bits = profile->window_bits;
+  z->mem_level = profile->mem_level;
+  z->buffer_size = profile->buffer_size;
+  z->zlib_memory = 0;
+  z->handle_memory = 0;
+  z->sniffing = false;
+  z->level = Z_DEFAULT_COMPRESSION;
+  z->small_level = Z_DEFAULT_COMPRESSION;
+  z->adaptive_entry = false;
+  z->deflate_us = 0;
+  z->out_us = 0;
+
+  /* adaptive levels start from the default one (6) */
+  z->adaptive_level = 6;
+  if( z->adaptive_level < z->opts.min_level )
+    z->adaptive_level = z->opts.min_level;
+  if( z->adaptive_level > z->opts.max_level )
+    z->adaptive_level = z->opts.max_level;
+
+  /* the padded password is hashed once, not on every key derivation */
+  if( z->opts.password != NULL )
+    zip_hmac_init( &z->password, z->opts.password, strlen( z->opts.password ) );
+  z->rate_limit = z->opts.rate_limit;
+  z->rate_burst = rate_burst;
+  z->rate_credit = ( int64_t )( rate_burst * 1000000 );
+  z->rate_refilled_us = _now_us();
+  z->rate_bytes = 0;
+  z->rate_throttled_us = 0;
+  z->rate_sample_bytes = 0;
+  z->rate_sample_us = z->rate_refilled_us;
+  z->bytes_written = 0;
+  z->central_dir_offset = 0;
+  z->disk_num = 0;
+  z->volume_written = 0;
+  z->volume_entries = 0;
+  z->central_dir_disk = 0;
+  z->central_dir_disk_offset = 0;
+  z->entry_opened = false;
+  z->entry_buffered = false;
+  z->verify_entry = NULL;
+  z->open_handles = 0;
+  z->small_stream_ready = false;
+  z->spill_file = NULL;
+  varray_init( z->stream_pool, 1 );
+  z->spill_size = 0;
+  z->num_spilled = 0;
+  z->append_fd = -1;
+  z->out_buffer = malloc( z->buffer_size );
+  z->rule_hits = calloc( z->opts.num_rules + 1, sizeof( uint64_t ) );
+  varray_init( z->entry_buffer, 1 );
+  varray_init( z->cd_buffer, 1 );
+  varray_init( z->manifest, 1 );
+  varray_init( z->comment, 1 );
+
+  /* starts with 1 entry in the array (the spill threshold is reserved when set) */
+  varray_init( z->entries, z->opts.spill_threshold + 1 );
+
+  /* the lock is used by the allocator of the deflate streams */
+  pthread_mutex_init( &z->out_lock, NULL );
+  pthread_mutex_init( &z->lock, NULL );
+  pthread_cond_init( &z->entry_ended, NULL );
+  pthread_mutex_init( &z->rate_lock, NULL );
+  if( !_deflate_init( z, &z->stream, z->window_bits, z->mem_level ) ||
+      ( z->opts.verify && !zip_verifier_init( &z->verifier ) ) )
+  {
+    /* deflateEnd does nothing on a stream that failed to initialize */
+    deflateEnd( &z->stream );
+    free( z->out_buffer );
+    free( z->rule_hits );
+    varray_release( z->entries );
+    varray_release( z->entry_buffer );
+    varray_release( z->cd_buffer );
+    varray_release( z->manifest );
+    varray_release( z->comment );
+    varray_release( z->stream_pool );
+    pthread_mutex_destroy( &z->out_lock );
+    pthread_mutex_destroy( &z->lock );
+    pthread_cond_destroy( &z->entry_ended );
+    pthread_mutex_destroy( &z->rate_lock );
+    return false;
+  }
+
+  return true;
+}
+
+
+/** Releases the resources of an initialized ZIP context.
+ *
+ *  \param z ZIP context to release.
+ *
+ *  \note \a zip_end must be called before this function to ensure all data is flushed.
+ */
+void zip_release( zip_t *z )
+{
+  /* an entry that didn't end is dropped, then the thread is done with the queue */
+  if( z->opts.verify )
+  {
+    if( z->verify_entry != NULL )
+      zip_verifier_abort( &z->verifier, z->verify_entry );
+    zip_verifier_release( &z->verifier );
+  }
+
+  z->out_cb = NULL;
+  deflateEnd( &z->stream );
+  if( z->small_stream_ready )
+    deflateEnd( &z->small_stream );
+  free( z->out_buffer );
+  free( z->rule_hits );
+  varray_release( z->entries );
+  varray_release( z->entry_buffer );
+  varray_release( z->cd_buffer );
+  varray_release( z->manifest );
+  varray_release( z->comment );
+
+  for( size_t i = 0; i < varray_len( z->stream_pool ); i++ )
+  {
+    deflateEnd( z->stream_pool[i] );
+    free( z->stream_pool[i] );
+  }
+  varray_release( z->stream_pool );
+  pthread_mutex_destroy( &z->out_lock );
+  pthread_mutex_destroy( &z->lock );
+  pthread_cond_destroy( &z->entry_ended );
+  pthread_mutex_destroy( &z->rate_lock );
+
+  if( z->spill_file != NULL )
+    fclose( z->spill_file );
+
+  /* the keys don't outlive the context */
+  memset( &z->password, 0, sizeof( z->password ) );
+  memset( &z->aes, 0, sizeof( z->aes ) );
+}
+
+
+/** Adds the manifest entry.
+ *
+ *  \param z ZIP context.
+ *  \return \c false on error.
+ */
+static bool _write_manifest( zip_t *z )
+{
+  /* the line of the manifest itself goes to a new array */
+  char *manifest = z->manifest;
+  varray_init( z->manifest, 1 );
+
+  bool rv = zip_entry_add_data( z, z->opts.manifest, zip_get_datetime(), manifest, varray_len( manifest ) );
+  varray_release( manifest );
+  return rv;
+}
+
+
+/** Finishes the ZIP generation and flushes remaining data. The central directory may start past
+ *  4 GiB (the ZIP64 end records are written then), but not the local header of the manifest.
+ *
+ *  \param z ZIP context.
+ *  \return \c false on error.
+ */
+bool zip_end( zip_t *z )
+{
+  pthread_mutex_lock( &z->lock );
+  bool handles_open = ( z->open_handles > 0 );
+  pthread_mutex_unlock( &z->lock );
+
+  if( z->entry_opened || handles_open )
+    return false;
+
+  /* the manifest is the last entry, so it lists all the others */
+  if( z->opts.manifest != NULL && !_write_manifest( z ) )
+    return false;
+
+  /* the central directory is not written for an archive with corrupt entries */
+  if( !zip_verify_wait( z ) )
+    return false;
+
+  z->central_dir_offset = z->bytes_written;
+  z->central_dir_disk = z->disk_num;
+  z->central_dir_disk_offset = z->volume_written;
+  z->volume_entries = 0;
+
+  /* the records of the oldest entries were moved to disk */
+  if( z->spill_file != NULL && !_write_spilled_central_dir( z ) )
+    return false;
+
+  /* writes the Central directory file headers, already encoded */
+  if( !_write_cd_records( z, z->cd_buffer, varray_len( z->cd_buffer ) ) )
+    return false;
+
+  /* writes the end of central directory record */
+  if( !_write_eocd( z ) )
+    return false;
+
+  /* a reopened archive may be shorter than before, e.g. if the old comment was longer */
+  return ( z->append_fd < 0 || ftruncate( z->append_fd, z->bytes_written ) == 0 );
+}
+
+
+/** Reopens an existing archive to add more entries to it. The entries already in the archive
+ *  are kept untouched, along with their central directory records (extra fields, comments and
+ *  attributes included) and the archive comment: new entries overwrite the old central
+ *  directory and \a zip_end writes a new one covering both the old and the new entries, then
+ *  truncates the file after it.
+ *
+ *  \param z ZIP context, initialized with an output callback that writes to \a fd.
+ *  \param fd Archive file descriptor (must be open for reading and writing).
+ *  \return \c false on error.
+ *
+ *  \note Must be called right after \a zip_init. \a fd is positioned at the old central
+ *        directory, which stays valid until the first new entry is written.
+ *  \note Without ZIP64 extra fields, the archive must stay within 4 GiB: old archives with a
+ *        central directory past 4 GiB or 64 bit entries are rejected, and new entries that
+ *        would start past 4 GiB fail.
+ */
+bool zip_open_append( zip_t *z, int fd )
+{
+  if( z->entry_opened || z->bytes_written != 0 || varray_len( z->entries ) != 0 ||
+      z->opts.volume_size > 0 )
+    return false;
+
+  zip_map_t m;
+  if( !zip_map_open_fd( &m, fd ) )
+    return false;
+
+  /* loads the existing central directory */
+  bool rv = true;
+  const uint8_t *record = m.data + m.central_dir_offset;
+  for( size_t i = 0; i < zip_map_num_entries( &m ); i++ )
+  {
+    const zip_map_entry_t *old = zip_map_entry( &m, i );
+
+    /* the entries are stored with 32 bit sizes and offsets, and only AE-2 with AES-256 is
+     * written for encrypted ones */
+    bool encrypted = ( old->method == ZIP_AES_METHOD );
+    if( old->name_len > ZIP_ENTRY_MAX_NAME_LEN || old->size > 0xffffffffU ||
+        old->size_compressed > 0xffffffffU || old->offset > 0xffffffffU ||
+        ( encrypted && ( old->aes_version != 2U || old->aes_strength != 3U ) ) )
+    {
+      rv = false;
+      break;
+    }
+
+    zip_entry_t entry = {
+      .offset = old->offset,
+      .crc = old->crc,
+      .size = old->size,
+      .size_compressed = old->size_compressed,
+      .time = old->time,
+      .date = old->date,
+      .method = encrypted ? old->aes_method : old->method,
+      .flags = old->flags,
+      .disk = 0,
+      .encrypted = encrypted,
+    };
+    memcpy( entry.name, old->name, old->name_len );
+    entry.name[old->name_len] = '\0';
+    varray_push( z->entries, entry );
+    if( z->opts.manifest != NULL )
+      _append_manifest_line( z, &entry );
+
+    /* the record is kept as it is, so nothing the library doesn't write is lost */
+    size_t record_len = _cd_record_len( record );
+    varray_append( z->cd_buffer, record, record_len );
+    record += record_len;
+  }
+
+  uint64_t central_dir_offset = m.central_dir_offset;
+  varray_append( z->comment, m.comment, m.comment_len );
+  zip_map_close( &m );
+
+  /* new entries start where the old central directory was, the file is truncated by zip_end */
+  if( !rv || central_dir_offset > 0xffffffffU || lseek( fd, central_dir_offset, SEEK_SET ) < 0 )
+  {
+    varray_len( z->entries ) = 0;
+    varray_len( z->cd_buffer ) = 0;
+    varray_len( z->comment ) = 0;
+    varray_len( z->manifest ) = 0;
+    return false;
+  }
+
+  z->bytes_written = central_dir_offset;
+  z->volume_written = central_dir_offset;
+  z->append_fd = fd;
+  return true;
+}
+
+
+/** Returns the size of the buffer required by \a zip_checkpoint.
+ *
+ *  \param z ZIP context.
+ *  \return Checkpoint size.
+ */
+size_t zip_checkpoint_size( zip_t *z )
+{
+  pthread_mutex_lock( &z->lock );
+  size_t size = ZIP_CHECKPOINT_HEADER_SIZE + zip_get_central_dir_size( z );
+  pthread_mutex_unlock( &z->lock );
+
+  return size;
+}
+
+
+/** Encodes a checkpoint (see \a zip_checkpoint), with the output lock and the lock held.
+ *
+ *  \param z ZIP context.
+ *  \param buffer Output buffer (at least \a zip_checkpoint_size bytes).
+ *  \return \c false on error.
+ */
+static bool _checkpoint( zip_t *z, uint8_t *buffer )
+{
+  uint8_t *p = buffer;
+  _put32_le( p, ZIP_CHECKPOINT_SIGNATURE );
+  _put64_le( p + 4, z->opts.buffer_threshold );
+  _put64_le( p + 12, z->opts.spill_threshold );
+  _put64_le( p + 20, z->bytes_written );
+  _put64_le( p + 28, zip_get_num_entries( z ) );
+  _put64_le( p + 36, zip_get_central_dir_size( z ) );
+  p += ZIP_CHECKPOINT_HEADER_SIZE;
+
+  /* the spilled records are read back, the file stays positioned at its end for more spills */
+  if( z->spill_file != NULL )
+  {
+    if( fflush( z->spill_file ) != 0 || fseek( z->spill_file, 0, SEEK_SET ) != 0 ||
+        fread( p, 1, z->spill_size, z->spill_file ) != z->spill_size ||
+        fseek( z->spill_file, 0, SEEK_END ) != 0 )
+      return false;
+
+    p += z->spill_size;
+  }
+
+  memcpy( p, z->cd_buffer, varray_len( z->cd_buffer ) );
+  return true;
+}
+
+
+/** Saves the state of the archive generation between entries, so a job that dies can continue
+ *  with \a zip_restore instead of starting over. The checkpoint holds the number of bytes
+ *  written, the thresholds of the options and the central directory records of the finished
+ *  entries.
+ *
+ *  \param z ZIP context.
+ *  \param buffer Output buffer.
+ *  \param buffer_len Size of \a buffer (see \a zip_checkpoint_size).
+ *  \return \c false on error (e.g. an entry is in process, or entry handles were committed
+ *          since \a zip_checkpoint_size and the buffer is too small).
+ *
+ *  \note The output must be durable up to \a bytes_written before the checkpoint is stored.
+ */
+bool zip_checkpoint( zip_t *z, uint8_t *buffer, size_t buffer_len )
+{
+  if( z->opts.volume_size > 0 )
+    return false;
+
+  /* entry handles may be committed concurrently, the output lock keeps the offset in step with
+   * the records */
+  pthread_mutex_lock( &z->out_lock );
+  pthread_mutex_lock( &z->lock );
+  bool rv = !z->entry_opened && buffer_len >= ZIP_CHECKPOINT_HEADER_SIZE + zip_get_central_dir_size( z ) &&
+            _checkpoint( z, buffer );
+  pthread_mutex_unlock( &z->lock );
+  pthread_mutex_unlock( &z->out_lock );
+
+  return rv;
+}
+
+
+/** Restores the state saved by \a zip_checkpoint. Adding entries continues at the checkpointed
+ *  offset (\a bytes_written), so the output must be truncated there: anything written after the
+ *  checkpoint belongs to an unfinished entry.
+ *
+ *  \param z ZIP context, initialized with an output callback that appends to the old output.
+ *  \param checkpoint Checkpoint data.
+ *  \param checkpoint_len Bytes in \a checkpoint.
+ *  \return \c false on error.
+ *
+ *  \note Must be called right after \a zip_init. The thresholds saved in the checkpoint replace
+ *        the ones in the options, the callbacks are kept.
+ */
+bool zip_restore( zip_t *z, const uint8_t *checkpoint, size_t checkpoint_len )
+{
+  if( z->entry_opened || z->bytes_written != 0 || zip_get_num_entries( z ) != 0 ||
+      checkpoint_len < ZIP_CHECKPOINT_HEADER_SIZE || _get32_le( checkpoint ) != ZIP_CHECKPOINT_SIGNATURE )
+    return false;
+
+  uint64_t bytes_written = _get64_le( checkpoint + 20 );
+  uint64_t num_entries = _get64_le( checkpoint + 28 );
+  uint64_t central_dir_size = _get64_le( checkpoint + 36 );
+  if( central_dir_size != checkpoint_len - ZIP_CHECKPOINT_HEADER_SIZE )
+    return false;
+
+  z->opts.buffer_threshold = _get64_le( checkpoint + 4 );
+  z->opts.spill_threshold = _get64_le( checkpoint + 12 );
+
+  /* loads the finished entries, spilling them as they would have been */
+  const uint8_t *p = checkpoint + ZIP_CHECKPOINT_HEADER_SIZE;
+  const uint8_t *end = checkpoint + checkpoint_len;
+  bool rv = true;
+  while( rv && p < end )
+  {
+    zip_entry_t entry;
+    size_t record_len = _decode_cd_file_header( p, end - p, &entry );
+    if( record_len == 0 || entry.offset >= bytes_written )
+    {
+      rv = false;
+      break;
+    }
+
+    if( z->opts.spill_threshold > 0 && varray_len( z->entries ) >= z->opts.spill_threshold )
+      rv = _spill_central_dir( z );
+
+    varray_push( z->entries, entry );
+    varray_append( z->cd_buffer, p, record_len );
+    if( z->opts.manifest != NULL )
+      _append_manifest_line( z, &entry );
+    p += record_len;
+  }
+
+  if( !rv || zip_get_num_entries( z ) != num_entries )
+  {
+    varray_len( z->entries ) = 0;
+    varray_len( z->cd_buffer ) = 0;
+    varray_len( z->manifest ) = 0;
+    if( z->spill_file != NULL )
+      fclose( z->spill_file );
+    z->spill_file = NULL;
+    z->spill_size = 0;
+    z->num_spilled = 0;
+    return false;
+  }
+
+  z->bytes_written = bytes_written;
+  z->volume_written = bytes_written;
+  return true;
+}
+
+
+/** Matches an entry name against a glob pattern, ignoring case.
+ *
+ *  \param pattern Glob pattern (\c * matches any run of characters and \c ? any single one).
+ *  \param name Entry name.
+ *  \return \c true if the name matches.
+ */
+static bool _match_glob( const char *pattern, const char *name )
+{
+  for( ; *pattern != '\0'; pattern++, name++ )
+  {
+    /* tries the rest of the pattern against every suffix of the name */
+    if( *pattern == '*' )
+    {
+      for( ;; name++ )
+      {
+        if( _match_glob( pattern + 1, name ) )
+          return true;
+        if( *name == '\0' )
+          return false;
+      }
+    }
+
+    if( *name == '\0' ||
+        ( *pattern != '?' && tolower( ( unsigned char )*pattern ) != tolower( ( unsigned char )*name ) ) )
+      return false;
+  }
+
+  return ( *name == '\0' );
+}
+
+
+/** Finds the first rule that matches an entry.
+ *
+ *  \param z ZIP context.
+ *  \param name Entry name.
+ *  \param data First data of the entry (\c NULL if it's not available yet).
+ *  \param data_len Bytes in \a data.
+ *  \param first Index of the first rule to check.
+ *  \return Index of the rule (\a num_rules if none matches). Without data, the first rule
+ *          that needs it is returned.
+ */
+static size_t _find_rule( zip_t *z, const char *name, const void *data, size_t data_len, size_t first )
+{
+  for( size_t i = first; i < z->opts.num_rules; i++ )
+  {
+    const zip_rule_t *rule = &z->opts.rules[i];
+    if( rule->pattern != NULL && !_match_glob( rule->pattern, name ) )
+      continue;
+
+    if( rule->magic == NULL || data == NULL ||
+        ( data_len >= rule->magic_len && memcmp( data, rule->magic, rule->magic_len ) == 0 ) )
+      return i;
+  }
+
+  return z->opts.num_rules;
+}
+
+
+/** Counts an entry that matched a rule (entry handles may count theirs concurrently).
+ *
+ *  \param z ZIP context.
+ *  \param rule Index of the rule (\a num_rules for the entries without one).
+ */
+static void _count_rule_hit( zip_t *z, size_t rule )
+{
+  pthread_mutex_lock( &z->lock );
+  z->rule_hits[rule]++;
+  pthread_mutex_unlock( &z->lock );
+}
+
+
+/** Gets the compression level of a rule and counts the hit.
+ *
+ *  \param z ZIP context.
+ *  \param rule Index of the rule (\a num_rules for the entries without one).
+ *  \return Compression level.
+ */
+static int _rule_level( zip_t *z, size_t rule )
+{
+  _count_rule_hit( z, rule );
+  if( rule < z->opts.num_rules )
+    return z->opts.rules[rule].level;
+  return z->opts.adaptive ? z->adaptive_level : Z_DEFAULT_COMPRESSION;
+}
+
+
+/** Sets the compression level of the current entry from a rule.
+ *
+ *  \param z ZIP context.
+ *  \param rule Index of the rule (\a num_rules for the entries without one).
+ *  \return \c false on error.
+ */
+static bool _apply_rule( zip_t *z, size_t rule )
+{
+  /* only the entries without a rule adapt their level */
+  z->adaptive_entry = ( z->opts.adaptive && rule == z->opts.num_rules );
+  int level = _rule_level( z, rule );
+  if( !_set_level( z, level ) )
+    return false;
+
+  /* level 0 is STORED when the header gets the sizes, streamed entries keep deflate stored blocks
+   * so streaming readers find their end */
+  if( level != 0 || z->adaptive_entry || ( !z->entry_buffered && z->opts.pwrite_cb == NULL ) )
+    return true;
+
+  CUR_ENTRY( z ).method = 0U; /* STORED */
+  return _reverify( &z->verifier, &z->verify_entry, CUR_ENTRY( z ).name, 0U );
+}
+
+
+/** Starts checking the rules of an entry: finds the first one that matches its name and how
+ *  much of its data the ones that need it compare.
+ *
+ *  \param z ZIP context.
+ *  \param sniff First data of the entry.
+ *  \param name Entry name.
+ *  \return Whether the rule waits for the data (otherwise it's \a sniff->rule).
+ */
+static bool _sniff_start( zip_t *z, zip_sniff_t *sniff, const char *name )
+{
+  sniff->rule = _find_rule( z, name, NULL, 0, 0 );
+  sniff->needed = 0;
+  sniff->len = 0;
+
+  for( size_t i = sniff->rule; i < z->opts.num_rules; i++ )
+  {
+    const zip_rule_t *rule = &z->opts.rules[i];
+    if( rule->magic != NULL && rule->magic_len > sniff->needed &&
+        ( rule->pattern == NULL || _match_glob( rule->pattern, name ) ) )
+      sniff->needed = rule->magic_len;
+  }
+
+  return ( sniff->rule < z->opts.num_rules && z->opts.rules[sniff->rule].magic != NULL );
+}
+
+
+/** Holds back the first data of an entry until there is enough to check its rules.
+ *
+ *  \param sniff First data of the entry.
+ *  \param data Data given to the entry.
+ *  \param data_len Bytes in \a data.
+ *  \return Bytes of \a data held back.
+ */
+static size_t _sniff_take( zip_sniff_t *sniff, const void *data, size_t data_len )
+{
+  size_t len = sniff->needed - sniff->len;
+  if( len > data_len )
+    len = data_len;
+
+  memcpy( sniff->data + sniff->len, data, len );
+  sniff->len += len;
+  return len;
+}
+
+
+/** Compresses data of the current entry, updating its CRC (and hash).
+ *
+ *  \param z ZIP context.
+ *  \param data Data to compress.
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error.
+ */
+static bool _update( zip_t *z, const void *data, size_t data_len )
+{
+  /* the hash reads the data in blocks that stay in the cache for deflate */
+  size_t block_size = z->opts.digest ? ZIP_DIGEST_BLOCK_SIZE : data_len;
+  for( size_t i = 0; i < data_len; i += block_size )
+  {
+    const uint8_t *block = ( const uint8_t * )data + i;
+    size_t block_len = ( data_len - i < block_size ) ? data_len - i : block_size;
+    CUR_ENTRY( z ).crc = crc32( CUR_ENTRY( z ).crc, block, block_len );
+    if( z->opts.digest )
+      zip_sha256_update( &z->sha256, block, block_len );
+    if( CUR_ENTRY( z ).method == 0U ? !_store( z, block, block_len ) : !_deflate( z, Z_NO_FLUSH, block, block_len ) )
+      return false;
+  }
+
+  return true;
+}
+
+
+/** Sets the compression level of the current entry from its first data, checking the rules
+ *  left by \a zip_entry_add, then compresses the data held back.
+ *
+ *  \param z ZIP context.
+ *  \return \c false on error.
+ */
+static bool _sniff( zip_t *z )
+{
+  z->sniffing = false;
+  return _apply_rule( z, _find_rule( z, CUR_ENTRY( z ).name, z->sniff.data, z->sniff.len, z->sniff.rule ) ) &&
+         _update( z, z->sniff.data, z->sniff.len );
+}
+
+
+/** Adds a new entry to the ZIP archive. To add content, call \a zip_entry_update repeatedly and
+ *  then \a zip_entry_end.
+ *
+ *  \param z ZIP context.
+ *  \param filename Entry name (if larger than \c ZIP_ENTRY_MAX_NAME_LEN it's truncated).
+ *  \param datetime Entry date and time.
+ *  \return \c false on error.
+ */
+bool zip_entry_add( zip_t *z, const char *filename, struct zip_datetime datetime )
+{
+  if( z->entry_opened )
+    return false;
+
+  /* entry handles may be committed concurrently */
+  pthread_mutex_lock( &z->out_lock );
+  if( !_reserve_record( z ) )
+  {
+    pthread_mutex_unlock( &z->out_lock );
+    return false;
+  }
+
+  zip_entry_t entry;
+
+  size_t entry_name_len = strlen( filename );
+  if( entry_name_len > ZIP_ENTRY_MAX_NAME_LEN )
+    entry_name_len = ZIP_ENTRY_MAX_NAME_LEN;
+
+  /* initializes the entry */
+  entry.crc = crc32( 0, Z_NULL, 0 );
+  entry.size = 0;
+  entry.size_compressed = 0;
+  memcpy( entry.name, filename, entry_name_len );
+  entry.name[entry_name_len] = '\0';
+  entry.offset = 0; /* set when the header is written */
+  entry.disk = 0;
+  entry.date = _get_dos_date( datetime );
+  entry.time = _get_dos_time( datetime );
+  entry.method = 8U; /* DEFLATE */
+  entry.encrypted = ( z->opts.password != NULL );
+  memset( entry.sha256, 0, sizeof( entry.sha256 ) );
+
+  /* small entries are kept in memory until they end, so the header can have the real sizes */
+  bool buffered = ( z->opts.buffer_threshold > 0 && z->opts.pwrite_cb == NULL );
+
+  /* bit 3 on to indicate streaming unless the header can be written or patched later, bit 1 and
+   * 2 for compression options, bit 0 for encryption */
+  entry.flags = ( buffered || z->opts.pwrite_cb != NULL ) ? 0U : ( 1U << 3U );
+  entry.flags |= entry.encrypted ? 1U : 0U;
+
+  if( !buffered && !_write_local_header( z, &entry ) )
+  {
+    pthread_mutex_unlock( &z->out_lock );
+    return false;
+  }
+
+  pthread_mutex_lock( &z->lock );
+  z->entry_opened = true;
+  z->entry_thread = pthread_self();
+  varray_push( z->entries, entry );
+  pthread_mutex_unlock( &z->lock );
+  pthread_mutex_unlock( &z->out_lock );
+
+  z->entry_buffered = buffered;
+  z->flush_bytes = z->opts.flush_bytes;
+  z->flush_latency_ms = z->opts.flush_latency_ms;
+  z->unflushed = 0;
+
+  if( z->opts.digest )
+    zip_sha256_init( &z->sha256 );
+
+  if( z->opts.verify &&
+      ( z->verify_entry = zip_verifier_entry( &z->verifier, entry.name, entry.method ) ) == NULL )
+    return false;
+
+  /* the data of encrypted entries starts with the salt and the password verifier */
+  uint8_t aes_header[ZIP_AES_HEADER_SIZE];
+  if( entry.encrypted && ( !zip_aes_start( &z->aes, &z->password, aes_header ) ||
+                           !_output_entry_data( z, aes_header, sizeof( aes_header ), false ) ) )
+    return false;
+
+  /* resets the compression context, the rules that need data wait for the first update */
+  if( deflateReset( &z->stream ) != Z_OK )
+    return false;
+
+  z->adaptive_entry = false;
+  z->sniffing = _sniff_start( z, &z->sniff, entry.name );
+  return z->sniffing || _apply_rule( z, z->sniff.rule );
+}
+
+
+/** Writes data into the current entry (can be called many times for the same entry).
+ *
+ *  \param z ZIP context.
+ *  \param data Data to compress.
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error.
+ *
+ *  \note In order to call this function, \a zip_entry_add must have been called before.
+ */
+bool zip_entry_update( zip_t *z, const void *data, size_t data_len )
+{
+  if( !z->entry_opened )
+    return false;
+
+  if( data_len == 0 )
+    return true;
+
+  /* magic bytes split across updates are put together before the rules are checked */
+  if( z->sniffing )
+  {
+    size_t taken = _sniff_take( &z->sniff, data, data_len );
+    if( z->sniff.len >= z->sniff.needed &&
+        ( !_sniff( z ) || !_update( z, ( const uint8_t * )data + taken, data_len - taken ) ) )
+      return false;
+  }
+  else if( !_update( z, data, data_len ) )
+    return false;
+
+  /* the entry can't be completed once its sizes don't fit in its records */
+  if( !_sizes_fit( &CUR_ENTRY( z ) ) )
+    return false;
+
+  if( z->flush_bytes == 0 && z->flush_latency_ms == 0 )
+    return true;
+
+  /* flushes when the data held by deflate (or for the rules) exceeds the bounds of the entry */
+  uint64_t now = ( z->flush_latency_ms > 0 ) ? _now_ms() : 0;
+  if( z->unflushed == 0 )
+    z->unflushed_since = now;
+  z->unflushed += data_len;
+
+  if( ( z->flush_bytes > 0 && z->unflushed >= z->flush_bytes ) ||
+      ( z->flush_latency_ms > 0 && now - z->unflushed_since >= z->flush_latency_ms ) )
+    return zip_entry_flush( z );
+
+  return true;
+}
+
+
+/** Outputs all the data of the current entry given so far, so the consumer can decompress it
+ *  without waiting for more input (at the cost of some compression ratio).
+ *
+ *  \param z ZIP context.
+ *  \return \c false on error.
+ *
+ *  \note A buffered entry is streamed from then on.
+ */
+bool zip_entry_flush( zip_t *z )
+{
+  if( !z->entry_opened )
+    return false;
+
+  z->unflushed = 0;
+
+  /* the data held back for the rules can't wait any longer */
+  if( z->sniffing && !_sniff( z ) )
+    return false;
+
+  /* the header must go out first */
+  if( z->entry_buffered && !_stream_entry( z ) )
+    return false;
+
+  /* stored data is never held back */
+  return ( CUR_ENTRY( z ).method == 0U || _deflate( z, Z_SYNC_FLUSH, NULL, 0 ) );
+}
+
+
+/** Sets the flush bounds of the current entry, replacing the ones in the options.
+ *
+ *  \param z ZIP context.
+ *  \param max_bytes Maximum bytes given to \a zip_entry_update before flushing (0 for no limit).
+ *  \param max_latency_ms Maximum milliseconds since the first byte not flushed (0 for no limit).
+ *  \return \c false on error.
+ */
+bool zip_entry_set_flush( zip_t *z, size_t max_bytes, unsigned max_latency_ms )
+{
+  if( !z->entry_opened )
+    return false;
+
+  z->flush_bytes = max_bytes;
+  z->flush_latency_ms = max_latency_ms;
+  return true;
+}
+
+
+/** Flushes the current entry once its oldest byte not flushed is older than its flush latency.
+ *  \a zip_entry_update only checks the latency when it's called, so producers whose data can
+ *  stop for a while call this function from a timer to bound it. Between entries it does
+ *  nothing.
+ *
+ *  \param z ZIP context.
+ *  \return \c false on error.
+ */
+bool zip_entry_poll( zip_t *z )
+{
+  if( !z->entry_opened || z->flush_latency_ms == 0 || z->unflushed == 0 ||
+      _now_ms() - z->unflushed_since < z->flush_latency_ms )
+    return true;
+
+  return zip_entry_flush( z );
+}
+
+
+/** Updates the memory accounted for the entry handles.
+ *
+ *  \param z ZIP context.
+ *  \param allocated Bytes allocated.
+ *  \param released Bytes released.
+ */
+static void _account_handle_memory( zip_t *z, size_t allocated, size_t released )
+{
+  pthread_mutex_lock( &z->lock );
+  z->handle_memory = z->handle_memory + allocated - released;
+  pthread_mutex_unlock( &z->lock );
+}
+
+
+/** Drops the compressed data of an entry handle that couldn't be stored, so the handle keeps no
+ *  memory or temporary file while it waits to be closed.
+ *
+ *  \param h Entry handle.
+ *  \return \c false, for the caller to return.
+ */
+static bool _spool_failed( zip_entry_h *h )
+{
+  if( h->spool_file != NULL )
+    fclose( h->spool_file );
+  h->spool_file = NULL;
+
+  if( h->spool != NULL )
+  {
+    _account_handle_memory( h->z, 0, VARRAY_MEMORY( h->spool ) );
+    varray_release( h->spool );
+  }
+
+  h->failed = true;
+  return false;
+}
+
+
+/** Stores compressed data of an entry handle, in memory until \a spool_size and then in a
+ *  temporary file. On error, the data stored so far is dropped and the handle fails.
+ *
+ *  \param h Entry handle.
+ *  \param data Compressed data.
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error.
+ */
+static bool _spool( zip_entry_h *h, const uint8_t *data, size_t data_len )
+{
+  if( h->spool_file == NULL && varray_len( h->spool ) + data_len > h->z->opts.spool_size )
+  {
+    size_t spool_len = varray_len( h->spool );
+    if( ( h->spool_file = tmpfile() ) == NULL ||
+        fwrite( h->spool, 1, spool_len, h->spool_file ) != spool_len )
+      return _spool_failed( h );
+
+    _account_handle_memory( h->z, 0, VARRAY_MEMORY( h->spool ) );
+    varray_release( h->spool );
+  }
+
+  if( h->spool_file != NULL )
+    return ( fwrite( data, 1, data_len, h->spool_file ) == data_len ) || _spool_failed( h );
+
+  size_t spool_memory = VARRAY_MEMORY( h->spool );
+  varray_append( h->spool, data, data_len );
+  if( VARRAY_MEMORY( h->spool ) != spool_memory )
+    _account_handle_memory( h->z, VARRAY_MEMORY( h->spool ), spool_memory );
+  return true;
+}
+
+
+/** Spools data of an entry handle, verified first and encrypted if needed.
+ *
+ *  \param h Entry handle.
+ *  \param data Entry data (compressed if needed), encrypted in place.
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error.
+ */
+static bool _handle_output( zip_entry_h *h, uint8_t *data, size_t data_len )
+{
+  if( h->verify_entry != NULL && !zip_verifier_feed( &h->z->verifier, h->verify_entry, data, data_len ) )
+    return false;
+
+  if( h->entry.encrypted )
+    zip_aes_encrypt( &h->aes, data, data_len );
+
+  h->entry.size_compressed += data_len;
+  return _spool( h, data, data_len );
+}
+
+
+/** Deflates data of an entry handle until it's completely consumed (STORED entries only copy
+ *  it).
+ *
+ *  \param h Entry handle.
+ *  \param flush Flush mode as described in libz.
+ *  \param data Buffer of data to compress.
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error.
+ */
+static bool _handle_deflate( zip_entry_h *h, int flush, const void *data, size_t data_len )
+{
+  uint8_t buffer[ZIP_INTERNAL_BUFFER_SIZE];
+
+  h->entry.size += data_len;
+  if( h->entry.method == 0U )
+  {
+    /* the data of the caller is encrypted in the buffer */
+    for( size_t i = 0; i < data_len; i += sizeof( buffer ) )
+    {
+      size_t block_len = ( data_len - i < sizeof( buffer ) ) ? data_len - i : sizeof( buffer );
+      memcpy( buffer, ( const uint8_t * )data + i, block_len );
+      if( !_handle_output( h, buffer, block_len ) )
+        return false;
+    }
+    return true;
+  }
+
+  h->stream->avail_in = data_len;
+  h->stream->next_in = ( Bytef * )data;
+
+  do
+  {
+    h->stream->avail_out = sizeof( buffer );
+    h->stream->next_out = buffer;
+    if( deflate( h->stream, flush ) < 0 )
+      return false;
+
+    if( !_handle_output( h, buffer, sizeof( buffer ) - h->stream->avail_out ) )
+      return false;
+  } while( h->stream->avail_out == 0 );
+
+  return true;
+}
+
+
+/** Sets the compression level of an entry handle from a rule, before any data is compressed.
+ *  Handles don't adapt their level.
+ *
+ *  \param h Entry handle.
+ *  \param rule Index of the rule (\a num_rules for the entries without one).
+ *  \return \c false on error.
+ */
+static bool _handle_apply_rule( zip_entry_h *h, size_t rule )
+{
+  zip_t *z = h->z;
+  _count_rule_hit( z, rule );
+
+  /* handles write their header once they are complete, so level 0 is STORED */
+  int level = ( rule < z->opts.num_rules ) ? z->opts.rules[rule].level : Z_DEFAULT_COMPRESSION;
+  if( level == 0 )
+  {
+    h->entry.method = 0U; /* STORED */
+    return _reverify( &z->verifier, &h->verify_entry, h->entry.name, 0U );
+  }
+
+  /* the stream may come from the pool with the level of another entry */
+  return ( deflateParams( h->stream, level, Z_DEFAULT_STRATEGY ) == Z_OK );
+}
+
+
+/** Sets the compression level of an entry handle from its first data, then compresses the data
+ *  held back.
+ *
+ *  \param h Entry handle.
+ *  \return \c false on error.
+ */
+static bool _handle_sniff( zip_entry_h *h )
+{
+  h->sniffing = false;
+  return _handle_apply_rule( h, _find_rule( h->z, h->entry.name, h->sniff.data, h->sniff.len, h->sniff.rule ) ) &&
+         zip_entry_write( h, h->sniff.data, h->sniff.len );
+}
+
+
+/** Writes the local header and the spooled data of an entry handle into the archive (the caller
+ *  holds \a out_lock).
+ *
+ *  \param h Entry handle (its deflate stream finished).
+ *  \return \c false on error.
+ */
+static bool _commit_handle( zip_entry_h *h )
+{
+  zip_t *z = h->z;
+
+  if( !_reserve_record( z ) || !_write_local_header( z, &h->entry ) )
+    return false;
+
+  if( h->spool_file == NULL )
+  {
+    if( !_out( z, h->spool, varray_len( h->spool ) ) )
+      return false;
+  }
+  else
+  {
+    if( fflush( h->spool_file ) != 0 || fseek( h->spool_file, 0, SEEK_SET ) != 0 )
+      return false;
+
+    size_t n;
+    while( ( n = fread( z->out_buffer, 1, z->buffer_size, h->spool_file ) ) > 0 )
+      if( !_out( z, z->out_buffer, n ) )
+        return false;
+
+    if( ferror( h->spool_file ) )
+      return false;
+  }
+
+  z->bytes_written += h->entry.size_compressed;
+  _add_record( z, &h->entry );
+  return true;
+}
+
+
+/** Releases an entry handle.
+ *
+ *  \param h Entry handle.
+ */
+static void _release_handle( zip_entry_h *h )
+{
+  if( h->verify_entry != NULL )
+    zip_verifier_abort( &h->z->verifier, h->verify_entry );
+
+  /* the stream goes back to the pool for the next handle */
+  pthread_mutex_lock( &h->z->lock );
+  h->z->open_handles--;
+  h->z->handle_memory -= sizeof( zip_entry_h ) + ( ( h->spool != NULL ) ? VARRAY_MEMORY( h->spool ) : 0 );
+  varray_push( h->z->stream_pool, h->stream );
+  pthread_mutex_unlock( &h->z->lock );
+
+  if( h->spool_file != NULL )
+    fclose( h->spool_file );
+  if( h->spool != NULL )
+    varray_release( h->spool );
+  free( h );
+}
+
+
+/** Opens an entry that can be written at the same time as other entries. Its data is
+ *  compressed with its own deflate stream and kept aside (see \a spool_size) until
+ *  \a zip_entry_close adds it to the archive, so the entries are stored in the order they are
+ *  closed and their local headers carry the CRC and sizes.
+ *
+ *  Handles can be used from different threads: only taking a deflate stream from the pool and
+ *  committing the entry on close are serialized.
+ *
+ *  \param z ZIP context.
+ *  \param filename Entry name (if larger than \c ZIP_ENTRY_MAX_NAME_LEN it's truncated).
+ *  \param datetime Entry date and time.
+ *  \return The entry handle (\c NULL on error).
+ */
+zip_entry_h *zip_entry_open( zip_t *z, const char *filename, struct zip_datetime datetime )
+{
+  zip_entry_h *h = malloc( sizeof( zip_entry_h ) );
+  if( h == NULL )
+    return NULL;
+
+  /* reuses the stream of a closed handle, initializing a new one is much more expensive */
+  pthread_mutex_lock( &z->lock );
+  h->stream = ( varray_len( z->stream_pool ) > 0 ) ? varray_pop( z->stream_pool ) : NULL;
+  z->open_handles++;
+  pthread_mutex_unlock( &z->lock );
+
+  /* new streams stay allocated in the pool until the context is released */
+  size_t stream_memory = 0;
+  if( h->stream != NULL )
+    deflateReset( h->stream );
+  else if( ( h->stream = malloc( sizeof( z_stream ) ) ) == NULL ||
+           !_deflate_init( z, h->stream, z->window_bits, z->mem_level ) )
+  {
+    pthread_mutex_lock( &z->lock );
+    z->open_handles--;
+    pthread_mutex_unlock( &z->lock );
+
+    free( h->stream );
+    free( h );
+    return NULL;
+  }
+  else
+    stream_memory = sizeof( z_stream );
+
+  size_t entry_name_len = strlen( filename );
+  if( entry_name_len > ZIP_ENTRY_MAX_NAME_LEN )
+    entry_name_len = ZIP_ENTRY_MAX_NAME_LEN;
+
+  h->z = z;
+  h->entry.crc = crc32( 0, Z_NULL, 0 );
+  h->entry.size = 0;
+  h->entry.size_compressed = 0;
+  memcpy( h->entry.name, filename, entry_name_len );
+  h->entry.name[entry_name_len] = '\0';
+  h->entry.offset = 0; /* set when the header is written */
+  h->entry.disk = 0;
+  h->entry.date = _get_dos_date( datetime );
+  h->entry.time = _get_dos_time( datetime );
+  h->entry.method = 8U; /* DEFLATE */
+  h->entry.encrypted = ( z->opts.password != NULL );
+  memset( h->entry.sha256, 0, sizeof( h->entry.sha256 ) );
+  h->entry.flags = h->entry.encrypted ? 1U : 0U; /* the header is written once the entry is complete */
+  h->spool_file = NULL;
+  h->verify_entry = NULL;
+  h->sniffing = false;
+  h->finished = false;
+  h->failed = false;
+  if( z->opts.digest )
+    zip_sha256_init( &h->sha256 );
+  varray_init( h->spool, 1 );
+  _account_handle_memory( z, sizeof( zip_entry_h ) + stream_memory + VARRAY_MEMORY( h->spool ), 0 );
+
+  if( z->opts.verify &&
+      ( h->verify_entry = zip_verifier_entry( &z->verifier, h->entry.name, h->entry.method ) ) == NULL )
+  {
+    _release_handle( h );
+    return NULL;
+  }
+
+  /* the data of encrypted entries starts with the salt and the password verifier */
+  uint8_t aes_header[ZIP_AES_HEADER_SIZE];
+  if( h->entry.encrypted )
+  {
+    h->entry.size_compressed = sizeof( aes_header );
+    if( !zip_aes_start( &h->aes, &z->password, aes_header ) || !_spool( h, aes_header, sizeof( aes_header ) ) )
+    {
+      _release_handle( h );
+      return NULL;
+    }
+  }
+
+  /* the rules that need data wait for the first writes */
+  h->sniffing = _sniff_start( z, &h->sniff, h->entry.name );
+  if( !h->sniffing && !_handle_apply_rule( h, h->sniff.rule ) )
+  {
+    _release_handle( h );
+    return NULL;
+  }
 
-  /* starts with 1 entry in the array */
-  varray_init( z->entries, 1 );
+  return h;
+}
 
-  /* initializes the stream */
-  z->stream.opaque = Z_NULL;
-  z->stream.zalloc = Z_NULL;
-  z->stream.zfree = Z_NULL;
-  z->stream.next_in = NULL;
-  z->stream.data_type = Z_BINARY;
 
-  /* zlib initialization parameters */
-  const int memlevel = 8;
-  const int strategy = Z_DEFAULT_STRATEGY;
-  const int method = Z_DEFLATED;
-  const int level = Z_DEFAULT_COMPRESSION;
-  const int window_bits = -15;
+/** Writes data into an entry opened with \a zip_entry_open.
+ *
+ *  \param h Entry handle.
+ *  \param data Data to compress.
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error (the handle fails: the next writes fail too, and closing it
+ *          releases it without adding the entry).
+ */
+bool zip_entry_write( zip_entry_h *h, const void *data, size_t data_len )
+{
+  if( h->finished || h->failed )
+    return false;
 
-  if( deflateInit2( &z->stream, level, method, window_bits, memlevel, strategy ) != Z_OK )
+  if( data_len == 0 )
+    return true;
+
+  /* magic bytes split across writes are put together before the rules are checked */
+  if( h->sniffing )
   {
-    free( z->out_buffer );
-    free( z->entries );
-    return false;
+    size_t taken = _sniff_take( &h->sniff, data, data_len );
+    if( h->sniff.len < h->sniff.needed )
+      return true;
+    return _handle_sniff( h ) && zip_entry_write( h, ( const uint8_t * )data + taken, data_len - taken );
+  }
+
+  /* updates the CRC (and the hash, in blocks that stay in the cache for deflate) */
+  size_t block_size = h->z->opts.digest ? ZIP_DIGEST_BLOCK_SIZE : data_len;
+  for( size_t i = 0; i < data_len; i += block_size )
+  {
+    const uint8_t *block = ( const uint8_t * )data + i;
+    size_t block_len = ( data_len - i < block_size ) ? data_len - i : block_size;
+    h->entry.crc = crc32( h->entry.crc, block, block_len );
+    if( h->z->opts.digest )
+      zip_sha256_update( &h->sha256, block, block_len );
+
+    /* part of the data may be stored already, so the entry can't be completed */
+    if( !_handle_deflate( h, Z_NO_FLUSH, block, block_len ) || !_sizes_fit( &h->entry ) )
+    {
+      h->failed = true;
+      return false;
+    }
   }
 
   return true;
 }
 
 
-/** Releases the resources of an initialized ZIP context.
- *
- *  \param z ZIP context to release.
+/** Finishes an entry opened with \a zip_entry_open and adds it to the archive. While an entry
+ *  added with \a zip_entry_add is in process on another thread, it waits for that one to end.
  *
- *  \note \a zip_end must be called before this function to ensure all data is flushed.
+ *  \param h Entry handle, released unless the function fails because the calling thread has an
+ *         entry added with \a zip_entry_add in process (it can be closed again once that one
+ *         ends). Otherwise it's released, whether the function succeeds or not.
+ *  \return \c false on error.
  */
-void zip_release( zip_t *z )
+bool zip_entry_close( zip_entry_h *h )
 {
-  z->out_cb = NULL;
-  deflateEnd( &z->stream );
-  free( z->out_buffer );
-  varray_release( z->entries );
+  /* the data of a failed handle is lost, so it's never committed */
+  if( h->failed )
+  {
+    _release_handle( h );
+    return false;
+  }
+
+  if( !h->finished )
+  {
+    /* short entries are checked against the rules that need data too */
+    if( h->sniffing && !_handle_sniff( h ) )
+    {
+      _release_handle( h );
+      return false;
+    }
+
+    h->finished = true;
+    if( !_handle_deflate( h, Z_FINISH, NULL, 0 ) )
+    {
+      _release_handle( h );
+      return false;
+    }
+
+    /* the verify thread checks the entry once it inflated all of it */
+    if( h->verify_entry != NULL )
+    {
+      if( !zip_verifier_end( &h->z->verifier, h->verify_entry, h->entry.crc, h->entry.size ) )
+      {
+        _release_handle( h );
+        return false;
+      }
+      h->verify_entry = NULL;
+    }
+
+    if( h->z->opts.digest )
+      zip_sha256_final( &h->sha256, h->entry.sha256 );
+
+    /* the data of encrypted entries ends with the authentication code */
+    uint8_t mac[ZIP_AES_MAC_SIZE];
+    if( h->entry.encrypted )
+    {
+      zip_aes_finish( &h->aes, mac );
+      h->entry.size_compressed += sizeof( mac );
+      if( !_spool( h, mac, sizeof( mac ) ) )
+      {
+        _release_handle( h );
+        return false;
+      }
+    }
+  }
+
+  /* the sequential entry owns the output until it ends, and no other one can start while the
+   * output lock is held (the thread that has to end it can't wait) */
+  pthread_mutex_lock( &h->z->out_lock );
+  pthread_mutex_lock( &h->z->lock );
+  while( h->z->entry_opened && !pthread_equal( h->z->entry_thread, pthread_self() ) )
+    pthread_cond_wait( &h->z->entry_ended, &h->z->lock );
+  bool opened = h->z->entry_opened;
+  pthread_mutex_unlock( &h->z->lock );
+  bool rv = !opened && _commit_handle( h );
+  pthread_mutex_unlock( &h->z->out_lock );
+
+  if( !opened )
+    _release_handle( h );
+
+  return rv;
 }
 
 
-/** Finishes the ZIP generation and flushes remaining data.
+/** Closes an entry.
  *
  *  \param z ZIP context.
  *  \return \c false on error.
  */
-bool zip_end( zip_t *z )
+bool zip_entry_end( zip_t *z )
 {
-  if( z->entry_opened )
+  if( !z->entry_opened )
+    return true;
+
+  /* short entries are checked against the rules that need data too */
+  if( z->sniffing && !_sniff( z ) )
     return false;
 
-  z->central_dir_offset = z->bytes_written;
+  /* flushes remaining data (stored data is never held back) */
+  if( CUR_ENTRY( z ).method != 0U && !_deflate( z, Z_FINISH, NULL, 0 ) )
+    return false;
 
-  /* writes the Central directory file headers */
-  for( size_t i = 0; i < varray_len( z->entries ); i++ )
-    if( !_write_cd_file_header( z, i ) )
+  /* the data kept as is by a buffered STORED entry is complete, so it's verified and encrypted */
+  if( CUR_ENTRY( z ).method == 0U && z->entry_buffered )
+  {
+    size_t stored_len = CUR_ENTRY( z ).size;
+    uint8_t *stored = z->entry_buffer + varray_len( z->entry_buffer ) - stored_len;
+    if( z->verify_entry != NULL && !zip_verifier_feed( &z->verifier, z->verify_entry, stored, stored_len ) )
       return false;
+    if( CUR_ENTRY( z ).encrypted )
+      zip_aes_encrypt( &z->aes, stored, stored_len );
+  }
 
-  /* writes the end of central directory record */
-  return _write_eocd( z );
+  /* the verify thread checks the entry once it inflated all of it */
+  if( z->verify_entry != NULL )
+  {
+    if( !zip_verifier_end( &z->verifier, z->verify_entry, CUR_ENTRY( z ).crc, CUR_ENTRY( z ).size ) )
+      return false;
+    z->verify_entry = NULL;
+  }
+
+  if( z->opts.digest )
+    zip_sha256_final( &z->sha256, CUR_ENTRY( z ).sha256 );
+
+  /* the data of encrypted entries ends with the authentication code */
+  uint8_t mac[ZIP_AES_MAC_SIZE];
+  if( CUR_ENTRY( z ).encrypted )
+  {
+    zip_aes_finish( &z->aes, mac );
+    if( !_output_entry_data( z, mac, sizeof( mac ), false ) )
+      return false;
+  }
+
+  if( !_sizes_fit( &CUR_ENTRY( z ) ) )
+    return false;
+
+  if( z->entry_buffered )
+  {
+    /* the whole entry was buffered, so the header can have the CRC and sizes */
+    if( !_write_local_header( z, &CUR_ENTRY( z ) ) ||
+        !_out( z, z->entry_buffer, varray_len( z->entry_buffer ) ) )
+      return false;
+
+    z->bytes_written += varray_len( z->entry_buffer );
+    varray_len( z->entry_buffer ) = 0;
+    z->entry_buffered = false;
+  }
+  else if( !( CUR_ENTRY( z ).flags & ( 1U << 3U ) ) )
+  {
+    /* on seekable outputs the CRC and sizes are patched into the local header */
+    uint8_t fields[12];
+    _put32_le( fields, _header_crc( &CUR_ENTRY( z ) ) );
+    _put32_le( fields + 4, CUR_ENTRY( z ).size_compressed );
+    _put32_le( fields + 8, CUR_ENTRY( z ).size );
+
+    /* the CRC is the first of the fields, at offset 14 of the header */
+    if( !z->opts.pwrite_cb( z->out_cb_ctx, fields, sizeof( fields ), CUR_ENTRY( z ).offset + 14 ) )
+      return false;
+
+    /* the header was written before the rule stored the entry, so the method is patched too (at
+     * offset 8, or in the AES extra field after the name) */
+    uint8_t method[2];
+    _put16_le( method, CUR_ENTRY( z ).method );
+    uint64_t method_offset = CUR_ENTRY( z ).encrypted ? 30 + strlen( CUR_ENTRY( z ).name ) + 9 : 8;
+    if( CUR_ENTRY( z ).method == 0U &&
+        !z->opts.pwrite_cb( z->out_cb_ctx, method, sizeof( method ), CUR_ENTRY( z ).offset + method_offset ) )
+      return false;
+  }
+  else if( !_write_data_descriptor( z ) )
+    return false;
+
+  /* the central directory record is ready as soon as the entry ends */
+  pthread_mutex_lock( &z->lock );
+  z->entry_opened = false;
+  _append_cd_file_header( z, &CUR_ENTRY( z ) );
+  if( z->opts.manifest != NULL )
+    _append_manifest_line( z, &CUR_ENTRY( z ) );
+  pthread_cond_broadcast( &z->entry_ended );
+  pthread_mutex_unlock( &z->lock );
+
+  /* success */
+  return true;
 }
 
 
-/** Adds a new entry to the ZIP archive. To add content, call \a zip_entry_update repeatedly and
- *  then \a zip_entry_end.
+/** Compresses a small entry in a single pass with the small entry stream.
+ *
+ *  \param z ZIP context.
+ *  \param level Compression level.
+ *  \param data Entry data.
+ *  \param data_len Bytes in \a data.
+ *  \param compressed Output buffer.
+ *  \param compressed_size Size of \a compressed (large enough for the worst case).
+ *  \param compressed_len Output bytes in \a compressed.
+ *  \return \c false on error.
+ */
+static bool _compress_small( zip_t *z, int level, const void *data, size_t data_len, uint8_t *compressed,
+                             size_t compressed_size, size_t *compressed_len )
+{
+  if( !z->small_stream_ready )
+  {
+    /* never larger than the main stream, so it fits the memory budget */
+    int window_bits = ( z->window_bits < ZIP_SMALL_ENTRY_WINDOW_BITS ) ? z->window_bits : ZIP_SMALL_ENTRY_WINDOW_BITS;
+    int mem_level = ( z->mem_level < ZIP_SMALL_ENTRY_MEM_LEVEL ) ? z->mem_level : ZIP_SMALL_ENTRY_MEM_LEVEL;
+    if( !_deflate_init( z, &z->small_stream, window_bits, mem_level ) )
+      return false;
+    z->small_stream_ready = true;
+    z->small_level = Z_DEFAULT_COMPRESSION;
+  }
+  else if( deflateReset( &z->small_stream ) != Z_OK )
+    return false;
+
+  if( level != z->small_level )
+  {
+    if( deflateParams( &z->small_stream, level, Z_DEFAULT_STRATEGY ) != Z_OK )
+      return false;
+    z->small_level = level;
+  }
+
+  if( deflateBound( &z->small_stream, data_len ) > compressed_size )
+    return false;
+
+  z->small_stream.next_in = ( Bytef * )data;
+  z->small_stream.avail_in = data_len;
+  z->small_stream.next_out = compressed;
+  z->small_stream.avail_out = compressed_size;
+  if( deflate( &z->small_stream, Z_FINISH ) != Z_STREAM_END )
+    return false;
+
+  *compressed_len = compressed_size - z->small_stream.avail_out;
+  return true;
+}
+
+
+/** Adds a whole entry to the ZIP archive. Small entries are compressed in a single pass with a
+ *  stream that is cheap to reset, and stored uncompressed when that is smaller or when their rule
+ *  sets level 0. Larger ones are the same as \a zip_entry_add, \a zip_entry_update and
+ *  \a zip_entry_end.
  *
  *  \param z ZIP context.
  *  \param filename Entry name (if larger than \c ZIP_ENTRY_MAX_NAME_LEN it's truncated).
  *  \param datetime Entry date and time.
+ *  \param data Entry data.
+ *  \param data_len Bytes in \a data.
  *  \return \c false on error.
  */
-bool zip_entry_add( zip_t *z, const char *filename, struct zip_datetime datetime )
+bool zip_entry_add_data( zip_t *z, const char *filename, struct zip_datetime datetime, const void *data,
+                         size_t data_len )
 {
   if( z->entry_opened )
     return false;
 
-  zip_entry_t entry;
+  if( data_len > ZIP_SMALL_ENTRY_SIZE )
+    return zip_entry_add( z, filename, datetime ) && zip_entry_update( z, data, data_len ) &&
+           zip_entry_end( z );
+
+  /* the entries with level 0 are stored without going through the stream */
+  int level = _rule_level( z, _find_rule( z, filename, ( data != NULL ) ? data : "", data_len, 0 ) );
+  uint8_t compressed[ZIP_SMALL_ENTRY_SIZE + ( ZIP_SMALL_ENTRY_SIZE >> 3 ) + ( ZIP_SMALL_ENTRY_SIZE >> 6 ) + 64];
+  size_t compressed_len = data_len;
+  if( level != 0 && !_compress_small( z, level, data, data_len, compressed, sizeof( compressed ), &compressed_len ) )
+    return false;
 
   size_t entry_name_len = strlen( filename );
   if( entry_name_len > ZIP_ENTRY_MAX_NAME_LEN )
     entry_name_len = ZIP_ENTRY_MAX_NAME_LEN;
 
-  /* initializes the entry */
-  entry.crc = crc32( 0, Z_NULL, 0 );
-  entry.size = 0;
-  entry.size_compressed = 0;
+  zip_entry_t entry;
+  entry.crc = crc32( crc32( 0, Z_NULL, 0 ), data, data_len );
+  entry.size = data_len;
+  entry.size_compressed = compressed_len;
   memcpy( entry.name, filename, entry_name_len );
   entry.name[entry_name_len] = '\0';
-  entry.offset = z->bytes_written;
+  entry.offset = 0; /* set when the header is written */
+  entry.disk = 0;
   entry.date = _get_dos_date( datetime );
   entry.time = _get_dos_time( datetime );
+  entry.method = 8U; /* DEFLATE */
+  entry.encrypted = ( z->opts.password != NULL );
+  entry.flags = entry.encrypted ? 1U : 0U; /* the header has the CRC and sizes */
+  memset( entry.sha256, 0, sizeof( entry.sha256 ) );
+  if( z->opts.digest )
+  {
+    zip_sha256_t sha256;
+    zip_sha256_init( &sha256 );
+    if( data_len > 0 )
+      zip_sha256_update( &sha256, data, data_len );
+    zip_sha256_final( &sha256, entry.sha256 );
+  }
 
-  struct zip_local_file_header lf_header = {
-    .signature = 0x04034b50U,
-    .extract_version = 20U,
-    .flags = ( 1U << 3U ), /* bit 3 on to indicate streaming, bit 1 and 2 for compression options */
-    .method = 8U,          /* DEFLATE */
-    .modif_time = entry.time,
-    .modif_date = entry.date,
-    .crc = 0,                       /* set to zero because it's indicated in the data descriptor */
-    .compressed_size = 0,           /* set to zero because it's indicated in the data descriptor */
-    .uncompressed_size = 0,         /* set to zero because it's indicated in the data descriptor */
-    .fname_length = entry_name_len, /* filename length (null character not included) */
-    .extra_field_length = 0,        /* no extra field */
-  };
+  /* incompressible data is stored too */
+  const uint8_t *entry_data = compressed;
+  if( entry.size_compressed >= data_len )
+  {
+    entry.method = 0U; /* STORED */
+    entry.size_compressed = data_len;
+    entry_data = data;
+  }
 
-  /* writes each field in little-endian */
-  size_t bytes_written = 0;
-  if( !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, lf_header.signature ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, lf_header.extract_version ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, lf_header.flags ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, lf_header.method ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, lf_header.modif_time ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, lf_header.modif_date ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, lf_header.crc ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, lf_header.compressed_size ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, lf_header.uncompressed_size ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, lf_header.fname_length ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, lf_header.extra_field_length ) )
+  /* the whole entry is verified at once, before it's encrypted */
+  if( z->opts.verify )
+  {
+    zip_verify_entry_t *verify_entry = zip_verifier_entry( &z->verifier, entry.name, entry.method );
+    if( verify_entry == NULL )
+      return false;
+
+    if( !zip_verifier_feed( &z->verifier, verify_entry, entry_data, entry.size_compressed ) ||
+        !zip_verifier_end( &z->verifier, verify_entry, entry.crc, entry.size ) )
+    {
+      zip_verifier_abort( &z->verifier, verify_entry );
+      return false;
+    }
+  }
+
+  /* encrypted data is wrapped in the salt and password verifier, and the authentication code */
+  size_t entry_data_len = entry.size_compressed;
+  uint8_t aes_header[ZIP_AES_HEADER_SIZE];
+  uint8_t mac[ZIP_AES_MAC_SIZE];
+  if( entry.encrypted )
+  {
+    if( !zip_aes_start( &z->aes, &z->password, aes_header ) )
+      return false;
+
+    if( entry_data != compressed && data_len > 0 )
+      memcpy( compressed, data, data_len );
+    entry_data = compressed;
+    zip_aes_encrypt( &z->aes, compressed, entry_data_len );
+    zip_aes_finish( &z->aes, mac );
+    entry.size_compressed += sizeof( aes_header ) + sizeof( mac );
+  }
+
+  /* entry handles may be committed concurrently */
+  pthread_mutex_lock( &z->out_lock );
+
+  bool rv = _reserve_record( z ) && _write_local_header( z, &entry ) &&
+            ( !entry.encrypted || _out( z, aes_header, sizeof( aes_header ) ) ) &&
+            _out( z, entry_data, entry_data_len ) && ( !entry.encrypted || _out( z, mac, sizeof( mac ) ) );
+  if( rv )
+  {
+    z->bytes_written += entry.size_compressed;
+    _add_record( z, &entry );
+  }
+
+  pthread_mutex_unlock( &z->out_lock );
+  return rv;
+}
+
+
+/** Copies an entry from another archive without decompressing it: its compressed data is
+ *  written as is, with new headers and central directory record. Only STORED and DEFLATE
+ *  entries, and AES-256 (AE-2) encrypted ones, are copied. With \a opts.password set, the
+ *  entries that aren't encrypted yet are encrypted as they are copied, still without being
+ *  decompressed. The entry keeps its date, and its data is verified if \a opts.verify is set
+ *  (unless it was encrypted in \a m), but it has no digest.
+ *
+ *  \param z ZIP context.
+ *  \param m Source archive.
+ *  \param index Index of the entry in \a m.
+ *  \param filename New entry name, \c NULL to keep the name in \a m (names larger than
+ *         \c ZIP_ENTRY_MAX_NAME_LEN are rejected).
+ *  \return \c false on error.
+ */
+bool zip_entry_copy_raw( zip_t *z, const zip_map_t *m, size_t index, const char *filename )
+{
+  if( z->entry_opened )
     return false;
 
-  /* writes the filename */
-  if( !z->out_cb( z->out_cb_ctx, ( uint8_t * ) entry.name, lf_header.fname_length ) )
+  const zip_map_entry_t *src = zip_map_entry( m, index );
+  const uint8_t *data;
+  size_t data_len;
+  if( src == NULL || !zip_map_get_raw( m, index, &data, &data_len ) )
     return false;
 
-  z->entry_opened = true;
-  varray_push( z->entries, entry );
+  /* the headers are written with 32 bit sizes, and the version and CRC they need are only known
+   * for the methods written by this library (encrypted entries can't use the old scheme) */
+  bool encrypted = ( src->method == ZIP_AES_METHOD );
+  uint16_t method = encrypted ? src->aes_method : src->method;
+  if( src->size > 0xffffffffU || src->size_compressed > 0xffffffffU || ( method != 0U && method != 8U ) ||
+      ( encrypted && ( src->aes_version != 2U || src->aes_strength != 3U ) ) ||
+      ( !encrypted && ( src->flags & 1U ) ) )
+    return false;
 
-  /* updates the number of bytes written */
-  z->bytes_written += bytes_written + lf_header.fname_length;
+  /* a truncated name could collide with another entry, whether it's renamed or not */
+  size_t entry_name_len = ( filename != NULL ) ? strlen( filename ) : src->name_len;
+  if( entry_name_len > ZIP_ENTRY_MAX_NAME_LEN )
+    return false;
+
+  /* the archives with a password don't get plain entries */
+  bool encrypt = ( !encrypted && z->opts.password != NULL );
+
+  /* the header has the CRC and sizes, so there is no data descriptor */
+  zip_entry_t entry;
+  entry.crc = src->crc;
+  entry.size = src->size;
+  entry.size_compressed = src->size_compressed;
+  memcpy( entry.name, ( filename != NULL ) ? filename : src->name, entry_name_len );
+  entry.name[entry_name_len] = '\0';
+  entry.offset = 0; /* set when the header is written */
+  entry.disk = 0;
+  entry.date = src->date;
+  entry.time = src->time;
+  entry.method = method;
+  entry.encrypted = ( encrypted || encrypt );
+  entry.flags = ( src->flags & ~( 1U << 3U ) ) | ( encrypt ? 1U : 0U );
+  memset( entry.sha256, 0, sizeof( entry.sha256 ) );
+
+  /* the data of encrypted entries starts with the salt and the password verifier */
+  uint8_t aes_header[ZIP_AES_HEADER_SIZE];
+  if( encrypt )
+  {
+    if( !zip_aes_start( &z->aes, &z->password, aes_header ) )
+      return false;
+    entry.size_compressed += sizeof( aes_header ) + ZIP_AES_MAC_SIZE;
+  }
+
+  zip_verify_entry_t *verify_entry = NULL;
+  if( z->opts.verify && !encrypted &&
+      ( verify_entry = zip_verifier_entry( &z->verifier, entry.name, entry.method ) ) == NULL )
+    return false;
+
+  /* entry handles may be committed concurrently */
+  pthread_mutex_lock( &z->out_lock );
+
+  /* the mapping is read-only, so the data is encrypted through the output buffer */
+  size_t chunk_size = encrypt ? z->buffer_size : ZIP_COPY_CHUNK_SIZE;
+  bool rv = _reserve_record( z ) && _write_local_header( z, &entry ) &&
+            ( !encrypt || _out( z, aes_header, sizeof( aes_header ) ) );
+  for( size_t i = 0; rv && i < data_len; i += chunk_size )
+  {
+    size_t chunk_len = ( data_len - i < chunk_size ) ? data_len - i : chunk_size;
+    const uint8_t *chunk = data + i;
+    if( verify_entry != NULL && !zip_verifier_feed( &z->verifier, verify_entry, chunk, chunk_len ) )
+      rv = false;
+    else if( encrypt )
+    {
+      memcpy( z->out_buffer, chunk, chunk_len );
+      zip_aes_encrypt( &z->aes, z->out_buffer, chunk_len );
+      chunk = z->out_buffer;
+    }
+
+    rv = rv && _out( z, chunk, chunk_len );
+  }
+
+  /* the data of encrypted entries ends with the authentication code */
+  uint8_t mac[ZIP_AES_MAC_SIZE];
+  if( rv && encrypt )
+  {
+    zip_aes_finish( &z->aes, mac );
+    rv = _out( z, mac, sizeof( mac ) );
+  }
+
+  if( rv )
+  {
+    z->bytes_written += entry.size_compressed;
+    _add_record( z, &entry );
+  }
+
+  pthread_mutex_unlock( &z->out_lock );
+
+  if( verify_entry != NULL && ( !rv || !zip_verifier_end( &z->verifier, verify_entry, entry.crc, entry.size ) ) )
+  {
+    zip_verifier_abort( &z->verifier, verify_entry );
+    return false;
+  }
 
-  /* resets the compression context */
-  return ( deflateReset( &z->stream ) == Z_OK );
+  return rv;
 }
 
 
-/** Writes data into the current entry (can be called many times for the same entry).
+/** Returns the number of entries added to the ZIP.
  *
  *  \param z ZIP context.
- *  \param data Data to compress.
- *  \param data_len Bytes in \a data.
- *  \return \c false on error.
+ *  \return Number of entries.
+ */
+size_t zip_get_num_entries( zip_t *z )
+{
+  return z->num_spilled + varray_len( z->entries );
+}
+
+
+/** Returns the size of the central directory of the entries finished so far.
  *
- *  \note In order to call this function, \a zip_entry_add must have been called before.
+ *  \param z ZIP context.
+ *  \return Central directory size.
  */
-bool zip_entry_update( zip_t *z, const void *data, size_t data_len )
+size_t zip_get_central_dir_size( zip_t *z )
 {
-  if( !z->entry_opened )
-    return false;
+  return z->spill_size + varray_len( z->cd_buffer );
+}
 
-  if( data_len == 0 )
-    return true;
 
-  /* updates the CRC */
-  CUR_ENTRY( z ).crc = crc32( CUR_ENTRY( z ).crc, data, data_len );
-  return _deflate( z, Z_NO_FLUSH, data, data_len );
+/** Returns the number of bytes \a zip_end would write if no more entries were added (i.e. the
+ *  central directory and the end of central directory records).
+ *
+ *  \param z ZIP context.
+ *  \return Size of the archive tail.
+ */
+size_t zip_get_tail_size( zip_t *z )
+{
+  size_t central_dir_size = zip_get_central_dir_size( z );
+  size_t tail_size = central_dir_size + 22 + varray_len( z->comment ); /* EOCD record and comment */
+
+  /* ZIP64 EOCD record and locator */
+  if( _needs_eocd64( zip_get_num_entries( z ), central_dir_size, z->bytes_written ) )
+    tail_size += 56 + 20;
+
+  return tail_size;
 }
 
 
-/** Closes an entry.
+/** Returns the heap memory used by the ZIP context: deflate streams (including the ones of the
+ *  entry handles), buffers, entry handles, the central directory kept in memory and the
+ *  verifier (its buffer, queued data and inflate streams). The buffers of the temporary files
+ *  are not included.
  *
  *  \param z ZIP context.
- *  \return \c false on error.
+ *  \return Memory in bytes.
  */
-bool zip_entry_end( zip_t *z )
+size_t zip_memory_usage( zip_t *z )
 {
-  if( !z->entry_opened )
-    return true;
+  pthread_mutex_lock( &z->lock );
+  size_t usage = z->zlib_memory + z->handle_memory + z->buffer_size + VARRAY_MEMORY( z->entries ) +
+                 VARRAY_MEMORY( z->entry_buffer ) + VARRAY_MEMORY( z->cd_buffer ) + VARRAY_MEMORY( z->manifest ) +
+                 VARRAY_MEMORY( z->comment ) + VARRAY_MEMORY( z->stream_pool ) +
+                 ( z->opts.num_rules + 1 ) * sizeof( uint64_t );
+  pthread_mutex_unlock( &z->lock );
 
-  /* flushes remaining data */
-  if( !_deflate( z, Z_FINISH, NULL, 0 ) )
-    return false;
+  if( z->opts.verify )
+    usage += zip_verifier_memory( &z->verifier );
 
-  /* writes the data descriptor record */
-  const uint32_t data_desc_signature = 0x08074b50U;
+  return usage;
+}
 
-  /* writes the data descriptor record */
-  size_t bytes_written = 0;
-  if( !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, data_desc_signature ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, CUR_ENTRY( z ).crc ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, CUR_ENTRY( z ).size_compressed ) ||
-      !WRITE_LE( &bytes_written, z->out_cb, z->out_cb_ctx, CUR_ENTRY( z ).size ) )
+
+/** Returns the number of entries that matched a rule.
+ *
+ *  \param z ZIP context.
+ *  \param index Index of the rule in the options (the number of rules for the entries that
+ *         matched none).
+ *  \return Number of entries.
+ */
+uint64_t zip_get_rule_hits( zip_t *z, size_t index )
+{
+  if( index > z->opts.num_rules )
+    return 0;
+
+  pthread_mutex_lock( &z->lock );
+  uint64_t hits = z->rule_hits[index];
+  pthread_mutex_unlock( &z->lock );
+
+  return hits;
+}
+
+
+/** Changes the output rate limit. It can be called from any thread, and takes effect on the
+ *  next output (or within \a ZIP_RATE_MAX_SLEEP_US if it's waiting).
+ *
+ *  \param z ZIP context.
+ *  \param bytes_per_sec Maximum output rate (0 for no limit).
+ *  \param burst Bytes that can be output at once after being idle (0 for one second of
+ *         \a bytes_per_sec).
+ *  \return \c false if the burst is too large.
+ */
+bool zip_set_rate_limit( zip_t *z, uint64_t bytes_per_sec, uint64_t burst )
+{
+  if( burst == 0 )
+    burst = bytes_per_sec;
+  if( burst > ZIP_RATE_MAX_BURST )
     return false;
 
-  /* updates the number of bytes written */
-  z->bytes_written += bytes_written;
-  z->entry_opened = false;
+  /* the tokens earned so far count at the previous rate */
+  pthread_mutex_lock( &z->rate_lock );
+  bool was_limited = ( z->rate_limit > 0 );
+  _rate_refill( z, _now_us() );
+
+  int64_t max_credit = ( int64_t )( burst * 1000000 );
+  z->rate_limit = bytes_per_sec;
+  z->rate_burst = burst;
+  if( !was_limited || z->rate_credit > max_credit )
+    z->rate_credit = max_credit;
+  pthread_mutex_unlock( &z->rate_lock );
 
-  /* success */
   return true;
 }
 
 
-/** Returns the number of entries added to the ZIP.
+/** Waits until the verify thread checked all the data written so far. \a zip_end waits too,
+ *  and fails without writing the central directory if any entry failed.
  *
  *  \param z ZIP context.
- *  \return Number of entries.
+ *  \return \c false if any entry didn't match its CRC or size (\c true if \a opts.verify is not
+ *          set).
  */
-size_t zip_get_num_entries( zip_t *z )
+bool zip_verify_wait( zip_t *z )
+{
+  return !z->opts.verify || zip_verifier_wait( &z->verifier );
+}
+
+
+/** Gets the results of the verify thread so far, without waiting for it. It can be called from
+ *  any thread.
+ *
+ *  \param z ZIP context.
+ *  \param stats Verification results (all zero if \a opts.verify is not set).
+ */
+void zip_get_verify_stats( zip_t *z, zip_verify_stats_t *stats )
+{
+  if( z->opts.verify )
+    zip_verifier_get_stats( &z->verifier, stats );
+  else
+    memset( stats, 0, sizeof( zip_verify_stats_t ) );
+}
+
+
+/** Gets the output rate statistics. It can be called from any thread.
+ *
+ *  \param z ZIP context.
+ *  \param stats Output statistics.
+ */
+void zip_get_rate_stats( zip_t *z, zip_rate_stats_t *stats )
+{
+  pthread_mutex_lock( &z->rate_lock );
+  uint64_t now = _now_us();
+  _rate_refill( z, now );
+
+  stats->bytes = z->rate_bytes;
+  stats->rate = 0;
+  if( now > z->rate_sample_us )
+    stats->rate = ( z->rate_bytes - z->rate_sample_bytes ) * 1000000 / ( now - z->rate_sample_us );
+  stats->throttled_us = z->rate_throttled_us;
+  stats->delay_us = _rate_delay( z );
+
+  z->rate_sample_bytes = z->rate_bytes;
+  z->rate_sample_us = now;
+  pthread_mutex_unlock( &z->rate_lock );
+}
+
+
+/** Returns the default compression rules, used unless the options set others. Common formats
+ *  that are already compressed are stored, by extension or by their first bytes.
+ *
+ *  \param rules Output rules.
+ *  \return Number of rules.
+ */
+size_t zip_get_default_rules( const zip_rule_t **rules )
 {
-  return varray_len( z->entries );
+  *rules = _default_rules;
+  return sizeof( _default_rules ) / sizeof( _default_rules[0] );
 }
 
 
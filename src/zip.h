@@ -8,6 +8,11 @@
 
 /* include area */
 #include "zlib.h"
+#include "zip_crypto.h"
+#include "zip_map.h"
+#include "zip_verify.h"
+#include <pthread.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -21,6 +26,9 @@
 #  define ZIP_ENTRY_MAX_NAME_LEN 127
 #endif
 
+/** Maximum length of the magic bytes of a rule (see \a zip_rule_t). */
+#define ZIP_RULE_MAX_MAGIC_LEN 16
+
 
 /*-----------------------------------------------------------------------------
    Library data types
@@ -41,20 +49,175 @@ struct zip_datetime
 /** Callback for the user to handle the compressed data. */
 typedef bool ( *zip_out_cb_t )( void *cb_ctx, const uint8_t *data, size_t data_len );
 
-/** Structure representing an entry in the ZIP archive. */
+/** Callback to overwrite data already handled by the output callback. \a offset is relative to
+ *  the bytes of the archive (i.e. it's 0 for the first byte given to the output callback).
+ */
+typedef bool ( *zip_pwrite_cb_t )( void *cb_ctx, const uint8_t *data, size_t data_len, uint64_t offset );
+
+/** Callback to start a new volume of a split archive: the data given to the output callback
+ *  afterwards belongs to volume \a disk_num (0 is the first one).
+ */
+typedef bool ( *zip_volume_cb_t )( void *cb_ctx, uint32_t disk_num );
+
+/** Rule to choose the compression level of entries by their name or contents (see \a rules). */
+typedef struct
+{
+  /** Glob pattern matched against the whole entry name, ignoring case (\c * matches any run of
+   *  characters and \c ? any single one). \c NULL matches any name. */
+  const char *pattern;
+
+  /** Bytes the entry data must start with (\c NULL for any data). The first data of the entries
+   *  is held back until it's as long as the magic bytes of the rules left, so they can come in
+   *  several pieces, unless the entry is flushed or ends before. */
+  const void *magic;
+
+  /** Length of \a magic (up to \c ZIP_RULE_MAX_MAGIC_LEN). */
+  size_t magic_len;
+
+  /** Compression level of the matching entries: 0 stores them, 1 (fastest) to 9 (smallest) or
+   *  \c Z_DEFAULT_COMPRESSION. */
+  int level;
+
+} zip_rule_t;
+
+/** First data of an entry, held back until the rules that need it can be checked. */
+typedef struct
+{
+  /** First rule still to check. */
+  size_t rule;
+
+  /** Bytes needed to check the rules left (the longest of their magic bytes). */
+  size_t needed;
+
+  /** Bytes held back in \a data. */
+  size_t len;
+
+  /** Data held back. */
+  uint8_t data[ZIP_RULE_MAX_MAGIC_LEN];
+
+} zip_sniff_t;
+
+/** Output rate statistics (see \a zip_get_rate_stats). */
 typedef struct
 {
-  /** The entry's offset in the file. */
-  uint32_t offset;
+  /** Bytes given to the output callback. */
+  uint64_t bytes;
+
+  /** Average output rate (bytes per second) since the previous call to \a zip_get_rate_stats. */
+  uint64_t rate;
+
+  /** Microseconds spent waiting for the rate limit. */
+  uint64_t throttled_us;
+
+  /** Microseconds until the output can continue without waiting (0 if it can now). */
+  uint64_t delay_us;
+
+} zip_rate_stats_t;
+
+/** ZIP context options (see \a zip_options_init for the defaults). */
+typedef struct
+{
+  /** Optional callback for seekable outputs (uses the output callback context). When set, the
+   *  CRC and sizes are patched into the local headers and no data descriptors are written. */
+  zip_pwrite_cb_t pwrite_cb;
+
+  /** Entries up to this uncompressed size are kept in memory until they end, so their local
+   *  headers carry the CRC and sizes even on non-seekable outputs (0 disables it). Larger
+   *  entries are streamed once they exceed it. */
+  size_t buffer_threshold;
+
+  /** Maximum number of finished entries kept in memory (0 keeps all of them). The central
+   *  directory records of older entries are moved to a temporary file, so the memory used
+   *  doesn't depend on the number of entries. */
+  size_t spill_threshold;
+
+  /** Callback to rotate the output to a new volume (uses the output callback context). */
+  zip_volume_cb_t volume_cb;
+
+  /** Maximum size of each volume of a split archive (0 for a single volume). It must be at
+   *  least 64 KiB and less than 4 GiB (the offsets in the records are 32 bit), requires
+   *  \a volume_cb, and can't be combined with \a pwrite_cb. */
+  size_t volume_size;
+
+  /** Default for the maximum uncompressed bytes of an entry held by deflate before flushing it
+   *  (0 for no limit). See \a zip_entry_set_flush. */
+  size_t flush_bytes;
+
+  /** Default for the maximum milliseconds since the oldest byte not flushed (0 for no limit).
+   *  It's checked on every \a zip_entry_update, so it's only a bound while updates keep coming
+   *  or \a zip_entry_poll is called in between. */
+  unsigned flush_latency_ms;
+
+  /** Compressed bytes of each entry opened with \a zip_entry_open kept in memory (1 MiB by
+   *  default). Larger entries are spooled to a temporary file until they are closed. */
+  size_t spool_size;
+
+  /** Heap memory for the deflate streams and buffers of the context (0 for the default
+   *  profile, about 300 KiB). Smaller budgets use smaller deflate windows and buffers, trading
+   *  compression ratio for memory, and larger ones improve the ratio a bit. The entries of the
+   *  central directory are not included (see \a spill_threshold), nor the entry handles, which
+   *  take a deflate stream of the same size each (and an inflate stream when \a verify is set).
+   *  The verifier takes about 1.1 MiB of the budget: its buffer, a full queue and the inflate
+   *  stream of one entry. */
+  size_t memory_budget;
+
+  /** Rules to choose the compression level of each entry (none by default, \a zip_get_default_rules
+   *  returns rules that store common compressed formats). The first matching rule applies, entries
+   *  without one use the default level. The array must stay valid while the context is used. */
+  const zip_rule_t *rules;
+
+  /** Number of \a rules (0 compresses every entry with the default level). */
+  size_t num_rules;
+
+  /** Maximum output rate in bytes per second (0 for no limit). See \a zip_set_rate_limit. */
+  uint64_t rate_limit;
+
+  /** Bytes that can be output at once after being idle (0 for one second of \a rate_limit). */
+  uint64_t rate_burst;
+
+  /** Whether the entries without a rule adapt their compression level to the output: it's
+   *  raised while the output is slower than deflate and lowered while it's faster, between
+   *  \a min_level and \a max_level (1 and 9 by default). */
+  bool adaptive;
+  int min_level;
+  int max_level;
+
+  /** Password to encrypt every entry with AES-256 (WinZip AE-2), \c NULL for no encryption. It's
+   *  only read by the initialization. */
+  const char *password;
+
+  /** Whether the compressed data of the entries is inflated again on a helper thread and checked
+   *  against their CRC and size (see \a zip_verify_wait). */
+  bool verify;
+
+  /** Whether the SHA-256 of every entry is computed in the same pass as its CRC (see
+   *  \a zip_entry_t::sha256). */
+  bool digest;
+
+  /** Name of an entry added by \a zip_end with the SHA-256 of the other entries, in the format of
+   *  \c sha256sum (\c NULL for none, otherwise \a digest is implied). The entries without a
+   *  digest (raw copies, kept by \a zip_open_append or \a zip_restore) are listed in comment
+   *  lines. */
+  const char *manifest;
+
+} zip_options_t;
+
+/** Structure representing an entry in the ZIP archive. The offset and sizes are counted in 64
+ *  bits, but the records only have their 32 bit fields (ZIP64 extra fields are not written), so
+ *  the entries whose values don't fit fail. */
+typedef struct
+{
+  /** The entry's offset in the file (in its volume). */
+  uint64_t offset;
 
   /** The CRC-32 of the uncompressed entry data. */
   uint32_t crc;
 
   /** Entry size. */
-  uint32_t size;
+  uint64_t size;
 
   /** Compressed entry size. */
-  uint32_t size_compressed;
+  uint64_t size_compressed;
 
   /** Entry name as a C string. */
   char name[ZIP_ENTRY_MAX_NAME_LEN + 1];
@@ -65,6 +228,22 @@ typedef struct
   /** Entry's date in MS-DOS format. */
   uint16_t date;
 
+  /** Compression method. */
+  uint16_t method;
+
+  /** General purpose bit flag. */
+  uint16_t flags;
+
+  /** Number of the volume with the entry's local header. */
+  uint16_t disk;
+
+  /** Whether the entry is encrypted with AES-256 (\a method is the compression method, the
+   *  headers have the AES method and extra field). */
+  bool encrypted;
+
+  /** SHA-256 of the uncompressed entry data (all zero unless \a zip_options_t::digest is set). */
+  uint8_t sha256[ZIP_SHA256_SIZE];
+
 } zip_entry_t;
 
 /** ZIP context type. */
@@ -79,23 +258,224 @@ typedef struct
   /** User defined context for \a out_cb */
   void *out_cb_ctx;
 
-  /** \a varray of entries in the ZIP archive. */
+  /** Options set on initialization. */
+  zip_options_t opts;
+
+  /** \a varray of entries in the ZIP archive (only the last ones if some were spilled). */
   zip_entry_t *entries;
 
+  /** \a varray with the central directory records of the finished entries (encoded as soon as
+   *  each entry ends). */
+  uint8_t *cd_buffer;
+
+  /** Temporary file with the central directory records of the spilled entries. */
+  FILE *spill_file;
+
+  /** Size of the records in \a spill_file. */
+  size_t spill_size;
+
+  /** Number of entries moved to \a spill_file. */
+  size_t num_spilled;
+
+  /** \a varray with the archive comment kept by \a zip_open_append. */
+  uint8_t *comment;
+
+  /** File reopened by \a zip_open_append, truncated by \a zip_end (-1 if none). */
+  int append_fd;
+
   /** Internal buffer to hold compressed data. */
   uint8_t *out_buffer;
 
+  /** Size of \a out_buffer. */
+  size_t buffer_size;
+
+  /** Base two logarithm of the window size of the deflate streams. */
+  int window_bits;
+
+  /** Memory level of the deflate streams. */
+  int mem_level;
+
+  /** Bytes allocated by zlib for the deflate streams. */
+  size_t zlib_memory;
+
+  /** Bytes allocated for the entry handles (handles, deflate streams and spools). */
+  size_t handle_memory;
+
+  /** Entries that matched each rule, plus the ones that matched none at the end. */
+  uint64_t *rule_hits;
+
+  /** First data of the current entry, while its rule waits for it. */
+  zip_sniff_t sniff;
+
+  /** Whether the level of the current entry waits for its first data. */
+  bool sniffing;
+
+  /** Compression level of \a stream. */
+  int level;
+
+  /** Compression level of \a small_stream. */
+  int small_level;
+
+  /** Whether the level of the current entry is adaptive. */
+  bool adaptive_entry;
+
+  /** Current adaptive level, kept between entries. */
+  int adaptive_level;
+
+  /** Sliding window of the time (us) spent in deflate and in the output by adaptive entries. */
+  uint64_t deflate_us;
+  uint64_t out_us;
+
+  /** HMAC keyed with the password, shared by the key derivation of the entries. */
+  zip_hmac_t password;
+
+  /** Encryption of the current entry. */
+  zip_aes_t aes;
+
+  /** Hash of the current entry. */
+  zip_sha256_t sha256;
+
+  /** \a varray with the lines of the manifest (see \a opts.manifest). */
+  char *manifest;
+
+  /** Verify thread (only when \a opts.verify is set). */
+  zip_verifier_t verifier;
+
+  /** Verification of the current entry (\c NULL if it's not verified). */
+  zip_verify_entry_t *verify_entry;
+
+  /** \a varray holding the compressed data of the current entry while it's buffered. */
+  uint8_t *entry_buffer;
+
   /** The number of bytes written to the output file. */
   size_t bytes_written;
 
   /** The offset until the central directory. */
   size_t central_dir_offset;
 
+  /** Number of the current volume. */
+  uint32_t disk_num;
+
+  /** The number of bytes written to the current volume. */
+  size_t volume_written;
+
+  /** Central directory records written to the current volume. */
+  size_t volume_entries;
+
+  /** Number of the volume where the central directory starts. */
+  uint32_t central_dir_disk;
+
+  /** Offset of the central directory in \a central_dir_disk. */
+  size_t central_dir_disk_offset;
+
+  /** Flush bounds of the current entry. */
+  size_t flush_bytes;
+  unsigned flush_latency_ms;
+
+  /** Bytes of the current entry given to deflate since the last flush. */
+  size_t unflushed;
+
+  /** Timestamp (ms) of the oldest byte not flushed. */
+  uint64_t unflushed_since;
+
   /** Whether an entry is in process. */
   bool entry_opened;
 
+  /** Whether the current entry is kept in \a entry_buffer (its header was not written yet). */
+  bool entry_buffered;
+
+  /** Zlib stream for the small entries of \a zip_entry_add_data (initialized on first use). */
+  z_stream small_stream;
+
+  /** Whether \a small_stream was initialized. */
+  bool small_stream_ready;
+
+  /** Number of entries opened with \a zip_entry_open and not closed yet. */
+  size_t open_handles;
+
+  /** \a varray of deflate streams released by closed entry handles. */
+  z_stream **stream_pool;
+
+  /** Serializes the output between the entries added at once and the committed entry handles.
+   *  The rate limit sleeps holding it, so it's always taken before \a lock, never while holding it. */
+  pthread_mutex_t out_lock;
+
+  /** Guards the entry records, the stream pool and the memory accounted for the entry handles. */
+  pthread_mutex_t lock;
+
+  /** Signaled (under \a lock) when the entry added with \a zip_entry_add ends, for the handles
+   *  waiting to be committed. */
+  pthread_cond_t entry_ended;
+
+  /** Thread that added the entry in process (\a zip_entry_close can't wait for it there). */
+  pthread_t entry_thread;
+
+  /** Guards the rate limit fields below, which can be changed from any thread. */
+  pthread_mutex_t rate_lock;
+
+  /** Rate limit (bytes per second, 0 for no limit) and burst size. */
+  uint64_t rate_limit;
+  uint64_t rate_burst;
+
+  /** Tokens of the rate limit bucket, in millionths of a byte (negative while in debt). */
+  int64_t rate_credit;
+
+  /** Timestamp (us) of the last refill of \a rate_credit. */
+  uint64_t rate_refilled_us;
+
+  /** Bytes given to the output callback. */
+  uint64_t rate_bytes;
+
+  /** Microseconds spent waiting for the rate limit. */
+  uint64_t rate_throttled_us;
+
+  /** Bytes and timestamp (us) of the last \a zip_get_rate_stats. */
+  uint64_t rate_sample_bytes;
+  uint64_t rate_sample_us;
+
 } zip_t;
 
+/** Handle of an entry written at the same time as others (see \a zip_entry_open). */
+typedef struct
+{
+  /** ZIP context of the entry. */
+  zip_t *z;
+
+  /** Zlib stream of the entry (taken from \a stream_pool). */
+  z_stream *stream;
+
+  /** The entry. */
+  zip_entry_t entry;
+
+  /** \a varray with the compressed data while it's smaller than \a spool_size. */
+  uint8_t *spool;
+
+  /** Temporary file with the compressed data once it's larger than \a spool_size. */
+  FILE *spool_file;
+
+  /** Encryption of the entry. */
+  zip_aes_t aes;
+
+  /** Verification of the entry (\c NULL if it's not verified). */
+  zip_verify_entry_t *verify_entry;
+
+  /** Hash of the entry. */
+  zip_sha256_t sha256;
+
+  /** First data of the entry, while its rule waits for it. */
+  zip_sniff_t sniff;
+
+  /** Whether the level of the entry waits for its first data. */
+  bool sniffing;
+
+  /** Whether the deflate stream was finished. */
+  bool finished;
+
+  /** Whether a write failed (the handle can only be closed, which fails). */
+  bool failed;
+
+} zip_entry_h;
+
 
 /*-----------------------------------------------------------------------------
    Function prototypes
@@ -103,18 +483,48 @@ typedef struct
 
 /** Init/uninit */
 bool zip_init( zip_t *z, zip_out_cb_t out_cb, void *out_cb_ctx );
+bool zip_init_ex( zip_t *z, zip_out_cb_t out_cb, void *out_cb_ctx, const zip_options_t *opts );
+void zip_options_init( zip_options_t *opts );
 void zip_release( zip_t *z );
 
 bool zip_end( zip_t *z );
+bool zip_open_append( zip_t *z, int fd );
+
+/** Checkpoints */
+size_t zip_checkpoint_size( zip_t *z );
+bool zip_checkpoint( zip_t *z, uint8_t *buffer, size_t buffer_len );
+bool zip_restore( zip_t *z, const uint8_t *checkpoint, size_t checkpoint_len );
 
 /** Entry handling */
 bool zip_entry_add( zip_t *z, const char *filename, struct zip_datetime datetime );
 bool zip_entry_update( zip_t *z, const void *data, size_t data_len );
 bool zip_entry_end( zip_t *z );
+bool zip_entry_add_data( zip_t *z, const char *filename, struct zip_datetime datetime, const void *data,
+                         size_t data_len );
+bool zip_entry_flush( zip_t *z );
+bool zip_entry_set_flush( zip_t *z, size_t max_bytes, unsigned max_latency_ms );
+bool zip_entry_poll( zip_t *z );
+bool zip_entry_copy_raw( zip_t *z, const zip_map_t *m, size_t index, const char *filename );
+zip_entry_h *zip_entry_open( zip_t *z, const char *filename, struct zip_datetime datetime );
+bool zip_entry_write( zip_entry_h *h, const void *data, size_t data_len );
+bool zip_entry_close( zip_entry_h *h );
 size_t zip_get_num_entries( zip_t *z );
+size_t zip_get_central_dir_size( zip_t *z );
+size_t zip_get_tail_size( zip_t *z );
+size_t zip_memory_usage( zip_t *z );
+uint64_t zip_get_rule_hits( zip_t *z, size_t index );
+
+/** Output rate */
+bool zip_set_rate_limit( zip_t *z, uint64_t bytes_per_sec, uint64_t burst );
+void zip_get_rate_stats( zip_t *z, zip_rate_stats_t *stats );
+
+/** Verify on write */
+bool zip_verify_wait( zip_t *z );
+void zip_get_verify_stats( zip_t *z, zip_verify_stats_t *stats );
 
 /** Miscellaneous */
 struct zip_datetime zip_get_datetime( void );
+size_t zip_get_default_rules( const zip_rule_t **rules );
 
 
 #endif
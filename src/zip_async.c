@@ -0,0 +1,504 @@
+/**
+ * \file
+ * ZIP asynchronous compression - Implementation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+/* include area */
+#include "string.h"
+#include "zip_async.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+
+/*-----------------------------------------------------------------------------
+   Definitions
+-----------------------------------------------------------------------------*/
+
+/** Operation types. */
+enum
+{
+  ZIP_ASYNC_ADD,
+  ZIP_ASYNC_UPDATE,
+  ZIP_ASYNC_END,
+  ZIP_ASYNC_FLUSH,
+  ZIP_ASYNC_POLL
+};
+
+
+/*-----------------------------------------------------------------------------
+   Helper functions
+-----------------------------------------------------------------------------*/
+
+/** Runs an operation on the ZIP context and reports its completion.
+ *
+ *  \param a Asynchronous compression context.
+ *  \param op Operation to run.
+ *  \return \c false on error.
+ */
+static bool _run( zip_async_t *a, const zip_async_op_t *op )
+{
+  /* the flag is only written by the compression thread, it's read by submitters under the lock */
+  bool rv = !a->failed;
+  if( rv )
+  {
+    switch( op->type )
+    {
+      case ZIP_ASYNC_ADD:
+        rv = zip_entry_add( a->z, op->name, op->datetime );
+        break;
+
+      case ZIP_ASYNC_UPDATE:
+        rv = zip_entry_update( a->z, op->data, op->data_len );
+        break;
+
+      case ZIP_ASYNC_END:
+        rv = zip_entry_end( a->z );
+        break;
+
+      case ZIP_ASYNC_FLUSH:
+        rv = zip_entry_flush( a->z );
+        break;
+
+      case ZIP_ASYNC_POLL:
+        rv = zip_entry_poll( a->z );
+        break;
+    }
+  }
+
+  if( op->done_cb != NULL )
+    op->done_cb( op->done_cb_ctx, op->data, op->data_len, rv );
+
+  return rv;
+}
+
+
+/** Runs the oldest queued operation.
+ *
+ *  \param a Asynchronous compression context.
+ *  \return \c false if the queue was empty.
+ */
+static bool _run_next( zip_async_t *a )
+{
+  pthread_mutex_lock( &a->lock );
+  if( a->queued == 0 )
+  {
+    pthread_mutex_unlock( &a->lock );
+    return false;
+  }
+
+  /* copies the operation so its slot can be reused while it runs */
+  zip_async_op_t op = a->queue[a->head];
+  a->head = ( a->head + 1 ) % a->queue_depth;
+  a->queued--;
+  pthread_cond_signal( &a->not_full );
+  pthread_mutex_unlock( &a->lock );
+
+  bool rv = _run( a, &op );
+
+  pthread_mutex_lock( &a->lock );
+  if( !rv && !a->failed )
+  {
+    /* wakes up the submitters waiting for a slot, they fail from now on */
+    a->failed = true;
+    pthread_cond_broadcast( &a->not_full );
+  }
+  if( --a->pending == 0 )
+    pthread_cond_broadcast( &a->idle );
+  pthread_mutex_unlock( &a->lock );
+
+  return true;
+}
+
+
+/** Compression thread: runs the queued operations until it's stopped.
+ *
+ *  \param arg Asynchronous compression context.
+ *  \return \c NULL.
+ */
+static void *_worker( void *arg )
+{
+  zip_async_t *a = arg;
+
+  for( ;; )
+  {
+    pthread_mutex_lock( &a->lock );
+    while( a->queued == 0 && !a->stop )
+      pthread_cond_wait( &a->not_empty, &a->lock );
+    bool stop = ( a->queued == 0 );
+    pthread_mutex_unlock( &a->lock );
+
+    if( stop )
+      break;
+    _run_next( a );
+  }
+
+  return NULL;
+}
+
+
+/** Adds a context to the end of the queue of its scheduler.
+ *
+ *  \param a Asynchronous compression context.
+ */
+static void _schedule( zip_async_t *a )
+{
+  zip_sched_t *s = a->sched;
+
+  pthread_mutex_lock( &s->lock );
+  a->next = NULL;
+  if( s->ready_tail != NULL )
+    s->ready_tail->next = a;
+  else
+    s->ready_head = a;
+  s->ready_tail = a;
+  pthread_cond_signal( &s->ready );
+  pthread_mutex_unlock( &s->lock );
+}
+
+
+/** Runs a turn of a context in a scheduler thread.
+ *
+ *  \param a Asynchronous compression context.
+ */
+static void _run_turn( zip_async_t *a )
+{
+  for( unsigned i = 0; i < a->priority && _run_next( a ); i++ )
+    ;
+
+  /* goes back to the end of the queue if there's more work, so every context gets its turn */
+  pthread_mutex_lock( &a->lock );
+  a->scheduled = ( a->queued > 0 );
+  bool again = a->scheduled;
+  if( !again )
+    pthread_cond_broadcast( &a->idle );
+  pthread_mutex_unlock( &a->lock );
+
+  if( again )
+    _schedule( a );
+}
+
+
+/** Scheduler thread: runs turns of the contexts with queued operations until it's stopped.
+ *
+ *  \param arg Scheduler.
+ *  \return \c NULL.
+ */
+static void *_sched_worker( void *arg )
+{
+  zip_sched_t *s = arg;
+
+  pthread_mutex_lock( &s->lock );
+  for( ;; )
+  {
+    while( s->ready_head == NULL && !s->stop )
+      pthread_cond_wait( &s->ready, &s->lock );
+
+    if( s->ready_head == NULL )
+      break;
+
+    zip_async_t *a = s->ready_head;
+    s->ready_head = a->next;
+    if( s->ready_head == NULL )
+      s->ready_tail = NULL;
+    pthread_mutex_unlock( &s->lock );
+
+    _run_turn( a );
+
+    pthread_mutex_lock( &s->lock );
+  }
+  pthread_mutex_unlock( &s->lock );
+
+  return NULL;
+}
+
+
+/** Queues an operation, waiting for a free slot if the queue is full.
+ *
+ *  \param a Asynchronous compression context.
+ *  \param op Operation to queue (copied).
+ *  \return \c false if a previous operation failed (\a op is not queued).
+ */
+static bool _submit( zip_async_t *a, const zip_async_op_t *op )
+{
+  pthread_mutex_lock( &a->lock );
+  while( a->queued == a->queue_depth && !a->failed )
+    pthread_cond_wait( &a->not_full, &a->lock );
+
+  if( a->failed )
+  {
+    pthread_mutex_unlock( &a->lock );
+    return false;
+  }
+
+  a->queue[( a->head + a->queued ) % a->queue_depth] = *op;
+  a->queued++;
+  a->pending++;
+  pthread_cond_signal( &a->not_empty );
+
+  /* the context waits for a turn unless it already has one */
+  bool schedule = ( a->sched != NULL && !a->scheduled );
+  if( schedule )
+    a->scheduled = true;
+  pthread_mutex_unlock( &a->lock );
+
+  if( schedule )
+    _schedule( a );
+  return true;
+}
+
+
+/** Initializes the queue of an asynchronous compression context.
+ *
+ *  \param a Asynchronous compression context.
+ *  \param z Initialized ZIP context.
+ *  \param queue_depth Maximum number of queued operations (0 for \c ZIP_ASYNC_QUEUE_DEPTH).
+ *  \return \c false on error.
+ */
+static bool _init_queue( zip_async_t *a, zip_t *z, size_t queue_depth )
+{
+  memset( a, 0, sizeof( zip_async_t ) );
+  a->z = z;
+  a->queue_depth = ( queue_depth > 0 ) ? queue_depth : ZIP_ASYNC_QUEUE_DEPTH;
+  a->queue = malloc( a->queue_depth * sizeof( zip_async_op_t ) );
+  if( a->queue == NULL )
+    return false;
+
+  pthread_mutex_init( &a->lock, NULL );
+  pthread_cond_init( &a->not_empty, NULL );
+  pthread_cond_init( &a->not_full, NULL );
+  pthread_cond_init( &a->idle, NULL );
+  return true;
+}
+
+
+/*-----------------------------------------------------------------------------
+   Public functions
+-----------------------------------------------------------------------------*/
+
+/** Initializes an asynchronous compression context and starts its thread.
+ *
+ *  \param a Asynchronous compression context.
+ *  \param z Initialized ZIP context (owned by the thread until \a zip_async_wait).
+ *  \param queue_depth Maximum number of queued operations (0 for \c ZIP_ASYNC_QUEUE_DEPTH).
+ *  \return \c false on error.
+ */
+bool zip_async_init( zip_async_t *a, zip_t *z, size_t queue_depth )
+{
+  if( !_init_queue( a, z, queue_depth ) )
+    return false;
+
+  if( pthread_create( &a->thread, NULL, _worker, a ) != 0 )
+  {
+    pthread_cond_destroy( &a->idle );
+    pthread_cond_destroy( &a->not_full );
+    pthread_cond_destroy( &a->not_empty );
+    pthread_mutex_destroy( &a->lock );
+    free( a->queue );
+    return false;
+  }
+
+  return true;
+}
+
+
+/** Initializes an asynchronous compression context run by the threads of a scheduler. Each
+ *  time it gets a turn, up to \a priority operations are run before moving to the next context.
+ *  The operations of a context never run concurrently, so a context blocked by its output only
+ *  holds one thread, and its submitters wait once its queue is full. That thread is held until
+ *  the output callback returns, though: the callbacks can't report that they would block.
+ *
+ *  \param a Asynchronous compression context.
+ *  \param z Initialized ZIP context (owned by the scheduler until \a zip_async_wait).
+ *  \param queue_depth Maximum number of queued operations (0 for \c ZIP_ASYNC_QUEUE_DEPTH).
+ *  \param s Initialized scheduler.
+ *  \param priority Operations run on each turn (0 is the same as 1).
+ *  \return \c false on error.
+ */
+bool zip_async_init_sched( zip_async_t *a, zip_t *z, size_t queue_depth, zip_sched_t *s, unsigned priority )
+{
+  if( s == NULL || !_init_queue( a, z, queue_depth ) )
+    return false;
+
+  a->sched = s;
+  a->priority = ( priority > 0 ) ? priority : 1;
+  return true;
+}
+
+
+/** Runs the queued operations, stops the thread and releases the context. The ZIP context is
+ *  not released.
+ *
+ *  \param a Asynchronous compression context.
+ *  \return \c false if any operation failed.
+ */
+bool zip_async_release( zip_async_t *a )
+{
+  pthread_mutex_lock( &a->lock );
+  a->stop = true;
+  pthread_cond_signal( &a->not_empty );
+
+  /* the scheduler must be done with the context */
+  while( a->scheduled )
+    pthread_cond_wait( &a->idle, &a->lock );
+  pthread_mutex_unlock( &a->lock );
+
+  if( a->sched == NULL )
+    pthread_join( a->thread, NULL );
+
+  pthread_cond_destroy( &a->idle );
+  pthread_cond_destroy( &a->not_full );
+  pthread_cond_destroy( &a->not_empty );
+  pthread_mutex_destroy( &a->lock );
+  free( a->queue );
+
+  return !a->failed;
+}
+
+
+/** Submits a new entry (see \a zip_entry_add).
+ *
+ *  \param a Asynchronous compression context.
+ *  \param filename Entry name (copied, if larger than \c ZIP_ENTRY_MAX_NAME_LEN it's truncated).
+ *  \param datetime Entry's datetime.
+ *  \return \c false if a previous operation failed.
+ */
+bool zip_async_entry_add( zip_async_t *a, const char *filename, struct zip_datetime datetime )
+{
+  zip_async_op_t op = { .type = ZIP_ASYNC_ADD, .datetime = datetime };
+  strncpy( op.name, filename, ZIP_ENTRY_MAX_NAME_LEN );
+  return _submit( a, &op );
+}
+
+
+/** Submits data for the current entry (see \a zip_entry_update). The data is not copied: it
+ *  must stay valid until \a done_cb is called, or until \a zip_async_wait returns if there is
+ *  no callback.
+ *
+ *  \param a Asynchronous compression context.
+ *  \param data Data to compress.
+ *  \param data_len Bytes in \a data.
+ *  \param done_cb Optional callback called once \a data has been compressed.
+ *  \param done_cb_ctx User defined context for \a done_cb.
+ *  \return \c false if a previous operation failed (\a done_cb is not called).
+ */
+bool zip_async_entry_update( zip_async_t *a, const void *data, size_t data_len, zip_async_done_cb_t done_cb,
+                             void *done_cb_ctx )
+{
+  zip_async_op_t op = {
+    .type = ZIP_ASYNC_UPDATE, .data = data, .data_len = data_len, .done_cb = done_cb, .done_cb_ctx = done_cb_ctx
+  };
+  return _submit( a, &op );
+}
+
+
+/** Submits the end of the current entry (see \a zip_entry_end).
+ *
+ *  \param a Asynchronous compression context.
+ *  \param done_cb Optional callback called once the entry is finished.
+ *  \param done_cb_ctx User defined context for \a done_cb.
+ *  \return \c false if a previous operation failed (\a done_cb is not called).
+ */
+bool zip_async_entry_end( zip_async_t *a, zip_async_done_cb_t done_cb, void *done_cb_ctx )
+{
+  zip_async_op_t op = { .type = ZIP_ASYNC_END, .done_cb = done_cb, .done_cb_ctx = done_cb_ctx };
+  return _submit( a, &op );
+}
+
+
+/** Submits a flush of the current entry (see \a zip_entry_flush).
+ *
+ *  \param a Asynchronous compression context.
+ *  \return \c false if a previous operation failed.
+ */
+bool zip_async_entry_flush( zip_async_t *a )
+{
+  zip_async_op_t op = { .type = ZIP_ASYNC_FLUSH };
+  return _submit( a, &op );
+}
+
+
+/** Submits a check of the flush latency of the current entry (see \a zip_entry_poll), e.g.
+ *  from a timer while the data of the entry stops coming.
+ *
+ *  \param a Asynchronous compression context.
+ *  \return \c false if a previous operation failed.
+ */
+bool zip_async_entry_poll( zip_async_t *a )
+{
+  zip_async_op_t op = { .type = ZIP_ASYNC_POLL };
+  return _submit( a, &op );
+}
+
+
+/** Waits until every submitted operation has completed. Afterwards the ZIP context can be used
+ *  directly (e.g. to call \a zip_end) as long as nothing else is submitted meanwhile.
+ *
+ *  \param a Asynchronous compression context.
+ *  \return \c false if any operation failed.
+ */
+bool zip_async_wait( zip_async_t *a )
+{
+  pthread_mutex_lock( &a->lock );
+  while( a->pending > 0 || a->scheduled )
+    pthread_cond_wait( &a->idle, &a->lock );
+  bool rv = !a->failed;
+  pthread_mutex_unlock( &a->lock );
+
+  return rv;
+}
+
+
+/** Initializes a scheduler and starts its threads.
+ *
+ *  \param s Scheduler.
+ *  \param num_threads Number of threads (0 for one per online CPU).
+ *  \return \c false on error.
+ */
+bool zip_sched_init( zip_sched_t *s, size_t num_threads )
+{
+  if( num_threads == 0 )
+  {
+    long num_cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    num_threads = ( num_cpus > 0 ) ? ( size_t )num_cpus : 1;
+  }
+
+  memset( s, 0, sizeof( zip_sched_t ) );
+  s->threads = malloc( num_threads * sizeof( pthread_t ) );
+  if( s->threads == NULL )
+    return false;
+
+  pthread_mutex_init( &s->lock, NULL );
+  pthread_cond_init( &s->ready, NULL );
+
+  for( ; s->num_threads < num_threads; s->num_threads++ )
+    if( pthread_create( &s->threads[s->num_threads], NULL, _sched_worker, s ) != 0 )
+    {
+      zip_sched_release( s );
+      return false;
+    }
+
+  return true;
+}
+
+
+/** Stops the threads of a scheduler and releases it. The contexts attached to it must be
+ *  released first.
+ *
+ *  \param s Scheduler.
+ */
+void zip_sched_release( zip_sched_t *s )
+{
+  pthread_mutex_lock( &s->lock );
+  s->stop = true;
+  pthread_cond_broadcast( &s->ready );
+  pthread_mutex_unlock( &s->lock );
+
+  for( size_t i = 0; i < s->num_threads; i++ )
+    pthread_join( s->threads[i], NULL );
+
+  pthread_cond_destroy( &s->ready );
+  pthread_mutex_destroy( &s->lock );
+  free( s->threads );
+}
@@ -0,0 +1,185 @@
+/**
+ * \file
+ * ZIP asynchronous compression - Interface.
+ *
+ * Moves the compression of a \a zip_t to a background thread. Operations are submitted to a
+ * bounded queue and run in order by the thread, so callers only pay for enqueueing them. When
+ * the queue is full, submitting blocks until the thread catches up.
+ *
+ * While a \a zip_async_t is running, the \a zip_t belongs to its thread: it must not be used
+ * directly until \a zip_async_wait returns.
+ *
+ * Processes with many archives can share a fixed pool of threads instead: a \a zip_sched_t
+ * runs the queues of every \a zip_async_t attached to it, taking turns between them. An output
+ * callback can't report that it would block, so an operation whose output blocks keeps its
+ * pool thread until the callback returns: with as many blocked outputs as threads, the other
+ * contexts wait. Outputs that may block for long should get their own thread
+ * (\a zip_async_init) or buffer the data and return.
+ */
+
+#ifndef ZIP_ASYNC
+#define ZIP_ASYNC
+
+/* include area */
+#include "zip.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*-----------------------------------------------------------------------------
+   Library definitions
+-----------------------------------------------------------------------------*/
+
+/** Default maximum number of operations waiting in the queue. */
+#ifndef ZIP_ASYNC_QUEUE_DEPTH
+#  define ZIP_ASYNC_QUEUE_DEPTH 64
+#endif
+
+
+/*-----------------------------------------------------------------------------
+   Library data types
+-----------------------------------------------------------------------------*/
+
+/** Callback to report the completion of a submission. It's called from the compression thread
+ *  once \a data is no longer needed, so it can release it. \a success is \c false if the
+ *  operation or any previous one failed.
+ */
+typedef void ( *zip_async_done_cb_t )( void *cb_ctx, const void *data, size_t data_len, bool success );
+
+/** A queued operation. */
+typedef struct
+{
+  /** Operation type. */
+  int type;
+
+  /** Entry name (new entries only). */
+  char name[ZIP_ENTRY_MAX_NAME_LEN + 1];
+
+  /** Entry datetime (new entries only). */
+  struct zip_datetime datetime;
+
+  /** Data to compress. */
+  const void *data;
+
+  /** Bytes in \a data. */
+  size_t data_len;
+
+  /** Optional completion callback. */
+  zip_async_done_cb_t done_cb;
+
+  /** User defined context for \a done_cb. */
+  void *done_cb_ctx;
+
+} zip_async_op_t;
+
+/** Asynchronous compression context type. */
+typedef struct zip_async
+{
+  /** ZIP context used by the compression thread. */
+  zip_t *z;
+
+  /** Compression thread (unused when \a sched is set). */
+  pthread_t thread;
+
+  /** Scheduler running the operations (\c NULL if the context has its own thread). */
+  struct zip_sched *sched;
+
+  /** Operations run on each turn of the scheduler. */
+  unsigned priority;
+
+  /** Next context waiting for a turn (guarded by the lock of \a sched). */
+  struct zip_async *next;
+
+  /** Guards the fields below. */
+  pthread_mutex_t lock;
+
+  /** Signaled when operations are queued or the thread must stop. */
+  pthread_cond_t not_empty;
+
+  /** Signaled when operations leave the queue. */
+  pthread_cond_t not_full;
+
+  /** Signaled when every submitted operation has completed. */
+  pthread_cond_t idle;
+
+  /** Ring of queued operations. */
+  zip_async_op_t *queue;
+
+  /** Number of slots in \a queue. */
+  size_t queue_depth;
+
+  /** Index of the oldest queued operation. */
+  size_t head;
+
+  /** Number of queued operations. */
+  size_t queued;
+
+  /** Operations submitted and not completed yet (queued or running). */
+  size_t pending;
+
+  /** Whether an operation failed (every later one fails too). */
+  bool failed;
+
+  /** Whether the thread must exit once the queue is empty. */
+  bool stop;
+
+  /** Whether the context is waiting for a turn or being run by the scheduler. */
+  bool scheduled;
+
+} zip_async_t;
+
+/** Scheduler of asynchronous compression contexts type. Operations are never parked: one whose
+ *  output blocks holds its thread until the output callback returns. */
+typedef struct zip_sched
+{
+  /** Worker threads. */
+  pthread_t *threads;
+
+  /** Number of \a threads. */
+  size_t num_threads;
+
+  /** Guards the fields below. */
+  pthread_mutex_t lock;
+
+  /** Signaled when a context is waiting for a turn or the threads must stop. */
+  pthread_cond_t ready;
+
+  /** First context waiting for a turn. */
+  zip_async_t *ready_head;
+
+  /** Last context waiting for a turn. */
+  zip_async_t *ready_tail;
+
+  /** Whether the threads must exit. */
+  bool stop;
+
+} zip_sched_t;
+
+
+/*-----------------------------------------------------------------------------
+   Function prototypes
+-----------------------------------------------------------------------------*/
+
+/** Init/uninit */
+bool zip_async_init( zip_async_t *a, zip_t *z, size_t queue_depth );
+bool zip_async_init_sched( zip_async_t *a, zip_t *z, size_t queue_depth, zip_sched_t *s, unsigned priority );
+bool zip_async_release( zip_async_t *a );
+
+bool zip_sched_init( zip_sched_t *s, size_t num_threads );
+void zip_sched_release( zip_sched_t *s );
+
+/** Submissions */
+bool zip_async_entry_add( zip_async_t *a, const char *filename, struct zip_datetime datetime );
+bool zip_async_entry_update( zip_async_t *a, const void *data, size_t data_len, zip_async_done_cb_t done_cb,
+                             void *done_cb_ctx );
+bool zip_async_entry_end( zip_async_t *a, zip_async_done_cb_t done_cb, void *done_cb_ctx );
+bool zip_async_entry_flush( zip_async_t *a );
+bool zip_async_entry_poll( zip_async_t *a );
+
+/** Completion */
+bool zip_async_wait( zip_async_t *a );
+
+
+#endif
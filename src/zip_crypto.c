@@ -0,0 +1,1043 @@
+/**
+ * \file
+ * ZIP encryption primitives - Implementation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+/* include area */
+#include "zip_crypto.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/*-----------------------------------------------------------------------------
+   Definitions
+-----------------------------------------------------------------------------*/
+
+/** Whether the AES-NI and SHA-NI code is built (it's only used if the CPU supports it). */
+#ifndef ZIP_CRYPTO_HW
+#  if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#    define ZIP_CRYPTO_HW 1
+#  else
+#    define ZIP_CRYPTO_HW 0
+#  endif
+#endif
+
+#if ZIP_CRYPTO_HW
+#  include <immintrin.h>
+#endif
+
+/** Whether the random bytes come from getrandom (glibc 2.25 and later), without a file
+ *  descriptor. */
+#ifndef ZIP_CRYPTO_GETRANDOM
+#  if defined( __linux__ ) && defined( __GLIBC__ ) && ( __GLIBC__ > 2 || __GLIBC_MINOR__ >= 25 )
+#    define ZIP_CRYPTO_GETRANDOM 1
+#  else
+#    define ZIP_CRYPTO_GETRANDOM 0
+#  endif
+#endif
+
+#if ZIP_CRYPTO_GETRANDOM
+#  include <sys/random.h>
+#endif
+
+/** Number of rounds of AES-256. */
+#define ZIP_AES_ROUNDS 14
+
+/** Keystream blocks generated at once by the AES-NI code, so the rounds of independent blocks
+ *  overlap in the pipeline. */
+#define ZIP_AES_HW_BLOCKS 4
+
+/** Rotates a 32 bit word to the left.
+ *
+ *  \param x The word.
+ *  \param n Bits to rotate (1 to 31).
+ */
+#define ROTL32( x, n ) ( ( ( x ) << ( n ) ) | ( ( x ) >> ( 32 - ( n ) ) ) )
+
+/** Rotates a 32 bit word to the right.
+ *
+ *  \param x The word.
+ *  \param n Bits to rotate (1 to 31).
+ */
+#define ROTR32( x, n ) ROTL32( x, 32 - ( n ) )
+
+
+/*-----------------------------------------------------------------------------
+   Internal data types
+-----------------------------------------------------------------------------*/
+
+/** Compression function of a hash: updates the intermediate hash value with 64 byte blocks. */
+typedef void ( *blocks_fn_t )( uint32_t *h, const uint8_t *data, size_t num_blocks );
+
+
+/*-----------------------------------------------------------------------------
+   Internal data
+-----------------------------------------------------------------------------*/
+
+/** Whether the AES-NI and SHA-NI code may be used (see \a zip_crypto_set_hw). */
+static bool _hw_allowed = true;
+
+/** SHA-256 round constants. */
+static const uint32_t _sha256_k[64] = {
+  0x428a2f98U, 0x71374491U, 0xb5c0fbcfU, 0xe9b5dba5U, 0x3956c25bU, 0x59f111f1U, 0x923f82a4U, 0xab1c5ed5U,
+  0xd807aa98U, 0x12835b01U, 0x243185beU, 0x550c7dc3U, 0x72be5d74U, 0x80deb1feU, 0x9bdc06a7U, 0xc19bf174U,
+  0xe49b69c1U, 0xefbe4786U, 0x0fc19dc6U, 0x240ca1ccU, 0x2de92c6fU, 0x4a7484aaU, 0x5cb0a9dcU, 0x76f988daU,
+  0x983e5152U, 0xa831c66dU, 0xb00327c8U, 0xbf597fc7U, 0xc6e00bf3U, 0xd5a79147U, 0x06ca6351U, 0x14292967U,
+  0x27b70a85U, 0x2e1b2138U, 0x4d2c6dfcU, 0x53380d13U, 0x650a7354U, 0x766a0abbU, 0x81c2c92eU, 0x92722c85U,
+  0xa2bfe8a1U, 0xa81a664bU, 0xc24b8b70U, 0xc76c51a3U, 0xd192e819U, 0xd6990624U, 0xf40e3585U, 0x106aa070U,
+  0x19a4c116U, 0x1e376c08U, 0x2748774cU, 0x34b0bcb5U, 0x391c0cb3U, 0x4ed8aa4aU, 0x5b9cca4fU, 0x682e6ff3U,
+  0x748f82eeU, 0x78a5636fU, 0x84c87814U, 0x8cc70208U, 0x90befffaU, 0xa4506cebU, 0xbef9a3f7U, 0xc67178f2U,
+};
+
+/** AES substitution box. */
+static const uint8_t _sbox[256] = {
+  0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+  0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+  0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+  0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+  0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+  0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+  0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+  0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+  0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+  0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+  0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+  0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+  0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+  0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+  0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+
+/*-----------------------------------------------------------------------------
+   Helper functions
+-----------------------------------------------------------------------------*/
+
+/** Reads a big-endian 32 bit integer.
+ *
+ *  \param input Input bytes.
+ *  \return The integer.
+ */
+static uint32_t _get32_be( const uint8_t *input )
+{
+  return ( ( uint32_t )input[0] << 24 ) | ( ( uint32_t )input[1] << 16 ) | ( ( uint32_t )input[2] << 8 ) | input[3];
+}
+
+
+/** Stores a big-endian 32 bit integer.
+ *
+ *  \param output Output buffer.
+ *  \param input The integer.
+ */
+static void _put32_be( uint8_t *output, uint32_t input )
+{
+  output[0] = ( uint8_t )( input >> 24 );
+  output[1] = ( uint8_t )( input >> 16 );
+  output[2] = ( uint8_t )( input >> 8 );
+  output[3] = ( uint8_t )input;
+}
+
+
+/** Hashes 64 byte blocks with the portable code.
+ *
+ *  \param h Intermediate hash value.
+ *  \param data The blocks.
+ *  \param num_blocks Number of blocks in \a data.
+ */
+static void _sha1_blocks_sw( uint32_t *h, const uint8_t *data, size_t num_blocks )
+{
+  for( ; num_blocks > 0; num_blocks--, data += 64 )
+  {
+    uint32_t w[80];
+    for( size_t i = 0; i < 16; i++ )
+      w[i] = _get32_be( data + 4 * i );
+    for( size_t i = 16; i < 80; i++ )
+      w[i] = ROTL32( w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1 );
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for( size_t i = 0; i < 80; i++ )
+    {
+      uint32_t f;
+      if( i < 20 )
+        f = ( ( b & c ) | ( ~b & d ) ) + 0x5a827999U;
+      else if( i < 40 )
+        f = ( b ^ c ^ d ) + 0x6ed9eba1U;
+      else if( i < 60 )
+        f = ( ( b & c ) | ( b & d ) | ( c & d ) ) + 0x8f1bbcdcU;
+      else
+        f = ( b ^ c ^ d ) + 0xca62c1d6U;
+
+      uint32_t t = ROTL32( a, 5 ) + f + e + w[i];
+      e = d;
+      d = c;
+      c = ROTL32( b, 30 );
+      b = a;
+      a = t;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+}
+
+
+#if ZIP_CRYPTO_HW
+
+/** Hashes 64 byte blocks with SHA-NI. Each step runs 4 rounds, while the message schedule of
+ *  the next steps is computed.
+ *
+ *  \param h Intermediate hash value.
+ *  \param data The blocks.
+ *  \param num_blocks Number of blocks in \a data.
+ */
+__attribute__( ( target( "sha,sse4.1" ) ) ) static void _sha1_blocks_hw( uint32_t *h, const uint8_t *data,
+                                                                           size_t num_blocks )
+{
+  const __m128i byte_swap = _mm_set_epi64x( 0x0001020304050607LL, 0x08090a0b0c0d0e0fLL );
+  __m128i abcd = _mm_shuffle_epi32( _mm_loadu_si128( ( const __m128i * )h ), 0x1b );
+  __m128i e0 = _mm_set_epi32( ( int )h[4], 0, 0, 0 );
+
+  for( ; num_blocks > 0; num_blocks--, data += 64 )
+  {
+    __m128i abcd_saved = abcd;
+    __m128i e_saved = e0;
+    __m128i e[2] = { e0, e0 };
+    __m128i msg[4];
+
+    /* unrolled, so the message registers and round functions are resolved at compile time */
+#pragma GCC unroll 20
+    for( size_t i = 0; i < 20; i++ )
+    {
+      size_t m = i % 4;
+      if( i < 4 )
+        msg[m] = _mm_shuffle_epi8( _mm_loadu_si128( ( const __m128i * )( data + 16 * i ) ), byte_swap );
+
+      /* the E of this step is derived from A of 4 rounds ago */
+      e[i % 2] = ( i == 0 ) ? _mm_add_epi32( e[0], msg[0] ) : _mm_sha1nexte_epu32( e[i % 2], msg[m] );
+      e[( i + 1 ) % 2] = abcd;
+
+      if( i >= 3 && i <= 18 )
+        msg[( m + 1 ) % 4] = _mm_sha1msg2_epu32( msg[( m + 1 ) % 4], msg[m] );
+
+      switch( i / 5 )
+      {
+        case 0: abcd = _mm_sha1rnds4_epu32( abcd, e[i % 2], 0 ); break;
+        case 1: abcd = _mm_sha1rnds4_epu32( abcd, e[i % 2], 1 ); break;
+        case 2: abcd = _mm_sha1rnds4_epu32( abcd, e[i % 2], 2 ); break;
+        default: abcd = _mm_sha1rnds4_epu32( abcd, e[i % 2], 3 ); break;
+      }
+
+      if( i >= 1 && i <= 16 )
+        msg[( m + 3 ) % 4] = _mm_sha1msg1_epu32( msg[( m + 3 ) % 4], msg[m] );
+      if( i >= 2 && i <= 17 )
+        msg[( m + 2 ) % 4] = _mm_xor_si128( msg[( m + 2 ) % 4], msg[m] );
+    }
+
+    e0 = _mm_sha1nexte_epu32( e[0], e_saved );
+    abcd = _mm_add_epi32( abcd, abcd_saved );
+  }
+
+  _mm_storeu_si128( ( __m128i * )h, _mm_shuffle_epi32( abcd, 0x1b ) );
+  h[4] = ( uint32_t )_mm_extract_epi32( e0, 3 );
+}
+
+#endif
+
+
+/** Hashes 64 byte blocks.
+ *
+ *  \param h Intermediate hash value.
+ *  \param data The blocks.
+ *  \param num_blocks Number of blocks in \a data.
+ */
+static void _sha1_blocks( uint32_t *h, const uint8_t *data, size_t num_blocks )
+{
+#if ZIP_CRYPTO_HW
+  if( _hw_allowed && __builtin_cpu_supports( "sha" ) && __builtin_cpu_supports( "sse4.1" ) )
+  {
+    _sha1_blocks_hw( h, data, num_blocks );
+    return;
+  }
+#endif
+  _sha1_blocks_sw( h, data, num_blocks );
+}
+
+
+/** Hashes 64 byte blocks with the portable SHA-256 code.
+ *
+ *  \param h Intermediate hash value.
+ *  \param data The blocks.
+ *  \param num_blocks Number of blocks in \a data.
+ */
+static void _sha256_blocks_sw( uint32_t *h, const uint8_t *data, size_t num_blocks )
+{
+  for( ; num_blocks > 0; num_blocks--, data += 64 )
+  {
+    uint32_t w[64];
+    for( size_t i = 0; i < 16; i++ )
+      w[i] = _get32_be( data + 4 * i );
+    for( size_t i = 16; i < 64; i++ )
+    {
+      uint32_t s0 = ROTR32( w[i - 15], 7 ) ^ ROTR32( w[i - 15], 18 ) ^ ( w[i - 15] >> 3 );
+      uint32_t s1 = ROTR32( w[i - 2], 17 ) ^ ROTR32( w[i - 2], 19 ) ^ ( w[i - 2] >> 10 );
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for( size_t i = 0; i < 64; i++ )
+    {
+      uint32_t t1 = hh + ( ROTR32( e, 6 ) ^ ROTR32( e, 11 ) ^ ROTR32( e, 25 ) ) + ( ( e & f ) ^ ( ~e & g ) ) +
+                    _sha256_k[i] + w[i];
+      uint32_t t2 = ( ROTR32( a, 2 ) ^ ROTR32( a, 13 ) ^ ROTR32( a, 22 ) ) + ( ( a & b ) ^ ( a & c ) ^ ( b & c ) );
+      hh = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += hh;
+  }
+}
+
+
+#if ZIP_CRYPTO_HW
+
+/** Hashes 64 byte blocks with the SHA-256 instructions of SHA-NI. The state is kept as the
+ *  ABEF and CDGH halves the instructions work on, and each step runs 4 rounds while the message
+ *  schedule of a later step is computed.
+ *
+ *  \param h Intermediate hash value.
+ *  \param data The blocks.
+ *  \param num_blocks Number of blocks in \a data.
+ */
+__attribute__( ( target( "sha,sse4.1" ) ) ) static void _sha256_blocks_hw( uint32_t *h, const uint8_t *data,
+                                                                             size_t num_blocks )
+{
+  const __m128i byte_swap = _mm_set_epi64x( 0x0c0d0e0f08090a0bLL, 0x0405060700010203LL );
+  __m128i dcba = _mm_shuffle_epi32( _mm_loadu_si128( ( const __m128i * )h ), 0xb1 );
+  __m128i hgfe = _mm_shuffle_epi32( _mm_loadu_si128( ( const __m128i * )( h + 4 ) ), 0x1b );
+  __m128i abef = _mm_alignr_epi8( dcba, hgfe, 8 );
+  __m128i cdgh = _mm_blend_epi16( hgfe, dcba, 0xf0 );
+
+  for( ; num_blocks > 0; num_blocks--, data += 64 )
+  {
+    __m128i abef_saved = abef;
+    __m128i cdgh_saved = cdgh;
+    __m128i msg[4];
+    for( size_t i = 0; i < 4; i++ )
+      msg[i] = _mm_shuffle_epi8( _mm_loadu_si128( ( const __m128i * )( data + 16 * i ) ), byte_swap );
+
+#pragma GCC unroll 16
+    for( size_t i = 0; i < 16; i++ )
+    {
+      __m128i wk = _mm_add_epi32( msg[i % 4], _mm_loadu_si128( ( const __m128i * )( _sha256_k + 4 * i ) ) );
+      cdgh = _mm_sha256rnds2_epu32( cdgh, abef, wk );
+      abef = _mm_sha256rnds2_epu32( abef, cdgh, _mm_shuffle_epi32( wk, 0x0e ) );
+
+      /* the words of step i + 4 replace the ones just used */
+      if( i < 12 )
+      {
+        __m128i w = _mm_sha256msg1_epu32( msg[i % 4], msg[( i + 1 ) % 4] );
+        w = _mm_add_epi32( w, _mm_alignr_epi8( msg[( i + 3 ) % 4], msg[( i + 2 ) % 4], 4 ) );
+        msg[i % 4] = _mm_sha256msg2_epu32( w, msg[( i + 3 ) % 4] );
+      }
+    }
+
+    abef = _mm_add_epi32( abef, abef_saved );
+    cdgh = _mm_add_epi32( cdgh, cdgh_saved );
+  }
+
+  __m128i feba = _mm_shuffle_epi32( abef, 0x1b );
+  __m128i dchg = _mm_shuffle_epi32( cdgh, 0xb1 );
+  _mm_storeu_si128( ( __m128i * )h, _mm_blend_epi16( feba, dchg, 0xf0 ) );
+  _mm_storeu_si128( ( __m128i * )( h + 4 ), _mm_alignr_epi8( dchg, feba, 8 ) );
+}
+
+#endif
+
+
+/** Hashes 64 byte blocks with SHA-256.
+ *
+ *  \param h Intermediate hash value.
+ *  \param data The blocks.
+ *  \param num_blocks Number of blocks in \a data.
+ */
+static void _sha256_blocks( uint32_t *h, const uint8_t *data, size_t num_blocks )
+{
+#if ZIP_CRYPTO_HW
+  if( _hw_allowed && __builtin_cpu_supports( "sha" ) && __builtin_cpu_supports( "sse4.1" ) )
+  {
+    _sha256_blocks_hw( h, data, num_blocks );
+    return;
+  }
+#endif
+  _sha256_blocks_sw( h, data, num_blocks );
+}
+
+
+/** Hashes data with a compression function, keeping the bytes that don't fill a block.
+ *
+ *  \param blocks Compression function.
+ *  \param h Intermediate hash value.
+ *  \param len Bytes hashed so far (updated).
+ *  \param block Data not hashed yet (less than a block).
+ *  \param data Data to hash.
+ *  \param data_len Bytes in \a data.
+ */
+static void _hash_update( blocks_fn_t blocks, uint32_t *h, uint64_t *len, uint8_t *block, const void *data,
+                          size_t data_len )
+{
+  const uint8_t *p = data;
+  size_t used = *len % 64;
+  *len += data_len;
+
+  if( used > 0 )
+  {
+    size_t n = ( data_len < 64 - used ) ? data_len : 64 - used;
+    memcpy( block + used, p, n );
+    p += n;
+    data_len -= n;
+    if( used + n < 64 )
+      return;
+    blocks( h, block, 1 );
+  }
+
+  blocks( h, p, data_len / 64 );
+  memcpy( block, p + data_len / 64 * 64, data_len % 64 );
+}
+
+
+/** Pads the data hashed with a compression function, ending with its length in bits.
+ *
+ *  \param blocks Compression function.
+ *  \param h Intermediate hash value.
+ *  \param len Bytes hashed so far.
+ *  \param block Data not hashed yet (less than a block).
+ */
+static void _hash_pad( blocks_fn_t blocks, uint32_t *h, uint64_t *len, uint8_t *block )
+{
+  uint64_t bits = *len * 8;
+  uint8_t padding[72] = { 0x80 };
+  size_t padding_len = ( *len % 64 < 56 ) ? 56 - *len % 64 : 120 - *len % 64;
+  _put32_be( padding + padding_len, ( uint32_t )( bits >> 32 ) );
+  _put32_be( padding + padding_len + 4, ( uint32_t )bits );
+  _hash_update( blocks, h, len, block, padding, padding_len + 8 );
+}
+
+
+/** Computes the HMAC of a message as long as a digest, in place. Both hashes take a single
+ *  block, so they are computed directly from the padded key states.
+ *
+ *  \param h HMAC context keyed and not updated.
+ *  \param data Message and output authentication code.
+ */
+static void _hmac_digest( const zip_hmac_t *h, uint8_t *data )
+{
+  /* the padding of a message of 64 + 20 bytes */
+  uint8_t block[64] = { 0 };
+  memcpy( block, data, ZIP_SHA1_SIZE );
+  block[ZIP_SHA1_SIZE] = 0x80U;
+  block[62] = ( ( 64 + ZIP_SHA1_SIZE ) * 8 ) >> 8;
+  block[63] = ( uint8_t )( ( 64 + ZIP_SHA1_SIZE ) * 8 );
+
+  uint32_t state[5];
+  memcpy( state, h->inner.h, sizeof( state ) );
+  _sha1_blocks( state, block, 1 );
+  for( size_t i = 0; i < 5; i++ )
+    _put32_be( block + 4 * i, state[i] );
+
+  memcpy( state, h->outer.h, sizeof( state ) );
+  _sha1_blocks( state, block, 1 );
+  for( size_t i = 0; i < 5; i++ )
+    _put32_be( data + 4 * i, state[i] );
+}
+
+
+/** Multiplies by x in GF(2^8).
+ *
+ *  \param a Field element.
+ *  \return The product.
+ */
+static uint8_t _xtime( uint8_t a )
+{
+  return ( uint8_t )( ( a << 1 ) ^ ( ( a & 0x80U ) ? 0x1bU : 0 ) );
+}
+
+
+/** Encrypts a block with the portable code.
+ *
+ *  \param aes AES context with the key set.
+ *  \param input Plaintext block.
+ *  \param output Ciphertext block (can be \a input).
+ */
+static void _aes_block_sw( const zip_aes_t *aes, const uint8_t *input, uint8_t *output )
+{
+  uint8_t s[16];
+  for( size_t i = 0; i < 16; i++ )
+    s[i] = input[i] ^ aes->round_keys[0][i];
+
+  for( size_t round = 1; round <= ZIP_AES_ROUNDS; round++ )
+  {
+    /* SubBytes and ShiftRows: row r of column c comes from column c + r */
+    uint8_t t[16];
+    for( size_t c = 0; c < 4; c++ )
+      for( size_t r = 0; r < 4; r++ )
+        t[4 * c + r] = _sbox[s[4 * ( ( c + r ) % 4 ) + r]];
+
+    /* MixColumns, except in the last round */
+    if( round < ZIP_AES_ROUNDS )
+    {
+      for( size_t c = 0; c < 4; c++ )
+      {
+        uint8_t *col = t + 4 * c;
+        uint8_t a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+        uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+        col[0] = a0 ^ all ^ _xtime( a0 ^ a1 );
+        col[1] = a1 ^ all ^ _xtime( a1 ^ a2 );
+        col[2] = a2 ^ all ^ _xtime( a2 ^ a3 );
+        col[3] = a3 ^ all ^ _xtime( a3 ^ a0 );
+      }
+    }
+
+    for( size_t i = 0; i < 16; i++ )
+      s[i] = t[i] ^ aes->round_keys[round][i];
+  }
+
+  memcpy( output, s, 16 );
+}
+
+
+/** Stores a counter block (little-endian, as WinZip does).
+ *
+ *  \param output Output block.
+ *  \param counter Counter value.
+ */
+static void _counter_block( uint8_t *output, uint64_t counter )
+{
+  memset( output, 0, 16 );
+  for( size_t i = 0; i < 8; i++ )
+    output[i] = ( uint8_t )( counter >> ( 8 * i ) );
+}
+
+
+#if ZIP_CRYPTO_HW
+
+/** Encrypts a block with AES-NI.
+ *
+ *  \param aes AES context with the key set.
+ *  \param input Plaintext block.
+ *  \param output Ciphertext block (can be \a input).
+ */
+__attribute__( ( target( "aes,sse2" ) ) ) static void _aes_block_hw( const zip_aes_t *aes, const uint8_t *input,
+                                                                       uint8_t *output )
+{
+  __m128i b = _mm_xor_si128( _mm_loadu_si128( ( const __m128i * )input ),
+                             _mm_loadu_si128( ( const __m128i * )aes->round_keys[0] ) );
+  for( size_t round = 1; round < ZIP_AES_ROUNDS; round++ )
+    b = _mm_aesenc_si128( b, _mm_loadu_si128( ( const __m128i * )aes->round_keys[round] ) );
+  b = _mm_aesenclast_si128( b, _mm_loadu_si128( ( const __m128i * )aes->round_keys[ZIP_AES_ROUNDS] ) );
+  _mm_storeu_si128( ( __m128i * )output, b );
+}
+
+
+/** Encrypts whole blocks in CTR mode with AES-NI, several of them at once.
+ *
+ *  \param aes AES context.
+ *  \param data Data encrypted in place.
+ *  \param num_blocks Number of 16 byte blocks in \a data.
+ */
+__attribute__( ( target( "aes,sse2" ) ) ) static void _aes_ctr_hw( zip_aes_t *aes, uint8_t *data, size_t num_blocks )
+{
+  __m128i k[ZIP_AES_ROUNDS + 1];
+  for( size_t i = 0; i <= ZIP_AES_ROUNDS; i++ )
+    k[i] = _mm_loadu_si128( ( const __m128i * )aes->round_keys[i] );
+
+  while( num_blocks > 0 )
+  {
+    size_t n = ( num_blocks < ZIP_AES_HW_BLOCKS ) ? num_blocks : ZIP_AES_HW_BLOCKS;
+    __m128i b[ZIP_AES_HW_BLOCKS];
+    for( size_t j = 0; j < n; j++ )
+      b[j] = _mm_xor_si128( _mm_set_epi64x( 0, ( long long )aes->counter++ ), k[0] );
+
+    for( size_t round = 1; round < ZIP_AES_ROUNDS; round++ )
+      for( size_t j = 0; j < n; j++ )
+        b[j] = _mm_aesenc_si128( b[j], k[round] );
+
+    for( size_t j = 0; j < n; j++ )
+    {
+      __m128i *p = ( __m128i * )( data + 16 * j );
+      b[j] = _mm_aesenclast_si128( b[j], k[ZIP_AES_ROUNDS] );
+      _mm_storeu_si128( p, _mm_xor_si128( _mm_loadu_si128( p ), b[j] ) );
+    }
+
+    data += 16 * n;
+    num_blocks -= n;
+  }
+}
+
+#endif
+
+
+/** Applies the keystream to the data (encryption and decryption are the same in CTR mode).
+ *
+ *  \param aes AES context.
+ *  \param data Data transformed in place.
+ *  \param data_len Bytes in \a data.
+ */
+static void _aes_ctr( zip_aes_t *aes, uint8_t *data, size_t data_len )
+{
+  /* the rest of the block left by the previous call */
+  for( ; data_len > 0 && aes->keystream_used < 16; data++, data_len-- )
+    *data ^= aes->keystream[aes->keystream_used++];
+
+  size_t num_blocks = data_len / 16;
+#if ZIP_CRYPTO_HW
+  if( aes->hw )
+  {
+    _aes_ctr_hw( aes, data, num_blocks );
+    data += 16 * num_blocks;
+    data_len -= 16 * num_blocks;
+    num_blocks = 0;
+  }
+#endif
+
+  for( ; num_blocks > 0; num_blocks-- )
+  {
+    uint8_t block[16];
+    _counter_block( block, aes->counter++ );
+    _aes_block_sw( aes, block, block );
+    for( size_t i = 0; i < 16; i++ )
+      data[i] ^= block[i];
+
+    data += 16;
+    data_len -= 16;
+  }
+
+  /* a partial block keeps the rest of its keystream for the next call */
+  if( data_len > 0 )
+  {
+    _counter_block( aes->keystream, aes->counter++ );
+    zip_aes_block( aes, aes->keystream, aes->keystream );
+    for( aes->keystream_used = 0; aes->keystream_used < data_len; aes->keystream_used++ )
+      data[aes->keystream_used] ^= aes->keystream[aes->keystream_used];
+  }
+}
+
+
+/** Derives the keys of an entry from the password and its salt.
+ *
+ *  \param aes AES context.
+ *  \param password Password keyed HMAC.
+ *  \param salt Salt of the entry.
+ *  \param verifier Output password verifier.
+ */
+static void _aes_derive( zip_aes_t *aes, const zip_hmac_t *password, const uint8_t *salt, uint8_t *verifier )
+{
+  /* encryption key, authentication key and password verifier */
+  uint8_t keys[2 * ZIP_AES_KEY_SIZE + ZIP_AES_VERIFIER_SIZE];
+  zip_pbkdf2( password, salt, ZIP_AES_SALT_SIZE, ZIP_AES_ITERATIONS, keys, sizeof( keys ) );
+
+  zip_aes_set_key( aes, keys );
+  zip_hmac_init( &aes->mac, keys + ZIP_AES_KEY_SIZE, ZIP_AES_KEY_SIZE );
+  memcpy( verifier, keys + 2 * ZIP_AES_KEY_SIZE, ZIP_AES_VERIFIER_SIZE );
+  memset( keys, 0, sizeof( keys ) );
+}
+
+
+/*-----------------------------------------------------------------------------
+   Public functions
+-----------------------------------------------------------------------------*/
+
+/** Initializes a SHA-1 context.
+ *
+ *  \param s SHA-1 context.
+ */
+void zip_sha1_init( zip_sha1_t *s )
+{
+  s->h[0] = 0x67452301U;
+  s->h[1] = 0xefcdab89U;
+  s->h[2] = 0x98badcfeU;
+  s->h[3] = 0x10325476U;
+  s->h[4] = 0xc3d2e1f0U;
+  s->len = 0;
+}
+
+
+/** Hashes data (can be called many times).
+ *
+ *  \param s SHA-1 context.
+ *  \param data Data to hash.
+ *  \param data_len Bytes in \a data.
+ */
+void zip_sha1_update( zip_sha1_t *s, const void *data, size_t data_len )
+{
+  _hash_update( _sha1_blocks, s->h, &s->len, s->block, data, data_len );
+}
+
+
+/** Finishes the hash.
+ *
+ *  \param s SHA-1 context (must be initialized again to be reused).
+ *  \param digest Output digest.
+ */
+void zip_sha1_final( zip_sha1_t *s, uint8_t digest[ZIP_SHA1_SIZE] )
+{
+  _hash_pad( _sha1_blocks, s->h, &s->len, s->block );
+  for( size_t i = 0; i < 5; i++ )
+    _put32_be( digest + 4 * i, s->h[i] );
+}
+
+
+/** Initializes a SHA-256 context.
+ *
+ *  \param s SHA-256 context.
+ */
+void zip_sha256_init( zip_sha256_t *s )
+{
+  static const uint32_t h[8] = {
+    0x6a09e667U, 0xbb67ae85U, 0x3c6ef372U, 0xa54ff53aU, 0x510e527fU, 0x9b05688cU, 0x1f83d9abU, 0x5be0cd19U,
+  };
+
+  memcpy( s->h, h, sizeof( h ) );
+  s->len = 0;
+}
+
+
+/** Hashes data (can be called many times).
+ *
+ *  \param s SHA-256 context.
+ *  \param data Data to hash.
+ *  \param data_len Bytes in \a data.
+ */
+void zip_sha256_update( zip_sha256_t *s, const void *data, size_t data_len )
+{
+  _hash_update( _sha256_blocks, s->h, &s->len, s->block, data, data_len );
+}
+
+
+/** Finishes the hash.
+ *
+ *  \param s SHA-256 context (must be initialized again to be reused).
+ *  \param digest Output digest.
+ */
+void zip_sha256_final( zip_sha256_t *s, uint8_t digest[ZIP_SHA256_SIZE] )
+{
+  _hash_pad( _sha256_blocks, s->h, &s->len, s->block );
+  for( size_t i = 0; i < 8; i++ )
+    _put32_be( digest + 4 * i, s->h[i] );
+}
+
+
+/** Initializes an HMAC-SHA1 context with a key.
+ *
+ *  \param h HMAC context.
+ *  \param key The key.
+ *  \param key_len Bytes in \a key.
+ */
+void zip_hmac_init( zip_hmac_t *h, const void *key, size_t key_len )
+{
+  /* longer keys are hashed first */
+  uint8_t block[64] = { 0 };
+  if( key_len > sizeof( block ) )
+  {
+    zip_sha1_init( &h->inner );
+    zip_sha1_update( &h->inner, key, key_len );
+    zip_sha1_final( &h->inner, block );
+  }
+  else
+    memcpy( block, key, key_len );
+
+  for( size_t i = 0; i < sizeof( block ); i++ )
+    block[i] ^= 0x36U;
+  zip_sha1_init( &h->inner );
+  zip_sha1_update( &h->inner, block, sizeof( block ) );
+
+  for( size_t i = 0; i < sizeof( block ); i++ )
+    block[i] ^= 0x36U ^ 0x5cU;
+  zip_sha1_init( &h->outer );
+  zip_sha1_update( &h->outer, block, sizeof( block ) );
+  memset( block, 0, sizeof( block ) );
+}
+
+
+/** Authenticates data (can be called many times).
+ *
+ *  \param h HMAC context.
+ *  \param data Data to authenticate.
+ *  \param data_len Bytes in \a data.
+ */
+void zip_hmac_update( zip_hmac_t *h, const void *data, size_t data_len )
+{
+  zip_sha1_update( &h->inner, data, data_len );
+}
+
+
+/** Finishes the authentication code.
+ *
+ *  \param h HMAC context (a copy taken before the first update can be reused instead).
+ *  \param mac Output authentication code.
+ */
+void zip_hmac_final( zip_hmac_t *h, uint8_t mac[ZIP_SHA1_SIZE] )
+{
+  zip_sha1_final( &h->inner, mac );
+  zip_sha1_update( &h->outer, mac, ZIP_SHA1_SIZE );
+  zip_sha1_final( &h->outer, mac );
+}
+
+
+/** Derives a key from a password with PBKDF2-HMAC-SHA1.
+ *
+ *  \param password HMAC context keyed with the password (not modified, so the padded password
+ *         is hashed once for all the iterations).
+ *  \param salt The salt.
+ *  \param salt_len Bytes in \a salt.
+ *  \param iterations Number of iterations.
+ *  \param output Output key.
+ *  \param output_len Bytes of key to derive.
+ */
+void zip_pbkdf2( const zip_hmac_t *password, const uint8_t *salt, size_t salt_len, unsigned iterations,
+                 uint8_t *output, size_t output_len )
+{
+  for( uint32_t block = 1; output_len > 0; block++ )
+  {
+    uint8_t index[4];
+    _put32_be( index, block );
+
+    uint8_t u[ZIP_SHA1_SIZE];
+    zip_hmac_t h = *password;
+    zip_hmac_update( &h, salt, salt_len );
+    zip_hmac_update( &h, index, sizeof( index ) );
+    zip_hmac_final( &h, u );
+
+    uint8_t t[ZIP_SHA1_SIZE];
+    memcpy( t, u, sizeof( t ) );
+    for( unsigned i = 1; i < iterations; i++ )
+    {
+      _hmac_digest( password, u );
+      for( size_t j = 0; j < sizeof( t ); j++ )
+        t[j] ^= u[j];
+    }
+
+    size_t n = ( output_len < sizeof( t ) ) ? output_len : sizeof( t );
+    memcpy( output, t, n );
+    output += n;
+    output_len -= n;
+  }
+}
+
+
+/** Sets the AES-256 key and resets the CTR counter.
+ *
+ *  \param aes AES context.
+ *  \param key The key.
+ */
+void zip_aes_set_key( zip_aes_t *aes, const uint8_t key[ZIP_AES_KEY_SIZE] )
+{
+  uint8_t *rk = aes->round_keys[0];
+  memcpy( rk, key, ZIP_AES_KEY_SIZE );
+
+  uint8_t rcon = 1;
+  for( size_t i = ZIP_AES_KEY_SIZE; i < sizeof( aes->round_keys ); i += 4 )
+  {
+    uint8_t t[4] = { rk[i - 4], rk[i - 3], rk[i - 2], rk[i - 1] };
+    if( i % ZIP_AES_KEY_SIZE == 0 )
+    {
+      uint8_t first = t[0];
+      t[0] = _sbox[t[1]] ^ rcon;
+      t[1] = _sbox[t[2]];
+      t[2] = _sbox[t[3]];
+      t[3] = _sbox[first];
+      rcon = _xtime( rcon );
+    }
+    else if( i % ZIP_AES_KEY_SIZE == 16 )
+    {
+      for( size_t j = 0; j < 4; j++ )
+        t[j] = _sbox[t[j]];
+    }
+
+    for( size_t j = 0; j < 4; j++ )
+      rk[i + j] = rk[i - ZIP_AES_KEY_SIZE + j] ^ t[j];
+  }
+
+  aes->counter = 1;
+  aes->keystream_used = 16;
+#if ZIP_CRYPTO_HW
+  aes->hw = _hw_allowed && __builtin_cpu_supports( "aes" );
+#else
+  aes->hw = false;
+#endif
+}
+
+
+/** Encrypts a single block.
+ *
+ *  \param aes AES context with the key set.
+ *  \param input Plaintext block.
+ *  \param output Ciphertext block (can be \a input).
+ */
+void zip_aes_block( const zip_aes_t *aes, const uint8_t input[16], uint8_t output[16] )
+{
+#if ZIP_CRYPTO_HW
+  if( aes->hw )
+  {
+    _aes_block_hw( aes, input, output );
+    return;
+  }
+#endif
+  _aes_block_sw( aes, input, output );
+}
+
+
+/** Starts the encryption of an entry with a random salt.
+ *
+ *  \param aes AES context.
+ *  \param password Password keyed HMAC.
+ *  \param header Output salt and password verifier, written before the encrypted data.
+ *  \return \c false on error.
+ */
+bool zip_aes_start( zip_aes_t *aes, const zip_hmac_t *password, uint8_t header[ZIP_AES_HEADER_SIZE] )
+{
+  if( !zip_random( header, ZIP_AES_SALT_SIZE ) )
+    return false;
+
+  _aes_derive( aes, password, header, header + ZIP_AES_SALT_SIZE );
+  return true;
+}
+
+
+/** Starts the decryption of an entry.
+ *
+ *  \param aes AES context.
+ *  \param password Password keyed HMAC.
+ *  \param header Salt and password verifier found before the encrypted data.
+ *  \return \c false if the password verifier doesn't match.
+ */
+bool zip_aes_open( zip_aes_t *aes, const zip_hmac_t *password, const uint8_t header[ZIP_AES_HEADER_SIZE] )
+{
+  uint8_t verifier[ZIP_AES_VERIFIER_SIZE];
+  _aes_derive( aes, password, header, verifier );
+  return memcmp( verifier, header + ZIP_AES_SALT_SIZE, sizeof( verifier ) ) == 0;
+}
+
+
+/** Encrypts entry data and authenticates the result (can be called many times).
+ *
+ *  \param aes AES context.
+ *  \param data Data encrypted in place.
+ *  \param data_len Bytes in \a data.
+ */
+void zip_aes_encrypt( zip_aes_t *aes, uint8_t *data, size_t data_len )
+{
+  _aes_ctr( aes, data, data_len );
+  zip_hmac_update( &aes->mac, data, data_len );
+}
+
+
+/** Authenticates encrypted entry data and decrypts it (can be called many times).
+ *
+ *  \param aes AES context.
+ *  \param data Data decrypted in place.
+ *  \param data_len Bytes in \a data.
+ */
+void zip_aes_decrypt( zip_aes_t *aes, uint8_t *data, size_t data_len )
+{
+  zip_hmac_update( &aes->mac, data, data_len );
+  _aes_ctr( aes, data, data_len );
+}
+
+
+/** Finishes an entry.
+ *
+ *  \param aes AES context.
+ *  \param mac Output authentication code, written after the encrypted data.
+ */
+void zip_aes_finish( zip_aes_t *aes, uint8_t mac[ZIP_AES_MAC_SIZE] )
+{
+  uint8_t digest[ZIP_SHA1_SIZE];
+  zip_hmac_final( &aes->mac, digest );
+  memcpy( mac, digest, ZIP_AES_MAC_SIZE );
+}
+
+
+/** Allows or forbids the AES-NI and SHA-NI code (allowed by default), so the portable code can
+ *  be tested and compared on any CPU. Not thread safe: it must be called while the primitives
+ *  are not in use, and it only affects the AES contexts keyed afterwards.
+ *
+ *  \param allowed Whether the instructions are used when the CPU supports them.
+ */
+void zip_crypto_set_hw( bool allowed )
+{
+  _hw_allowed = allowed;
+}
+
+
+/** Fills a buffer with random bytes from the system.
+ *
+ *  \param buffer Output buffer.
+ *  \param buffer_len Bytes in \a buffer.
+ *  \return \c false on error.
+ */
+bool zip_random( void *buffer, size_t buffer_len )
+{
+  uint8_t *p = buffer;
+
+#if ZIP_CRYPTO_GETRANDOM
+  /* large requests may return less, or be interrupted by signals */
+  while( buffer_len > 0 )
+  {
+    ssize_t n = getrandom( p, buffer_len, 0 );
+    if( n < 0 && errno == EINTR )
+      continue;
+
+    /* kernels older than 3.17 fall back to the device */
+    if( n < 0 && errno == ENOSYS )
+      break;
+    if( n < 0 )
+      return false;
+
+    p += n;
+    buffer_len -= n;
+  }
+
+  if( buffer_len == 0 )
+    return true;
+#endif
+
+  int fd = open( "/dev/urandom", O_RDONLY | O_CLOEXEC );
+  if( fd < 0 )
+    return false;
+
+  while( buffer_len > 0 )
+  {
+    ssize_t n = read( fd, p, buffer_len );
+    if( n < 0 && errno == EINTR )
+      continue;
+    if( n <= 0 )
+      break;
+
+    p += n;
+    buffer_len -= n;
+  }
+
+  close( fd );
+  return ( buffer_len == 0 );
+}
@@ -0,0 +1,154 @@
+/**
+ * \file
+ * ZIP encryption primitives - Interface.
+ *
+ * SHA-1, HMAC-SHA1, PBKDF2 and AES-256 in CTR mode, as required by the WinZip AE-2 encryption
+ * of ZIP entries, and SHA-256 for the digests of the entries. AES and the hashes use the
+ * AES-NI and SHA-NI instructions when the CPU supports them, unless \a zip_crypto_set_hw forbids
+ * it.
+ */
+
+#ifndef ZIP_CRYPTO
+#define ZIP_CRYPTO
+
+/* include area */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*-----------------------------------------------------------------------------
+   Library definitions
+-----------------------------------------------------------------------------*/
+
+/** Size of a SHA-1 digest. */
+#define ZIP_SHA1_SIZE 20
+
+/** Size of a SHA-256 digest. */
+#define ZIP_SHA256_SIZE 32
+
+/** Size of an AES-256 key. */
+#define ZIP_AES_KEY_SIZE 32
+
+/** Size of the salt at the beginning of AES-256 encrypted entries. */
+#define ZIP_AES_SALT_SIZE 16
+
+/** Size of the password verifier after the salt. */
+#define ZIP_AES_VERIFIER_SIZE 2
+
+/** Bytes before the encrypted data of an entry (salt and password verifier). */
+#define ZIP_AES_HEADER_SIZE ( ZIP_AES_SALT_SIZE + ZIP_AES_VERIFIER_SIZE )
+
+/** Size of the authentication code after the encrypted data of an entry. */
+#define ZIP_AES_MAC_SIZE 10
+
+/** PBKDF2 iterations of the key derivation. */
+#define ZIP_AES_ITERATIONS 1000
+
+
+/*-----------------------------------------------------------------------------
+   Library data types
+-----------------------------------------------------------------------------*/
+
+/** SHA-1 context. */
+typedef struct
+{
+  /** Intermediate hash value. */
+  uint32_t h[5];
+
+  /** Bytes hashed. */
+  uint64_t len;
+
+  /** Data not hashed yet (less than a block). */
+  uint8_t block[64];
+
+} zip_sha1_t;
+
+/** SHA-256 context. */
+typedef struct
+{
+  /** Intermediate hash value. */
+  uint32_t h[8];
+
+  /** Bytes hashed. */
+  uint64_t len;
+
+  /** Data not hashed yet (less than a block). */
+  uint8_t block[64];
+
+} zip_sha256_t;
+
+/** HMAC-SHA1 context. Once initialized with a key, it can be copied to authenticate several
+ *  messages without hashing the key again. */
+typedef struct
+{
+  /** Hash of the inner padded key and the message. */
+  zip_sha1_t inner;
+
+  /** Hash of the outer padded key. */
+  zip_sha1_t outer;
+
+} zip_hmac_t;
+
+/** AES-256 CTR context of an encrypted entry, with the HMAC-SHA1 of its encrypted data. */
+typedef struct
+{
+  /** Expanded key. */
+  uint8_t round_keys[15][16];
+
+  /** Counter of the next keystream block (the first one is 1). */
+  uint64_t counter;
+
+  /** Keystream block partially used by the previous call. */
+  uint8_t keystream[16];
+
+  /** Bytes of \a keystream already used (16 when there are none left). */
+  size_t keystream_used;
+
+  /** Authentication of the encrypted data. */
+  zip_hmac_t mac;
+
+  /** Whether the AES-NI instructions are used. */
+  bool hw;
+
+} zip_aes_t;
+
+
+/*-----------------------------------------------------------------------------
+   Function prototypes
+-----------------------------------------------------------------------------*/
+
+/** SHA-1 */
+void zip_sha1_init( zip_sha1_t *s );
+void zip_sha1_update( zip_sha1_t *s, const void *data, size_t data_len );
+void zip_sha1_final( zip_sha1_t *s, uint8_t digest[ZIP_SHA1_SIZE] );
+
+/** SHA-256 */
+void zip_sha256_init( zip_sha256_t *s );
+void zip_sha256_update( zip_sha256_t *s, const void *data, size_t data_len );
+void zip_sha256_final( zip_sha256_t *s, uint8_t digest[ZIP_SHA256_SIZE] );
+
+/** HMAC-SHA1 and PBKDF2 */
+void zip_hmac_init( zip_hmac_t *h, const void *key, size_t key_len );
+void zip_hmac_update( zip_hmac_t *h, const void *data, size_t data_len );
+void zip_hmac_final( zip_hmac_t *h, uint8_t mac[ZIP_SHA1_SIZE] );
+void zip_pbkdf2( const zip_hmac_t *password, const uint8_t *salt, size_t salt_len, unsigned iterations,
+                 uint8_t *output, size_t output_len );
+
+/** AES-256 */
+void zip_aes_set_key( zip_aes_t *aes, const uint8_t key[ZIP_AES_KEY_SIZE] );
+void zip_aes_block( const zip_aes_t *aes, const uint8_t input[16], uint8_t output[16] );
+
+/** WinZip AE-2 entries */
+bool zip_aes_start( zip_aes_t *aes, const zip_hmac_t *password, uint8_t header[ZIP_AES_HEADER_SIZE] );
+bool zip_aes_open( zip_aes_t *aes, const zip_hmac_t *password, const uint8_t header[ZIP_AES_HEADER_SIZE] );
+void zip_aes_encrypt( zip_aes_t *aes, uint8_t *data, size_t data_len );
+void zip_aes_decrypt( zip_aes_t *aes, uint8_t *data, size_t data_len );
+void zip_aes_finish( zip_aes_t *aes, uint8_t mac[ZIP_AES_MAC_SIZE] );
+
+/** Miscellaneous */
+void zip_crypto_set_hw( bool allowed );
+bool zip_random( void *buffer, size_t buffer_len );
+
+
+#endif
@@ -0,0 +1,477 @@
+/**
+ * \file
+ * ZIP directory ingestion - Implementation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+/* include area */
+#include "zip_dir.h"
+#include "varray.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/*-----------------------------------------------------------------------------
+   Internal data types
+-----------------------------------------------------------------------------*/
+
+/** A file found in the tree. */
+struct zip_dir_file
+{
+  /** Path relative to the root, which is the entry name. */
+  char *path;
+
+  /** Opened file (-1 until it's prefetched). */
+  int fd;
+
+  /** First bytes of the file, reused to read the rest. */
+  uint8_t *chunk;
+
+  /** Bytes in \a chunk. */
+  size_t chunk_len;
+
+  /** Modification time. */
+  struct zip_datetime datetime;
+
+  /** Whether a reader finished prefetching the file. */
+  bool ready;
+
+  /** Whether prefetching the file failed. */
+  bool failed;
+};
+
+/** State shared by the readers and the compressing thread. */
+struct zip_dir_job
+{
+  /** Root directory, every path is relative to it. */
+  int root_fd;
+
+  /** Guards the fields below. */
+  pthread_mutex_t lock;
+
+  /** Signaled when directories are queued, files are prefetched or compressed, or on errors. */
+  pthread_cond_t changed;
+
+  /** \a varray of directories waiting to be listed. */
+  char **dirs;
+
+  /** Readers listing a directory. */
+  size_t listing;
+
+  /** \a varray of files found. */
+  struct zip_dir_file *files;
+
+  /** Index of the next file to prefetch. */
+  size_t next_read;
+
+  /** Index of the file being compressed. */
+  size_t next_add;
+
+  /** Maximum files prefetched ahead of \a next_add. */
+  size_t prefetch;
+
+  /** Whether the ingestion failed (the readers stop). */
+  bool failed;
+};
+
+
+/*-----------------------------------------------------------------------------
+   Helper functions
+-----------------------------------------------------------------------------*/
+
+/** Joins a directory path and a name.
+ *
+ *  \param dir Directory path relative to the root (empty for the root).
+ *  \param name Name in the directory.
+ *  \return The new path (released by the caller), \c NULL on error.
+ */
+static char *_join( const char *dir, const char *name )
+{
+  size_t dir_len = strlen( dir );
+  size_t name_len = strlen( name );
+  char *path = malloc( dir_len + name_len + 2 );
+  if( path == NULL )
+    return NULL;
+
+  memcpy( path, dir, dir_len );
+  if( dir_len > 0 )
+    path[dir_len++] = '/';
+  memcpy( path + dir_len, name, name_len + 1 );
+  return path;
+}
+
+
+/** Lists a directory, queueing its subdirectories and adding its regular files.
+ *
+ *  \param job Ingestion job.
+ *  \param dir Directory path relative to the root.
+ *  \return \c false on error.
+ */
+static bool _list( struct zip_dir_job *job, const char *dir )
+{
+  int fd = openat( job->root_fd, ( dir[0] != '\0' ) ? dir : ".", O_RDONLY | O_DIRECTORY );
+  DIR *d = ( fd >= 0 ) ? fdopendir( fd ) : NULL;
+  if( d == NULL )
+  {
+    if( fd >= 0 )
+      close( fd );
+    return false;
+  }
+
+  bool rv = true;
+  struct dirent *e;
+  while( rv && ( e = readdir( d ) ) != NULL )
+  {
+    if( strcmp( e->d_name, "." ) == 0 || strcmp( e->d_name, ".." ) == 0 )
+      continue;
+
+    /* symbolic links are not followed, and files removed meanwhile are skipped */
+    struct stat st;
+    char *path = _join( dir, e->d_name );
+    bool found = ( path != NULL && fstatat( job->root_fd, path, &st, AT_SYMLINK_NOFOLLOW ) == 0 );
+    rv = ( path != NULL && ( found || errno == ENOENT ) );
+    if( !found || !( S_ISDIR( st.st_mode ) || S_ISREG( st.st_mode ) ) )
+    {
+      free( path );
+      continue;
+    }
+
+    pthread_mutex_lock( &job->lock );
+    if( S_ISDIR( st.st_mode ) )
+    {
+      varray_push( job->dirs, path );
+      pthread_cond_signal( &job->changed );
+    }
+    else
+    {
+      struct zip_dir_file file = { .path = path, .fd = -1 };
+      varray_push( job->files, file );
+    }
+    pthread_mutex_unlock( &job->lock );
+  }
+
+  closedir( d );
+  return rv;
+}
+
+
+/** Reader thread listing directories until every one was listed.
+ *
+ *  \param arg Ingestion job.
+ *  \return \c NULL.
+ */
+static void *_list_worker( void *arg )
+{
+  struct zip_dir_job *job = arg;
+
+  pthread_mutex_lock( &job->lock );
+  for( ;; )
+  {
+    /* the tree is done once no directory is queued nor being listed */
+    while( !job->failed && varray_len( job->dirs ) == 0 && job->listing > 0 )
+      pthread_cond_wait( &job->changed, &job->lock );
+    if( job->failed || varray_len( job->dirs ) == 0 )
+      break;
+
+    char *dir = varray_pop( job->dirs );
+    job->listing++;
+    pthread_mutex_unlock( &job->lock );
+
+    bool rv = _list( job, dir );
+    free( dir );
+
+    pthread_mutex_lock( &job->lock );
+    job->listing--;
+    job->failed |= !rv;
+    if( job->failed || job->listing == 0 )
+      pthread_cond_broadcast( &job->changed );
+  }
+  pthread_mutex_unlock( &job->lock );
+
+  return NULL;
+}
+
+
+/** Reads from a file until a buffer is full or the file ends.
+ *
+ *  \param fd File descriptor.
+ *  \param buffer Output buffer.
+ *  \param size Size of \a buffer.
+ *  \return Bytes read (less than \a size at the end of the file), -1 on error.
+ */
+static ssize_t _read_full( int fd, uint8_t *buffer, size_t size )
+{
+  size_t len = 0;
+  while( len < size )
+  {
+    ssize_t n = read( fd, buffer + len, size - len );
+    if( n < 0 && errno != EINTR )
+      return -1;
+    if( n == 0 )
+      break;
+    if( n > 0 )
+      len += n;
+  }
+
+  return len;
+}
+
+
+/** Opens a file and reads its first chunk, asking the kernel to read ahead the rest.
+ *
+ *  \param job Ingestion job.
+ *  \param file File to prefetch (owned by the calling reader until it's ready).
+ *  \return \c false on error.
+ */
+static bool _prefetch( struct zip_dir_job *job, struct zip_dir_file *file )
+{
+  struct stat st;
+  struct tm tm;
+  file->fd = openat( job->root_fd, file->path, O_RDONLY );
+  if( file->fd < 0 || fstat( file->fd, &st ) != 0 || localtime_r( &st.st_mtime, &tm ) == NULL )
+    return false;
+
+  file->datetime = ( struct zip_datetime ){
+    .year = tm.tm_year + 1900,
+    .month = tm.tm_mon + 1,
+    .day = tm.tm_mday,
+    .hours = tm.tm_hour,
+    .minutes = tm.tm_min,
+    .seconds = tm.tm_sec,
+  };
+
+  /* only a hint, it's fine if the filesystem ignores it */
+  posix_fadvise( file->fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+  posix_fadvise( file->fd, 0, 0, POSIX_FADV_WILLNEED );
+
+  file->chunk = malloc( ZIP_DIR_CHUNK_SIZE );
+  ssize_t n = ( file->chunk != NULL ) ? _read_full( file->fd, file->chunk, ZIP_DIR_CHUNK_SIZE ) : -1;
+  if( n < 0 )
+    return false;
+
+  file->chunk_len = n;
+  return true;
+}
+
+
+/** Reader thread prefetching the files, at most \a prefetch ahead of the one being compressed.
+ *
+ *  \param arg Ingestion job.
+ *  \return \c NULL.
+ */
+static void *_read_worker( void *arg )
+{
+  struct zip_dir_job *job = arg;
+
+  pthread_mutex_lock( &job->lock );
+  for( ;; )
+  {
+    while( !job->failed && job->next_read < varray_len( job->files ) &&
+           job->next_read >= job->next_add + job->prefetch )
+      pthread_cond_wait( &job->changed, &job->lock );
+    if( job->failed || job->next_read >= varray_len( job->files ) )
+      break;
+
+    struct zip_dir_file *file = &job->files[job->next_read++];
+    pthread_mutex_unlock( &job->lock );
+
+    bool rv = _prefetch( job, file );
+
+    pthread_mutex_lock( &job->lock );
+    file->ready = true;
+    file->failed = !rv;
+    pthread_cond_broadcast( &job->changed );
+  }
+  pthread_mutex_unlock( &job->lock );
+
+  return NULL;
+}
+
+
+/** Compresses a prefetched file into a new entry.
+ *
+ *  \param z ZIP context.
+ *  \param file Prefetched file.
+ *  \return \c false on error.
+ */
+static bool _add_file( zip_t *z, struct zip_dir_file *file )
+{
+  if( !zip_entry_add( z, file->path, file->datetime ) )
+    return false;
+
+  /* the rest is likely in the page cache already, the chunk buffer is reused for it */
+  size_t len = file->chunk_len;
+  while( len > 0 )
+  {
+    if( !zip_entry_update( z, file->chunk, len ) )
+      return false;
+
+    ssize_t n = ( len == ZIP_DIR_CHUNK_SIZE ) ? _read_full( file->fd, file->chunk, ZIP_DIR_CHUNK_SIZE ) : 0;
+    if( n < 0 )
+      return false;
+    len = n;
+  }
+
+  return zip_entry_end( z );
+}
+
+
+/** Compares two files by path, for \a qsort.
+ *
+ *  \param a First file.
+ *  \param b Second file.
+ *  \return Result of \a strcmp on the paths.
+ */
+static int _compare_files( const void *a, const void *b )
+{
+  return strcmp( ( ( const struct zip_dir_file * )a )->path, ( ( const struct zip_dir_file * )b )->path );
+}
+
+
+/** Starts the reader threads.
+ *
+ *  \param job Ingestion job.
+ *  \param num_readers Number of threads.
+ *  \param worker Thread function.
+ *  \param threads Output thread handles (\a num_readers).
+ *  \return Number of threads started.
+ */
+static size_t _start( struct zip_dir_job *job, size_t num_readers, void *( *worker )( void * ), pthread_t *threads )
+{
+  size_t started = 0;
+  while( started < num_readers && pthread_create( &threads[started], NULL, worker, job ) == 0 )
+    started++;
+
+  /* fewer threads work too, none does not */
+  if( started == 0 )
+  {
+    pthread_mutex_lock( &job->lock );
+    job->failed = true;
+    pthread_mutex_unlock( &job->lock );
+  }
+
+  return started;
+}
+
+
+/*-----------------------------------------------------------------------------
+   Public functions
+-----------------------------------------------------------------------------*/
+
+/** Initializes the directory ingestion options with the defaults.
+ *
+ *  \param opts Options to initialize.
+ */
+void zip_dir_options_init( zip_dir_options_t *opts )
+{
+  opts->num_readers = 4;
+  opts->prefetch = 16;
+  opts->sorted = false;
+}
+
+
+/** Adds every regular file in a directory tree to the ZIP archive, named by its path relative
+ *  to \a root (directories without files and symbolic links are skipped). The entries get the
+ *  modification times of the files. No entry can be in process.
+ *
+ *  \param z ZIP context.
+ *  \param root Directory to add.
+ *  \param opts Options (\c NULL for the defaults).
+ *  \return \c false on error.
+ */
+bool zip_add_directory( zip_t *z, const char *root, const zip_dir_options_t *opts )
+{
+  zip_dir_options_t default_opts;
+  if( opts == NULL )
+  {
+    zip_dir_options_init( &default_opts );
+    opts = &default_opts;
+  }
+
+  if( z->entry_opened || opts->num_readers == 0 || opts->prefetch == 0 )
+    return false;
+
+  struct zip_dir_job job = { .prefetch = opts->prefetch };
+  job.root_fd = open( root, O_RDONLY | O_DIRECTORY );
+  pthread_t *threads = malloc( opts->num_readers * sizeof( pthread_t ) );
+  if( job.root_fd < 0 || threads == NULL )
+  {
+    if( job.root_fd >= 0 )
+      close( job.root_fd );
+    free( threads );
+    return false;
+  }
+
+  pthread_mutex_init( &job.lock, NULL );
+  pthread_cond_init( &job.changed, NULL );
+  varray_init( job.dirs, 16 );
+  varray_init( job.files, 64 );
+  varray_push( job.dirs, _join( "", "" ) );
+
+  /* lists the whole tree first, so the files can be sorted */
+  size_t started = _start( &job, opts->num_readers, _list_worker, threads );
+  for( size_t i = 0; i < started; i++ )
+    pthread_join( threads[i], NULL );
+
+  if( !job.failed && opts->sorted )
+    qsort( job.files, varray_len( job.files ), sizeof( job.files[0] ), _compare_files );
+
+  /* compresses each file as soon as it's prefetched */
+  started = job.failed ? 0 : _start( &job, opts->num_readers, _read_worker, threads );
+  for( size_t i = 0; i < varray_len( job.files ) && !job.failed; i++ )
+  {
+    struct zip_dir_file *file = &job.files[i];
+    pthread_mutex_lock( &job.lock );
+    while( !file->ready && !job.failed )
+      pthread_cond_wait( &job.changed, &job.lock );
+    pthread_mutex_unlock( &job.lock );
+
+    bool rv = !job.failed && !file->failed && _add_file( z, file );
+
+    /* the slot of the file is given to the readers */
+    if( file->fd >= 0 )
+      close( file->fd );
+    free( file->chunk );
+    file->fd = -1;
+    file->chunk = NULL;
+
+    pthread_mutex_lock( &job.lock );
+    job.next_add = i + 1;
+    job.failed |= !rv;
+    pthread_cond_broadcast( &job.changed );
+    pthread_mutex_unlock( &job.lock );
+  }
+
+  for( size_t i = 0; i < started; i++ )
+    pthread_join( threads[i], NULL );
+
+  /* files prefetched after an error */
+  for( size_t i = 0; i < varray_len( job.files ); i++ )
+  {
+    if( job.files[i].fd >= 0 )
+      close( job.files[i].fd );
+    free( job.files[i].chunk );
+    free( job.files[i].path );
+  }
+
+  for( size_t i = 0; i < varray_len( job.dirs ); i++ )
+    free( job.dirs[i] );
+
+  bool rv = !job.failed;
+  varray_release( job.files );
+  varray_release( job.dirs );
+  pthread_cond_destroy( &job.changed );
+  pthread_mutex_destroy( &job.lock );
+  close( job.root_fd );
+  free( threads );
+
+  return rv;
+}
@@ -0,0 +1,58 @@
+/**
+ * \file
+ * ZIP directory ingestion - Interface.
+ *
+ * Adds every regular file of a directory tree to a \a zip_t. A pool of reader threads lists the
+ * directories in parallel, then opens and reads ahead the next files while the current one is
+ * compressed, so slow or networked filesystems don't stall deflate.
+ */
+
+#ifndef ZIP_DIR
+#define ZIP_DIR
+
+/* include area */
+#include "zip.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+
+/*-----------------------------------------------------------------------------
+   Library definitions
+-----------------------------------------------------------------------------*/
+
+/** Bytes read ahead from each prefetched file (the rest is read while it's compressed). */
+#ifndef ZIP_DIR_CHUNK_SIZE
+#  define ZIP_DIR_CHUNK_SIZE ( 256 << 10 )
+#endif
+
+
+/*-----------------------------------------------------------------------------
+   Library data types
+-----------------------------------------------------------------------------*/
+
+/** Directory ingestion options (see \a zip_dir_options_init for the defaults). */
+typedef struct
+{
+  /** Threads listing directories and reading files (4 by default). */
+  size_t num_readers;
+
+  /** Files opened and read ahead of the one being compressed (16 by default). Each one takes
+   *  up to \a ZIP_DIR_CHUNK_SIZE bytes of memory. */
+  size_t prefetch;
+
+  /** Whether the entries are added sorted by name. Otherwise they are added in the order the
+   *  readers find them, which can change between runs. */
+  bool sorted;
+
+} zip_dir_options_t;
+
+
+/*-----------------------------------------------------------------------------
+   Function prototypes
+-----------------------------------------------------------------------------*/
+
+void zip_dir_options_init( zip_dir_options_t *opts );
+bool zip_add_directory( zip_t *z, const char *root, const zip_dir_options_t *opts );
+
+
+#endif
@@ -0,0 +1,583 @@
+/**
+ * \file
+ * ZIP random access reader - Implementation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+/* include area */
+#include "string.h"
+#include "zip_map.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/*-----------------------------------------------------------------------------
+   Definitions
+-----------------------------------------------------------------------------*/
+
+/** Local file header signature. */
+#define ZIP_MAP_LOCAL_HEADER_SIG 0x04034b50U
+
+/** Central directory file header signature. */
+#define ZIP_MAP_CENTRAL_DIR_SIG 0x02014b50U
+
+/** End of central directory record signature. */
+#define ZIP_MAP_EOCD_SIG 0x06054b50U
+
+/** ZIP64 end of central directory record signature. */
+#define ZIP_MAP_EOCD64_SIG 0x06064b50U
+
+/** ZIP64 end of central directory locator signature. */
+#define ZIP_MAP_EOCD64_LOCATOR_SIG 0x07064b50U
+
+/** Fixed size of the local file header (without name and extra field). */
+#define ZIP_MAP_LOCAL_HEADER_SIZE 30
+
+/** Fixed size of the central directory file header (without variable fields). */
+#define ZIP_MAP_CENTRAL_DIR_SIZE 46
+
+/** Fixed size of the end of central directory record (without comment). */
+#define ZIP_MAP_EOCD_SIZE 22
+
+/** Size of the ZIP64 end of central directory locator. */
+#define ZIP_MAP_EOCD64_LOCATOR_SIZE 20
+
+/** Fixed size of the ZIP64 end of central directory record. */
+#define ZIP_MAP_EOCD64_SIZE 56
+
+
+/** Reads a 16 bit little-endian integer.
+ *
+ *  \param p Input bytes.
+ *  \return The number.
+ */
+static uint16_t _read16_le( const uint8_t *p )
+{
+  return ( uint16_t )( p[0] | ( p[1] << 8 ) );
+}
+
+
+/** Reads a 32 bit little-endian integer.
+ *
+ *  \param p Input bytes.
+ *  \return The number.
+ */
+static uint32_t _read32_le( const uint8_t *p )
+{
+  return ( uint32_t )p[0] | ( ( uint32_t )p[1] << 8 ) | ( ( uint32_t )p[2] << 16 ) |
+         ( ( uint32_t )p[3] << 24 );
+}
+
+
+/** Reads a 64 bit little-endian integer.
+ *
+ *  \param p Input bytes.
+ *  \return The number.
+ */
+static uint64_t _read64_le( const uint8_t *p )
+{
+  return ( uint64_t )_read32_le( p ) | ( ( uint64_t )_read32_le( p + 4 ) << 32 );
+}
+
+
+/** Hashes an entry name (32 bit FNV-1a).
+ *
+ *  \param name Entry name.
+ *  \param name_len Length of \a name.
+ *  \return Hash value.
+ */
+static uint32_t _hash( const char *name, size_t name_len )
+{
+  uint32_t h = 2166136261U;
+  for( size_t i = 0; i < name_len; i++ )
+  {
+    h ^= ( uint8_t )name[i];
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+
+/** Finds the central directory location.
+ *
+ *  \param m Mapped archive.
+ *  \param num_entries Output number of entries.
+ *  \param cd_size Output central directory size.
+ *  \return \c false if the archive is not valid.
+ */
+static bool _find_central_dir( zip_map_t *m, uint64_t *num_entries, uint64_t *cd_size )
+{
+  if( m->size < ZIP_MAP_EOCD_SIZE )
+    return false;
+
+  /* the EOCD is at the end, only followed by a comment of up to 64 KiB */
+  size_t min_offset = ( m->size > ZIP_MAP_EOCD_SIZE + 0xffffU ) ? m->size - ZIP_MAP_EOCD_SIZE - 0xffffU : 0;
+  size_t eocd = m->size - ZIP_MAP_EOCD_SIZE;
+  while( _read32_le( m->data + eocd ) != ZIP_MAP_EOCD_SIG ||
+         eocd + ZIP_MAP_EOCD_SIZE + _read16_le( m->data + eocd + 20 ) > m->size )
+  {
+    if( eocd == min_offset )
+      return false;
+    eocd--;
+  }
+
+  *num_entries = _read16_le( m->data + eocd + 10 );
+  *cd_size = _read32_le( m->data + eocd + 12 );
+  m->central_dir_offset = _read32_le( m->data + eocd + 16 );
+  m->comment_len = _read16_le( m->data + eocd + 20 );
+  m->comment = m->data + eocd + ZIP_MAP_EOCD_SIZE;
+
+  /* looks for the ZIP64 records right before the EOCD */
+  if( eocd >= ZIP_MAP_EOCD64_LOCATOR_SIZE )
+  {
+    const uint8_t *locator = m->data + eocd - ZIP_MAP_EOCD64_LOCATOR_SIZE;
+    if( _read32_le( locator ) == ZIP_MAP_EOCD64_LOCATOR_SIG )
+    {
+      uint64_t eocd64 = _read64_le( locator + 8 );
+      if( m->size < ZIP_MAP_EOCD64_SIZE || eocd64 > m->size - ZIP_MAP_EOCD64_SIZE ||
+          _read32_le( m->data + eocd64 ) != ZIP_MAP_EOCD64_SIG )
+        return false;
+
+      *num_entries = _read64_le( m->data + eocd64 + 32 );
+      *cd_size = _read64_le( m->data + eocd64 + 40 );
+      m->central_dir_offset = _read64_le( m->data + eocd64 + 48 );
+    }
+  }
+
+  return m->central_dir_offset <= m->size && *cd_size <= m->size - m->central_dir_offset;
+}
+
+
+/** Parses a central directory record.
+ *
+ *  \param record Central directory record.
+ *  \param end End of the central directory.
+ *  \param entry Output entry.
+ *  \return Size of the record or 0 on error.
+ */
+static size_t _parse_cd_record( const uint8_t *record, const uint8_t *end, zip_map_entry_t *entry )
+{
+  if( record + ZIP_MAP_CENTRAL_DIR_SIZE > end || _read32_le( record ) != ZIP_MAP_CENTRAL_DIR_SIG )
+    return 0;
+
+  size_t name_len = _read16_le( record + 28 );
+  size_t extra_len = _read16_le( record + 30 );
+  size_t comment_len = _read16_le( record + 32 );
+  size_t record_len = ZIP_MAP_CENTRAL_DIR_SIZE + name_len + extra_len + comment_len;
+  if( record + record_len > end )
+    return 0;
+
+  entry->flags = _read16_le( record + 8 );
+  entry->method = _read16_le( record + 10 );
+  entry->time = _read16_le( record + 12 );
+  entry->date = _read16_le( record + 14 );
+  entry->crc = _read32_le( record + 16 );
+  entry->size_compressed = _read32_le( record + 20 );
+  entry->size = _read32_le( record + 24 );
+  entry->offset = _read32_le( record + 42 );
+  entry->name = ( const char * )record + ZIP_MAP_CENTRAL_DIR_SIZE;
+  entry->name_len = name_len;
+  entry->hash = _hash( entry->name, name_len );
+  entry->aes_version = 0;
+  entry->aes_strength = 0;
+  entry->aes_method = 0;
+
+  /* the ZIP64 extended information holds the fields that didn't fit in 32 bits */
+  const uint8_t *extra = record + ZIP_MAP_CENTRAL_DIR_SIZE + name_len;
+  const uint8_t *extra_end = extra + extra_len;
+  while( extra + 4 <= extra_end )
+  {
+    uint16_t id = _read16_le( extra );
+    const uint8_t *field = extra + 4;
+    const uint8_t *field_end = field + _read16_le( extra + 2 );
+    if( field_end > extra_end )
+      return 0;
+
+    if( id == 0x0001U )
+    {
+      uint64_t *values[] = { &entry->size, &entry->size_compressed, &entry->offset };
+      for( size_t i = 0; i < sizeof( values ) / sizeof( values[0] ); i++ )
+      {
+        if( *values[i] != 0xffffffffU )
+          continue;
+        if( field + 8 > field_end )
+          return 0;
+        *values[i] = _read64_le( field );
+        field += 8;
+      }
+    }
+    else if( id == 0x9901U && field + 7 <= field_end )
+    {
+      /* the AES extra field holds the real compression method */
+      entry->aes_version = _read16_le( field );
+      entry->aes_strength = field[4];
+      entry->aes_method = _read16_le( field + 5 );
+    }
+
+    extra = field_end;
+  }
+
+  return record_len;
+}
+
+
+/** Builds the hash index over the entries.
+ *
+ *  \param m Mapped archive.
+ *  \return \c false on error.
+ */
+static bool _build_index( zip_map_t *m )
+{
+  /* keeps the load factor under 0.5 */
+  size_t num_slots = 1;
+  while( num_slots < m->num_entries * 2 )
+    num_slots *= 2;
+
+  m->index = calloc( num_slots, sizeof( *m->index ) );
+  if( m->index == NULL )
+    return false;
+  m->index_mask = num_slots - 1;
+
+  for( size_t i = 0; i < m->num_entries; i++ )
+  {
+    /* linear probing, duplicated names keep the first entry */
+    size_t slot = m->entries[i].hash & m->index_mask;
+    while( m->index[slot] != 0 )
+      slot = ( slot + 1 ) & m->index_mask;
+
+    m->index[slot] = i + 1;
+  }
+
+  return true;
+}
+
+
+/** Gets the location of the data of an entry.
+ *
+ *  \param m Mapped archive.
+ *  \param entry Entry.
+ *  \return Pointer to the entry data or \c NULL on error.
+ */
+static const uint8_t *_entry_data( const zip_map_t *m, const zip_map_entry_t *entry )
+{
+  if( m->size < ZIP_MAP_LOCAL_HEADER_SIZE || entry->offset > m->size - ZIP_MAP_LOCAL_HEADER_SIZE )
+    return NULL;
+
+  const uint8_t *header = m->data + entry->offset;
+  if( _read32_le( header ) != ZIP_MAP_LOCAL_HEADER_SIG )
+    return NULL;
+
+  /* the local name and extra field lengths may differ from the central directory ones */
+  uint64_t data_offset = entry->offset + ZIP_MAP_LOCAL_HEADER_SIZE + _read16_le( header + 26 ) +
+                         _read16_le( header + 28 );
+  if( data_offset > m->size || entry->size_compressed > m->size - data_offset )
+    return NULL;
+
+  return m->data + data_offset;
+}
+
+
+/** Opens an archive given its path.
+ *
+ *  \param m Mapped archive to initialize.
+ *  \param path Archive path.
+ *  \return \c false on error.
+ */
+bool zip_map_open( zip_map_t *m, const char *path )
+{
+  int fd = open( path, O_RDONLY );
+  if( fd < 0 )
+    return false;
+
+  if( !zip_map_open_fd( m, fd ) )
+  {
+    close( fd );
+    return false;
+  }
+
+  m->owns_fd = true;
+  return true;
+}
+
+
+/** Opens an archive given an open file descriptor. The descriptor is not closed by
+ *  \a zip_map_close and must remain open until then.
+ *
+ *  \param m Mapped archive to initialize.
+ *  \param fd Archive file descriptor (must be readable).
+ *  \return \c false on error.
+ */
+bool zip_map_open_fd( zip_map_t *m, int fd )
+{
+  struct stat st;
+  if( fstat( fd, &st ) != 0 || st.st_size < ZIP_MAP_EOCD_SIZE )
+    return false;
+
+  void *data = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  if( data == MAP_FAILED )
+    return false;
+
+  m->fd = fd;
+  m->owns_fd = false;
+  m->data = data;
+  m->size = st.st_size;
+  m->entries = NULL;
+  m->index = NULL;
+  m->num_entries = 0;
+
+  uint64_t num_entries = 0;
+  uint64_t cd_size = 0;
+  if( !_find_central_dir( m, &num_entries, &cd_size ) )
+    goto error;
+
+  /* every record takes at least its fixed size */
+  if( num_entries > cd_size / ZIP_MAP_CENTRAL_DIR_SIZE )
+    goto error;
+
+  m->entries = malloc( ( num_entries ? num_entries : 1 ) * sizeof( *m->entries ) );
+  if( m->entries == NULL )
+    goto error;
+
+  /* parses the central directory */
+  const uint8_t *record = m->data + m->central_dir_offset;
+  const uint8_t *end = record + cd_size;
+  for( ; m->num_entries < num_entries; m->num_entries++ )
+  {
+    size_t record_len = _parse_cd_record( record, end, &m->entries[m->num_entries] );
+    if( record_len == 0 )
+      goto error;
+    record += record_len;
+  }
+
+  if( !_build_index( m ) )
+    goto error;
+
+  return true;
+
+error:
+  free( m->entries );
+  munmap( ( void * )m->data, m->size );
+  return false;
+}
+
+
+/** Unmaps an archive and releases its resources.
+ *
+ *  \param m Mapped archive.
+ */
+void zip_map_close( zip_map_t *m )
+{
+  free( m->index );
+  free( m->entries );
+  munmap( ( void * )m->data, m->size );
+
+  if( m->owns_fd )
+    close( m->fd );
+
+  m->data = NULL;
+  m->fd = -1;
+}
+
+
+/** Returns the number of entries in the archive.
+ *
+ *  \param m Mapped archive.
+ *  \return Number of entries.
+ */
+size_t zip_map_num_entries( const zip_map_t *m )
+{
+  return m->num_entries;
+}
+
+
+/** Returns an entry given its index.
+ *
+ *  \param m Mapped archive.
+ *  \param index Entry index (central directory order).
+ *  \return The entry or \c NULL if the index is out of range.
+ */
+const zip_map_entry_t *zip_map_entry( const zip_map_t *m, size_t index )
+{
+  return ( index < m->num_entries ) ? &m->entries[index] : NULL;
+}
+
+
+/** Looks for an entry by name.
+ *
+ *  \param m Mapped archive.
+ *  \param name Entry name.
+ *  \param index Output entry index.
+ *  \return \c false if there's no entry with such name.
+ */
+bool zip_map_find( const zip_map_t *m, const char *name, size_t *index )
+{
+  size_t name_len = strlen( name );
+  uint32_t hash = _hash( name, name_len );
+
+  for( size_t slot = hash & m->index_mask; m->index[slot] != 0; slot = ( slot + 1 ) & m->index_mask )
+  {
+    const zip_map_entry_t *entry = &m->entries[m->index[slot] - 1];
+    if( entry->hash == hash && entry->name_len == name_len &&
+        memcmp( entry->name, name, name_len ) == 0 )
+    {
+      *index = m->index[slot] - 1;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+/** Gets the compressed data of an entry without copying it.
+ *
+ *  \param m Mapped archive.
+ *  \param index Entry index.
+ *  \param data Output pointer to the data (inside the mapping).
+ *  \param data_len Output size of \a data.
+ *  \return \c false on error.
+ */
+bool zip_map_get_raw( const zip_map_t *m, size_t index, const uint8_t **data, size_t *data_len )
+{
+  const zip_map_entry_t *entry = zip_map_entry( m, index );
+  if( entry == NULL )
+    return false;
+
+  *data = _entry_data( m, entry );
+  *data_len = entry->size_compressed;
+  return *data != NULL;
+}
+
+
+/** Gets the data of a STORED entry without copying it.
+ *
+ *  \param m Mapped archive.
+ *  \param index Entry index.
+ *  \param data Output pointer to the data (inside the mapping).
+ *  \param data_len Output size of \a data.
+ *  \return \c false on error or if the entry is compressed (see \a zip_map_stream_open).
+ */
+bool zip_map_get_stored( const zip_map_t *m, size_t index, const uint8_t **data, size_t *data_len )
+{
+  const zip_map_entry_t *entry = zip_map_entry( m, index );
+  if( entry == NULL || entry->method != 0U || ( entry->flags & 1U ) ||
+      entry->size != entry->size_compressed )
+    return false;
+
+  return zip_map_get_raw( m, index, data, data_len );
+}
+
+
+/** Prepares a stream to read the uncompressed data of an entry.
+ *
+ *  \param m Mapped archive.
+ *  \param index Entry index.
+ *  \param s Stream to initialize.
+ *  \return \c false on error.
+ */
+bool zip_map_stream_open( const zip_map_t *m, size_t index, zip_map_stream_t *s )
+{
+  const zip_map_entry_t *entry = zip_map_entry( m, index );
+  if( entry == NULL || ( entry->flags & 1U ) || ( entry->method != 0U && entry->method != 8U ) )
+    return false;
+
+  const uint8_t *data = _entry_data( m, entry );
+  if( data == NULL )
+    return false;
+
+  s->entry = entry;
+  s->next = data;
+  s->remaining = entry->size_compressed;
+  s->crc = crc32( 0, Z_NULL, 0 );
+  s->size = 0;
+  s->finished = false;
+
+  /* initializes the stream */
+  s->stream.opaque = Z_NULL;
+  s->stream.zalloc = Z_NULL;
+  s->stream.zfree = Z_NULL;
+  s->stream.next_in = ( Bytef * )data;
+  s->stream.avail_in = 0;
+
+  return inflateInit2( &s->stream, -15 ) == Z_OK;
+}
+
+
+/** Reads uncompressed data from an entry.
+ *
+ *  \param s Entry stream.
+ *  \param buffer Output buffer.
+ *  \param buffer_len Size of \a buffer.
+ *  \param read_len Output number of bytes written to \a buffer (0 at the end of the entry, or
+ *         if \a buffer_len is 0).
+ *  \return \c false on error (including a CRC or size mismatch at the end of the entry).
+ */
+bool zip_map_stream_read( zip_map_stream_t *s, void *buffer, size_t buffer_len, size_t *read_len )
+{
+  *read_len = 0;
+
+  /* an empty buffer reads nothing, which must not be taken for the end of the entry */
+  if( s->finished || buffer_len == 0 )
+    return true;
+
+  if( s->entry->method == 0U )
+  {
+    size_t n = ( s->remaining < buffer_len ) ? s->remaining : buffer_len;
+    memcpy( buffer, s->next, n );
+    s->next += n;
+    s->remaining -= n;
+    *read_len = n;
+  }
+  else
+  {
+    s->stream.next_out = buffer;
+    s->stream.avail_out = buffer_len;
+
+    /* zlib takes at most 4 GiB of input per call */
+    do
+    {
+      if( s->stream.avail_in == 0 && s->remaining > 0 )
+      {
+        uInt n = ( s->remaining > 0xffffffffU ) ? 0xffffffffU : ( uInt )s->remaining;
+        s->stream.avail_in = n;
+        s->remaining -= n;
+      }
+
+      int ret = inflate( &s->stream, Z_NO_FLUSH );
+      if( ret == Z_STREAM_END )
+        break;
+      if( ret != Z_OK )
+        return false;
+    } while( s->stream.avail_out > 0 );
+
+    *read_len = buffer_len - s->stream.avail_out;
+  }
+
+  s->crc = crc32( s->crc, buffer, *read_len );
+  s->size += *read_len;
+
+  /* checks the CRC and size once all the data was read */
+  if( *read_len == 0 || ( s->entry->method == 0U && s->remaining == 0 ) )
+  {
+    s->finished = true;
+    if( s->crc != s->entry->crc || s->size != s->entry->size )
+      return false;
+  }
+
+  return true;
+}
+
+
+/** Releases the resources of an entry stream.
+ *
+ *  \param s Entry stream.
+ */
+void zip_map_stream_close( zip_map_stream_t *s )
+{
+  inflateEnd( &s->stream );
+}
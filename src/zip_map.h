@@ -0,0 +1,160 @@
+/**
+ * \file
+ * ZIP random access reader - Interface.
+ *
+ * Maps an archive in memory and builds a hash index over its central directory, so entries can
+ * be looked up by name in constant time. Names are not copied: they point into the mapping.
+ *
+ * Once opened, a \a zip_map_t is never modified, so it can be shared by many threads as long as
+ * each of them uses its own \a zip_map_stream_t to inflate entries.
+ */
+
+#ifndef ZIP_MAP
+#define ZIP_MAP
+
+/* include area */
+#include "zlib.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*-----------------------------------------------------------------------------
+   Library data types
+-----------------------------------------------------------------------------*/
+
+/** Central directory information of an entry. */
+typedef struct
+{
+  /** Entry name (NOT null terminated, points into the mapped archive). */
+  const char *name;
+
+  /** Length of \a name. */
+  uint16_t name_len;
+
+  /** General purpose bit flag. */
+  uint16_t flags;
+
+  /** Compression method. */
+  uint16_t method;
+
+  /** Entry's time in MS-DOS format. */
+  uint16_t time;
+
+  /** Entry's date in MS-DOS format. */
+  uint16_t date;
+
+  /** The CRC-32 of the uncompressed entry data. */
+  uint32_t crc;
+
+  /** Entry size. */
+  uint64_t size;
+
+  /** Compressed entry size. */
+  uint64_t size_compressed;
+
+  /** Offset of the entry's local header. */
+  uint64_t offset;
+
+  /** Vendor version of the AES extra field of WinZip encrypted entries (0 if there is none). */
+  uint16_t aes_version;
+
+  /** AES key strength (3 for AES-256). */
+  uint8_t aes_strength;
+
+  /** Compression method of the AES encrypted entries (\a method is 99). */
+  uint16_t aes_method;
+
+  /** Hash of the name (used by the index). */
+  uint32_t hash;
+
+} zip_map_entry_t;
+
+/** Mapped archive type. */
+typedef struct
+{
+  /** Archive file descriptor. */
+  int fd;
+
+  /** Whether \a fd was opened by \a zip_map_open. */
+  bool owns_fd;
+
+  /** Mapped archive. */
+  const uint8_t *data;
+
+  /** Size of the archive. */
+  size_t size;
+
+  /** Entries in central directory order. */
+  zip_map_entry_t *entries;
+
+  /** Number of entries in the archive. */
+  size_t num_entries;
+
+  /** Open addressing hash table of entry indexes plus one (0 marks an empty slot). */
+  uint32_t *index;
+
+  /** Number of slots in \a index minus one (the number of slots is a power of 2). */
+  size_t index_mask;
+
+  /** Offset of the central directory. */
+  uint64_t central_dir_offset;
+
+  /** Archive comment (NOT null terminated, points into the mapped archive). */
+  const uint8_t *comment;
+
+  /** Length of \a comment. */
+  uint16_t comment_len;
+
+} zip_map_t;
+
+/** Inflate context for a single entry. */
+typedef struct
+{
+  /** Zlib stream */
+  z_stream stream;
+
+  /** The entry being read. */
+  const zip_map_entry_t *entry;
+
+  /** Compressed data not read yet (STORED entries only). */
+  const uint8_t *next;
+
+  /** Bytes not read yet from \a next. */
+  uint64_t remaining;
+
+  /** The CRC-32 of the data read so far. */
+  uint32_t crc;
+
+  /** Uncompressed bytes read so far. */
+  uint64_t size;
+
+  /** Whether the end of the entry was reached. */
+  bool finished;
+
+} zip_map_stream_t;
+
+
+/*-----------------------------------------------------------------------------
+   Function prototypes
+-----------------------------------------------------------------------------*/
+
+/** Open/close */
+bool zip_map_open( zip_map_t *m, const char *path );
+bool zip_map_open_fd( zip_map_t *m, int fd );
+void zip_map_close( zip_map_t *m );
+
+/** Entry lookup */
+size_t zip_map_num_entries( const zip_map_t *m );
+const zip_map_entry_t *zip_map_entry( const zip_map_t *m, size_t index );
+bool zip_map_find( const zip_map_t *m, const char *name, size_t *index );
+
+/** Entry data */
+bool zip_map_get_raw( const zip_map_t *m, size_t index, const uint8_t **data, size_t *data_len );
+bool zip_map_get_stored( const zip_map_t *m, size_t index, const uint8_t **data, size_t *data_len );
+bool zip_map_stream_open( const zip_map_t *m, size_t index, zip_map_stream_t *s );
+bool zip_map_stream_read( zip_map_stream_t *s, void *buffer, size_t buffer_len, size_t *read_len );
+void zip_map_stream_close( zip_map_stream_t *s );
+
+
+#endif
@@ -0,0 +1,546 @@
+/**
+ * \file
+ * ZIP streaming reader - Implementation.
+ */
+
+/* include area */
+#include "string.h"
+#include "zip_reader.h"
+#include "varray.h"
+
+
+/*-----------------------------------------------------------------------------
+   Definitions
+-----------------------------------------------------------------------------*/
+
+/** Local file header signature. */
+#define ZIP_READER_LOCAL_HEADER_SIG 0x04034b50U
+
+/** Central directory file header signature. */
+#define ZIP_READER_CENTRAL_DIR_SIG 0x02014b50U
+
+/** End of central directory record signature. */
+#define ZIP_READER_EOCD_SIG 0x06054b50U
+
+/** ZIP64 end of central directory record signature. */
+#define ZIP_READER_EOCD64_SIG 0x06064b50U
+
+/** Data descriptor signature (also used as split archive marker). */
+#define ZIP_READER_DATA_DESC_SIG 0x08074b50U
+
+/** Single segment archive marker. */
+#define ZIP_READER_SINGLE_SEGMENT_SIG 0x30304b50U
+
+/** Fixed size of the local file header (without name and extra field). */
+#define ZIP_READER_LOCAL_HEADER_SIZE 30
+
+
+/*-----------------------------------------------------------------------------
+   Internal data types
+-----------------------------------------------------------------------------*/
+
+/** Parser states. */
+enum
+{
+  /** Waiting for the signature of the next record. */
+  ZIP_READER_STATE_SIGNATURE,
+
+  /** Reading a local file header. */
+  ZIP_READER_STATE_HEADER,
+
+  /** Reading the entry data. */
+  ZIP_READER_STATE_DATA,
+
+  /** Reading the data descriptor. */
+  ZIP_READER_STATE_DESCRIPTOR,
+
+  /** The central directory was reached, the rest of the input is ignored. */
+  ZIP_READER_STATE_DONE,
+
+  /** Invalid input was found. */
+  ZIP_READER_STATE_ERROR,
+};
+
+
+/** Reads a 16 bit little-endian integer.
+ *
+ *  \param p Input bytes.
+ *  \return The number.
+ */
+static uint16_t _read16_le( const uint8_t *p )
+{
+  return ( uint16_t )( p[0] | ( p[1] << 8 ) );
+}
+
+
+/** Reads a 32 bit little-endian integer.
+ *
+ *  \param p Input bytes.
+ *  \return The number.
+ */
+static uint32_t _read32_le( const uint8_t *p )
+{
+  return ( uint32_t )p[0] | ( ( uint32_t )p[1] << 8 ) | ( ( uint32_t )p[2] << 16 ) |
+         ( ( uint32_t )p[3] << 24 );
+}
+
+
+/** Reads a 64 bit little-endian integer.
+ *
+ *  \param p Input bytes.
+ *  \return The number.
+ */
+static uint64_t _read64_le( const uint8_t *p )
+{
+  return ( uint64_t )_read32_le( p ) | ( ( uint64_t )_read32_le( p + 4 ) << 32 );
+}
+
+
+/** Copies input into the record buffer until it holds \c record_len bytes.
+ *
+ *  \param r Reader context.
+ *  \param data Input data.
+ *  \param data_len Bytes in \a data.
+ *  \param consumed Updated with the number of bytes taken from \a data.
+ *  \return \c true if the record is complete.
+ */
+static bool _fill_record( zip_reader_t *r, const uint8_t *data, size_t data_len, size_t *consumed )
+{
+  size_t missing = r->record_len - varray_len( r->record );
+  size_t n = ( data_len - *consumed < missing ) ? data_len - *consumed : missing;
+
+  varray_append( r->record, data + *consumed, n );
+  *consumed += n;
+
+  return varray_len( r->record ) == r->record_len;
+}
+
+
+/** Prepares the reader to parse a new record.
+ *
+ *  \param r Reader context.
+ *  \param state State that parses the record.
+ *  \param record_len Initial number of bytes required.
+ */
+static void _start_record( zip_reader_t *r, int state, size_t record_len )
+{
+  varray_len( r->record ) = 0;
+  r->record_len = record_len;
+  r->state = state;
+}
+
+
+/** Verifies the entry that was just read and notifies the user.
+ *
+ *  \param r Reader context.
+ *  \param crc Expected CRC-32.
+ *  \param size Expected uncompressed size.
+ *  \param size_compressed Expected compressed size.
+ *  \return \c false on error.
+ */
+static bool _finish_entry( zip_reader_t *r, uint32_t crc, uint64_t size, uint64_t size_compressed )
+{
+  if( r->entry.crc != crc || r->entry.size != size ||
+      r->entry.size_compressed != size_compressed )
+    return false;
+
+  if( !r->cb( r->cb_ctx, &r->entry, NULL, 0 ) )
+    return false;
+
+  _start_record( r, ZIP_READER_STATE_SIGNATURE, 4 );
+  return true;
+}
+
+
+/** Parses a ZIP64 extended information extra field, if present.
+ *
+ *  \param r Reader context.
+ *  \param extra Extra field data.
+ *  \param extra_len Bytes in \a extra.
+ *  \return \c false on error.
+ */
+static bool _parse_extra( zip_reader_t *r, const uint8_t *extra, size_t extra_len )
+{
+  while( extra_len >= 4 )
+  {
+    uint16_t id = _read16_le( extra );
+    uint16_t len = _read16_le( extra + 2 );
+    if( ( size_t )len + 4 > extra_len )
+      return false;
+
+    /* ZIP64 extended information */
+    if( id == 0x0001U )
+    {
+      const uint8_t *field = extra + 4;
+      r->zip64 = true;
+
+      if( r->header_size == 0xffffffffU )
+      {
+        if( field + 8 > extra + 4 + len )
+          return false;
+        r->header_size = _read64_le( field );
+        field += 8;
+      }
+
+      if( r->header_size_compressed == 0xffffffffU )
+      {
+        if( field + 8 > extra + 4 + len )
+          return false;
+        r->header_size_compressed = _read64_le( field );
+      }
+    }
+
+    extra += 4 + len;
+    extra_len -= 4 + len;
+  }
+
+  return true;
+}
+
+
+/** Reads the signature of the next record.
+ *
+ *  \param r Reader context.
+ *  \param data Input data.
+ *  \param data_len Bytes in \a data.
+ *  \param consumed Updated with the number of bytes taken from \a data.
+ *  \return \c false on error.
+ */
+static bool _read_signature( zip_reader_t *r, const uint8_t *data, size_t data_len, size_t *consumed )
+{
+  if( varray_len( r->record ) == 0 )
+    r->entry.offset = r->bytes_read;
+
+  if( !_fill_record( r, data, data_len, consumed ) )
+    return true;
+
+  uint32_t signature = _read32_le( r->record );
+  switch( signature )
+  {
+    case ZIP_READER_LOCAL_HEADER_SIG:
+      r->record_len = ZIP_READER_LOCAL_HEADER_SIZE;
+      r->state = ZIP_READER_STATE_HEADER;
+      return true;
+
+    case ZIP_READER_CENTRAL_DIR_SIG:
+    case ZIP_READER_EOCD_SIG:
+    case ZIP_READER_EOCD64_SIG:
+      r->state = ZIP_READER_STATE_DONE;
+      return true;
+
+    case ZIP_READER_DATA_DESC_SIG:
+    case ZIP_READER_SINGLE_SEGMENT_SIG:
+      /* split archive markers are only valid at the very beginning */
+      if( r->entry.offset != 0 )
+        return false;
+
+      _start_record( r, ZIP_READER_STATE_SIGNATURE, 4 );
+      return true;
+  }
+
+  return false;
+}
+
+
+/** Reads a local file header and starts the entry.
+ *
+ *  \param r Reader context.
+ *  \param data Input data.
+ *  \param data_len Bytes in \a data.
+ *  \param consumed Updated with the number of bytes taken from \a data.
+ *  \return \c false on error.
+ */
+static bool _read_header( zip_reader_t *r, const uint8_t *data, size_t data_len, size_t *consumed )
+{
+  if( !_fill_record( r, data, data_len, consumed ) )
+    return true;
+
+  const uint8_t *rec = r->record;
+  size_t name_len = _read16_le( rec + 26 );
+  size_t extra_len = _read16_le( rec + 28 );
+
+  /* the fixed part was read, now waits for the name and extra field */
+  if( r->record_len == ZIP_READER_LOCAL_HEADER_SIZE && name_len + extra_len > 0 )
+  {
+    r->record_len += name_len + extra_len;
+    if( !_fill_record( r, data, data_len, consumed ) )
+      return true;
+    rec = r->record;
+  }
+
+  r->entry.flags = _read16_le( rec + 6 );
+  r->entry.method = _read16_le( rec + 8 );
+  r->entry.time = _read16_le( rec + 10 );
+  r->entry.date = _read16_le( rec + 12 );
+  r->entry.crc = crc32( 0, Z_NULL, 0 );
+  r->entry.size = 0;
+  r->entry.size_compressed = 0;
+  r->header_crc = _read32_le( rec + 14 );
+  r->header_size_compressed = _read32_le( rec + 18 );
+  r->header_size = _read32_le( rec + 22 );
+  r->zip64 = false;
+
+  if( !_parse_extra( r, rec + ZIP_READER_LOCAL_HEADER_SIZE + name_len, extra_len ) )
+    return false;
+
+  /* the extra field is not needed anymore, so the name can be null terminated in place */
+  if( extra_len == 0 )
+    varray_push( r->record, '\0' );
+  else
+    r->record[ZIP_READER_LOCAL_HEADER_SIZE + name_len] = '\0';
+  r->entry.name = ( const char * )r->record + ZIP_READER_LOCAL_HEADER_SIZE;
+
+  /* encrypted entries are not supported */
+  if( r->entry.flags & 1U )
+    return false;
+
+  bool streamed = ( r->entry.flags & ( 1U << 3U ) ) != 0;
+  switch( r->entry.method )
+  {
+    case 0U: /* STORED */
+      /* the end of streamed stored data can't be found without the central directory */
+      if( streamed )
+        return false;
+      break;
+
+    case 8U: /* DEFLATE */
+      if( inflateReset( &r->stream ) != Z_OK )
+        return false;
+      break;
+
+    default:
+      return false;
+  }
+
+  r->state = ZIP_READER_STATE_DATA;
+
+  /* empty stored entries have no data at all */
+  if( r->entry.method == 0U && r->header_size_compressed == 0 )
+    return _finish_entry( r, r->header_crc, r->header_size, r->header_size_compressed );
+
+  return true;
+}
+
+
+/** Reads entry data, delivering the uncompressed bytes to the user.
+ *
+ *  \param r Reader context.
+ *  \param data Input data.
+ *  \param data_len Bytes in \a data.
+ *  \param consumed Updated with the number of bytes taken from \a data.
+ *  \return \c false on error.
+ */
+static bool _read_data( zip_reader_t *r, const uint8_t *data, size_t data_len, size_t *consumed )
+{
+  /* stored data is delivered as is */
+  if( r->entry.method == 0U )
+  {
+    uint64_t remaining = r->header_size_compressed - r->entry.size_compressed;
+    size_t n = ( data_len < remaining ) ? data_len : ( size_t )remaining;
+
+    r->entry.crc = crc32( r->entry.crc, data, n );
+    r->entry.size += n;
+    r->entry.size_compressed += n;
+    *consumed = n;
+
+    if( !r->cb( r->cb_ctx, &r->entry, data, n ) )
+      return false;
+
+    if( n < remaining )
+      return true;
+
+    return _finish_entry( r, r->header_crc, r->header_size, r->header_size_compressed );
+  }
+
+  r->stream.next_in = ( Bytef * )data;
+  r->stream.avail_in = data_len;
+
+  /* inflates until the input is consumed or the deflate stream ends */
+  int ret;
+  do
+  {
+    r->stream.next_out = r->out_buffer;
+    r->stream.avail_out = ZIP_READER_BUFFER_SIZE;
+
+    ret = inflate( &r->stream, Z_NO_FLUSH );
+    if( ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR )
+      return false;
+
+    size_t out_size = ZIP_READER_BUFFER_SIZE - r->stream.avail_out;
+    if( out_size > 0 )
+    {
+      r->entry.crc = crc32( r->entry.crc, r->out_buffer, out_size );
+      r->entry.size += out_size;
+
+      if( !r->cb( r->cb_ctx, &r->entry, r->out_buffer, out_size ) )
+        return false;
+    }
+  } while( ret != Z_STREAM_END && ( r->stream.avail_in > 0 || r->stream.avail_out == 0 ) );
+
+  *consumed = data_len - r->stream.avail_in;
+  r->entry.size_compressed += *consumed;
+
+  if( ret != Z_STREAM_END )
+    return true;
+
+  /* the sizes and CRC follow the data when streamed */
+  if( r->entry.flags & ( 1U << 3U ) )
+  {
+    _start_record( r, ZIP_READER_STATE_DESCRIPTOR, 4 );
+    return true;
+  }
+
+  return _finish_entry( r, r->header_crc, r->header_size, r->header_size_compressed );
+}
+
+
+/** Reads the data descriptor that follows streamed entries.
+ *
+ *  \param r Reader context.
+ *  \param data Input data.
+ *  \param data_len Bytes in \a data.
+ *  \param consumed Updated with the number of bytes taken from \a data.
+ *  \return \c false on error.
+ */
+static bool _read_descriptor( zip_reader_t *r, const uint8_t *data, size_t data_len, size_t *consumed )
+{
+  if( !_fill_record( r, data, data_len, consumed ) )
+    return true;
+
+  /* the signature is optional, so the full length is only known after reading 4 bytes */
+  if( r->record_len == 4 )
+  {
+    bool has_signature = ( _read32_le( r->record ) == ZIP_READER_DATA_DESC_SIG );
+    r->record_len = ( has_signature ? 4 : 0 ) + ( r->zip64 ? 20 : 12 );
+
+    if( !_fill_record( r, data, data_len, consumed ) )
+      return true;
+  }
+
+  const uint8_t *rec = r->record + ( r->record_len - ( r->zip64 ? 20 : 12 ) );
+  uint32_t crc = _read32_le( rec );
+  uint64_t size_compressed = r->zip64 ? _read64_le( rec + 4 ) : _read32_le( rec + 4 );
+  uint64_t size = r->zip64 ? _read64_le( rec + 12 ) : _read32_le( rec + 8 );
+
+  return _finish_entry( r, crc, size, size_compressed );
+}
+
+
+/** Initializes the ZIP streaming reader context.
+ *
+ *  \param r Reader context to initialize.
+ *  \param cb Callback that receives the entries data.
+ *  \param cb_ctx Callback context.
+ *  \return \c false on error.
+ */
+bool zip_reader_init( zip_reader_t *r, zip_reader_cb_t cb, void *cb_ctx )
+{
+  if( cb == NULL )
+    return false;
+
+  r->cb = cb;
+  r->cb_ctx = cb_ctx;
+  r->bytes_read = 0;
+  r->out_buffer = malloc( ZIP_READER_BUFFER_SIZE );
+  memset( &r->entry, 0, sizeof( r->entry ) );
+
+  /* enough for the fixed part of a local header, grows for the name if required */
+  varray_init( r->record, ZIP_READER_LOCAL_HEADER_SIZE );
+  _start_record( r, ZIP_READER_STATE_SIGNATURE, 4 );
+
+  /* initializes the stream */
+  r->stream.opaque = Z_NULL;
+  r->stream.zalloc = Z_NULL;
+  r->stream.zfree = Z_NULL;
+  r->stream.next_in = Z_NULL;
+  r->stream.avail_in = 0;
+
+  if( inflateInit2( &r->stream, -15 ) != Z_OK )
+  {
+    free( r->out_buffer );
+    varray_release( r->record );
+    return false;
+  }
+
+  return true;
+}
+
+
+/** Releases the resources of an initialized reader context.
+ *
+ *  \param r Reader context to release.
+ */
+void zip_reader_release( zip_reader_t *r )
+{
+  r->cb = NULL;
+  inflateEnd( &r->stream );
+  free( r->out_buffer );
+  varray_release( r->record );
+}
+
+
+/** Parses the next chunk of the archive. Entries data is delivered through the callback as it
+ *  becomes available.
+ *
+ *  \param r Reader context.
+ *  \param data Archive data.
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error (the reader can't be used anymore).
+ */
+bool zip_reader_feed( zip_reader_t *r, const void *data, size_t data_len )
+{
+  const uint8_t *in = data;
+
+  while( data_len > 0 )
+  {
+    size_t consumed = 0;
+    bool ok = false;
+
+    switch( r->state )
+    {
+      case ZIP_READER_STATE_SIGNATURE:
+        ok = _read_signature( r, in, data_len, &consumed );
+        break;
+
+      case ZIP_READER_STATE_HEADER:
+        ok = _read_header( r, in, data_len, &consumed );
+        break;
+
+      case ZIP_READER_STATE_DATA:
+        ok = _read_data( r, in, data_len, &consumed );
+        break;
+
+      case ZIP_READER_STATE_DESCRIPTOR:
+        ok = _read_descriptor( r, in, data_len, &consumed );
+        break;
+
+      case ZIP_READER_STATE_DONE:
+        /* the central directory has no information for streaming readers */
+        r->bytes_read += data_len;
+        return true;
+    }
+
+    if( !ok )
+    {
+      r->state = ZIP_READER_STATE_ERROR;
+      return false;
+    }
+
+    in += consumed;
+    data_len -= consumed;
+    r->bytes_read += consumed;
+  }
+
+  return true;
+}
+
+
+/** Checks that the whole archive was read.
+ *
+ *  \param r Reader context.
+ *  \return \c false if the input ended in the middle of an entry.
+ */
+bool zip_reader_end( zip_reader_t *r )
+{
+  return r->state == ZIP_READER_STATE_DONE;
+}
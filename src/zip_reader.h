@@ -0,0 +1,132 @@
+/**
+ * \file
+ * ZIP streaming reader - Interface.
+ *
+ * Parses a ZIP archive pushed in arbitrary chunks (e.g. as it arrives from a pipe) without
+ * seeking. Local headers are processed in order and the data of each entry is delivered through
+ * a callback, so memory usage does not depend on the archive or entry sizes.
+ */
+
+#ifndef ZIP_READER
+#define ZIP_READER
+
+/* include area */
+#include "zlib.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*-----------------------------------------------------------------------------
+   Library definitions
+-----------------------------------------------------------------------------*/
+
+/** Size of the buffer used to hold inflated data before delivering it. */
+#ifndef ZIP_READER_BUFFER_SIZE
+#  define ZIP_READER_BUFFER_SIZE ( 16 << 10 )
+#endif
+
+
+/*-----------------------------------------------------------------------------
+   Library data types
+-----------------------------------------------------------------------------*/
+
+/** Metadata of the entry being read. */
+typedef struct
+{
+  /** Entry name as a C string (only valid during the callback). */
+  const char *name;
+
+  /** General purpose bit flag. */
+  uint16_t flags;
+
+  /** Compression method. */
+  uint16_t method;
+
+  /** Entry's time in MS-DOS format. */
+  uint16_t time;
+
+  /** Entry's date in MS-DOS format. */
+  uint16_t date;
+
+  /** The CRC-32 of the uncompressed data read so far. */
+  uint32_t crc;
+
+  /** Uncompressed bytes read so far. */
+  uint64_t size;
+
+  /** Compressed bytes read so far. */
+  uint64_t size_compressed;
+
+  /** Offset of the entry's local header in the archive. */
+  uint64_t offset;
+
+} zip_reader_entry_t;
+
+
+/** Callback for the user to handle the entries data. It's called once for every chunk of
+ *  uncompressed data and one last time with \a data set to \c NULL after the entry is verified.
+ */
+typedef bool ( *zip_reader_cb_t )( void *cb_ctx,
+                                   const zip_reader_entry_t *entry,
+                                   const uint8_t *data,
+                                   size_t data_len );
+
+/** ZIP streaming reader context type. */
+typedef struct
+{
+  /** Zlib stream */
+  z_stream stream;
+
+  /** Callback that handles the uncompressed data. */
+  zip_reader_cb_t cb;
+
+  /** User defined context for \a cb */
+  void *cb_ctx;
+
+  /** The entry being read. */
+  zip_reader_entry_t entry;
+
+  /** \a varray holding the record being parsed (local header or data descriptor). */
+  uint8_t *record;
+
+  /** Number of bytes of \a record needed before it can be parsed. */
+  size_t record_len;
+
+  /** Internal buffer to hold inflated data. */
+  uint8_t *out_buffer;
+
+  /** The number of bytes consumed from the input. */
+  uint64_t bytes_read;
+
+  /** CRC-32 stated in the local header. */
+  uint32_t header_crc;
+
+  /** Uncompressed size stated in the local header. */
+  uint64_t header_size;
+
+  /** Compressed size stated in the local header. */
+  uint64_t header_size_compressed;
+
+  /** Whether the entry uses ZIP64 sizes in its data descriptor. */
+  bool zip64;
+
+  /** Parser state. */
+  int state;
+
+} zip_reader_t;
+
+
+/*-----------------------------------------------------------------------------
+   Function prototypes
+-----------------------------------------------------------------------------*/
+
+/** Init/uninit */
+bool zip_reader_init( zip_reader_t *r, zip_reader_cb_t cb, void *cb_ctx );
+void zip_reader_release( zip_reader_t *r );
+
+/** Data input */
+bool zip_reader_feed( zip_reader_t *r, const void *data, size_t data_len );
+bool zip_reader_end( zip_reader_t *r );
+
+
+#endif
@@ -0,0 +1,465 @@
+/**
+ * \file
+ * ZIP verify on write - Implementation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+/* include area */
+#include "zip_verify.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/*-----------------------------------------------------------------------------
+   Definitions
+-----------------------------------------------------------------------------*/
+
+/** Chunk types. */
+enum
+{
+  ZIP_VERIFY_DATA,
+  ZIP_VERIFY_END,
+  ZIP_VERIFY_ABORT
+};
+
+struct zip_verify_entry
+{
+  /** Raw inflate stream (deflated entries only). */
+  z_stream stream;
+
+  /** Whether the data is deflated (otherwise it's stored). */
+  bool deflated;
+
+  /** Whether the end of the deflate stream was reached. */
+  bool stream_end;
+
+  /** Whether the data is already known to be wrong. */
+  bool failed;
+
+  /** CRC-32 and size of the data inflated so far. */
+  uint32_t crc;
+  uint64_t size;
+
+  /** Entry name, for the failure reports. */
+  char name[ZIP_VERIFY_MAX_NAME_LEN + 1];
+};
+
+struct zip_verify_chunk
+{
+  /** Next chunk in the queue. */
+  zip_verify_chunk_t *next;
+
+  /** Entry of the chunk. */
+  zip_verify_entry_t *entry;
+
+  /** Chunk type. */
+  int type;
+
+  /** Expected CRC-32 and size of the entry (end chunks only). */
+  uint32_t crc;
+  uint64_t size;
+
+  /** Compressed bytes in \a data. */
+  size_t data_len;
+
+  /** Compressed data (data chunks only). */
+  uint8_t data[];
+};
+
+
+/*-----------------------------------------------------------------------------
+   Helper functions
+-----------------------------------------------------------------------------*/
+
+/** Inflates a chunk of compressed data of an entry.
+ *
+ *  \param e Entry.
+ *  \param buffer Output buffer (\c ZIP_VERIFY_BUFFER_SIZE bytes).
+ *  \param data Compressed data.
+ *  \param data_len Bytes in \a data.
+ */
+static void _inflate( zip_verify_entry_t *e, uint8_t *buffer, const uint8_t *data, size_t data_len )
+{
+  if( !e->deflated )
+  {
+    e->crc = crc32( e->crc, data, data_len );
+    e->size += data_len;
+    return;
+  }
+
+  /* nothing may follow the end of the stream */
+  if( e->stream_end )
+  {
+    e->failed = true;
+    return;
+  }
+
+  e->stream.next_in = ( Bytef * )data;
+  e->stream.avail_in = data_len;
+  do
+  {
+    e->stream.next_out = buffer;
+    e->stream.avail_out = ZIP_VERIFY_BUFFER_SIZE;
+    int rv = inflate( &e->stream, Z_NO_FLUSH );
+
+    size_t out_size = ZIP_VERIFY_BUFFER_SIZE - e->stream.avail_out;
+    e->crc = crc32( e->crc, buffer, out_size );
+    e->size += out_size;
+
+    if( rv == Z_STREAM_END )
+    {
+      e->stream_end = true;
+      e->failed = ( e->stream.avail_in > 0 );
+      return;
+    }
+
+    /* the input is exhausted in the middle of the stream */
+    if( rv == Z_BUF_ERROR && e->stream.avail_in == 0 )
+      return;
+
+    if( rv != Z_OK )
+    {
+      e->failed = true;
+      return;
+    }
+  } while( e->stream.avail_in > 0 || e->stream.avail_out == 0 );
+}
+
+
+/** Gets the memory of an entry.
+ *
+ *  \param e Entry.
+ *  \return Memory in bytes.
+ */
+static size_t _entry_memory( const zip_verify_entry_t *e )
+{
+  return sizeof( zip_verify_entry_t ) + ( e->deflated ? ZIP_VERIFY_INFLATE_SIZE : 0 );
+}
+
+
+/** Checks an entry once all its data was inflated and releases it.
+ *
+ *  \param v Verifier.
+ *  \param e Entry.
+ *  \param crc Expected CRC-32.
+ *  \param size Expected size.
+ */
+static void _check( zip_verifier_t *v, zip_verify_entry_t *e, uint32_t crc, uint64_t size )
+{
+  bool ok = !e->failed && ( !e->deflated || e->stream_end ) && e->crc == crc && e->size == size;
+
+  pthread_mutex_lock( &v->lock );
+  v->stats.entries++;
+  if( !ok )
+  {
+    v->stats.failures++;
+    strcpy( v->stats.last_failure, e->name );
+  }
+  pthread_mutex_unlock( &v->lock );
+}
+
+
+/** Verify thread: processes the queued chunks until it's stopped.
+ *
+ *  \param arg Verifier.
+ *  \return \c NULL.
+ */
+static void *_worker( void *arg )
+{
+  zip_verifier_t *v = arg;
+
+  pthread_mutex_lock( &v->lock );
+  for( ;; )
+  {
+    while( v->head == NULL && !v->stop )
+    {
+      v->busy = false;
+      pthread_cond_broadcast( &v->idle );
+      pthread_cond_wait( &v->not_empty, &v->lock );
+    }
+
+    if( v->head == NULL )
+      break;
+
+    zip_verify_chunk_t *c = v->head;
+    v->head = c->next;
+    if( v->head == NULL )
+      v->tail = NULL;
+    v->queued -= c->data_len;
+    v->busy = true;
+    pthread_cond_broadcast( &v->not_full );
+    pthread_mutex_unlock( &v->lock );
+
+    zip_verify_entry_t *e = c->entry;
+    size_t released = 0;
+    switch( c->type )
+    {
+      case ZIP_VERIFY_DATA:
+        if( !e->failed )
+          _inflate( e, v->buffer, c->data, c->data_len );
+        break;
+
+      case ZIP_VERIFY_END:
+        _check( v, e, c->crc, c->size );
+        /* fall through */
+
+      case ZIP_VERIFY_ABORT:
+        released = _entry_memory( e );
+        if( e->deflated )
+          inflateEnd( &e->stream );
+        free( e );
+        break;
+    }
+    free( c );
+
+    pthread_mutex_lock( &v->lock );
+    v->entry_memory -= released;
+  }
+  v->busy = false;
+  pthread_cond_broadcast( &v->idle );
+  pthread_mutex_unlock( &v->lock );
+
+  return NULL;
+}
+
+
+/** Queues a chunk, waiting while the queue is full. A chunk larger than the queue is taken
+ *  once the queue is empty.
+ *
+ *  \param v Verifier.
+ *  \param c Chunk to queue (owned by the verifier from now on).
+ */
+static void _submit( zip_verifier_t *v, zip_verify_chunk_t *c )
+{
+  pthread_mutex_lock( &v->lock );
+  while( v->queued > 0 && v->queued + c->data_len > ZIP_VERIFY_QUEUE_SIZE )
+    pthread_cond_wait( &v->not_full, &v->lock );
+
+  c->next = NULL;
+  if( v->tail != NULL )
+    v->tail->next = c;
+  else
+    v->head = c;
+  v->tail = c;
+  v->queued += c->data_len;
+  pthread_cond_signal( &v->not_empty );
+  pthread_mutex_unlock( &v->lock );
+}
+
+
+/** Queues a chunk without data.
+ *
+ *  \param v Verifier.
+ *  \param e Entry.
+ *  \param type Chunk type.
+ *  \param crc Expected CRC-32.
+ *  \param size Expected size.
+ *  \return \c false on error.
+ */
+static bool _submit_marker( zip_verifier_t *v, zip_verify_entry_t *e, int type, uint32_t crc, uint64_t size )
+{
+  zip_verify_chunk_t *c = malloc( sizeof( zip_verify_chunk_t ) );
+  if( c == NULL )
+    return false;
+
+  c->entry = e;
+  c->type = type;
+  c->crc = crc;
+  c->size = size;
+  c->data_len = 0;
+  _submit( v, c );
+  return true;
+}
+
+
+/*-----------------------------------------------------------------------------
+   Public functions
+-----------------------------------------------------------------------------*/
+
+/** Initializes a verifier and starts its thread.
+ *
+ *  \param v Verifier.
+ *  \return \c false on error.
+ */
+bool zip_verifier_init( zip_verifier_t *v )
+{
+  memset( v, 0, sizeof( zip_verifier_t ) );
+  v->buffer = malloc( ZIP_VERIFY_BUFFER_SIZE );
+  if( v->buffer == NULL )
+    return false;
+
+  pthread_mutex_init( &v->lock, NULL );
+  pthread_cond_init( &v->not_empty, NULL );
+  pthread_cond_init( &v->not_full, NULL );
+  pthread_cond_init( &v->idle, NULL );
+
+  if( pthread_create( &v->thread, NULL, _worker, v ) != 0 )
+  {
+    pthread_cond_destroy( &v->idle );
+    pthread_cond_destroy( &v->not_full );
+    pthread_cond_destroy( &v->not_empty );
+    pthread_mutex_destroy( &v->lock );
+    free( v->buffer );
+    return false;
+  }
+
+  return true;
+}
+
+
+/** Processes the queued chunks, stops the thread and releases the verifier. The entries not
+ *  ended or aborted yet are leaked.
+ *
+ *  \param v Verifier.
+ */
+void zip_verifier_release( zip_verifier_t *v )
+{
+  pthread_mutex_lock( &v->lock );
+  v->stop = true;
+  pthread_cond_signal( &v->not_empty );
+  pthread_mutex_unlock( &v->lock );
+
+  pthread_join( v->thread, NULL );
+  pthread_cond_destroy( &v->idle );
+  pthread_cond_destroy( &v->not_full );
+  pthread_cond_destroy( &v->not_empty );
+  pthread_mutex_destroy( &v->lock );
+  free( v->buffer );
+}
+
+
+/** Starts the verification of an entry.
+ *
+ *  \param v Verifier.
+ *  \param name Entry name (truncated to \c ZIP_VERIFY_MAX_NAME_LEN).
+ *  \param method Compression method of the entry (0 or 8).
+ *  \return The entry, to be given to \a zip_verifier_end or \a zip_verifier_abort (\c NULL on
+ *          error).
+ */
+zip_verify_entry_t *zip_verifier_entry( zip_verifier_t *v, const char *name, uint16_t method )
+{
+  zip_verify_entry_t *e = malloc( sizeof( zip_verify_entry_t ) );
+  if( e == NULL )
+    return NULL;
+
+  memset( &e->stream, 0, sizeof( e->stream ) );
+  e->deflated = ( method == 8U );
+  if( e->deflated && inflateInit2( &e->stream, -MAX_WBITS ) != Z_OK )
+  {
+    free( e );
+    return NULL;
+  }
+
+  e->stream_end = false;
+  e->failed = ( method != 0U && method != 8U );
+  e->crc = crc32( 0, Z_NULL, 0 );
+  e->size = 0;
+  strncpy( e->name, name, ZIP_VERIFY_MAX_NAME_LEN );
+  e->name[ZIP_VERIFY_MAX_NAME_LEN] = '\0';
+
+  pthread_mutex_lock( &v->lock );
+  v->entry_memory += _entry_memory( e );
+  pthread_mutex_unlock( &v->lock );
+  return e;
+}
+
+
+/** Queues compressed data of an entry, as it's written to the archive. The data is copied.
+ *
+ *  \param v Verifier.
+ *  \param e Entry.
+ *  \param data Compressed data.
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error.
+ */
+bool zip_verifier_feed( zip_verifier_t *v, zip_verify_entry_t *e, const void *data, size_t data_len )
+{
+  if( data_len == 0 )
+    return true;
+
+  zip_verify_chunk_t *c = malloc( sizeof( zip_verify_chunk_t ) + data_len );
+  if( c == NULL )
+    return false;
+
+  c->entry = e;
+  c->type = ZIP_VERIFY_DATA;
+  c->data_len = data_len;
+  memcpy( c->data, data, data_len );
+  _submit( v, c );
+  return true;
+}
+
+
+/** Ends an entry: once its data is inflated, it's checked against its CRC and size.
+ *
+ *  \param v Verifier.
+ *  \param e Entry (released by the verifier).
+ *  \param crc CRC-32 of the uncompressed data.
+ *  \param size Size of the uncompressed data.
+ *  \return \c false on error (the entry is still valid).
+ */
+bool zip_verifier_end( zip_verifier_t *v, zip_verify_entry_t *e, uint32_t crc, uint64_t size )
+{
+  return _submit_marker( v, e, ZIP_VERIFY_END, crc, size );
+}
+
+
+/** Drops an entry that won't be completed, without checking it.
+ *
+ *  \param v Verifier.
+ *  \param e Entry (released by the verifier).
+ *  \return \c false on error (the entry is still valid).
+ */
+bool zip_verifier_abort( zip_verifier_t *v, zip_verify_entry_t *e )
+{
+  return _submit_marker( v, e, ZIP_VERIFY_ABORT, 0, 0 );
+}
+
+
+/** Waits until all the queued data is verified.
+ *
+ *  \param v Verifier.
+ *  \return \c false if any entry failed so far.
+ */
+bool zip_verifier_wait( zip_verifier_t *v )
+{
+  pthread_mutex_lock( &v->lock );
+  while( v->head != NULL || v->busy )
+    pthread_cond_wait( &v->idle, &v->lock );
+  bool rv = ( v->stats.failures == 0 );
+  pthread_mutex_unlock( &v->lock );
+
+  return rv;
+}
+
+
+/** Gets the results so far, without waiting for the queued data.
+ *
+ *  \param v Verifier.
+ *  \param stats Results.
+ */
+void zip_verifier_get_stats( zip_verifier_t *v, zip_verify_stats_t *stats )
+{
+  pthread_mutex_lock( &v->lock );
+  *stats = v->stats;
+  pthread_mutex_unlock( &v->lock );
+}
+
+
+/** Gets the memory used by the verifier: its inflate buffer, the copies of the data in the
+ *  queue and the entries not released yet. It's bounded by \c ZIP_VERIFY_BUFFER_SIZE and
+ *  \c ZIP_VERIFY_QUEUE_SIZE (or a single larger chunk), plus \c ZIP_VERIFY_INFLATE_SIZE for each
+ *  deflated entry in process.
+ *
+ *  \param v Verifier.
+ *  \return Memory in bytes.
+ */
+size_t zip_verifier_memory( zip_verifier_t *v )
+{
+  pthread_mutex_lock( &v->lock );
+  size_t memory = ZIP_VERIFY_BUFFER_SIZE + v->queued + v->entry_memory;
+  pthread_mutex_unlock( &v->lock );
+
+  return memory;
+}
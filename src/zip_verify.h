@@ -0,0 +1,129 @@
+/**
+ * \file
+ * ZIP verify on write - Interface.
+ *
+ * Inflates again the compressed data of the entries on a helper thread and checks it against
+ * their CRC and size, so archives are verified as they are written instead of being read back.
+ * The producers copy each compressed chunk into a bounded queue; when it's full, they wait for
+ * the thread to catch up.
+ */
+
+#ifndef ZIP_VERIFY
+#define ZIP_VERIFY
+
+/* include area */
+#include "zlib.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*-----------------------------------------------------------------------------
+   Library definitions
+-----------------------------------------------------------------------------*/
+
+/** Maximum compressed bytes waiting for the verify thread. */
+#ifndef ZIP_VERIFY_QUEUE_SIZE
+#  define ZIP_VERIFY_QUEUE_SIZE ( 1 << 20 )
+#endif
+
+/** Size of the buffer the entries are inflated into (the data is only needed for the CRC). */
+#define ZIP_VERIFY_BUFFER_SIZE ( 64 * 1024 )
+
+/** Memory allocated by zlib for the inflate stream of a deflated entry: its 32 KiB window and
+ *  about 7 KiB of state (see the zlib's inflateInit2 docs). */
+#define ZIP_VERIFY_INFLATE_SIZE ( ( 32 + 7 ) << 10 )
+
+/** Maximum length of the entry names kept for the failure reports. */
+#define ZIP_VERIFY_MAX_NAME_LEN 127
+
+
+/*-----------------------------------------------------------------------------
+   Library data types
+-----------------------------------------------------------------------------*/
+
+/** Verification of a single entry (opaque). */
+typedef struct zip_verify_entry zip_verify_entry_t;
+
+/** Chunk of compressed data waiting in the queue (opaque). */
+typedef struct zip_verify_chunk zip_verify_chunk_t;
+
+/** Verification results (see \a zip_verifier_get_stats). */
+typedef struct
+{
+  /** Entries verified. */
+  uint64_t entries;
+
+  /** Entries whose data didn't match their CRC or size, or couldn't be inflated. */
+  uint64_t failures;
+
+  /** Name of the last entry that failed (empty if none did). */
+  char last_failure[ZIP_VERIFY_MAX_NAME_LEN + 1];
+
+} zip_verify_stats_t;
+
+/** Verify thread and its queue. */
+typedef struct
+{
+  /** Verify thread. */
+  pthread_t thread;
+
+  /** Guards the queue and the results. */
+  pthread_mutex_t lock;
+
+  /** Signaled when chunks are queued or the thread must stop. */
+  pthread_cond_t not_empty;
+
+  /** Signaled when the thread takes chunks from the queue. */
+  pthread_cond_t not_full;
+
+  /** Signaled when the queue is empty and the thread is waiting. */
+  pthread_cond_t idle;
+
+  /** Buffer the entries are inflated into. */
+  uint8_t *buffer;
+
+  /** Queued chunks, oldest first. */
+  zip_verify_chunk_t *head;
+  zip_verify_chunk_t *tail;
+
+  /** Compressed bytes in the queue. */
+  size_t queued;
+
+  /** Memory of the entries not released yet (with their inflate streams). */
+  size_t entry_memory;
+
+  /** Whether the thread is working on a chunk. */
+  bool busy;
+
+  /** Whether the thread must stop once the queue is empty. */
+  bool stop;
+
+  /** Results so far. */
+  zip_verify_stats_t stats;
+
+} zip_verifier_t;
+
+
+/*-----------------------------------------------------------------------------
+   Function prototypes
+-----------------------------------------------------------------------------*/
+
+/** Init/uninit */
+bool zip_verifier_init( zip_verifier_t *v );
+void zip_verifier_release( zip_verifier_t *v );
+
+/** Entries */
+zip_verify_entry_t *zip_verifier_entry( zip_verifier_t *v, const char *name, uint16_t method );
+bool zip_verifier_feed( zip_verifier_t *v, zip_verify_entry_t *e, const void *data, size_t data_len );
+bool zip_verifier_end( zip_verifier_t *v, zip_verify_entry_t *e, uint32_t crc, uint64_t size );
+bool zip_verifier_abort( zip_verifier_t *v, zip_verify_entry_t *e );
+
+/** Results */
+bool zip_verifier_wait( zip_verifier_t *v );
+void zip_verifier_get_stats( zip_verifier_t *v, zip_verify_stats_t *stats );
+size_t zip_verifier_memory( zip_verifier_t *v );
+
+
+#endif
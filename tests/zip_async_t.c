@@ -0,0 +1,362 @@
+/**
+ * \file
+ * ZIP asynchronous compression - Tests.
+ */
+
+/* include area */
+#include "scunit.h"
+#include "zip.h"
+#include "zip_async.h"
+#include "zip_reader.h"
+#include "varray.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/*-----------------------------------------------------------------------------
+   Internal definitions
+-----------------------------------------------------------------------------*/
+
+/** Number of entries in the test archive. */
+#define NUM_ENTRIES 3
+
+/** Chunks submitted for each entry. */
+#define NUM_CHUNKS 50
+
+/** Size of each chunk. */
+#define CHUNK_SIZE ( 8 << 10 )
+
+/** Number of archives sharing the scheduler. */
+#define NUM_JOBS 8
+
+/** Number of threads of the scheduler. */
+#define NUM_SCHED_THREADS 2
+
+
+/*-----------------------------------------------------------------------------
+   Internal data types
+-----------------------------------------------------------------------------*/
+
+/** Completions reported by the compression thread. */
+struct completions
+{
+  /** Chunks released. */
+  size_t chunks;
+
+  /** Entries finished. */
+  size_t entries;
+
+  /** Completions reported as failed. */
+  size_t failed;
+};
+
+/** Entries found while reading the archive. */
+struct read_result
+{
+  /** CRC-32 of each entry. */
+  uint32_t crc[NUM_ENTRIES];
+
+  /** Size of each entry. */
+  uint64_t size[NUM_ENTRIES];
+
+  /** Number of entries read. */
+  size_t num_entries;
+};
+
+
+/*-----------------------------------------------------------------------------
+   Helper functions
+-----------------------------------------------------------------------------*/
+
+/** Stores Zipped data into a \a varray.
+ *
+ *  \param cb_ctx Pointer to the \a varray.
+ *  \param data Zipped data.
+ *  \param data_len Zipped data length.
+ *  \return \c false on error.
+ */
+static bool _zip_to_mem( void *cb_ctx, const uint8_t *data, size_t data_len )
+{
+  uint8_t **buffer = cb_ctx;
+  varray_append( *buffer, data, data_len );
+  return true;
+}
+
+
+/** Accepts Zipped data until the first entry data is output.
+ *
+ *  \param cb_ctx Pointer to the number of bytes accepted.
+ *  \param data Zipped data.
+ *  \param data_len Zipped data length.
+ *  \return \c false once more than a local header was output.
+ */
+static bool _zip_fail( void *cb_ctx, const uint8_t *data, size_t data_len )
+{
+  size_t *bytes = cb_ctx;
+  *bytes += data_len;
+  return ( *bytes < 64 );
+}
+
+
+/** Releases a chunk and counts its completion.
+ *
+ *  \param cb_ctx Pointer to a \a completions.
+ *  \param data Chunk submitted.
+ *  \param data_len Bytes in \a data.
+ *  \param success Whether the chunk was compressed.
+ */
+static void _release_chunk( void *cb_ctx, const void *data, size_t data_len, bool success )
+{
+  struct completions *c = cb_ctx;
+  free( ( void * )data );
+  c->chunks++;
+  c->failed += !success;
+}
+
+
+/** Counts the completion of an entry.
+ *
+ *  \param cb_ctx Pointer to a \a completions.
+ *  \param data Unused.
+ *  \param data_len Unused.
+ *  \param success Whether the entry was finished.
+ */
+static void _entry_done( void *cb_ctx, const void *data, size_t data_len, bool success )
+{
+  struct completions *c = cb_ctx;
+  c->entries++;
+  c->failed += !success;
+}
+
+
+/** Collects the CRC and size of the entries.
+ *
+ *  \param cb_ctx Pointer to a \a read_result.
+ *  \param entry Entry being read.
+ *  \param data Uncompressed data (\c NULL when the entry ends).
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error.
+ */
+static bool _collect( void *cb_ctx, const zip_reader_entry_t *entry, const uint8_t *data, size_t data_len )
+{
+  struct read_result *res = cb_ctx;
+  if( data != NULL )
+    return true;
+  if( res->num_entries >= NUM_ENTRIES )
+    return false;
+
+  res->crc[res->num_entries] = entry->crc;
+  res->size[res->num_entries] = entry->size;
+  res->num_entries++;
+  return true;
+}
+
+
+/** Allocates a chunk of test data.
+ *
+ *  \param i Entry index.
+ *  \param j Chunk index.
+ *  \return The chunk (\a CHUNK_SIZE bytes).
+ */
+static uint8_t *_chunk( size_t i, size_t j )
+{
+  uint8_t *chunk = malloc( CHUNK_SIZE );
+  for( size_t k = 0; k < CHUNK_SIZE; k++ )
+    chunk[k] = ( uint8_t )( 'a' + ( i + j * k ) % 23 );
+  return chunk;
+}
+
+
+TEST( Entries )
+{
+  uint8_t *archive = NULL;
+  varray_init( archive, 1 );
+
+  zip_t z;
+  ASSERT_TRUE( zip_init( &z, _zip_to_mem, &archive ) );
+
+  /* a short queue makes the submitters wait for the thread */
+  zip_async_t a;
+  struct completions c = { 0 };
+  uint32_t crc[NUM_ENTRIES];
+  ASSERT_TRUE( zip_async_init( &a, &z, 4 ) );
+
+  for( size_t i = 0; i < NUM_ENTRIES; i++ )
+  {
+    char name[] = "entry_0";
+    name[6] = '0' + i;
+    ASSERT_TRUE( zip_async_entry_add( &a, name, zip_get_datetime() ) );
+
+    crc[i] = crc32( 0, NULL, 0 );
+    for( size_t j = 0; j < NUM_CHUNKS; j++ )
+    {
+      uint8_t *chunk = _chunk( i, j );
+      crc[i] = crc32( crc[i], chunk, CHUNK_SIZE );
+      ASSERT_TRUE( zip_async_entry_update( &a, chunk, CHUNK_SIZE, _release_chunk, &c ) );
+    }
+
+    /* polls are queued like any other operation, and do nothing between entries */
+    ASSERT_TRUE( zip_async_entry_poll( &a ) );
+    ASSERT_TRUE( zip_async_entry_end( &a, _entry_done, &c ) );
+    ASSERT_TRUE( zip_async_entry_poll( &a ) );
+  }
+
+  ASSERT_TRUE( zip_async_wait( &a ) );
+  ASSERT_EQ( NUM_ENTRIES * NUM_CHUNKS, c.chunks );
+  ASSERT_EQ( NUM_ENTRIES, c.entries );
+  ASSERT_EQ( 0, c.failed );
+
+  /* the context can be used directly once the queue is drained */
+  ASSERT_TRUE( zip_end( &z ) );
+  ASSERT_TRUE( zip_async_release( &a ) );
+  zip_release( &z );
+
+  zip_reader_t r;
+  struct read_result res = { { 0 } };
+  ASSERT_TRUE( zip_reader_init( &r, _collect, &res ) );
+  ASSERT_TRUE( zip_reader_feed( &r, archive, varray_len( archive ) ) );
+  ASSERT_TRUE( zip_reader_end( &r ) );
+  zip_reader_release( &r );
+
+  ASSERT_EQ( NUM_ENTRIES, res.num_entries );
+  for( size_t i = 0; i < NUM_ENTRIES; i++ )
+  {
+    ASSERT_EQ( crc[i], res.crc[i] );
+    ASSERT_EQ( NUM_CHUNKS * CHUNK_SIZE, res.size[i] );
+  }
+
+  varray_release( archive );
+}
+
+TEST( Failure )
+{
+  size_t bytes = 0;
+  zip_t z;
+  ASSERT_TRUE( zip_init( &z, _zip_fail, &bytes ) );
+
+  zip_async_t a;
+  struct completions c = { 0 };
+  ASSERT_TRUE( zip_async_init( &a, &z, 2 ) );
+  ASSERT_TRUE( zip_async_entry_add( &a, "entry", zip_get_datetime() ) );
+
+  /* submissions fail once the thread has seen the error, every accepted chunk is released */
+  size_t submitted = 0;
+  for( size_t j = 0; j < 1000; j++ )
+  {
+    uint8_t *chunk = _chunk( 0, j );
+    if( !zip_async_entry_update( &a, chunk, CHUNK_SIZE, _release_chunk, &c ) )
+    {
+      free( chunk );
+      break;
+    }
+    submitted++;
+  }
+
+  ASSERT_TRUE( submitted < 1000 );
+  ASSERT_FALSE( zip_async_wait( &a ) );
+  ASSERT_EQ( submitted, c.chunks );
+  ASSERT_TRUE( c.failed > 0 );
+  ASSERT_FALSE( zip_async_entry_end( &a, _entry_done, &c ) );
+  ASSERT_EQ( 0, c.entries );
+
+  ASSERT_FALSE( zip_async_release( &a ) );
+  zip_release( &z );
+}
+
+TEST( Scheduler )
+{
+  zip_sched_t s;
+  ASSERT_TRUE( zip_sched_init( &s, NUM_SCHED_THREADS ) );
+  ASSERT_EQ( NUM_SCHED_THREADS, s.num_threads );
+
+  /* the last archive fails, the others are not affected */
+  zip_t z[NUM_JOBS];
+  zip_async_t a[NUM_JOBS];
+  uint8_t *archives[NUM_JOBS];
+  size_t failed_bytes = 0;
+  struct completions c[NUM_JOBS] = { { 0 } };
+  for( size_t k = 0; k < NUM_JOBS; k++ )
+  {
+    archives[k] = NULL;
+    varray_init( archives[k], 1 );
+    if( k < NUM_JOBS - 1 )
+      ASSERT_TRUE( zip_init( &z[k], _zip_to_mem, &archives[k] ) );
+    else
+      ASSERT_TRUE( zip_init( &z[k], _zip_fail, &failed_bytes ) );
+
+    /* some archives run more operations on each turn */
+    unsigned priority = 1 + k % 3;
+    ASSERT_TRUE( zip_async_init_sched( &a[k], &z[k], 4, &s, priority ) );
+  }
+
+  /* every archive gets the same entries, submitted interleaved */
+  uint32_t crc[NUM_ENTRIES];
+  size_t accepted = 0;
+  for( size_t i = 0; i < NUM_ENTRIES; i++ )
+  {
+    char name[] = "entry_0";
+    name[6] = '0' + i;
+    for( size_t k = 0; k < NUM_JOBS - 1; k++ )
+      ASSERT_TRUE( zip_async_entry_add( &a[k], name, zip_get_datetime() ) );
+    zip_async_entry_add( &a[NUM_JOBS - 1], name, zip_get_datetime() );
+
+    crc[i] = crc32( 0, NULL, 0 );
+    for( size_t j = 0; j < NUM_CHUNKS; j++ )
+    {
+      uint8_t *chunk = _chunk( i, j );
+      crc[i] = crc32( crc[i], chunk, CHUNK_SIZE );
+      free( chunk );
+
+      for( size_t k = 0; k < NUM_JOBS; k++ )
+      {
+        chunk = _chunk( i, j );
+        if( zip_async_entry_update( &a[k], chunk, CHUNK_SIZE, _release_chunk, &c[k] ) )
+          accepted++;
+        else
+        {
+          ASSERT_EQ( NUM_JOBS - 1, k );
+          free( chunk );
+        }
+      }
+    }
+
+    for( size_t k = 0; k < NUM_JOBS - 1; k++ )
+      ASSERT_TRUE( zip_async_entry_end( &a[k], _entry_done, &c[k] ) );
+  }
+
+  for( size_t k = 0; k < NUM_JOBS; k++ )
+  {
+    bool rv = zip_async_wait( &a[k] );
+    ASSERT_TRUE( rv == ( k < NUM_JOBS - 1 ) );
+    if( rv )
+    {
+      ASSERT_EQ( NUM_ENTRIES * NUM_CHUNKS, c[k].chunks );
+      ASSERT_EQ( NUM_ENTRIES, c[k].entries );
+      ASSERT_EQ( 0, c[k].failed );
+      ASSERT_TRUE( zip_end( &z[k] ) );
+    }
+    else
+      ASSERT_EQ( accepted - ( NUM_JOBS - 1 ) * NUM_ENTRIES * NUM_CHUNKS, c[k].chunks );
+
+    ASSERT_TRUE( zip_async_release( &a[k] ) == rv );
+    zip_release( &z[k] );
+  }
+  zip_sched_release( &s );
+
+  for( size_t k = 0; k < NUM_JOBS - 1; k++ )
+  {
+    zip_reader_t r;
+    struct read_result res = { { 0 } };
+    ASSERT_TRUE( zip_reader_init( &r, _collect, &res ) );
+    ASSERT_TRUE( zip_reader_feed( &r, archives[k], varray_len( archives[k] ) ) );
+    ASSERT_TRUE( zip_reader_end( &r ) );
+    zip_reader_release( &r );
+
+    ASSERT_EQ( NUM_ENTRIES, res.num_entries );
+    for( size_t i = 0; i < NUM_ENTRIES; i++ )
+      ASSERT_EQ( crc[i], res.crc[i] );
+  }
+
+  for( size_t k = 0; k < NUM_JOBS; k++ )
+    varray_release( archives[k] );
+}
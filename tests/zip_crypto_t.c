@@ -0,0 +1,191 @@
+/**
+ * \file
+ * ZIP encryption primitives - Tests.
+ */
+
+/* include area */
+#include "scunit.h"
+#include "zip_crypto.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/*-----------------------------------------------------------------------------
+   Helper functions
+-----------------------------------------------------------------------------*/
+
+/** Checks bytes against their hexadecimal representation.
+ *
+ *  \param data Bytes to check.
+ *  \param hex Expected bytes in hexadecimal (two digits per byte).
+ *  \return \c true if they are the same.
+ */
+static bool _equals_hex( const uint8_t *data, const char *hex )
+{
+  for( size_t i = 0; hex[2 * i] != '\0'; i++ )
+  {
+    char digits[3] = { hex[2 * i], hex[2 * i + 1], '\0' };
+    if( data[i] != ( uint8_t )strtoul( digits, NULL, 16 ) )
+      return false;
+  }
+  return true;
+}
+
+
+TEST( Sha1 )
+{
+  /* the same vectors with the AES-NI/SHA-NI code (where supported) and the portable code */
+  for( int hw = 1; hw >= 0; hw-- )
+  {
+    zip_crypto_set_hw( hw );
+    uint8_t digest[ZIP_SHA1_SIZE];
+    zip_sha1_t s;
+    zip_sha1_init( &s );
+    zip_sha1_update( &s, "abc", 3 );
+    zip_sha1_final( &s, digest );
+    ASSERT_TRUE( _equals_hex( digest, "a9993e364706816aba3e25717850c26c9cd0d89d" ) );
+
+    /* two blocks of padding, given in pieces */
+    const char *message = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    zip_sha1_init( &s );
+    for( size_t i = 0; i < strlen( message ); i += 5 )
+      zip_sha1_update( &s, message + i, ( strlen( message ) - i < 5 ) ? strlen( message ) - i : 5 );
+    zip_sha1_final( &s, digest );
+    ASSERT_TRUE( _equals_hex( digest, "84983e441c3bd26ebaae4aa1f95129e5e54670f1" ) );
+  }
+  zip_crypto_set_hw( true );
+}
+
+TEST( Sha256 )
+{
+  for( int hw = 1; hw >= 0; hw-- )
+  {
+    zip_crypto_set_hw( hw );
+    uint8_t digest[ZIP_SHA256_SIZE];
+    zip_sha256_t s;
+    zip_sha256_init( &s );
+    zip_sha256_update( &s, "abc", 3 );
+    zip_sha256_final( &s, digest );
+    ASSERT_TRUE( _equals_hex( digest, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" ) );
+
+    const char *message = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    zip_sha256_init( &s );
+    zip_sha256_update( &s, message, strlen( message ) );
+    zip_sha256_final( &s, digest );
+    ASSERT_TRUE( _equals_hex( digest, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" ) );
+
+    /* a million 'a', in pieces that are not a multiple of the block size */
+    char a[1000];
+    memset( a, 'a', sizeof( a ) );
+    zip_sha256_init( &s );
+    for( size_t i = 0; i < 1000; i++ )
+      zip_sha256_update( &s, a, sizeof( a ) );
+    zip_sha256_final( &s, digest );
+    ASSERT_TRUE( _equals_hex( digest, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" ) );
+  }
+  zip_crypto_set_hw( true );
+}
+
+TEST( Pbkdf2 )
+{
+  for( int hw = 1; hw >= 0; hw-- )
+  {
+    zip_crypto_set_hw( hw );
+    /* RFC 6070 */
+    zip_hmac_t password;
+    zip_hmac_init( &password, "password", 8 );
+
+    uint8_t key[25];
+    zip_pbkdf2( &password, ( const uint8_t * )"salt", 4, 2, key, 20 );
+    ASSERT_TRUE( _equals_hex( key, "ea6c014dc72d6f8ccd1ed92ace1d41f0d8de8957" ) );
+    zip_pbkdf2( &password, ( const uint8_t * )"salt", 4, 4096, key, 20 );
+    ASSERT_TRUE( _equals_hex( key, "4b007901b765489abead49d926f721d065a429c1" ) );
+
+    /* keys longer than a digest */
+    zip_hmac_init( &password, "passwordPASSWORDpassword", 24 );
+    zip_pbkdf2( &password, ( const uint8_t * )"saltSALTsaltSALTsaltSALTsaltSALTsalt", 36, 4096, key, 25 );
+    ASSERT_TRUE( _equals_hex( key, "3d2eec4fe41c849b80c8d83662c0e44a8b291a964cf2f07038" ) );
+  }
+  zip_crypto_set_hw( true );
+}
+
+TEST( Aes )
+{
+  for( int hw = 1; hw >= 0; hw-- )
+  {
+    zip_crypto_set_hw( hw );
+    /* FIPS-197 appendix C.3 */
+    uint8_t key[ZIP_AES_KEY_SIZE];
+    for( size_t i = 0; i < sizeof( key ); i++ )
+      key[i] = ( uint8_t )i;
+
+    zip_aes_t aes;
+    uint8_t block[16];
+    for( size_t i = 0; i < sizeof( block ); i++ )
+      block[i] = ( uint8_t )( i * 0x11 );
+    zip_aes_set_key( &aes, key );
+    ASSERT_TRUE( hw || !aes.hw );
+    zip_aes_block( &aes, block, block );
+    ASSERT_TRUE( _equals_hex( block, "8ea2b7ca516745bfeafc49904b496089" ) );
+
+    /* the keystream is the same whatever the size of the pieces */
+    uint8_t data[1000], pieces[1000];
+    memset( data, 0, sizeof( data ) );
+    memset( pieces, 0, sizeof( pieces ) );
+    zip_aes_encrypt( &aes, data, sizeof( data ) );
+
+    zip_aes_set_key( &aes, key );
+    for( size_t i = 0, n = 1; i < sizeof( pieces ); i += n, n = n * 3 + 1 )
+      zip_aes_encrypt( &aes, pieces + i, ( n < sizeof( pieces ) - i ) ? n : sizeof( pieces ) - i );
+    ASSERT_TRUE( memcmp( data, pieces, sizeof( data ) ) == 0 );
+
+    /* the first keystream block is the little-endian counter 1 */
+    uint8_t counter[16] = { 1 };
+    zip_aes_block( &aes, counter, counter );
+    ASSERT_TRUE( memcmp( counter, data, sizeof( counter ) ) == 0 );
+  }
+  zip_crypto_set_hw( true );
+}
+
+TEST( EntryEncryption )
+{
+  for( int hw = 1; hw >= 0; hw-- )
+  {
+    zip_crypto_set_hw( hw );
+    zip_hmac_t password;
+    zip_hmac_init( &password, "secret", 6 );
+
+    uint8_t data[300];
+    for( size_t i = 0; i < sizeof( data ); i++ )
+      data[i] = ( uint8_t )( i * 7 );
+
+    uint8_t header[ZIP_AES_HEADER_SIZE];
+    uint8_t mac[ZIP_AES_MAC_SIZE];
+    uint8_t encrypted[sizeof( data )];
+    zip_aes_t aes;
+    memcpy( encrypted, data, sizeof( data ) );
+    ASSERT_TRUE( zip_aes_start( &aes, &password, header ) );
+    zip_aes_encrypt( &aes, encrypted, 100 );
+    zip_aes_encrypt( &aes, encrypted + 100, sizeof( data ) - 100 );
+    zip_aes_finish( &aes, mac );
+    ASSERT_TRUE( memcmp( encrypted, data, sizeof( data ) ) != 0 );
+
+    /* decrypts and authenticates with the same password */
+    uint8_t decrypted[sizeof( data )];
+    uint8_t decrypted_mac[ZIP_AES_MAC_SIZE];
+    memcpy( decrypted, encrypted, sizeof( data ) );
+    ASSERT_TRUE( zip_aes_open( &aes, &password, header ) );
+    zip_aes_decrypt( &aes, decrypted, sizeof( data ) );
+    zip_aes_finish( &aes, decrypted_mac );
+    ASSERT_TRUE( memcmp( decrypted, data, sizeof( data ) ) == 0 );
+    ASSERT_TRUE( memcmp( decrypted_mac, mac, sizeof( mac ) ) == 0 );
+
+    /* a wrong password fails the verifier or the authentication */
+    zip_hmac_init( &password, "Secret", 6 );
+    bool verified = zip_aes_open( &aes, &password, header );
+    zip_aes_decrypt( &aes, encrypted, sizeof( data ) );
+    zip_aes_finish( &aes, decrypted_mac );
+    ASSERT_FALSE( verified && memcmp( decrypted_mac, mac, sizeof( mac ) ) == 0 );
+  }
+  zip_crypto_set_hw( true );
+}
@@ -0,0 +1,290 @@
+/**
+ * \file
+ * ZIP directory ingestion - Tests.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+/* include area */
+#include "scunit.h"
+#include "zip.h"
+#include "zip_dir.h"
+#include "zip_reader.h"
+#include "varray.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/*-----------------------------------------------------------------------------
+   Internal definitions
+-----------------------------------------------------------------------------*/
+
+/** Directory tree added to the archives. */
+#define TEST_DIR "zip_dir_test"
+
+/** Number of regular files in the tree. */
+#define NUM_FILES 4
+
+/** Size of the file larger than a prefetched chunk. */
+#define LARGE_FILE_SIZE ( ZIP_DIR_CHUNK_SIZE * 2 + 1000 )
+
+
+/*-----------------------------------------------------------------------------
+   Internal data types
+-----------------------------------------------------------------------------*/
+
+/** Entries found while reading an archive. */
+struct read_result
+{
+  /** Names of the entries. */
+  char names[NUM_FILES][ZIP_ENTRY_MAX_NAME_LEN + 1];
+
+  /** CRC-32 of the data of each entry. */
+  uint32_t crc[NUM_FILES];
+
+  /** Size of each entry. */
+  uint64_t size[NUM_FILES];
+
+  /** Date and time of each entry in MS-DOS format. */
+  uint16_t date[NUM_FILES];
+  uint16_t time[NUM_FILES];
+
+  /** Number of entries read. */
+  size_t num_entries;
+};
+
+
+/*-----------------------------------------------------------------------------
+   Helper functions
+-----------------------------------------------------------------------------*/
+
+/** Stores Zipped data into a \a varray.
+ *
+ *  \param cb_ctx Pointer to the \a varray.
+ *  \param data Zipped data.
+ *  \param data_len Zipped data length.
+ *  \return \c false on error.
+ */
+static bool _zip_to_mem( void *cb_ctx, const uint8_t *data, size_t data_len )
+{
+  uint8_t **buffer = cb_ctx;
+  varray_append( *buffer, data, data_len );
+  return true;
+}
+
+
+/** Collects the entries of an archive.
+ *
+ *  \param cb_ctx Pointer to a \a read_result.
+ *  \param entry Entry being read.
+ *  \param data Uncompressed data (\c NULL when the entry ends).
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error.
+ */
+static bool _collect( void *cb_ctx, const zip_reader_entry_t *entry, const uint8_t *data, size_t data_len )
+{
+  struct read_result *res = cb_ctx;
+  if( data != NULL )
+    return true;
+  if( res->num_entries >= NUM_FILES )
+    return false;
+
+  size_t i = res->num_entries++;
+  strcpy( res->names[i], entry->name );
+  res->crc[i] = entry->crc;
+  res->size[i] = entry->size;
+  res->date[i] = entry->date;
+  res->time[i] = entry->time;
+  return true;
+}
+
+
+/** Writes a test file.
+ *
+ *  \param path File path.
+ *  \param data File contents.
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error.
+ */
+static bool _write_file( const char *path, const void *data, size_t data_len )
+{
+  FILE *f = fopen( path, "wb" );
+  if( f == NULL )
+    return false;
+
+  bool rv = ( fwrite( data, 1, data_len, f ) == data_len );
+  return ( fclose( f ) == 0 ) && rv;
+}
+
+
+/** Adds a directory to an archive in memory and reads it back.
+ *
+ *  \param opts Ingestion options.
+ *  \param res Output entries.
+ *  \return \c false on error.
+ */
+static bool _add_and_read( const zip_dir_options_t *opts, struct read_result *res )
+{
+  uint8_t *archive = NULL;
+  varray_init( archive, 1 );
+
+  zip_t z;
+  bool rv = zip_init( &z, _zip_to_mem, &archive ) && zip_add_directory( &z, TEST_DIR, opts ) && zip_end( &z );
+  zip_release( &z );
+
+  zip_reader_t r;
+  memset( res, 0, sizeof( *res ) );
+  rv = rv && zip_reader_init( &r, _collect, res );
+  rv = rv && zip_reader_feed( &r, archive, varray_len( archive ) ) && zip_reader_end( &r );
+  zip_reader_release( &r );
+
+  varray_release( archive );
+  return rv;
+}
+
+
+/** Finds an entry by name.
+ *
+ *  \param res Entries read.
+ *  \param name Entry name.
+ *  \return Index of the entry, \a NUM_FILES if it's not found.
+ */
+static size_t _find( const struct read_result *res, const char *name )
+{
+  size_t i = 0;
+  while( i < res->num_entries && strcmp( res->names[i], name ) != 0 )
+    i++;
+  return ( i < res->num_entries ) ? i : NUM_FILES;
+}
+
+
+/** Removes the test directory tree. */
+static void _remove_tree( void )
+{
+  remove( TEST_DIR "/link" );
+  remove( TEST_DIR "/sub/deeper/c.txt" );
+  remove( TEST_DIR "/sub/b.bin" );
+  remove( TEST_DIR "/empty" );
+  remove( TEST_DIR "/a.txt" );
+  remove( TEST_DIR "/no_files" );
+  remove( TEST_DIR "/sub/deeper" );
+  remove( TEST_DIR "/sub" );
+  remove( TEST_DIR );
+}
+
+
+/** Creates the test directory tree (replacing the one left by a failed test). */
+static void _create_tree( void )
+{
+  _remove_tree();
+  mkdir( TEST_DIR, 0755 );
+  mkdir( TEST_DIR "/sub", 0755 );
+  mkdir( TEST_DIR "/sub/deeper", 0755 );
+  mkdir( TEST_DIR "/no_files", 0755 );
+
+  uint8_t *large = malloc( LARGE_FILE_SIZE );
+  for( size_t i = 0; i < LARGE_FILE_SIZE; i++ )
+    large[i] = ( uint8_t )( i * 7 + i / 1000 );
+
+  if( !_write_file( TEST_DIR "/a.txt", "first file", 10 ) || !_write_file( TEST_DIR "/empty", "", 0 ) ||
+      !_write_file( TEST_DIR "/sub/b.bin", large, LARGE_FILE_SIZE ) ||
+      !_write_file( TEST_DIR "/sub/deeper/c.txt", "nested file", 11 ) ||
+      symlink( "a.txt", TEST_DIR "/link" ) != 0 )
+  {
+    printf( "Failed to create the test directory\n" );
+    exit( EXIT_FAILURE );
+  }
+
+  free( large );
+}
+
+
+TEST( Sorted )
+{
+  _create_tree();
+
+  /* a known modification time */
+  struct tm tm = { .tm_year = 2020 - 1900, .tm_mon = 4, .tm_mday = 17, .tm_hour = 10, .tm_min = 20, .tm_sec = 30,
+                   .tm_isdst = -1 };
+  struct timespec times[2] = { { mktime( &tm ), 0 }, { mktime( &tm ), 0 } };
+  ASSERT_EQ( 0, utimensat( AT_FDCWD, TEST_DIR "/a.txt", times, 0 ) );
+
+  zip_dir_options_t opts;
+  zip_dir_options_init( &opts );
+  opts.sorted = true;
+  opts.prefetch = 1;
+
+  struct read_result res;
+  ASSERT_TRUE( _add_and_read( &opts, &res ) );
+  ASSERT_EQ( NUM_FILES, res.num_entries );
+
+  /* symbolic links and directories without files are skipped */
+  const char *names[NUM_FILES] = { "a.txt", "empty", "sub/b.bin", "sub/deeper/c.txt" };
+  for( size_t i = 0; i < NUM_FILES; i++ )
+    ASSERT_TRUE( strcmp( names[i], res.names[i] ) == 0 );
+
+  ASSERT_EQ( 10, res.size[0] );
+  ASSERT_EQ( crc32( 0, ( const Bytef * )"first file", 10 ), res.crc[0] );
+  ASSERT_EQ( ( ( 2020 - 1980 ) << 9 ) | ( 5 << 5 ) | 17, res.date[0] );
+  ASSERT_EQ( ( 10 << 11 ) | ( 20 << 5 ) | ( 30 / 2 ), res.time[0] );
+  ASSERT_EQ( 0, res.size[1] );
+  ASSERT_EQ( 11, res.size[3] );
+
+  uint8_t *large = malloc( LARGE_FILE_SIZE );
+  for( size_t i = 0; i < LARGE_FILE_SIZE; i++ )
+    large[i] = ( uint8_t )( i * 7 + i / 1000 );
+  ASSERT_EQ( LARGE_FILE_SIZE, res.size[2] );
+  ASSERT_EQ( crc32( 0, large, LARGE_FILE_SIZE ), res.crc[2] );
+  free( large );
+
+  _remove_tree();
+}
+
+TEST( Unsorted )
+{
+  _create_tree();
+
+  /* the order depends on the readers, every file is there */
+  zip_dir_options_t opts;
+  zip_dir_options_init( &opts );
+  opts.num_readers = 8;
+
+  struct read_result res;
+  ASSERT_TRUE( _add_and_read( &opts, &res ) );
+  ASSERT_EQ( NUM_FILES, res.num_entries );
+  ASSERT_TRUE( _find( &res, "a.txt" ) < NUM_FILES );
+  ASSERT_TRUE( _find( &res, "empty" ) < NUM_FILES );
+  ASSERT_TRUE( _find( &res, "sub/b.bin" ) < NUM_FILES );
+  ASSERT_TRUE( _find( &res, "sub/deeper/c.txt" ) < NUM_FILES );
+  ASSERT_EQ( LARGE_FILE_SIZE, res.size[_find( &res, "sub/b.bin" )] );
+
+  _remove_tree();
+}
+
+TEST( Errors )
+{
+  zip_t z;
+  uint8_t *archive = NULL;
+  varray_init( archive, 1 );
+  ASSERT_TRUE( zip_init( &z, _zip_to_mem, &archive ) );
+
+  ASSERT_FALSE( zip_add_directory( &z, "does_not_exist", NULL ) );
+
+  zip_dir_options_t opts;
+  zip_dir_options_init( &opts );
+  opts.num_readers = 0;
+  ASSERT_FALSE( zip_add_directory( &z, ".", &opts ) );
+
+  /* not while an entry is in process */
+  ASSERT_TRUE( zip_entry_add( &z, "entry", zip_get_datetime() ) );
+  ASSERT_FALSE( zip_add_directory( &z, ".", NULL ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+
+  zip_release( &z );
+  varray_release( archive );
+}
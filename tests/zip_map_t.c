@@ -0,0 +1,257 @@
+/**
+ * \file
+ * ZIP random access reader - Tests.
+ */
+
+/* include area */
+#include "scunit.h"
+#include "zip.h"
+#include "zip_map.h"
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/*-----------------------------------------------------------------------------
+   Internal definitions
+-----------------------------------------------------------------------------*/
+
+/** Name of the test ZIP file. */
+#define TMP_FILE "test_map.zip"
+
+/** Name of the file archived with the \c zip command. */
+#define TMP_DATA_FILE "test_map.txt"
+
+/** Number of entries in the generated archive. */
+#define NUM_ENTRIES 1000
+
+
+/*-----------------------------------------------------------------------------
+   Helper functions
+-----------------------------------------------------------------------------*/
+
+/** Writes Zipped data into a file.
+ *
+ *  \param cb_ctx Pointer to the file descriptor.
+ *  \param data Zipped data.
+ *  \param data_len Zipped data length.
+ *  \return \c false on error.
+ */
+static bool _zip_to_fd( void *cb_ctx, const uint8_t *data, size_t data_len )
+{
+  int *fd = cb_ctx;
+  return ( write( *fd, data, data_len ) == data_len );
+}
+
+
+/** Builds the name and contents of a test entry.
+ *
+ *  \param i Entry index.
+ *  \param name Output name.
+ *  \param data Output contents.
+ *  \return Length of \a data.
+ */
+static size_t _entry( size_t i, char name[32], char data[128] )
+{
+  snprintf( name, 32, "dir_%zu/file_%zu.txt", i % 7, i );
+  return snprintf( data, 128, "contents of entry %zu, repeated: %zu %zu %zu", i, i, i, i );
+}
+
+
+/** Creates an archive with \a NUM_ENTRIES entries.
+ *
+ *  \return \c false on error.
+ */
+static bool _create_archive( void )
+{
+  int fd = open( TMP_FILE, O_CREAT | O_WRONLY | O_TRUNC, 0644 );
+  if( fd < 0 )
+    return false;
+
+  zip_t z;
+  bool rv = zip_init( &z, _zip_to_fd, &fd );
+  for( size_t i = 0; rv && i < NUM_ENTRIES; i++ )
+  {
+    char name[32];
+    char data[128];
+    size_t data_len = _entry( i, name, data );
+
+    rv = zip_entry_add( &z, name, zip_get_datetime() ) && zip_entry_update( &z, data, data_len ) &&
+         zip_entry_end( &z );
+  }
+
+  rv = rv && zip_end( &z );
+  zip_release( &z );
+  close( fd );
+  return rv;
+}
+
+
+/** Archives a single file with the \c zip command.
+ *
+ *  \param options Extra options for the \c zip command.
+ *  \param data Contents of the archived file.
+ *  \return \c false on error.
+ */
+static bool _zip_command( const char *options, const char *data )
+{
+  FILE *f = fopen( TMP_DATA_FILE, "w" );
+  if( f == NULL )
+    return false;
+  fputs( data, f );
+  fclose( f );
+
+  char command[256];
+  snprintf( command, sizeof( command ), "zip -q %s " TMP_FILE " " TMP_DATA_FILE, options );
+
+  remove( TMP_FILE );
+  int stat = system( command );
+  remove( TMP_DATA_FILE );
+  return ( WEXITSTATUS( stat ) == EXIT_SUCCESS );
+}
+
+
+/** Reads a whole entry with a \a zip_map_stream_t.
+ *
+ *  \param m Mapped archive.
+ *  \param index Entry index.
+ *  \param buffer Output buffer.
+ *  \param buffer_len Size of \a buffer.
+ *  \param data_len Output number of bytes read.
+ *  \return \c false on error.
+ */
+static bool _read_entry( zip_map_t *m, size_t index, char *buffer, size_t buffer_len, size_t *data_len )
+{
+  zip_map_stream_t s;
+  if( !zip_map_stream_open( m, index, &s ) )
+    return false;
+
+  /* reads in small chunks to exercise partial reads */
+  bool rv = true;
+  size_t n;
+  *data_len = 0;
+  do
+  {
+    size_t chunk = ( buffer_len - *data_len < 5 ) ? buffer_len - *data_len : 5;
+    rv = zip_map_stream_read( &s, buffer + *data_len, chunk, &n );
+    *data_len += n;
+  } while( rv && n > 0 );
+
+  zip_map_stream_close( &s );
+  return rv;
+}
+
+
+TEST( Lookup )
+{
+  ASSERT_TRUE( _create_archive() );
+
+  zip_map_t m;
+  ASSERT_TRUE( zip_map_open( &m, TMP_FILE ) );
+  ASSERT_EQ( NUM_ENTRIES, zip_map_num_entries( &m ) );
+
+  /* looks up the entries in reverse order */
+  for( size_t i = NUM_ENTRIES; i-- > 0; )
+  {
+    char name[32];
+    char expected[128];
+    char obtained[128];
+    size_t expected_len = _entry( i, name, expected );
+    size_t obtained_len = 0;
+    size_t index;
+
+    ASSERT_TRUE( zip_map_find( &m, name, &index ) );
+    ASSERT_EQ( i, index );
+    ASSERT_EQ( 8, zip_map_entry( &m, index )->method );
+    ASSERT_TRUE( _read_entry( &m, index, obtained, sizeof( obtained ), &obtained_len ) );
+    ASSERT_EQ( expected_len, obtained_len );
+    ASSERT_TRUE( memcmp( expected, obtained, expected_len ) == 0 );
+  }
+
+  /* an empty read doesn't end the entry, and the size is checked at the end with the CRC */
+  char name[32];
+  char expected[128];
+  char obtained[128];
+  size_t expected_len = _entry( 0, name, expected );
+  size_t obtained_len;
+  zip_map_stream_t s;
+  ASSERT_TRUE( zip_map_stream_open( &m, 0, &s ) );
+  ASSERT_TRUE( zip_map_stream_read( &s, obtained, 0, &obtained_len ) );
+  ASSERT_EQ( 0, obtained_len );
+  ASSERT_FALSE( s.finished );
+  zip_map_stream_close( &s );
+  ASSERT_TRUE( _read_entry( &m, 0, obtained, sizeof( obtained ), &obtained_len ) );
+  ASSERT_EQ( expected_len, obtained_len );
+  m.entries[0].size++;
+  ASSERT_FALSE( _read_entry( &m, 0, obtained, sizeof( obtained ), &obtained_len ) );
+  m.entries[0].size--;
+
+  size_t index;
+  ASSERT_FALSE( zip_map_find( &m, "dir_0/file_1.txt", &index ) );
+  ASSERT_FALSE( zip_map_find( &m, "", &index ) );
+  ASSERT_TRUE( zip_map_entry( &m, NUM_ENTRIES ) == NULL );
+
+  zip_map_close( &m );
+  remove( TMP_FILE );
+}
+
+TEST( Stored )
+{
+  const char *data = "stored data is returned without copying";
+  ASSERT_TRUE( _zip_command( "-0", data ) );
+
+  zip_map_t m;
+  ASSERT_TRUE( zip_map_open( &m, TMP_FILE ) );
+
+  size_t index;
+  const uint8_t *stored;
+  size_t stored_len;
+  ASSERT_TRUE( zip_map_find( &m, TMP_DATA_FILE, &index ) );
+  ASSERT_TRUE( zip_map_get_stored( &m, index, &stored, &stored_len ) );
+  ASSERT_EQ( strlen( data ), stored_len );
+  ASSERT_TRUE( memcmp( data, stored, stored_len ) == 0 );
+
+  /* the pointer is inside the mapping */
+  ASSERT_TRUE( stored > m.data && stored < m.data + m.size );
+
+  zip_map_close( &m );
+  remove( TMP_FILE );
+}
+
+TEST( Zip64 )
+{
+  const char *data = "the zip64 end of central directory record is used";
+  ASSERT_TRUE( _zip_command( "-fz", data ) );
+
+  zip_map_t m;
+  ASSERT_TRUE( zip_map_open( &m, TMP_FILE ) );
+
+  size_t index;
+  char obtained[128];
+  size_t obtained_len;
+  ASSERT_EQ( 1, zip_map_num_entries( &m ) );
+  ASSERT_TRUE( zip_map_find( &m, TMP_DATA_FILE, &index ) );
+  ASSERT_TRUE( _read_entry( &m, index, obtained, sizeof( obtained ), &obtained_len ) );
+  ASSERT_EQ( strlen( data ), obtained_len );
+  ASSERT_TRUE( memcmp( data, obtained, obtained_len ) == 0 );
+
+  zip_map_close( &m );
+  remove( TMP_FILE );
+}
+
+TEST( Invalid )
+{
+  FILE *f = fopen( TMP_FILE, "w" );
+  ASSERT_TRUE( f != NULL );
+  fputs( "this is not a ZIP archive, it has no end of central directory", f );
+  fclose( f );
+
+  zip_map_t m;
+  ASSERT_FALSE( zip_map_open( &m, TMP_FILE ) );
+  ASSERT_FALSE( zip_map_open( &m, "does_not_exist.zip" ) );
+
+  remove( TMP_FILE );
+}
@@ -0,0 +1,280 @@
+/**
+ * \file
+ * ZIP streaming reader - Tests.
+ */
+
+/* include area */
+#include "scunit.h"
+#include "zip.h"
+#include "zip_reader.h"
+#include "varray.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/*-----------------------------------------------------------------------------
+   Internal definitions
+-----------------------------------------------------------------------------*/
+
+/** Number of entries in the test archive. */
+#define NUM_ENTRIES 3
+
+/** Size of the data of the test entries. */
+#define ENTRY_SIZE ( 200 << 10 )
+
+
+/*-----------------------------------------------------------------------------
+   Internal data types
+-----------------------------------------------------------------------------*/
+
+/** Data collected while reading an archive. */
+struct read_result
+{
+  /** Names of the entries read. */
+  char names[NUM_ENTRIES][ZIP_ENTRY_MAX_NAME_LEN + 1];
+
+  /** \a varray with the data of each entry. */
+  uint8_t *data[NUM_ENTRIES];
+
+  /** Number of entries completely read. */
+  size_t num_entries;
+};
+
+
+/*-----------------------------------------------------------------------------
+   Helper functions
+-----------------------------------------------------------------------------*/
+
+/** Stores Zipped data into a \a varray.
+ *
+ *  \param cb_ctx Pointer to the \a varray.
+ *  \param data Zipped data.
+ *  \param data_len Zipped data length.
+ *  \return \c false on error.
+ */
+static bool _zip_to_mem( void *cb_ctx, const uint8_t *data, size_t data_len )
+{
+  uint8_t **buffer = cb_ctx;
+  varray_append( *buffer, data, data_len );
+  return true;
+}
+
+
+/** Collects the entries data into a \a read_result.
+ *
+ *  \param cb_ctx Pointer to the \a read_result.
+ *  \param entry Entry being read.
+ *  \param data Uncompressed data (\c NULL when the entry ends).
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error.
+ */
+static bool _collect( void *cb_ctx, const zip_reader_entry_t *entry, const uint8_t *data, size_t data_len )
+{
+  struct read_result *res = cb_ctx;
+  if( res->num_entries >= NUM_ENTRIES )
+    return false;
+
+  if( data == NULL )
+  {
+    strcpy( res->names[res->num_entries], entry->name );
+    res->num_entries++;
+    return true;
+  }
+
+  varray_append( res->data[res->num_entries], data, data_len );
+  return true;
+}
+
+
+/** Fills a buffer with the test data of an entry.
+ *
+ *  \param buffer Output buffer of \a ENTRY_SIZE bytes.
+ *  \param i Entry index.
+ */
+static void _entry_data( uint8_t *buffer, size_t i )
+{
+  uint32_t seed = i + 1;
+  for( size_t j = 0; j < ENTRY_SIZE; j++ )
+  {
+    /* mixes compressible text with pseudo random bytes */
+    seed = seed * 1103515245U + 12345U;
+    buffer[j] = ( i % 2 ) ? ( uint8_t )( seed >> 16 ) : ( uint8_t )( 'a' + j % 13 );
+  }
+}
+
+
+/** Generates a test archive in memory. The last entry is empty.
+ *
+ *  \param opts ZIP options (\c NULL for the defaults).
+ *  \return \a varray with the archive.
+ */
+static uint8_t *_create_archive( const zip_options_t *opts )
+{
+  uint8_t *archive = NULL;
+  varray_init( archive, 1 );
+
+  uint8_t *data = malloc( ENTRY_SIZE );
+
+  zip_t z;
+  zip_init_ex( &z, _zip_to_mem, &archive, opts );
+  for( size_t i = 0; i < NUM_ENTRIES; i++ )
+  {
+    char name[] = "entry_0";
+    name[6] = '0' + i;
+
+    zip_entry_add( &z, name, zip_get_datetime() );
+    if( i < NUM_ENTRIES - 1 )
+    {
+      _entry_data( data, i );
+      zip_entry_update( &z, data, ENTRY_SIZE );
+    }
+    zip_entry_end( &z );
+  }
+  zip_end( &z );
+  zip_release( &z );
+
+  free( data );
+  return archive;
+}
+
+
+/** Reads an archive feeding it in chunks of a given size.
+ *
+ *  \param res Output data.
+ *  \param archive Archive to read.
+ *  \param archive_len Bytes in \a archive.
+ *  \param chunk_size Bytes fed to the reader at a time.
+ *  \return \c false on error.
+ */
+static bool _read_archive( struct read_result *res, const uint8_t *archive, size_t archive_len, size_t chunk_size )
+{
+  memset( res, 0, sizeof( *res ) );
+  for( size_t i = 0; i < NUM_ENTRIES; i++ )
+    varray_init( res->data[i], 1 );
+
+  zip_reader_t r;
+  if( !zip_reader_init( &r, _collect, res ) )
+    return false;
+
+  bool rv = true;
+  for( size_t i = 0; rv && i < archive_len; i += chunk_size )
+  {
+    size_t n = ( archive_len - i < chunk_size ) ? archive_len - i : chunk_size;
+    rv = zip_reader_feed( &r, archive + i, n );
+  }
+
+  rv = rv && zip_reader_end( &r );
+  zip_reader_release( &r );
+  return rv;
+}
+
+
+/** Releases the data collected by \a _read_archive.
+ *
+ *  \param res Read data.
+ */
+static void _release_result( struct read_result *res )
+{
+  for( size_t i = 0; i < NUM_ENTRIES; i++ )
+    varray_release( res->data[i] );
+}
+
+
+TEST( RoundTrip )
+{
+  uint8_t *archive = _create_archive( NULL );
+  uint8_t *expected = malloc( ENTRY_SIZE );
+
+  const size_t chunk_sizes[] = { 1, 7, 4096, 1 << 20 };
+  for( size_t c = 0; c < sizeof( chunk_sizes ) / sizeof( chunk_sizes[0] ); c++ )
+  {
+    struct read_result res;
+    ASSERT_TRUE( _read_archive( &res, archive, varray_len( archive ), chunk_sizes[c] ) );
+    ASSERT_EQ( NUM_ENTRIES, res.num_entries );
+
+    for( size_t i = 0; i < NUM_ENTRIES; i++ )
+    {
+      char name[] = "entry_0";
+      name[6] = '0' + i;
+      ASSERT_TRUE( strcmp( name, res.names[i] ) == 0 );
+
+      if( i == NUM_ENTRIES - 1 )
+      {
+        ASSERT_EQ( 0, varray_len( res.data[i] ) );
+        continue;
+      }
+
+      _entry_data( expected, i );
+      ASSERT_EQ( ENTRY_SIZE, varray_len( res.data[i] ) );
+      ASSERT_TRUE( memcmp( expected, res.data[i], ENTRY_SIZE ) == 0 );
+    }
+
+    _release_result( &res );
+  }
+
+  free( expected );
+  varray_release( archive );
+}
+
+TEST( FullHeaders )
+{
+  /* the entries are buffered, so they are not streamed */
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.buffer_threshold = ENTRY_SIZE;
+
+  uint8_t *archive = _create_archive( &opts );
+  uint8_t *expected = malloc( ENTRY_SIZE );
+
+  struct read_result res;
+  ASSERT_TRUE( _read_archive( &res, archive, varray_len( archive ), 1000 ) );
+  ASSERT_EQ( NUM_ENTRIES, res.num_entries );
+
+  for( size_t i = 0; i < NUM_ENTRIES - 1; i++ )
+  {
+    _entry_data( expected, i );
+    ASSERT_EQ( ENTRY_SIZE, varray_len( res.data[i] ) );
+    ASSERT_TRUE( memcmp( expected, res.data[i], ENTRY_SIZE ) == 0 );
+  }
+
+  _release_result( &res );
+  free( expected );
+  varray_release( archive );
+}
+
+TEST( CorruptedData )
+{
+  uint8_t *archive = _create_archive( NULL );
+  struct read_result res;
+
+  /* corrupts the CRC of the first data descriptor (the entry data starts after the name) */
+  const uint8_t signature[] = { 0x50, 0x4b, 0x07, 0x08 };
+  uint8_t *desc = NULL;
+  for( size_t i = 0; i + 4 <= varray_len( archive ); i++ )
+    if( memcmp( archive + i, signature, 4 ) == 0 )
+    {
+      desc = archive + i;
+      break;
+    }
+
+  ASSERT_TRUE( desc != NULL );
+  desc[4] ^= 0xff;
+
+  ASSERT_FALSE( _read_archive( &res, archive, varray_len( archive ), 4096 ) );
+  ASSERT_EQ( 0, res.num_entries );
+  _release_result( &res );
+
+  varray_release( archive );
+}
+
+TEST( Truncated )
+{
+  uint8_t *archive = _create_archive( NULL );
+  struct read_result res;
+
+  /* the central directory is never reached */
+  ASSERT_FALSE( _read_archive( &res, archive, varray_len( archive ) / 2, 4096 ) );
+  _release_result( &res );
+
+  varray_release( archive );
+}
@@ -3,16 +3,26 @@
  * ZIP compression - Tests.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 /* include area */
 #include "scunit.h"
 #include "zip.h"
+#include "zip_crypto.h"
+#include "zip_map.h"
+#include "zip_reader.h"
+#include "varray.h"
 #include <sys/wait.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 
 /*-----------------------------------------------------------------------------
@@ -25,10 +35,37 @@
 /** Name of the output ZIP file. */
 #define TEST_DIR "zip_test/"
 
+/** Name of the archive the entries are copied from. */
+#define SOURCE_FILE "source.zip"
+
+/** Number of threads writing entries concurrently. */
+#define NUM_THREADS 4
+
+/** Entries written by each thread. */
+#define ENTRIES_PER_THREAD 25
+
+/** Name format of the volumes of split archives, except the last one (\a TMP_FILE). */
+#define VOLUME_FILE "test.z%02u"
+
 /** The size of the buffer used to write data. */
 #define WRITE_BUFFER_SIZE 2048
 
 
+/*-----------------------------------------------------------------------------
+   Internal data types
+-----------------------------------------------------------------------------*/
+
+/** Arguments of a thread writing entries. */
+struct writer_args
+{
+  /** ZIP context shared by the threads. */
+  zip_t *z;
+
+  /** Thread index. */
+  size_t index;
+};
+
+
 /*-----------------------------------------------------------------------------
    Internal data
 -----------------------------------------------------------------------------*/
@@ -112,6 +149,92 @@ static bool _zip_to_file( void *cb_ctx, const uint8_t *data, size_t data_len )
 }
 
 
+/** Writes Zipped data into \a TMP_FILE like a slow network would.
+ *
+ *  \param cb_ctx Unused.
+ *  \param data Zipped data.
+ *  \param data_len Zipped data length.
+ *  \return \c false on error.
+ */
+static bool _zip_to_slow_file( void *cb_ctx, const uint8_t *data, size_t data_len )
+{
+  struct timespec ts = { 0, 2000000 };
+  nanosleep( &ts, NULL );
+  return _zip_to_file( cb_ctx, data, data_len );
+}
+
+
+/** Overwrites Zipped data in \a TMP_FILE.
+ *
+ *  \param cb_ctx Unused.
+ *  \param data Zipped data.
+ *  \param data_len Zipped data length.
+ *  \param offset Offset of the data in the file.
+ *  \return \c false on error.
+ */
+static bool _zip_pwrite_file( void *cb_ctx, const uint8_t *data, size_t data_len, uint64_t offset )
+{
+  return ( pwrite( _fd, data, data_len, offset ) == data_len );
+}
+
+
+/** Discards Zipped data, for archives too large to be written.
+ *
+ *  \param cb_ctx Unused.
+ *  \param data Zipped data.
+ *  \param data_len Zipped data length.
+ *  \return \c true.
+ */
+static bool _zip_discard( void *cb_ctx, const uint8_t *data, size_t data_len )
+{
+  return true;
+}
+
+
+/** Discards overwritten Zipped data, keeping the offset.
+ *
+ *  \param cb_ctx Where the offset is stored (\c uint64_t).
+ *  \param data Zipped data.
+ *  \param data_len Zipped data length.
+ *  \param offset Offset of the data in the archive.
+ *  \return \c true.
+ */
+static bool _zip_pwrite_discard( void *cb_ctx, const uint8_t *data, size_t data_len, uint64_t offset )
+{
+  *( uint64_t * )cb_ctx = offset;
+  return true;
+}
+
+
+/** Counts the data descriptors in the test ZIP file.
+ *
+ *  \return Number of data descriptor signatures found.
+ */
+static size_t _count_data_descriptors( void )
+{
+  const uint8_t signature[] = { 0x50, 0x4b, 0x07, 0x08 };
+  uint8_t buffer[WRITE_BUFFER_SIZE];
+  size_t found = 0;
+
+  int fd = open( TMP_FILE, O_RDONLY );
+  if( fd < 0 )
+    return 0;
+
+  /* overlaps the reads so signatures between two buffers are found too */
+  ssize_t n;
+  off_t offset = 0;
+  while( ( n = pread( fd, buffer, sizeof( buffer ), offset ) ) >= ( ssize_t )sizeof( signature ) )
+  {
+    for( ssize_t i = 0; i + sizeof( signature ) <= n; i++ )
+      found += ( memcmp( buffer + i, signature, sizeof( signature ) ) == 0 );
+    offset += n - sizeof( signature ) + 1;
+  }
+
+  close( fd );
+  return found;
+}
+
+
 /** Checks that the test ZIP file is correctly formatted.
  *
  *  \return \c false if it's not well formatted.
@@ -241,6 +364,136 @@ end:
 }
 
 
+/** Closes the current volume and opens the next one as \a VOLUME_FILE.
+ *
+ *  \param cb_ctx Unused.
+ *  \param disk_num Number of the new volume.
+ *  \return \c false on error.
+ */
+static bool _zip_volume( void *cb_ctx, uint32_t disk_num )
+{
+  char name[32];
+  snprintf( name, sizeof( name ), VOLUME_FILE, disk_num + 1 );
+
+  close( _fd );
+  _fd = open( name, O_CREAT | O_WRONLY | O_TRUNC, 0644 );
+  return _fd >= 0;
+}
+
+
+/** Counts the entries read by a \a zip_reader_t.
+ *
+ *  \param cb_ctx Pointer to the counter.
+ *  \param entry Entry being read.
+ *  \param data Uncompressed data (\c NULL when the entry ends).
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error.
+ */
+static bool _count_entries( void *cb_ctx, const zip_reader_entry_t *entry, const uint8_t *data, size_t data_len )
+{
+  size_t *num_entries = cb_ctx;
+  *num_entries += ( data == NULL );
+  return true;
+}
+
+
+/** Checks the data of the test file from a given offset inflates to the expected data, i.e.
+ *  all of it was flushed.
+ *
+ *  \param offset Offset of the entry data.
+ *  \param expected Expected data.
+ *  \param expected_len Bytes in \a expected.
+ *  \return \c false on error.
+ */
+static bool _check_flushed( off_t offset, const char *expected, size_t expected_len )
+{
+  static uint8_t compressed[64 << 10];
+  static char obtained[64 << 10];
+
+  int fd = open( TMP_FILE, O_RDONLY );
+  ssize_t compressed_len = pread( fd, compressed, sizeof( compressed ), offset );
+  close( fd );
+  if( compressed_len <= 0 )
+    return false;
+
+  z_stream stream = { 0 };
+  if( inflateInit2( &stream, -15 ) != Z_OK )
+    return false;
+
+  stream.next_in = compressed;
+  stream.avail_in = compressed_len;
+  stream.next_out = ( Bytef * )obtained;
+  stream.avail_out = sizeof( obtained );
+  int rv = inflate( &stream, Z_SYNC_FLUSH );
+  size_t obtained_len = sizeof( obtained ) - stream.avail_out;
+  inflateEnd( &stream );
+
+  return ( rv == Z_OK || rv == Z_BUF_ERROR ) && stream.avail_in == 0 && obtained_len == expected_len &&
+         memcmp( obtained, expected, expected_len ) == 0;
+}
+
+
+/** Writes \a ENTRIES_PER_THREAD entries through entry handles.
+ *
+ *  \param arg Pointer to the \a writer_args.
+ *  \return \c NULL on success.
+ */
+static void *_write_entries( void *arg )
+{
+  const struct writer_args *args = arg;
+  zip_t *z = args->z;
+  for( size_t i = 0; i < ENTRIES_PER_THREAD; i++ )
+  {
+    char name[32];
+    snprintf( name, sizeof( name ), "thread_%zu/%zu", args->index, i );
+
+    zip_entry_h *h = zip_entry_open( z, name, zip_get_datetime() );
+    if( h == NULL )
+      return z;
+
+    for( size_t j = 0; j < 200; j++ )
+      if( !zip_entry_write( h, name, strlen( name ) ) )
+        return z;
+
+    if( !zip_entry_close( h ) )
+      return z;
+  }
+
+  return NULL;
+}
+
+
+/** Thread that adds two small stored entries under a rate limit, so the second one waits for
+ *  the debt left by the first.
+ *
+ *  \param arg ZIP context.
+ *  \return \c NULL on success.
+ */
+static void *_add_paced_entries( void *arg )
+{
+  zip_t *z = arg;
+  static char data[4 << 10];
+  memset( data, 'p', sizeof( data ) );
+
+  if( !zip_entry_add_data( z, "first.png", zip_get_datetime(), data, sizeof( data ) ) ||
+      !zip_entry_add_data( z, "second.png", zip_get_datetime(), data, sizeof( data ) ) )
+    return z;
+
+  return NULL;
+}
+
+
+/** Thread that closes an entry handle.
+ *
+ *  \param arg Entry handle.
+ *  \return \c NULL on success.
+ */
+static void *_close_handle( void *arg )
+{
+  return zip_entry_close( arg ) ? NULL : arg;
+}
+
+
 /** Deletes and creates the test file.
  *
  *  \return \c false on case of error.
@@ -259,6 +512,91 @@ static bool _test_file_reset( void )
 }
 
 
+/** Decrypts and decompresses an AES encrypted entry of a mapped archive.
+ *
+ *  \param m Mapped archive.
+ *  \param index Entry index.
+ *  \param password Password of the entry.
+ *  \param expected Expected entry data.
+ *  \param expected_len Bytes in \a expected.
+ *  \return \c false if the entry is not authenticated or its data is not the expected.
+ */
+static bool _check_encrypted( const zip_map_t *m, size_t index, const char *password, const void *expected,
+                              size_t expected_len )
+{
+  const zip_map_entry_t *entry = zip_map_entry( m, index );
+  const uint8_t *raw;
+  size_t raw_len;
+  if( entry == NULL || entry->method != 99U || !( entry->flags & 1U ) || entry->crc != 0 ||
+      entry->aes_version != 2U || entry->aes_strength != 3U || entry->size != expected_len ||
+      !zip_map_get_raw( m, index, &raw, &raw_len ) || raw_len < ZIP_AES_HEADER_SIZE + ZIP_AES_MAC_SIZE )
+    return false;
+
+  size_t data_len = raw_len - ZIP_AES_HEADER_SIZE - ZIP_AES_MAC_SIZE;
+  uint8_t *data = malloc( data_len + 1 );
+  uint8_t *output = malloc( expected_len + 1 );
+  memcpy( data, raw + ZIP_AES_HEADER_SIZE, data_len );
+
+  zip_hmac_t key;
+  zip_aes_t aes;
+  uint8_t mac[ZIP_AES_MAC_SIZE];
+  zip_hmac_init( &key, password, strlen( password ) );
+  bool rv = zip_aes_open( &aes, &key, raw );
+  zip_aes_decrypt( &aes, data, data_len );
+  zip_aes_finish( &aes, mac );
+  rv = rv && memcmp( mac, raw + raw_len - ZIP_AES_MAC_SIZE, sizeof( mac ) ) == 0;
+
+  if( entry->aes_method == 0U )
+    rv = rv && data_len == expected_len && memcmp( data, expected, expected_len ) == 0;
+  else
+  {
+    z_stream stream = { 0 };
+    rv = rv && entry->aes_method == 8U && inflateInit2( &stream, -MAX_WBITS ) == Z_OK;
+    stream.next_in = data;
+    stream.avail_in = data_len;
+    stream.next_out = output;
+    stream.avail_out = expected_len + 1;
+    rv = rv && inflate( &stream, Z_FINISH ) == Z_STREAM_END && stream.total_out == expected_len &&
+         memcmp( output, expected, expected_len ) == 0;
+    inflateEnd( &stream );
+  }
+
+  free( data );
+  free( output );
+  return rv;
+}
+
+
+
+/** Checks the data of an entry in a mapped archive.
+ *
+ *  \param m Mapped archive.
+ *  \param index Entry index.
+ *  \param expected Expected entry data.
+ *  \param expected_len Bytes in \a expected.
+ *  \return \c false if the data is not the expected.
+ */
+static bool _check_entry( const zip_map_t *m, size_t index, const void *expected, size_t expected_len )
+{
+  zip_map_stream_t stream;
+  if( !zip_map_stream_open( m, index, &stream ) )
+    return false;
+
+  uint8_t *data = malloc( expected_len + 1 );
+  size_t data_len = 0, n;
+  bool rv = true;
+  while( rv && !stream.finished )
+  {
+    rv = zip_map_stream_read( &stream, data + data_len, expected_len + 1 - data_len, &n );
+    data_len += n;
+  }
+  zip_map_stream_close( &stream );
+
+  rv = rv && data_len == expected_len && memcmp( data, expected, expected_len ) == 0;
+  free( data );
+  return rv;
+}
+
 
 void SETUP( void )
 {
@@ -427,3 +765,1673 @@ TEST( MultipleEntriesWithUpdates )
 
   TEARDOWN();
 }
+
+TEST( Append )
+{
+  SETUP();
+
+  /* creates an archive with the first entries */
+  zip_t z;
+  ASSERT_TRUE( zip_init( &z, _zip_to_file, NULL ) );
+
+  for( size_t i = 0; i < 5; i++ )
+  {
+    char fname[4 + 2] = "data";
+    fname[4] = '0' + i;
+    fname[5] = 0;
+
+    /* the last 2 entries are added after reopening the archive */
+    if( i == 3 )
+    {
+      ASSERT_TRUE( zip_end( &z ) );
+      zip_release( &z );
+      ASSERT_TRUE( _test_zip() );
+
+      close( _fd );
+      _fd = open( TMP_FILE, O_RDWR );
+      ASSERT_TRUE( _fd >= 0 );
+
+      ASSERT_TRUE( zip_init( &z, _zip_to_file, NULL ) );
+      ASSERT_TRUE( zip_open_append( &z, _fd ) );
+      ASSERT_EQ( 3, zip_get_num_entries( &z ) );
+
+      /* can only be done once */
+      ASSERT_FALSE( zip_open_append( &z, _fd ) );
+    }
+
+    ASSERT_TRUE( zip_entry_add( &z, fname, zip_get_datetime() ) );
+
+    char data[WRITE_BUFFER_SIZE] = { 'a' + i };
+    for( size_t i = 0; i < 100; i++ )
+      ASSERT_TRUE( zip_entry_update( &z, data, sizeof( data ) ) );
+
+    ASSERT_TRUE( zip_entry_end( &z ) );
+  }
+
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+
+  ASSERT_TRUE( _test_zip() );
+  ASSERT_TRUE( _check_zip_multiple() );
+
+  /* new entries can't start past 4 GiB, the archive is left as it was */
+  ASSERT_TRUE( zip_init( &z, _zip_to_file, NULL ) );
+  ASSERT_TRUE( zip_open_append( &z, _fd ) );
+  z.bytes_written = z.volume_written = ( uint64_t )0xffffffffU + 1;
+  ASSERT_FALSE( zip_entry_add_data( &z, "data5", zip_get_datetime(), "more", 4 ) );
+  zip_release( &z );
+  ASSERT_TRUE( _test_zip() );
+  ASSERT_TRUE( _check_zip_multiple() );
+
+  TEARDOWN();
+}
+
+TEST( CheckpointRestore )
+{
+  SETUP();
+
+  /* the first entries are spilled, so they are read back from the temporary file */
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.spill_threshold = 2;
+
+  zip_t z;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  uint8_t *checkpoint = NULL;
+  size_t checkpoint_len = 0;
+  for( size_t i = 0; i < 5; i++ )
+  {
+    char fname[4 + 2] = "data";
+    fname[4] = '0' + i;
+    fname[5] = 0;
+
+    if( i == 3 )
+    {
+      ASSERT_FALSE( zip_checkpoint( &z, NULL, 0 ) );
+
+      checkpoint_len = zip_checkpoint_size( &z );
+      checkpoint = malloc( checkpoint_len );
+      ASSERT_TRUE( zip_checkpoint( &z, checkpoint, checkpoint_len ) );
+
+      /* the job dies in the middle of the next entry */
+      char data[WRITE_BUFFER_SIZE] = { 'x' };
+      ASSERT_TRUE( zip_entry_add( &z, fname, zip_get_datetime() ) );
+      ASSERT_TRUE( zip_entry_update( &z, data, sizeof( data ) ) );
+      ASSERT_FALSE( zip_checkpoint( &z, checkpoint, checkpoint_len ) );
+      zip_release( &z );
+
+      /* restores without options, they come from the checkpoint */
+      ASSERT_TRUE( zip_init( &z, _zip_to_file, NULL ) );
+      ASSERT_FALSE( zip_restore( &z, checkpoint, checkpoint_len - 1 ) );
+      ASSERT_TRUE( zip_restore( &z, checkpoint, checkpoint_len ) );
+      ASSERT_EQ( 3, zip_get_num_entries( &z ) );
+      ASSERT_EQ( opts.spill_threshold, z.opts.spill_threshold );
+
+      ASSERT_TRUE( ftruncate( _fd, z.bytes_written ) == 0 );
+      ASSERT_TRUE( lseek( _fd, z.bytes_written, SEEK_SET ) >= 0 );
+    }
+
+    ASSERT_TRUE( zip_entry_add( &z, fname, zip_get_datetime() ) );
+
+    char data[WRITE_BUFFER_SIZE] = { 'a' + i };
+    for( size_t i = 0; i < 100; i++ )
+      ASSERT_TRUE( zip_entry_update( &z, data, sizeof( data ) ) );
+
+    ASSERT_TRUE( zip_entry_end( &z ) );
+  }
+
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+  free( checkpoint );
+
+  ASSERT_TRUE( _test_zip() );
+  ASSERT_TRUE( _check_zip_multiple() );
+  ASSERT_TRUE( _test_file_reset() );
+
+  /* checkpoints taken while entry handles are committed are consistent */
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  pthread_t threads[NUM_THREADS];
+  struct writer_args args[NUM_THREADS];
+  for( size_t i = 0; i < NUM_THREADS; i++ )
+  {
+    args[i] = ( struct writer_args ){ .z = &z, .index = i };
+    ASSERT_TRUE( pthread_create( &threads[i], NULL, _write_entries, &args[i] ) == 0 );
+  }
+
+  for( size_t checkpoints = 0; checkpoints < 20; )
+  {
+    /* the checkpoint fails when more entries are committed after its size is taken */
+    checkpoint_len = zip_checkpoint_size( &z );
+    checkpoint = malloc( checkpoint_len );
+    if( zip_checkpoint( &z, checkpoint, checkpoint_len ) )
+    {
+      zip_t restored;
+      ASSERT_TRUE( zip_init( &restored, _zip_discard, NULL ) );
+      ASSERT_TRUE( zip_restore( &restored, checkpoint, checkpoint_len ) );
+      zip_release( &restored );
+      checkpoints++;
+    }
+    free( checkpoint );
+  }
+
+  for( size_t i = 0; i < NUM_THREADS; i++ )
+  {
+    void *rv;
+    ASSERT_TRUE( pthread_join( threads[i], &rv ) == 0 );
+    ASSERT_TRUE( rv == NULL );
+  }
+
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+  ASSERT_TRUE( _test_zip() );
+
+  TEARDOWN();
+}
+
+TEST( AppendForeign )
+{
+  SETUP();
+
+  /* archives created by other tools keep their methods, flags, extra fields, attributes and
+   * comments */
+  close( _fd );
+  _fd = -1;
+  remove( TMP_FILE );
+  ASSERT_EQ( 0, WEXITSTATUS( system( "zip -q " TMP_FILE " Makefile && printf 'archive comment\\n.\\n' | zip -q -z "
+                                     TMP_FILE " && printf 'entry comment\\n' | zip -q -c " TMP_FILE " Makefile" ) ) );
+
+  _fd = open( TMP_FILE, O_RDWR );
+  ASSERT_TRUE( _fd >= 0 );
+
+  /* the old archive is left as it was until new entries are written */
+  zip_t z;
+  ASSERT_TRUE( zip_init( &z, _zip_to_file, NULL ) );
+  ASSERT_TRUE( zip_open_append( &z, _fd ) );
+  ASSERT_EQ( 1, zip_get_num_entries( &z ) );
+  ASSERT_TRUE( _test_zip() );
+
+  ASSERT_TRUE( zip_entry_add( &z, "data", zip_get_datetime() ) );
+  ASSERT_TRUE( zip_entry_update( &z, "appended", 8 ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+
+  /* the kept records can be checkpointed */
+  uint8_t checkpoint[1024];
+  ASSERT_TRUE( zip_checkpoint_size( &z ) <= sizeof( checkpoint ) );
+  ASSERT_TRUE( zip_checkpoint( &z, checkpoint, sizeof( checkpoint ) ) );
+  zip_t restored;
+  ASSERT_TRUE( zip_init( &restored, _zip_to_file, NULL ) );
+  ASSERT_TRUE( zip_restore( &restored, checkpoint, zip_checkpoint_size( &z ) ) );
+  ASSERT_EQ( 2, zip_get_num_entries( &restored ) );
+  zip_release( &restored );
+
+  ASSERT_TRUE( zip_end( &z ) );
+  ASSERT_EQ( lseek( _fd, 0, SEEK_END ), z.bytes_written );
+  zip_release( &z );
+
+  ASSERT_TRUE( _test_zip() );
+  ASSERT_EQ( 0, WEXITSTATUS( system( "unzip -z " TMP_FILE " | grep -q 'archive comment'" ) ) );
+  ASSERT_EQ( 0, WEXITSTATUS( system( "unzip -Z -v " TMP_FILE " Makefile | grep -q 'entry comment'" ) ) );
+  ASSERT_EQ( 0, WEXITSTATUS( system( "unzip -Z " TMP_FILE " Makefile | grep -q '^-rw'" ) ) );
+
+  TEARDOWN();
+}
+
+TEST( Seekable )
+{
+  SETUP();
+
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.pwrite_cb = _zip_pwrite_file;
+
+  zip_t z;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  for( size_t i = 0; i < 5; i++ )
+  {
+    char fname[4 + 2] = "data";
+    fname[4] = '0' + i;
+    fname[5] = 0;
+
+    ASSERT_TRUE( zip_entry_add( &z, fname, zip_get_datetime() ) );
+
+    char data[WRITE_BUFFER_SIZE] = { 'a' + i };
+    for( size_t i = 0; i < 100; i++ )
+      ASSERT_TRUE( zip_entry_update( &z, data, sizeof( data ) ) );
+
+    ASSERT_TRUE( zip_entry_end( &z ) );
+  }
+
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+
+  /* the local headers have the sizes, so there are no data descriptors */
+  ASSERT_EQ( 0, _count_data_descriptors() );
+  ASSERT_TRUE( _test_zip() );
+  ASSERT_TRUE( _check_zip_multiple() );
+
+  TEARDOWN();
+}
+
+TEST( LargeEntries )
+{
+  SETUP();
+
+  /* the output is discarded, and the sizes are set close to the limit rather than reached */
+  uint64_t patched = 0;
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.pwrite_cb = _zip_pwrite_discard;
+
+  zip_t z;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_discard, &patched, &opts ) );
+
+  char data[WRITE_BUFFER_SIZE];
+  memset( data, 'x', sizeof( data ) );
+  ASSERT_TRUE( zip_entry_add( &z, "large", zip_get_datetime() ) );
+  ASSERT_TRUE( zip_entry_update( &z, data, sizeof( data ) ) );
+  varray_last( z.entries ).size = 0xffffffffU - 100;
+  ASSERT_FALSE( zip_entry_update( &z, data, sizeof( data ) ) );
+
+  /* the sizes are never patched wrapped, and the archive can't be completed */
+  ASSERT_FALSE( zip_entry_end( &z ) );
+  ASSERT_EQ( 0, patched );
+  ASSERT_FALSE( zip_end( &z ) );
+  zip_release( &z );
+
+  /* a handle fails, but the archive can be completed without its entry */
+  opts.pwrite_cb = NULL;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_discard, NULL, &opts ) );
+  zip_entry_h *h = zip_entry_open( &z, "large", zip_get_datetime() );
+  ASSERT_TRUE( h != NULL );
+  ASSERT_TRUE( zip_entry_write( h, data, sizeof( data ) ) );
+  h->entry.size = 0xffffffffU;
+  ASSERT_FALSE( zip_entry_write( h, data, sizeof( data ) ) );
+  ASSERT_TRUE( h->failed );
+  ASSERT_FALSE( zip_entry_close( h ) );
+
+  ASSERT_TRUE( zip_entry_add_data( &z, "small", zip_get_datetime(), data, 100 ) );
+  ASSERT_TRUE( zip_end( &z ) );
+  ASSERT_EQ( 1, zip_get_num_entries( &z ) );
+  zip_release( &z );
+
+  /* the central directory can start past 4 GiB, but not the local headers */
+  opts.manifest = "MANIFEST.sha256";
+  for( size_t i = 0; i < 2; i++ )
+  {
+    ASSERT_TRUE( zip_init_ex( &z, _zip_discard, NULL, &opts ) );
+    z.bytes_written = z.volume_written = 0xffffffffU - 20;
+    ASSERT_TRUE( zip_entry_add_data( &z, "below", zip_get_datetime(), data, 100 ) );
+    ASSERT_EQ( 0xffffffffU - 20, z.entries[0].offset );
+    ASSERT_TRUE( z.volume_written > 0xffffffffU );
+    ASSERT_FALSE( zip_entry_add_data( &z, "above", zip_get_datetime(), data, 100 ) );
+    ASSERT_FALSE( zip_entry_add( &z, "above", zip_get_datetime() ) );
+    ASSERT_EQ( 1, zip_get_num_entries( &z ) );
+
+    /* the manifest is an entry too, the ZIP64 end records are written without it */
+    ASSERT_EQ( i == 1, zip_end( &z ) );
+    zip_release( &z );
+    opts.manifest = NULL;
+  }
+
+  TEARDOWN();
+}
+
+TEST( BufferedEntries )
+{
+  SETUP();
+
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.buffer_threshold = 64 << 10;
+
+  zip_t z;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  for( size_t i = 0; i < 5; i++ )
+  {
+    char fname[4 + 2] = "data";
+    fname[4] = '0' + i;
+    fname[5] = 0;
+
+    ASSERT_TRUE( zip_entry_add( &z, fname, zip_get_datetime() ) );
+
+    /* only the odd entries exceed the threshold */
+    char data[WRITE_BUFFER_SIZE] = { 'a' + i };
+    for( size_t j = 0; j < ( ( i % 2 ) ? 100 : 10 ); j++ )
+      ASSERT_TRUE( zip_entry_update( &z, data, sizeof( data ) ) );
+
+    ASSERT_TRUE( zip_entry_end( &z ) );
+  }
+
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+
+  /* the large entries are streamed */
+  ASSERT_EQ( 2, _count_data_descriptors() );
+  ASSERT_TRUE( _test_zip() );
+
+  TEARDOWN();
+}
+
+TEST( SpilledCentralDirectory )
+{
+  SETUP();
+
+  /* more entries than the EOCD can count, so the ZIP64 records are used too */
+  const size_t num_entries = 70000;
+
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.spill_threshold = 1000;
+
+  zip_t z;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  for( size_t i = 0; i < num_entries; i++ )
+  {
+    char fname[16];
+    snprintf( fname, sizeof( fname ), "%05zu", i );
+
+    ASSERT_TRUE( zip_entry_add( &z, fname, zip_get_datetime() ) );
+    ASSERT_TRUE( zip_entry_update( &z, fname, strlen( fname ) ) );
+    ASSERT_TRUE( zip_entry_end( &z ) );
+
+    /* the entries array never grows past the threshold */
+    ASSERT_TRUE( varray_capacity( z.entries ) <= opts.spill_threshold + 1 );
+  }
+
+  /* the tail includes the spilled records and the ZIP64 records */
+  ASSERT_EQ( num_entries, zip_get_num_entries( &z ) );
+  off_t tail_offset = lseek( _fd, 0, SEEK_CUR );
+  size_t tail_size = zip_get_tail_size( &z );
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+
+  ASSERT_EQ( tail_offset + tail_size, lseek( _fd, 0, SEEK_CUR ) );
+  ASSERT_TRUE( _test_zip() );
+
+  /* checks the order of the central directory */
+  zip_map_t m;
+  ASSERT_TRUE( zip_map_open( &m, TMP_FILE ) );
+  ASSERT_EQ( num_entries, zip_map_num_entries( &m ) );
+
+  for( size_t i = 0; i < num_entries; i += 997 )
+  {
+    char fname[16];
+    size_t index;
+    snprintf( fname, sizeof( fname ), "%05zu", i );
+    ASSERT_TRUE( zip_map_find( &m, fname, &index ) );
+    ASSERT_EQ( i, index );
+  }
+
+  zip_map_close( &m );
+
+  TEARDOWN();
+}
+
+TEST( TailSize )
+{
+  SETUP();
+
+  zip_t z;
+  ASSERT_TRUE( zip_init( &z, _zip_to_file, NULL ) );
+  ASSERT_EQ( 22, zip_get_tail_size( &z ) );
+
+  size_t central_dir_size = 0;
+  for( size_t i = 0; i < 10; i++ )
+  {
+    char fname[4 + 2] = "data";
+    fname[4] = '0' + i;
+    fname[5] = 0;
+
+    ASSERT_TRUE( zip_entry_add( &z, fname, zip_get_datetime() ) );
+    ASSERT_TRUE( zip_entry_update( &z, fname, strlen( fname ) ) );
+
+    /* the record of the entry is encoded when it ends */
+    ASSERT_EQ( central_dir_size, zip_get_central_dir_size( &z ) );
+    ASSERT_TRUE( zip_entry_end( &z ) );
+    central_dir_size += 46 + strlen( fname );
+    ASSERT_EQ( central_dir_size, zip_get_central_dir_size( &z ) );
+  }
+
+  off_t tail_offset = lseek( _fd, 0, SEEK_CUR );
+  size_t tail_size = zip_get_tail_size( &z );
+  ASSERT_EQ( central_dir_size + 22, tail_size );
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+
+  ASSERT_EQ( tail_offset + tail_size, lseek( _fd, 0, SEEK_CUR ) );
+  ASSERT_TRUE( _test_zip() );
+
+  TEARDOWN();
+}
+
+TEST( SplitVolumes )
+{
+  SETUP();
+
+  const size_t volume_size = 64 << 10;
+
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.volume_cb = _zip_volume;
+  opts.volume_size = volume_size;
+
+  /* the first volume is a .z01 file too */
+  zip_t z;
+  ASSERT_TRUE( _zip_volume( NULL, 0 ) );
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  /* incompressible data, so the entries span several volumes */
+  uint32_t seed = 1;
+  for( size_t i = 0; i < 5; i++ )
+  {
+    char fname[4 + 2] = "data";
+    fname[4] = '0' + i;
+    fname[5] = 0;
+
+    ASSERT_TRUE( zip_entry_add( &z, fname, zip_get_datetime() ) );
+
+    uint8_t data[WRITE_BUFFER_SIZE];
+    for( size_t j = 0; j < 25; j++ )
+    {
+      for( size_t k = 0; k < sizeof( data ); k++ )
+      {
+        seed = seed * 1103515245U + 12345U;
+        data[k] = ( uint8_t )( seed >> 16 );
+      }
+      ASSERT_TRUE( zip_entry_update( &z, data, sizeof( data ) ) );
+    }
+
+    ASSERT_TRUE( zip_entry_end( &z ) );
+  }
+
+  ASSERT_TRUE( zip_end( &z ) );
+  uint32_t num_volumes = z.disk_num + 1;
+  zip_release( &z );
+  ASSERT_TRUE( num_volumes >= 4 );
+
+  /* the last volume is the .zip file */
+  char name[32];
+  snprintf( name, sizeof( name ), VOLUME_FILE, num_volumes );
+  ASSERT_TRUE( rename( name, TMP_FILE ) == 0 );
+
+  /* joins the volumes, which are full except the last one */
+  uint8_t *archive = NULL;
+  varray_init( archive, volume_size );
+  for( uint32_t i = 0; i < num_volumes; i++ )
+  {
+    snprintf( name, sizeof( name ), VOLUME_FILE, i + 1 );
+
+    FILE *f = fopen( i == num_volumes - 1 ? TMP_FILE : name, "rb" );
+    ASSERT_TRUE( f != NULL );
+
+    uint8_t buffer[WRITE_BUFFER_SIZE];
+    size_t n;
+    size_t volume_len = 0;
+    while( ( n = fread( buffer, 1, sizeof( buffer ), f ) ) > 0 )
+    {
+      varray_append( archive, buffer, n );
+      volume_len += n;
+    }
+    fclose( f );
+    remove( name );
+
+    ASSERT_TRUE( volume_len <= volume_size );
+    ASSERT_TRUE( i == num_volumes - 1 || volume_len > volume_size - 256 );
+  }
+
+  /* the end of central directory record points to the last volume */
+  const uint8_t *eocd = archive + varray_len( archive ) - 22;
+  ASSERT_EQ( 0x06054b50U, eocd[0] | eocd[1] << 8 | eocd[2] << 16 | ( uint32_t )eocd[3] << 24 );
+  ASSERT_EQ( num_volumes - 1, eocd[4] | eocd[5] << 8 );
+  ASSERT_EQ( 5, eocd[10] | eocd[11] << 8 );
+
+  /* the streaming reader skips the split signature and checks every entry */
+  size_t num_entries = 0;
+  zip_reader_t r;
+  ASSERT_TRUE( zip_reader_init( &r, _count_entries, &num_entries ) );
+  ASSERT_TRUE( zip_reader_feed( &r, archive, varray_len( archive ) ) );
+  ASSERT_TRUE( zip_reader_end( &r ) );
+  zip_reader_release( &r );
+  ASSERT_EQ( 5, num_entries );
+
+  varray_release( archive );
+
+  /* volumes can't be combined with in-place patching */
+  opts.pwrite_cb = _zip_pwrite_file;
+  ASSERT_FALSE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  /* nor be too small, or too large for the 32 bit offsets of the records */
+  opts.pwrite_cb = NULL;
+  opts.volume_size = ( 64 << 10 ) - 1;
+  ASSERT_FALSE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  opts.volume_size = ( size_t )0xffffffffU + 1;
+  ASSERT_FALSE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  opts.volume_size = 0xffffffffU;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  zip_release( &z );
+
+  TEARDOWN();
+}
+
+TEST( Flush )
+{
+  SETUP();
+
+  /* the default rules hold the first bytes of the entries for their magic */
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.num_rules = zip_get_default_rules( &opts.rules );
+  opts.flush_bytes = 60;
+
+  zip_t z;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  ASSERT_FALSE( zip_entry_flush( &z ) );
+  ASSERT_TRUE( zip_entry_poll( &z ) );
+  ASSERT_TRUE( zip_entry_add( &z, "log", zip_get_datetime() ) );
+
+  /* the data starts after the local header */
+  const off_t data_offset = 30 + 3;
+
+  char log[4096] = "";
+  size_t log_len = 0;
+  for( size_t i = 0; i < 50; i++ )
+  {
+    /* a line alone is below the bound, two lines are above it */
+    char line[64];
+    size_t line_len = snprintf( line, sizeof( line ), "%04zu: a line of a slowly produced log\n", i );
+    memcpy( log + log_len, line, line_len );
+    log_len += line_len;
+
+    ASSERT_TRUE( zip_entry_update( &z, line, line_len ) );
+    if( i % 2 == 1 )
+      ASSERT_TRUE( _check_flushed( data_offset, log, log_len ) );
+  }
+
+  /* explicit flush with no bounds */
+  ASSERT_TRUE( zip_entry_set_flush( &z, 0, 0 ) );
+  ASSERT_TRUE( zip_entry_update( &z, "last line\n", 10 ) );
+  ASSERT_FALSE( _check_flushed( data_offset, log, log_len + 10 ) );
+  memcpy( log + log_len, "last line\n", 10 );
+  log_len += 10;
+  ASSERT_TRUE( zip_entry_flush( &z ) );
+  ASSERT_TRUE( _check_flushed( data_offset, log, log_len ) );
+
+  /* once the updates stop, the latency is only bounded by polling */
+  ASSERT_TRUE( zip_entry_set_flush( &z, 0, 50 ) );
+  ASSERT_TRUE( zip_entry_update( &z, "polled line\n", 12 ) );
+  memcpy( log + log_len, "polled line\n", 12 );
+  log_len += 12;
+  ASSERT_TRUE( zip_entry_poll( &z ) );
+  ASSERT_FALSE( _check_flushed( data_offset, log, log_len ) );
+  struct timespec ts = { 0, 60000000 };
+  nanosleep( &ts, NULL );
+  ASSERT_TRUE( zip_entry_poll( &z ) );
+  ASSERT_TRUE( _check_flushed( data_offset, log, log_len ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+
+  /* the first bytes held back for the rules count as not flushed */
+  ASSERT_TRUE( zip_entry_add( &z, "held", zip_get_datetime() ) );
+  ASSERT_TRUE( zip_entry_set_flush( &z, 0, 50 ) );
+  ASSERT_TRUE( zip_entry_update( &z, "ab", 2 ) );
+  ASSERT_TRUE( z.sniffing );
+  nanosleep( &ts, NULL );
+  ASSERT_TRUE( zip_entry_poll( &z ) );
+  ASSERT_FALSE( z.sniffing );
+  ASSERT_EQ( 0, z.unflushed );
+
+  ASSERT_TRUE( zip_entry_end( &z ) );
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+
+  ASSERT_TRUE( _test_zip() );
+
+  TEARDOWN();
+}
+
+TEST( InterleavedEntries )
+{
+  SETUP();
+
+  /* the last entry is spooled to a temporary file */
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.spool_size = 16 << 10;
+
+  zip_t z;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  zip_entry_h *h[3];
+  const char *names[3] = { "text", "numbers", "random" };
+  for( size_t i = 0; i < 3; i++ )
+    ASSERT_TRUE( ( h[i] = zip_entry_open( &z, names[i], zip_get_datetime() ) ) != NULL );
+
+  uint32_t seed = 1;
+  for( size_t j = 0; j < 100; j++ )
+  {
+    char line[64];
+    int line_len = snprintf( line, sizeof( line ), "line %zu of some text\n", j );
+    ASSERT_TRUE( zip_entry_write( h[0], line, line_len ) );
+
+    line_len = snprintf( line, sizeof( line ), "%zu\n", j * j );
+    ASSERT_TRUE( zip_entry_write( h[1], line, line_len ) );
+
+    uint8_t data[1024];
+    for( size_t k = 0; k < sizeof( data ); k++ )
+    {
+      seed = seed * 1103515245U + 12345U;
+      data[k] = ( uint8_t )( seed >> 16 );
+    }
+    ASSERT_TRUE( zip_entry_write( h[2], data, sizeof( data ) ) );
+  }
+  ASSERT_TRUE( h[2]->spool_file != NULL );
+
+  /* a handle can't be committed while a sequential entry is in process */
+  ASSERT_TRUE( zip_entry_add( &z, "sequential", zip_get_datetime() ) );
+  ASSERT_TRUE( zip_entry_update( &z, "sequential data", 15 ) );
+  ASSERT_FALSE( zip_entry_close( h[1] ) );
+  ASSERT_FALSE( zip_end( &z ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+
+  /* the entries are stored in closing order */
+  ASSERT_TRUE( zip_entry_close( h[1] ) );
+  ASSERT_TRUE( zip_entry_close( h[2] ) );
+  ASSERT_FALSE( zip_end( &z ) );
+  ASSERT_TRUE( zip_entry_close( h[0] ) );
+  ASSERT_EQ( 4, zip_get_num_entries( &z ) );
+
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+
+  ASSERT_TRUE( _test_zip() );
+
+  /* full local headers, no data descriptors */
+  ASSERT_EQ( 1, _count_data_descriptors() );
+
+  const char *order[4] = { "sequential", "numbers", "random", "text" };
+  zip_map_t m;
+  ASSERT_TRUE( zip_map_open( &m, TMP_FILE ) );
+  for( size_t i = 0; i < 4; i++ )
+  {
+    size_t index;
+    ASSERT_TRUE( zip_map_find( &m, order[i], &index ) );
+    ASSERT_EQ( i, index );
+  }
+  ASSERT_EQ( 100 * 1024, zip_map_entry( &m, 2 )->size );
+  zip_map_close( &m );
+
+  /* on another thread, closing waits for the sequential entry to end */
+  ASSERT_TRUE( _test_file_reset() );
+  ASSERT_TRUE( zip_init( &z, _zip_to_file, NULL ) );
+  ASSERT_TRUE( ( h[0] = zip_entry_open( &z, "handle", zip_get_datetime() ) ) != NULL );
+  ASSERT_TRUE( zip_entry_write( h[0], "handle data", 11 ) );
+  ASSERT_TRUE( zip_entry_add( &z, "sequential", zip_get_datetime() ) );
+
+  pthread_t thread;
+  ASSERT_TRUE( pthread_create( &thread, NULL, _close_handle, h[0] ) == 0 );
+  struct timespec ts = { 0, 50000000 };
+  nanosleep( &ts, NULL );
+  ASSERT_TRUE( zip_entry_update( &z, "sequential data", 15 ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+
+  void *rv;
+  ASSERT_TRUE( pthread_join( thread, &rv ) == 0 );
+  ASSERT_TRUE( rv == NULL );
+  ASSERT_EQ( 2, zip_get_num_entries( &z ) );
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+
+  ASSERT_TRUE( _test_zip() );
+  ASSERT_TRUE( zip_map_open( &m, TMP_FILE ) );
+  size_t index;
+  ASSERT_TRUE( zip_map_find( &m, "sequential", &index ) );
+  ASSERT_EQ( 0, index );
+  zip_map_close( &m );
+
+  TEARDOWN();
+}
+
+TEST( SpoolFailure )
+{
+  SETUP();
+
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.spool_size = 16 << 10;
+
+  zip_t z;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  /* the temporary file can't take the spool in memory, or can't grow later */
+  struct rlimit limit;
+  ASSERT_EQ( 0, getrlimit( RLIMIT_FSIZE, &limit ) );
+  rlim_t file_sizes[2] = { 8 << 10, 64 << 10 };
+  for( size_t i = 0; i < 2; i++ )
+  {
+    zip_entry_h *h = zip_entry_open( &z, "random", zip_get_datetime() );
+    ASSERT_TRUE( h != NULL );
+
+    struct rlimit small_limit = { file_sizes[i], limit.rlim_max };
+    signal( SIGXFSZ, SIG_IGN );
+    ASSERT_EQ( 0, setrlimit( RLIMIT_FSIZE, &small_limit ) );
+
+    uint32_t seed = 1;
+    bool written = true;
+    for( size_t j = 0; j < 200 && written; j++ )
+    {
+      uint8_t data[1024];
+      for( size_t k = 0; k < sizeof( data ); k++ )
+      {
+        seed = seed * 1103515245U + 12345U;
+        data[k] = ( uint8_t )( seed >> 16 );
+      }
+      written = zip_entry_write( h, data, sizeof( data ) );
+    }
+
+    setrlimit( RLIMIT_FSIZE, &limit );
+    signal( SIGXFSZ, SIG_DFL );
+    ASSERT_FALSE( written );
+
+    /* the spool is dropped, and the handle only takes its memory and its stream */
+    ASSERT_TRUE( h->failed );
+    ASSERT_TRUE( h->spool == NULL && h->spool_file == NULL );
+    ASSERT_EQ( sizeof( zip_entry_h ) + sizeof( z_stream ), z.handle_memory );
+    ASSERT_FALSE( zip_entry_write( h, "more", 4 ) );
+
+    /* closing releases the handle without adding the entry */
+    ASSERT_FALSE( zip_entry_close( h ) );
+    ASSERT_EQ( sizeof( z_stream ), z.handle_memory );
+    ASSERT_EQ( 0, z.open_handles );
+  }
+
+  /* the archive can still be completed */
+  ASSERT_TRUE( zip_entry_add_data( &z, "after", zip_get_datetime(), "after the failure", 17 ) );
+  ASSERT_TRUE( zip_end( &z ) );
+  ASSERT_EQ( 1, zip_get_num_entries( &z ) );
+  zip_release( &z );
+
+  ASSERT_TRUE( _test_zip() );
+
+  TEARDOWN();
+}
+
+TEST( ConcurrentHandles )
+{
+  SETUP();
+
+  zip_t z;
+  ASSERT_TRUE( zip_init( &z, _zip_to_file, NULL ) );
+
+  pthread_t threads[NUM_THREADS];
+  struct writer_args args[NUM_THREADS];
+  for( size_t i = 0; i < NUM_THREADS; i++ )
+  {
+    args[i] = ( struct writer_args ){ .z = &z, .index = i };
+    ASSERT_TRUE( pthread_create( &threads[i], NULL, _write_entries, &args[i] ) == 0 );
+  }
+
+  for( size_t i = 0; i < NUM_THREADS; i++ )
+  {
+    void *rv;
+    ASSERT_TRUE( pthread_join( threads[i], &rv ) == 0 );
+    ASSERT_TRUE( rv == NULL );
+  }
+
+  /* the streams of the closed handles are kept for reuse */
+  ASSERT_EQ( NUM_THREADS * ENTRIES_PER_THREAD, zip_get_num_entries( &z ) );
+  ASSERT_TRUE( varray_len( z.stream_pool ) <= NUM_THREADS );
+
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+
+  ASSERT_TRUE( _test_zip() );
+
+  TEARDOWN();
+}
+
+TEST( SmallEntries )
+{
+  SETUP();
+
+  zip_t z;
+  ASSERT_TRUE( zip_init( &z, _zip_to_file, NULL ) );
+
+  char text[1000];
+  for( size_t i = 0; i < sizeof( text ); i++ )
+    text[i] = "small entry "[i % 12];
+
+  uint8_t random[100];
+  uint32_t seed = 1;
+  for( size_t i = 0; i < sizeof( random ); i++ )
+  {
+    seed = seed * 1103515245U + 12345U;
+    random[i] = ( uint8_t )( seed >> 16 );
+  }
+
+  char *large = malloc( 100 << 10 );
+  for( size_t i = 0; i < ( 100 << 10 ); i++ )
+    large[i] = "large entry "[i % 12];
+
+  ASSERT_TRUE( zip_entry_add_data( &z, "text", zip_get_datetime(), text, sizeof( text ) ) );
+  ASSERT_TRUE( zip_entry_add_data( &z, "random", zip_get_datetime(), random, sizeof( random ) ) );
+  ASSERT_TRUE( zip_entry_add_data( &z, "empty", zip_get_datetime(), NULL, 0 ) );
+  ASSERT_TRUE( zip_entry_add_data( &z, "large", zip_get_datetime(), large, 100 << 10 ) );
+
+  /* not while a sequential entry is in process */
+  ASSERT_TRUE( zip_entry_add( &z, "sequential", zip_get_datetime() ) );
+  ASSERT_FALSE( zip_entry_add_data( &z, "text", zip_get_datetime(), text, sizeof( text ) ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+  free( large );
+
+  ASSERT_TRUE( _test_zip() );
+
+  /* the small entries have full local headers, incompressible data is stored */
+  zip_map_t m;
+  ASSERT_TRUE( zip_map_open( &m, TMP_FILE ) );
+  ASSERT_EQ( 5, zip_map_num_entries( &m ) );
+  ASSERT_EQ( 8, zip_map_entry( &m, 0 )->method );
+  ASSERT_TRUE( zip_map_entry( &m, 0 )->size_compressed < sizeof( text ) / 4 );
+  ASSERT_EQ( 0, zip_map_entry( &m, 0 )->flags );
+  ASSERT_EQ( 0, zip_map_entry( &m, 1 )->method );
+  ASSERT_EQ( 0, zip_map_entry( &m, 2 )->method );
+  ASSERT_EQ( 8, zip_map_entry( &m, 3 )->method );
+
+  const uint8_t *stored;
+  size_t stored_len;
+  ASSERT_TRUE( zip_map_get_stored( &m, 1, &stored, &stored_len ) );
+  ASSERT_EQ( sizeof( random ), stored_len );
+  ASSERT_TRUE( memcmp( random, stored, stored_len ) == 0 );
+  zip_map_close( &m );
+
+  TEARDOWN();
+}
+
+TEST( MemoryUsage )
+{
+  SETUP();
+
+  zip_t z;
+  ASSERT_TRUE( zip_init( &z, _zip_to_file, NULL ) );
+
+  /* the default deflate stream takes about 256 KiB */
+  size_t usage = zip_memory_usage( &z );
+  ASSERT_TRUE( usage > ( 256 << 10 ) && usage < ( 300 << 10 ) );
+
+  /* each handle takes another stream, which stays in the pool once closed */
+  zip_entry_h *h = zip_entry_open( &z, "handle", zip_get_datetime() );
+  ASSERT_TRUE( h != NULL );
+  ASSERT_TRUE( zip_memory_usage( &z ) > usage + ( 256 << 10 ) );
+  ASSERT_TRUE( zip_entry_write( h, "handle data", 11 ) );
+  ASSERT_TRUE( zip_entry_close( h ) );
+  ASSERT_TRUE( zip_memory_usage( &z ) > usage + ( 256 << 10 ) );
+
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+  ASSERT_TRUE( _test_file_reset() );
+
+  /* a small budget uses smaller streams and buffers */
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.memory_budget = 64 << 10;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  char text[WRITE_BUFFER_SIZE];
+  for( size_t i = 0; i < sizeof( text ); i++ )
+    text[i] = "budget "[i % 7];
+
+  for( size_t i = 0; i < 20; i++ )
+  {
+    char name[32];
+    snprintf( name, sizeof( name ), "small_%zu", i );
+    ASSERT_TRUE( zip_entry_add_data( &z, name, zip_get_datetime(), text, 100 + i ) );
+  }
+
+  ASSERT_TRUE( zip_entry_add( &z, "large", zip_get_datetime() ) );
+  for( size_t i = 0; i < 100; i++ )
+    ASSERT_TRUE( zip_entry_update( &z, text, sizeof( text ) ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+
+  ASSERT_TRUE( zip_memory_usage( &z ) <= opts.memory_budget );
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+  ASSERT_TRUE( _test_zip() );
+
+  /* the largest profile, and budgets too small for any profile */
+  opts.memory_budget = 1 << 20;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  ASSERT_EQ( 9, z.mem_level );
+  ASSERT_TRUE( zip_memory_usage( &z ) <= opts.memory_budget );
+  zip_release( &z );
+
+  /* the verifier takes its share of the budget first, and its inflate streams are counted */
+  opts.verify = true;
+  ASSERT_FALSE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  opts.memory_budget = 2 << 20;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  usage = zip_memory_usage( &z );
+  ASSERT_TRUE( usage > ZIP_VERIFY_BUFFER_SIZE );
+  ASSERT_TRUE( zip_entry_add( &z, "verified", zip_get_datetime() ) );
+  ASSERT_TRUE( zip_memory_usage( &z ) >= usage + ZIP_VERIFY_INFLATE_SIZE );
+  for( size_t i = 0; i < 100; i++ )
+    ASSERT_TRUE( zip_entry_update( &z, text, sizeof( text ) ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+  ASSERT_TRUE( zip_memory_usage( &z ) <= opts.memory_budget );
+  ASSERT_TRUE( zip_verify_wait( &z ) );
+  ASSERT_TRUE( zip_memory_usage( &z ) < usage + ZIP_VERIFY_INFLATE_SIZE );
+  zip_release( &z );
+  opts.verify = false;
+
+  opts.memory_budget = 16 << 10;
+  ASSERT_FALSE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  TEARDOWN();
+}
+
+TEST( Rules )
+{
+  SETUP();
+
+  /* logs are compressed fast, text with the best level and raw data stored */
+  const zip_rule_t rules[] = {
+    { "*.log", NULL, 0, 1 },
+    { "*.txt", NULL, 0, 9 },
+    { NULL, "RAW", 3, 0 },
+  };
+
+  const zip_rule_t invalid[] = { { "*", NULL, 0, 10 } };
+  const zip_rule_t long_magic[] = { { NULL, "seventeen bytes..", ZIP_RULE_MAX_MAGIC_LEN + 1, 0 } };
+
+  zip_t z;
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.rules = invalid;
+  opts.num_rules = 1;
+  ASSERT_FALSE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  opts.rules = long_magic;
+  ASSERT_FALSE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  opts.rules = rules;
+  opts.num_rules = sizeof( rules ) / sizeof( rules[0] );
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  char text[WRITE_BUFFER_SIZE];
+  for( size_t i = 0; i < sizeof( text ); i++ )
+    text[i] = "RAW rules "[i % 10];
+
+  const char *names[] = { "a.log", "b.TXT", "c.bin", "d.dat" };
+  for( size_t i = 0; i < 4; i++ )
+  {
+    ASSERT_TRUE( zip_entry_add( &z, names[i], zip_get_datetime() ) );
+    for( size_t j = 0; j < 10; j++ )
+      ASSERT_TRUE( zip_entry_update( &z, text + ( i == 3 ), sizeof( text ) - 1 ) );
+    ASSERT_TRUE( zip_entry_end( &z ) );
+  }
+  ASSERT_TRUE( zip_entry_add_data( &z, "e.bin", zip_get_datetime(), text, 100 ) );
+
+  /* the magic bytes can be split across updates, entries shorter than them match no magic */
+  ASSERT_TRUE( zip_entry_add( &z, "f.bin", zip_get_datetime() ) );
+  ASSERT_TRUE( zip_entry_update( &z, text, 2 ) );
+  for( size_t j = 0; j < 10; j++ )
+    ASSERT_TRUE( zip_entry_update( &z, text + 2, sizeof( text ) - 2 ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+  ASSERT_TRUE( zip_entry_add( &z, "g.bin", zip_get_datetime() ) );
+  ASSERT_TRUE( zip_entry_update( &z, text, 2 ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+
+  /* entry handles follow the rules too */
+  zip_entry_h *h[2];
+  h[0] = zip_entry_open( &z, "h.bin", zip_get_datetime() );
+  h[1] = zip_entry_open( &z, "i.log", zip_get_datetime() );
+  ASSERT_TRUE( h[0] != NULL && h[1] != NULL );
+  ASSERT_TRUE( zip_entry_write( h[0], text, 1 ) );
+  for( size_t j = 0; j < 10; j++ )
+  {
+    ASSERT_TRUE( zip_entry_write( h[0], text + 1, sizeof( text ) - 1 ) );
+    ASSERT_TRUE( zip_entry_write( h[1], text, sizeof( text ) ) );
+  }
+  ASSERT_TRUE( zip_entry_close( h[0] ) );
+  ASSERT_TRUE( zip_entry_close( h[1] ) );
+
+  ASSERT_EQ( 2, zip_get_rule_hits( &z, 0 ) );
+  ASSERT_EQ( 1, zip_get_rule_hits( &z, 1 ) );
+  ASSERT_EQ( 4, zip_get_rule_hits( &z, 2 ) );
+  ASSERT_EQ( 2, zip_get_rule_hits( &z, 3 ) );
+  ASSERT_EQ( 0, zip_get_rule_hits( &z, 4 ) );
+
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+  ASSERT_TRUE( _test_zip() );
+
+  /* streamed entries with level 0 are deflate stored blocks, small ones and handles are STORED */
+  zip_map_t m;
+  ASSERT_TRUE( zip_map_open( &m, TMP_FILE ) );
+  ASSERT_TRUE( zip_map_entry( &m, 0 )->size_compressed < zip_map_entry( &m, 0 )->size / 10 );
+  ASSERT_TRUE( zip_map_entry( &m, 1 )->size_compressed < zip_map_entry( &m, 1 )->size / 10 );
+  ASSERT_TRUE( zip_map_entry( &m, 2 )->size_compressed >= zip_map_entry( &m, 2 )->size );
+  ASSERT_TRUE( zip_map_entry( &m, 3 )->size_compressed < zip_map_entry( &m, 3 )->size / 10 );
+  ASSERT_EQ( 0, zip_map_entry( &m, 4 )->method );
+  ASSERT_TRUE( zip_map_entry( &m, 5 )->size_compressed >= zip_map_entry( &m, 5 )->size );
+  ASSERT_EQ( 2, zip_map_entry( &m, 6 )->size );
+  ASSERT_TRUE( zip_map_entry( &m, 7 )->size_compressed >= zip_map_entry( &m, 7 )->size );
+  ASSERT_EQ( 8, zip_map_entry( &m, 2 )->method );
+  ASSERT_EQ( 0, zip_map_entry( &m, 7 )->method );
+  ASSERT_TRUE( zip_map_entry( &m, 8 )->size_compressed < zip_map_entry( &m, 8 )->size / 10 );
+  zip_map_close( &m );
+  ASSERT_TRUE( _test_file_reset() );
+
+  /* the default rules store compressed formats once enabled, and only then */
+  for( size_t i = 0; i < 2; i++ )
+  {
+    zip_options_init( &opts );
+    if( i == 1 )
+      opts.num_rules = zip_get_default_rules( &opts.rules );
+    ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+    ASSERT_TRUE( zip_entry_add( &z, "photo.JPG", zip_get_datetime() ) );
+    ASSERT_TRUE( zip_entry_update( &z, text, sizeof( text ) ) );
+    ASSERT_TRUE( zip_entry_end( &z ) );
+    ASSERT_TRUE( zip_entry_add_data( &z, "icon", zip_get_datetime(), "\x89PNG small image, small image", 29 ) );
+    ASSERT_TRUE( zip_entry_add_data( &z, "notes", zip_get_datetime(), text, 200 ) );
+    ASSERT_TRUE( zip_end( &z ) );
+    zip_release( &z );
+    ASSERT_TRUE( _test_zip() );
+
+    ASSERT_TRUE( zip_map_open( &m, TMP_FILE ) );
+    ASSERT_EQ( i == 1, zip_map_entry( &m, 0 )->size_compressed >= sizeof( text ) );
+    ASSERT_EQ( i == 1 ? 0 : 8, zip_map_entry( &m, 1 )->method );
+    ASSERT_EQ( 8, zip_map_entry( &m, 2 )->method );
+    zip_map_close( &m );
+    ASSERT_TRUE( _test_file_reset() );
+  }
+
+  TEARDOWN();
+}
+
+TEST( StoredEntries )
+{
+  SETUP();
+
+  char *text = malloc( 100 << 10 );
+  for( size_t i = 0; i < ( 100 << 10 ); i++ )
+    text[i] = "stored entry "[i % 13] + ( i >> 10 ) % 3;
+
+  const zip_rule_t rules[] = { { "*.raw", NULL, 0, 0 } };
+  const char *names[] = { "small.raw", "large.raw", "flushed.raw", "text.txt", "handle.raw" };
+  const size_t sizes[] = { 2000, 100 << 10, 2000, 100 << 10, 50 << 10 };
+
+  /* level 0 is STORED whenever the header gets the sizes: on seekable outputs, for the buffered
+   * entries that stay small and for handles (the others are deflate stored blocks) */
+  for( size_t i = 0; i < 4; i++ )
+  {
+    bool seekable = ( i & 1 );
+    bool secure = ( i & 2 );
+    const uint16_t methods[] = { 0, seekable ? 0 : 8, seekable ? 0 : 8, 8, 0 };
+
+    zip_t z;
+    zip_options_t opts;
+    zip_options_init( &opts );
+    opts.rules = rules;
+    opts.num_rules = 1;
+    opts.buffer_threshold = 4 << 10;
+    opts.pwrite_cb = seekable ? _zip_pwrite_file : NULL;
+    opts.verify = secure;
+    opts.password = secure ? "secret" : NULL;
+    ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+    for( size_t j = 0; j < 4; j++ )
+    {
+      ASSERT_TRUE( zip_entry_add( &z, names[j], zip_get_datetime() ) );
+      ASSERT_TRUE( zip_entry_update( &z, text, sizes[j] / 2 ) );
+      ASSERT_TRUE( j != 2 || zip_entry_flush( &z ) );
+      ASSERT_TRUE( zip_entry_update( &z, text + sizes[j] / 2, sizes[j] / 2 ) );
+      ASSERT_TRUE( zip_entry_end( &z ) );
+    }
+
+    zip_entry_h *h = zip_entry_open( &z, names[4], zip_get_datetime() );
+    ASSERT_TRUE( h != NULL );
+    ASSERT_TRUE( zip_entry_write( h, text, sizes[4] ) );
+    ASSERT_TRUE( zip_entry_close( h ) );
+
+    ASSERT_TRUE( !secure || zip_verify_wait( &z ) );
+    ASSERT_TRUE( zip_end( &z ) );
+    zip_release( &z );
+
+    /* the large and flushed entries are streamed unless the output is seekable */
+    ASSERT_EQ( seekable ? 0 : 3, _count_data_descriptors() );
+    ASSERT_TRUE( secure || _test_zip() );
+
+    zip_map_t m;
+    ASSERT_TRUE( zip_map_open( &m, TMP_FILE ) );
+    ASSERT_EQ( 5, zip_map_num_entries( &m ) );
+    for( size_t j = 0; j < 5; j++ )
+    {
+      const zip_map_entry_t *entry = zip_map_entry( &m, j );
+      ASSERT_EQ( methods[j], secure ? entry->aes_method : entry->method );
+      ASSERT_TRUE( secure ? _check_encrypted( &m, j, "secret", text, sizes[j] )
+                          : _check_entry( &m, j, text, sizes[j] ) );
+    }
+    zip_map_close( &m );
+    ASSERT_TRUE( _test_file_reset() );
+  }
+
+  free( text );
+  TEARDOWN();
+}
+
+TEST( RateLimit )
+{
+  SETUP();
+
+  /* 1 MiB/s after a burst of 64 KiB, the data is stored so the output is as large */
+  zip_t z;
+  zip_options_t opts;
+  /* the .png entries are stored by the default rules, so their size is known */
+  zip_options_init( &opts );
+  opts.num_rules = zip_get_default_rules( &opts.rules );
+  opts.rate_limit = 1 << 20;
+  opts.rate_burst = 64 << 10;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  char data[WRITE_BUFFER_SIZE];
+  for( size_t i = 0; i < sizeof( data ); i++ )
+    data[i] = "rate "[i % 5];
+
+  struct timespec start;
+  struct timespec end;
+  clock_gettime( CLOCK_MONOTONIC, &start );
+
+  ASSERT_TRUE( zip_entry_add( &z, "paced.png", zip_get_datetime() ) );
+  for( size_t i = 0; i < ( 256 << 10 ) / sizeof( data ); i++ )
+    ASSERT_TRUE( zip_entry_update( &z, data, sizeof( data ) ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+
+  clock_gettime( CLOCK_MONOTONIC, &end );
+  uint64_t elapsed_ms = ( end.tv_sec - start.tv_sec ) * 1000 + ( end.tv_nsec - start.tv_nsec ) / 1000000;
+  ASSERT_TRUE( elapsed_ms >= 150 );
+
+  zip_rate_stats_t stats;
+  zip_get_rate_stats( &z, &stats );
+  ASSERT_TRUE( stats.bytes > ( 256 << 10 ) );
+  ASSERT_TRUE( stats.rate > 0 && stats.rate < ( 2 << 20 ) );
+  ASSERT_TRUE( stats.throttled_us > 0 );
+
+  /* a slower limit set at runtime puts the bucket in debt, which non-blocking callers can see */
+  ASSERT_FALSE( zip_set_rate_limit( &z, 1000, UINT64_MAX ) );
+  ASSERT_TRUE( zip_set_rate_limit( &z, 1000, 1000 ) );
+  ASSERT_TRUE( zip_entry_add_data( &z, "debt.png", zip_get_datetime(), data, sizeof( data ) ) );
+  zip_get_rate_stats( &z, &stats );
+  ASSERT_TRUE( stats.delay_us > 500000 );
+
+  /* removing the limit doesn't wait for the debt */
+  ASSERT_TRUE( zip_set_rate_limit( &z, 0, 0 ) );
+  zip_get_rate_stats( &z, &stats );
+  ASSERT_EQ( 0, stats.delay_us );
+  ASSERT_TRUE( zip_end( &z ) );
+
+  zip_get_rate_stats( &z, &stats );
+  ASSERT_EQ( lseek( _fd, 0, SEEK_END ), stats.bytes );
+  zip_release( &z );
+  ASSERT_TRUE( _test_zip() );
+
+  TEARDOWN();
+}
+
+TEST( RateLimitedHandles )
+{
+  SETUP();
+
+  /* each entry of the thread costs a second of the rate */
+  zip_t z;
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.num_rules = zip_get_default_rules( &opts.rules );
+  opts.rate_limit = 4 << 10;
+  opts.rate_burst = 256;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  pthread_t thread;
+  ASSERT_TRUE( pthread_create( &thread, NULL, _add_paced_entries, &z ) == 0 );
+  struct timespec ts = { 0, 100000000 };
+  nanosleep( &ts, NULL );
+
+  /* handles are opened and written while the thread is throttled */
+  struct timespec start;
+  struct timespec end;
+  clock_gettime( CLOCK_MONOTONIC, &start );
+
+  zip_entry_h *h = zip_entry_open( &z, "handle", zip_get_datetime() );
+  ASSERT_TRUE( h != NULL );
+  for( size_t i = 0; i < 1000; i++ )
+    ASSERT_TRUE( zip_entry_write( h, "written while throttled ", 24 ) );
+  ASSERT_TRUE( zip_memory_usage( &z ) > 0 );
+
+  clock_gettime( CLOCK_MONOTONIC, &end );
+  uint64_t elapsed_ms = ( end.tv_sec - start.tv_sec ) * 1000 + ( end.tv_nsec - start.tv_nsec ) / 1000000;
+  ASSERT_TRUE( elapsed_ms < 300 );
+
+  void *rv;
+  ASSERT_TRUE( pthread_join( thread, &rv ) == 0 );
+  ASSERT_TRUE( rv == NULL );
+
+  /* committing the handle is output, so it would wait for the debt */
+  ASSERT_TRUE( zip_set_rate_limit( &z, 0, 0 ) );
+  ASSERT_TRUE( zip_entry_close( h ) );
+  ASSERT_EQ( 3, zip_get_num_entries( &z ) );
+
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+  ASSERT_TRUE( _test_zip() );
+
+  TEARDOWN();
+}
+
+TEST( AdaptiveLevel )
+{
+  SETUP();
+
+  /* text that deflate compresses to about a third */
+  char *data = malloc( 1 << 20 );
+  uint32_t seed = 1;
+  for( size_t i = 0; i < ( 1 << 20 ); i++ )
+  {
+    seed = seed * 1103515245U + 12345U;
+    data[i] = ( seed >> 16 ) % 7 ? "adaptive level "[i % 15] : ( char )( 'a' + ( seed >> 20 ) % 26 );
+  }
+
+  /* a slow output raises the level */
+  zip_t z;
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.num_rules = zip_get_default_rules( &opts.rules );
+  opts.adaptive = true;
+  opts.min_level = 5;
+  opts.max_level = 7;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_slow_file, NULL, &opts ) );
+  ASSERT_EQ( 6, z.adaptive_level );
+
+  ASSERT_TRUE( zip_entry_add( &z, "slow", zip_get_datetime() ) );
+  for( size_t i = 0; i < 4 && z.adaptive_level < 7; i++ )
+    ASSERT_TRUE( zip_entry_update( &z, data, 1 << 20 ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+  ASSERT_EQ( 7, z.adaptive_level );
+
+  /* the entries with a rule keep its level */
+  ASSERT_TRUE( zip_entry_add( &z, "slow.png", zip_get_datetime() ) );
+  ASSERT_FALSE( z.adaptive_entry );
+  ASSERT_TRUE( zip_entry_update( &z, data, 1 << 16 ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+  ASSERT_TRUE( _test_zip() );
+  ASSERT_TRUE( _test_file_reset() );
+
+  /* a fast output lowers it */
+  opts.min_level = 1;
+  opts.max_level = 2;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  ASSERT_EQ( 2, z.adaptive_level );
+
+  ASSERT_TRUE( zip_entry_add( &z, "fast", zip_get_datetime() ) );
+  for( size_t i = 0; i < 16 && z.adaptive_level > 1; i++ )
+    ASSERT_TRUE( zip_entry_update( &z, data, 1 << 20 ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+  ASSERT_EQ( 1, z.adaptive_level );
+
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+  ASSERT_TRUE( _test_zip() );
+
+  /* invalid ranges */
+  opts.min_level = 3;
+  ASSERT_FALSE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  opts.max_level = 10;
+  ASSERT_FALSE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  free( data );
+  TEARDOWN();
+}
+
+TEST( Encryption )
+{
+  SETUP();
+
+  char *text = malloc( 200 << 10 );
+  for( size_t i = 0; i < ( 200 << 10 ); i++ )
+    text[i] = "encrypted entry "[i % 16] + ( i >> 10 ) % 3;
+
+  uint8_t random[100];
+  ASSERT_TRUE( zip_random( random, sizeof( random ) ) );
+
+  zip_t z;
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.password = "secret";
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  /* every way of adding entries encrypts them */
+  ASSERT_TRUE( zip_entry_add( &z, "streamed", zip_get_datetime() ) );
+  for( size_t i = 0; i < 200; i++ )
+    ASSERT_TRUE( zip_entry_update( &z, text + ( i << 10 ), 1 << 10 ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+  ASSERT_TRUE( zip_entry_add_data( &z, "small", zip_get_datetime(), text, 1000 ) );
+  ASSERT_TRUE( zip_entry_add_data( &z, "random", zip_get_datetime(), random, sizeof( random ) ) );
+
+  zip_entry_h *h = zip_entry_open( &z, "handle", zip_get_datetime() );
+  ASSERT_TRUE( h != NULL );
+  ASSERT_TRUE( zip_entry_write( h, text, 50 << 10 ) );
+  ASSERT_TRUE( zip_entry_close( h ) );
+
+  /* the records with the AES extra field are restored from checkpoints */
+  uint8_t *checkpoint = malloc( zip_checkpoint_size( &z ) );
+  ASSERT_TRUE( zip_checkpoint( &z, checkpoint, zip_checkpoint_size( &z ) ) );
+  zip_t restored;
+  ASSERT_TRUE( zip_init( &restored, _zip_to_file, NULL ) );
+  ASSERT_TRUE( zip_restore( &restored, checkpoint, zip_checkpoint_size( &z ) ) );
+  ASSERT_EQ( 4, zip_get_num_entries( &restored ) );
+  ASSERT_TRUE( restored.entries[0].encrypted );
+  ASSERT_EQ( 8, restored.entries[0].method );
+  zip_release( &restored );
+  free( checkpoint );
+
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+
+  /* reopened archives keep the encrypted entries */
+  close( _fd );
+  _fd = open( TMP_FILE, O_RDWR );
+  ASSERT_TRUE( _fd >= 0 );
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  ASSERT_TRUE( zip_open_append( &z, _fd ) );
+  ASSERT_TRUE( zip_entry_add_data( &z, "appended", zip_get_datetime(), text, 3000 ) );
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+
+  zip_map_t m;
+  ASSERT_TRUE( zip_map_open( &m, TMP_FILE ) );
+  ASSERT_EQ( 5, zip_map_num_entries( &m ) );
+  ASSERT_TRUE( _check_encrypted( &m, 0, "secret", text, 200 << 10 ) );
+  ASSERT_TRUE( _check_encrypted( &m, 1, "secret", text, 1000 ) );
+  ASSERT_TRUE( _check_encrypted( &m, 2, "secret", random, sizeof( random ) ) );
+  ASSERT_EQ( 0, zip_map_entry( &m, 2 )->aes_method );
+  ASSERT_TRUE( _check_encrypted( &m, 3, "secret", text, 50 << 10 ) );
+  ASSERT_TRUE( _check_encrypted( &m, 4, "secret", text, 3000 ) );
+  ASSERT_FALSE( _check_encrypted( &m, 0, "wrong", text, 200 << 10 ) );
+
+  /* encrypted entries can't be read without the password */
+  zip_map_stream_t stream;
+  ASSERT_FALSE( zip_map_stream_open( &m, 0, &stream ) );
+  zip_map_close( &m );
+
+  free( text );
+  TEARDOWN();
+}
+
+TEST( VerifyOnWrite )
+{
+  SETUP();
+
+  char *text = malloc( 200 << 10 );
+  for( size_t i = 0; i < ( 200 << 10 ); i++ )
+    text[i] = "verified entry "[i % 15] + ( i >> 10 ) % 5;
+
+  uint8_t random[100];
+  ASSERT_TRUE( zip_random( random, sizeof( random ) ) );
+
+  zip_t z;
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.verify = true;
+  opts.buffer_threshold = 4 << 10;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  /* every way of adding entries is verified: streamed, buffered, small, stored and handles */
+  ASSERT_TRUE( zip_entry_add( &z, "streamed", zip_get_datetime() ) );
+  for( size_t i = 0; i < 200; i++ )
+    ASSERT_TRUE( zip_entry_update( &z, text + ( i << 10 ), 1 << 10 ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+  ASSERT_TRUE( zip_entry_add( &z, "buffered", zip_get_datetime() ) );
+  ASSERT_TRUE( zip_entry_update( &z, text, 2000 ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+  ASSERT_TRUE( zip_entry_add_data( &z, "small", zip_get_datetime(), text, 1000 ) );
+  ASSERT_TRUE( zip_entry_add_data( &z, "random", zip_get_datetime(), random, sizeof( random ) ) );
+
+  zip_entry_h *h = zip_entry_open( &z, "handle", zip_get_datetime() );
+  ASSERT_TRUE( h != NULL );
+  ASSERT_TRUE( zip_entry_write( h, text, 50 << 10 ) );
+  ASSERT_TRUE( zip_entry_close( h ) );
+
+  ASSERT_TRUE( zip_verify_wait( &z ) );
+  zip_verify_stats_t stats;
+  zip_get_verify_stats( &z, &stats );
+  ASSERT_EQ( 5, stats.entries );
+  ASSERT_EQ( 0, stats.failures );
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+  ASSERT_TRUE( _test_zip() );
+
+  /* the data is verified before it's encrypted, and a mismatch fails the archive */
+  close( _fd );
+  _fd = open( TMP_FILE, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR );
+  ASSERT_TRUE( _fd >= 0 );
+  opts.password = "secret";
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  ASSERT_TRUE( zip_entry_add_data( &z, "encrypted", zip_get_datetime(), text, 3000 ) );
+  ASSERT_TRUE( zip_entry_add( &z, "corrupt", zip_get_datetime() ) );
+  ASSERT_TRUE( zip_entry_update( &z, text, 100 << 10 ) );
+  z.entries[varray_len( z.entries ) - 1].crc ^= 1;
+  ASSERT_TRUE( zip_entry_end( &z ) );
+
+  ASSERT_FALSE( zip_end( &z ) );
+  zip_get_verify_stats( &z, &stats );
+  ASSERT_EQ( 2, stats.entries );
+  ASSERT_EQ( 1, stats.failures );
+  ASSERT_TRUE( strcmp( stats.last_failure, "corrupt" ) == 0 );
+
+  /* an entry that doesn't end is dropped on release */
+  ASSERT_TRUE( zip_entry_add( &z, "unfinished", zip_get_datetime() ) );
+  ASSERT_TRUE( zip_entry_update( &z, text, 10 << 10 ) );
+  zip_release( &z );
+
+  free( text );
+  TEARDOWN();
+}
+
+TEST( Digests )
+{
+  SETUP();
+
+  char *text = malloc( 200 << 10 );
+  for( size_t i = 0; i < ( 200 << 10 ); i++ )
+    text[i] = "digested entry "[i % 15] + ( i >> 10 ) % 7;
+
+  uint8_t expected[3][ZIP_SHA256_SIZE];
+  size_t sizes[3] = { 200 << 10, 1000, 50 << 10 };
+  for( size_t i = 0; i < 3; i++ )
+  {
+    zip_sha256_t s;
+    zip_sha256_init( &s );
+    zip_sha256_update( &s, text, sizes[i] );
+    zip_sha256_final( &s, expected[i] );
+  }
+
+  zip_t z;
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.manifest = "MANIFEST.sha256";
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+
+  /* the updates are not aligned to the hashed blocks */
+  ASSERT_TRUE( zip_entry_add( &z, "streamed", zip_get_datetime() ) );
+  for( size_t i = 0; i < sizes[0]; i += 7000 )
+    ASSERT_TRUE( zip_entry_update( &z, text + i, ( sizes[0] - i < 7000 ) ? sizes[0] - i : 7000 ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+  ASSERT_TRUE( zip_entry_add_data( &z, "small", zip_get_datetime(), text, sizes[1] ) );
+
+  zip_entry_h *h = zip_entry_open( &z, "handle", zip_get_datetime() );
+  ASSERT_TRUE( h != NULL );
+  ASSERT_TRUE( zip_entry_write( h, text, sizes[2] ) );
+  ASSERT_TRUE( zip_entry_close( h ) );
+
+  for( size_t i = 0; i < 3; i++ )
+    ASSERT_TRUE( memcmp( z.entries[i].sha256, expected[i], ZIP_SHA256_SIZE ) == 0 );
+
+  /* the manifest is the last entry, and checks the extracted files */
+  ASSERT_TRUE( zip_end( &z ) );
+  ASSERT_EQ( 4, zip_get_num_entries( &z ) );
+  zip_release( &z );
+  ASSERT_TRUE( _unzip() );
+  int stat = system( "cd " TEST_DIR " && sha256sum -c --quiet --strict MANIFEST.sha256" );
+  ASSERT_EQ( EXIT_SUCCESS, WEXITSTATUS( stat ) );
+
+  /* the entries kept from the old archive and the raw copies have no digest, but are listed */
+  stat = system( "cp " TMP_FILE " " SOURCE_FILE );
+  ASSERT_EQ( EXIT_SUCCESS, WEXITSTATUS( stat ) );
+  zip_map_t source;
+  ASSERT_TRUE( zip_map_open( &source, SOURCE_FILE ) );
+
+  close( _fd );
+  _fd = open( TMP_FILE, O_RDWR );
+  ASSERT_TRUE( _fd >= 0 );
+  opts.manifest = "MANIFEST2.sha256";
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  ASSERT_TRUE( zip_open_append( &z, _fd ) );
+  ASSERT_TRUE( zip_entry_copy_raw( &z, &source, 1, "copied" ) );
+  ASSERT_TRUE( zip_entry_add_data( &z, "added", zip_get_datetime(), text, sizes[1] ) );
+  ASSERT_TRUE( zip_end( &z ) );
+  ASSERT_EQ( 7, zip_get_num_entries( &z ) );
+  zip_release( &z );
+  zip_map_close( &source );
+  remove( SOURCE_FILE );
+
+  ASSERT_TRUE( _unzip() );
+  stat = system( "cd " TEST_DIR " && sha256sum -c --quiet --strict MANIFEST2.sha256" );
+  ASSERT_EQ( EXIT_SUCCESS, WEXITSTATUS( stat ) );
+  stat = system( "grep -qx '# no digest  copied' " TEST_DIR "MANIFEST2.sha256 && "
+                 "test $( grep -c '^# no digest  ' " TEST_DIR "MANIFEST2.sha256 ) -eq 5 && "
+                 "test $( grep -c '  added$' " TEST_DIR "MANIFEST2.sha256 ) -eq 1" );
+  ASSERT_EQ( EXIT_SUCCESS, WEXITSTATUS( stat ) );
+
+  free( text );
+  TEARDOWN();
+}
+
+TEST( CopyRaw )
+{
+  SETUP();
+
+  char *text = malloc( 200 << 10 );
+  for( size_t i = 0; i < ( 200 << 10 ); i++ )
+    text[i] = "copied entry "[i % 13] + ( i >> 10 ) % 3;
+
+  uint8_t random[100];
+  ASSERT_TRUE( zip_random( random, sizeof( random ) ) );
+
+  /* the source has streamed entries (with data descriptors), a stored one and an encrypted one */
+  zip_t z;
+  ASSERT_TRUE( zip_init( &z, _zip_to_file, NULL ) );
+  ASSERT_TRUE( zip_entry_add( &z, "streamed", zip_get_datetime() ) );
+  ASSERT_TRUE( zip_entry_update( &z, text, 200 << 10 ) );
+  ASSERT_TRUE( zip_entry_end( &z ) );
+  ASSERT_TRUE( zip_entry_add_data( &z, "random", zip_get_datetime(), random, sizeof( random ) ) );
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+
+  close( _fd );
+  _fd = open( TMP_FILE, O_RDWR );
+  ASSERT_TRUE( _fd >= 0 );
+
+  zip_options_t opts;
+  zip_options_init( &opts );
+  opts.password = "secret";
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  ASSERT_TRUE( zip_open_append( &z, _fd ) );
+  ASSERT_TRUE( zip_entry_add_data( &z, "encrypted", zip_get_datetime(), text, 3000 ) );
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_release( &z );
+  close( _fd );
+  ASSERT_EQ( 0, rename( TMP_FILE, SOURCE_FILE ) );
+  _fd = open( TMP_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR );
+  ASSERT_TRUE( _fd >= 0 );
+
+  zip_map_t source;
+  ASSERT_TRUE( zip_map_open( &source, SOURCE_FILE ) );
+  ASSERT_EQ( 3, zip_map_num_entries( &source ) );
+
+  /* the copies are verified, and mixed with new entries */
+  zip_options_init( &opts );
+  opts.verify = true;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  ASSERT_TRUE( zip_entry_add_data( &z, "new", zip_get_datetime(), text, 500 ) );
+  ASSERT_TRUE( zip_entry_copy_raw( &z, &source, 0, "renamed" ) );
+  ASSERT_TRUE( zip_entry_copy_raw( &z, &source, 1, NULL ) );
+  ASSERT_TRUE( zip_entry_copy_raw( &z, &source, 2, NULL ) );
+  ASSERT_FALSE( zip_entry_copy_raw( &z, &source, 3, NULL ) );
+
+  /* names are never truncated, renamed or not */
+  char long_name[ZIP_ENTRY_MAX_NAME_LEN + 2];
+  memset( long_name, 'n', sizeof( long_name ) - 1 );
+  long_name[sizeof( long_name ) - 1] = '\0';
+  ASSERT_FALSE( zip_entry_copy_raw( &z, &source, 0, long_name ) );
+  ASSERT_TRUE( zip_end( &z ) );
+
+  zip_verify_stats_t stats;
+  zip_get_verify_stats( &z, &stats );
+  ASSERT_EQ( 3, stats.entries );
+  ASSERT_EQ( 0, stats.failures );
+  zip_release( &z );
+
+  /* unzip can't test the AES entries */
+  int stat = system( "unzip -tqq " TMP_FILE " -x encrypted" );
+  ASSERT_EQ( EXIT_SUCCESS, WEXITSTATUS( stat ) );
+
+  zip_map_t m;
+  ASSERT_TRUE( zip_map_open( &m, TMP_FILE ) );
+  ASSERT_EQ( 4, zip_map_num_entries( &m ) );
+  ASSERT_TRUE( _check_entry( &m, 0, text, 500 ) );
+  size_t index;
+  ASSERT_TRUE( zip_map_find( &m, "renamed", &index ) );
+  ASSERT_EQ( 1, index );
+  ASSERT_EQ( 0, zip_map_entry( &m, 1 )->flags & 8 );
+  ASSERT_TRUE( _check_entry( &m, 1, text, 200 << 10 ) );
+  ASSERT_TRUE( zip_map_find( &m, "random", &index ) );
+  ASSERT_EQ( 0, zip_map_entry( &m, 2 )->method );
+  ASSERT_TRUE( _check_entry( &m, 2, random, sizeof( random ) ) );
+
+  /* encrypted entries are copied without the password */
+  ASSERT_TRUE( _check_encrypted( &m, 3, "secret", text, 3000 ) );
+  zip_map_close( &m );
+
+  /* archives with a password encrypt the plain entries they copy */
+  ASSERT_TRUE( _test_file_reset() );
+  zip_options_init( &opts );
+  opts.password = "other";
+  opts.verify = true;
+  ASSERT_TRUE( zip_init_ex( &z, _zip_to_file, NULL, &opts ) );
+  ASSERT_TRUE( zip_entry_copy_raw( &z, &source, 0, NULL ) );
+  ASSERT_TRUE( zip_entry_copy_raw( &z, &source, 1, NULL ) );
+  ASSERT_TRUE( zip_entry_copy_raw( &z, &source, 2, NULL ) );
+  ASSERT_TRUE( zip_end( &z ) );
+  zip_get_verify_stats( &z, &stats );
+  ASSERT_EQ( 2, stats.entries );
+  ASSERT_EQ( 0, stats.failures );
+  zip_release( &z );
+  zip_map_close( &source );
+
+  ASSERT_TRUE( zip_map_open( &m, TMP_FILE ) );
+  ASSERT_EQ( 3, zip_map_num_entries( &m ) );
+  ASSERT_TRUE( _check_encrypted( &m, 0, "other", text, 200 << 10 ) );
+  ASSERT_TRUE( _check_encrypted( &m, 1, "other", random, sizeof( random ) ) );
+  ASSERT_EQ( 0, zip_map_entry( &m, 1 )->aes_method );
+  ASSERT_TRUE( _check_encrypted( &m, 2, "secret", text, 3000 ) );
+  zip_map_close( &m );
+
+  remove( SOURCE_FILE );
+  free( text );
+  TEARDOWN();
+}
@@ -0,0 +1,761 @@
+/**
+ * \file
+ * zipstream - Streams files, directories or stdin into a ZIP archive.
+ *
+ * Build it with \c make \c tool. Run \c zipstream \c -h for the options.
+ */
+
+/* O_DIRECT */
+#define _GNU_SOURCE
+
+/* include area */
+#include "zip.h"
+#include "zip_async.h"
+#include "zip_dir.h"
+#include "varray.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/*-----------------------------------------------------------------------------
+   Internal definitions
+-----------------------------------------------------------------------------*/
+
+/** Alignment of the buffers, offsets and sizes written with \c O_DIRECT. */
+#define DIRECT_ALIGNMENT 4096
+
+/** Size of the buffer of the \c O_DIRECT sink. */
+#define DIRECT_BUFFER_SIZE ( 1 << 20 )
+
+/** Default bytes read from the inputs at a time. */
+#define DEFAULT_READ_SIZE ( 256 << 10 )
+
+
+/*-----------------------------------------------------------------------------
+   Internal data types
+-----------------------------------------------------------------------------*/
+
+/** Output sink types. */
+enum sink_type
+{
+  SINK_FD,
+  SINK_DIRECT,
+  SINK_URING
+};
+
+/** Output sink. */
+struct sink
+{
+  /** Sink type. */
+  enum sink_type type;
+
+  /** Output file descriptor. */
+  int fd;
+
+  /** Aligned buffer of the \c O_DIRECT sink. */
+  uint8_t *buffer;
+
+  /** Bytes in \a buffer. */
+  size_t buffer_len;
+
+  /** Bytes received. */
+  uint64_t bytes;
+};
+
+/** Command line settings. */
+struct settings
+{
+  /** ZIP options. */
+  zip_options_t opts;
+
+  /** Directory ingestion options. */
+  zip_dir_options_t dir_opts;
+
+  /** Rules: the defaults plus one for every other entry. */
+  zip_rule_t rules[64];
+
+  /** Output file (\c NULL for stdout). */
+  const char *output;
+
+  /** File with the list of inputs, one per line (\c NULL if not used, "-" for stdin). */
+  const char *list;
+
+  /** Entry name for the data read from stdin. */
+  const char *stdin_name;
+
+  /** Bytes read from the inputs at a time. */
+  size_t read_size;
+
+  /** Whether the compression runs on a background thread. */
+  bool async;
+
+  /** Whether the statistics are printed. */
+  bool stats;
+};
+
+/** State of a run. */
+struct run
+{
+  /** ZIP context. */
+  zip_t z;
+
+  /** Background compression (if \a async is set). */
+  zip_async_t a;
+
+  /** Command line settings. */
+  const struct settings *s;
+
+  /** Bytes read from the inputs. */
+  uint64_t input_bytes;
+};
+
+
+/*-----------------------------------------------------------------------------
+   Helper functions
+-----------------------------------------------------------------------------*/
+
+/** Prints the usage of the tool.
+ *
+ *  \param name Program name.
+ */
+static void _usage( const char *name )
+{
+  fprintf( stderr,
+           "Usage: %s [options] [inputs...]\n"
+           "\n"
+           "Streams files, directories and stdin (\"-\") into a ZIP archive.\n"
+           "\n"
+           "  -o FILE       output file (stdout by default)\n"
+           "  -L FILE       read the inputs from FILE, one per line (\"-\" for stdin)\n"
+           "  -n NAME       entry name for the data read from stdin (\"stdin\" by default)\n"
+           "  -l LEVEL      compression level of the entries without a rule (0-9)\n"
+           "  -m METHOD     \"deflate\" (default) or \"store\" for every entry\n"
+           "  -R            disable the default rules that store compressed formats\n"
+           "  -a MIN:MAX    adapt the level to the output between MIN and MAX\n"
+           "  -e            encrypt the entries with AES-256, the password is read from the\n"
+           "                ZIPSTREAM_PASSWORD environment variable\n"
+           "  -V            verify the entries on a helper thread as they are written\n"
+           "  -D NAME       add a manifest entry with the SHA-256 of every entry\n"
+           "  -j N          reader threads for directories (4 by default)\n"
+           "  -p N          files prefetched ahead for directories (16 by default)\n"
+           "  -S            add the files of directories sorted by name\n"
+           "  -t            compress on a background thread\n"
+           "  -b SIZE       bytes read from the inputs at a time (256 KiB by default)\n"
+           "  -M BYTES      memory budget of the deflate streams and buffers\n"
+           "  -r BYTES/S    limit the output rate\n"
+           "  -k SINK       output sink: \"fd\" (default), \"direct\" (O_DIRECT) or \"uring\"\n"
+           "  -q            don't print the statistics\n"
+           "  -h            show this help\n",
+           name );
+}
+
+
+/** Parses a size with an optional K, M or G suffix.
+ *
+ *  \param str String to parse.
+ *  \param value Output value.
+ *  \return \c false if it's not a valid size.
+ */
+static bool _parse_size( const char *str, uint64_t *value )
+{
+  char *end;
+  errno = 0;
+  unsigned long long n = strtoull( str, &end, 10 );
+  if( errno != 0 || end == str )
+    return false;
+
+  switch( *end )
+  {
+    case 'G':
+    case 'g':
+      n <<= 10;
+      /* fall through */
+    case 'M':
+    case 'm':
+      n <<= 10;
+      /* fall through */
+    case 'K':
+    case 'k':
+      n <<= 10;
+      end++;
+      break;
+  }
+
+  *value = n;
+  return ( *end == '\0' );
+}
+
+
+/** Writes a whole buffer to a file descriptor.
+ *
+ *  \param fd File descriptor.
+ *  \param data Data to write.
+ *  \param data_len Bytes in \a data.
+ *  \return \c false on error.
+ */
+static bool _write_all( int fd, const uint8_t *data, size_t data_len )
+{
+  while( data_len > 0 )
+  {
+    ssize_t n = write( fd, data, data_len );
+    if( n < 0 && errno != EINTR )
+      return false;
+    if( n > 0 )
+    {
+      data += n;
+      data_len -= n;
+    }
+  }
+
+  return true;
+}
+
+
+/** Output callback writing to the sink.
+ *
+ *  \param cb_ctx Sink.
+ *  \param data Zipped data.
+ *  \param data_len Zipped data length.
+ *  \return \c false on error.
+ */
+static bool _sink_write( void *cb_ctx, const uint8_t *data, size_t data_len )
+{
+  struct sink *sink = cb_ctx;
+  sink->bytes += data_len;
+  if( sink->type == SINK_FD )
+    return _write_all( sink->fd, data, data_len );
+
+  /* O_DIRECT only takes whole aligned blocks */
+  while( data_len > 0 )
+  {
+    size_t n = DIRECT_BUFFER_SIZE - sink->buffer_len;
+    n = ( n < data_len ) ? n : data_len;
+    memcpy( sink->buffer + sink->buffer_len, data, n );
+    sink->buffer_len += n;
+    data += n;
+    data_len -= n;
+
+    if( sink->buffer_len == DIRECT_BUFFER_SIZE )
+    {
+      if( !_write_all( sink->fd, sink->buffer, DIRECT_BUFFER_SIZE ) )
+        return false;
+      sink->buffer_len = 0;
+    }
+  }
+
+  return true;
+}
+
+
+/** Callback for seekable outputs, patching the local headers.
+ *
+ *  \param cb_ctx Sink.
+ *  \param data Data to write.
+ *  \param data_len Bytes in \a data.
+ *  \param offset Offset of the data in the output.
+ *  \return \c false on error.
+ */
+static bool _sink_pwrite( void *cb_ctx, const uint8_t *data, size_t data_len, uint64_t offset )
+{
+  struct sink *sink = cb_ctx;
+  return ( pwrite( sink->fd, data, data_len, offset ) == ( ssize_t )data_len );
+}
+
+
+/** Opens the output sink.
+ *
+ *  \param sink Sink to open.
+ *  \param type Sink type.
+ *  \param path Output file (\c NULL for stdout).
+ *  \return \c false on error.
+ */
+static bool _sink_open( struct sink *sink, enum sink_type type, const char *path )
+{
+  memset( sink, 0, sizeof( *sink ) );
+  sink->type = type;
+  sink->fd = STDOUT_FILENO;
+
+  if( type == SINK_URING )
+  {
+    fprintf( stderr, "io_uring sinks are not supported by this build\n" );
+    return false;
+  }
+
+  if( type == SINK_DIRECT &&
+      ( path == NULL || posix_memalign( ( void ** )&sink->buffer, DIRECT_ALIGNMENT, DIRECT_BUFFER_SIZE ) != 0 ) )
+  {
+    fprintf( stderr, "O_DIRECT sinks need an output file\n" );
+    return false;
+  }
+
+  if( path != NULL )
+  {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | ( ( type == SINK_DIRECT ) ? O_DIRECT : 0 );
+    sink->fd = open( path, flags, 0644 );
+    if( sink->fd < 0 )
+    {
+      fprintf( stderr, "Can't open %s: %s\n", path, strerror( errno ) );
+      free( sink->buffer );
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+/** Flushes and closes the output sink.
+ *
+ *  \param sink Sink to close.
+ *  \return \c false on error.
+ */
+static bool _sink_close( struct sink *sink )
+{
+  bool rv = true;
+  if( sink->type == SINK_DIRECT && sink->buffer_len > 0 )
+  {
+    /* the last block is padded, then the file is cut to its real size */
+    size_t padded = ( sink->buffer_len + DIRECT_ALIGNMENT - 1 ) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+    memset( sink->buffer + sink->buffer_len, 0, padded - sink->buffer_len );
+    rv = _write_all( sink->fd, sink->buffer, padded ) && ftruncate( sink->fd, sink->bytes ) == 0;
+  }
+
+  free( sink->buffer );
+  if( sink->fd != STDOUT_FILENO )
+    rv = ( close( sink->fd ) == 0 ) && rv;
+  return rv;
+}
+
+
+/** Releases a chunk compressed in the background.
+ *
+ *  \param cb_ctx Unused.
+ *  \param data Chunk.
+ *  \param data_len Unused.
+ *  \param success Unused.
+ */
+static void _release_chunk( void *cb_ctx, const void *data, size_t data_len, bool success )
+{
+  free( ( void * )data );
+}
+
+
+/** Adds an entry with the data read from a file descriptor.
+ *
+ *  \param r Run state.
+ *  \param fd Input file descriptor.
+ *  \param name Entry name.
+ *  \param datetime Entry date and time.
+ *  \return \c false on error.
+ */
+static bool _add_stream( struct run *r, int fd, const char *name, struct zip_datetime datetime )
+{
+  const struct settings *s = r->s;
+  if( !( s->async ? zip_async_entry_add( &r->a, name, datetime ) : zip_entry_add( &r->z, name, datetime ) ) )
+    return false;
+
+  /* in the background each chunk is released once it's compressed */
+  uint8_t *chunk = s->async ? NULL : malloc( s->read_size );
+  bool rv = s->async || chunk != NULL;
+  while( rv )
+  {
+    if( s->async )
+      chunk = malloc( s->read_size );
+
+    ssize_t n = ( chunk != NULL ) ? read( fd, chunk, s->read_size ) : -1;
+    if( n < 0 && errno == EINTR )
+      continue;
+    if( n <= 0 )
+    {
+      rv = ( n == 0 );
+      break;
+    }
+
+    r->input_bytes += n;
+    rv = s->async ? zip_async_entry_update( &r->a, chunk, n, _release_chunk, NULL )
+                  : zip_entry_update( &r->z, chunk, n );
+    if( s->async && !rv )
+      free( chunk );
+    chunk = s->async ? NULL : chunk;
+  }
+
+  free( chunk );
+  return rv && ( s->async ? zip_async_entry_end( &r->a, NULL, NULL ) : zip_entry_end( &r->z ) );
+}
+
+
+/** Adds an input: a directory, a file, or stdin ("-").
+ *
+ *  \param r Run state.
+ *  \param path Input path.
+ *  \return \c false on error.
+ */
+static bool _add_input( struct run *r, const char *path )
+{
+  if( strcmp( path, "-" ) == 0 )
+    return _add_stream( r, STDIN_FILENO, r->s->stdin_name, zip_get_datetime() );
+
+  struct stat st;
+  if( stat( path, &st ) != 0 )
+  {
+    fprintf( stderr, "Can't open %s: %s\n", path, strerror( errno ) );
+    return false;
+  }
+
+  /* the background thread owns the context, so it must be idle */
+  if( S_ISDIR( st.st_mode ) )
+  {
+    if( r->s->async && !zip_async_wait( &r->a ) )
+      return false;
+    return zip_add_directory( &r->z, path, &r->s->dir_opts );
+  }
+
+  int fd = open( path, O_RDONLY );
+  if( fd < 0 )
+  {
+    fprintf( stderr, "Can't open %s: %s\n", path, strerror( errno ) );
+    return false;
+  }
+
+  struct tm tm;
+  localtime_r( &st.st_mtime, &tm );
+  struct zip_datetime datetime = {
+    .year = tm.tm_year + 1900,
+    .month = tm.tm_mon + 1,
+    .day = tm.tm_mday,
+    .hours = tm.tm_hour,
+    .minutes = tm.tm_min,
+    .seconds = tm.tm_sec,
+  };
+
+  /* entry names are relative */
+  const char *name = path;
+  while( *name == '/' )
+    name++;
+  while( strncmp( name, "./", 2 ) == 0 )
+    name += 2;
+
+  posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+  bool rv = _add_stream( r, fd, name, datetime );
+  close( fd );
+  return rv;
+}
+
+
+/** Adds the inputs listed in a file, one per line.
+ *
+ *  \param r Run state.
+ *  \param list File with the list ("-" for stdin).
+ *  \return \c false on error.
+ */
+static bool _add_list( struct run *r, const char *list )
+{
+  FILE *f = ( strcmp( list, "-" ) == 0 ) ? stdin : fopen( list, "r" );
+  if( f == NULL )
+  {
+    fprintf( stderr, "Can't open %s: %s\n", list, strerror( errno ) );
+    return false;
+  }
+
+  bool rv = true;
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t n;
+  while( rv && ( n = getline( &line, &line_size, f ) ) >= 0 )
+  {
+    while( n > 0 && ( line[n - 1] == '\n' || line[n - 1] == '\r' ) )
+      line[--n] = '\0';
+    if( n > 0 )
+      rv = _add_input( r, line );
+  }
+
+  free( line );
+  if( f != stdin )
+    fclose( f );
+  return rv;
+}
+
+
+/** Returns a monotonic timestamp.
+ *
+ *  \return Seconds since an arbitrary point.
+ */
+static double _now( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/** Prints the statistics of a finished run.
+ *
+ *  \param r Run state.
+ *  \param sink Output sink.
+ *  \param elapsed Seconds since the run started.
+ */
+static void _print_stats( struct run *r, const struct sink *sink, double elapsed )
+{
+  /* directories are not read by this tool, the entries tell their sizes */
+  uint64_t input = 0;
+  for( size_t i = 0; i < varray_len( r->z.entries ); i++ )
+    input += r->z.entries[i].size;
+  if( r->z.num_spilled > 0 )
+    input = r->input_bytes;
+
+  zip_rate_stats_t rate;
+  zip_get_rate_stats( &r->z, &rate );
+  zip_verify_stats_t verify;
+  zip_get_verify_stats( &r->z, &verify );
+
+  double ratio = ( input > 0 ) ? 100.0 * sink->bytes / input : 0;
+  fprintf( stderr, "entries      %zu\n", zip_get_num_entries( &r->z ) );
+  fprintf( stderr, "input        %llu bytes\n", ( unsigned long long )input );
+  fprintf( stderr, "output       %llu bytes (%.1f%%)\n", ( unsigned long long )sink->bytes, ratio );
+  fprintf( stderr, "elapsed      %.3f s (%.1f MiB/s in, %.1f MiB/s out)\n", elapsed,
+           input / 1048576.0 / elapsed, sink->bytes / 1048576.0 / elapsed );
+  fprintf( stderr, "throttled    %.3f s\n", rate.throttled_us / 1e6 );
+  fprintf( stderr, "memory       %zu bytes\n", zip_memory_usage( &r->z ) );
+  if( r->s->opts.adaptive )
+    fprintf( stderr, "level        %d (adaptive)\n", r->z.adaptive_level );
+  if( r->s->opts.verify )
+    fprintf( stderr, "verified     %llu entries\n", ( unsigned long long )verify.entries );
+
+  for( size_t i = 0; i <= r->s->opts.num_rules; i++ )
+  {
+    uint64_t hits = zip_get_rule_hits( &r->z, i );
+    if( hits == 0 )
+      continue;
+
+    /* the last counter is for the entries without a rule */
+    if( i == r->s->opts.num_rules )
+    {
+      fprintf( stderr, "no rule      %llu entries\n", ( unsigned long long )hits );
+      continue;
+    }
+
+    const zip_rule_t *rule = &r->s->opts.rules[i];
+    fprintf( stderr, "rule %-7s %llu entries, level %d\n", ( rule->pattern != NULL ) ? rule->pattern : "(magic)",
+             ( unsigned long long )hits, rule->level );
+  }
+}
+
+
+/** Parses the command line.
+ *
+ *  \param s Output settings.
+ *  \param argc Number of arguments.
+ *  \param argv Arguments.
+ *  \param sink_type Output sink type.
+ *  \return Index of the first input in \a argv, -1 on error.
+ */
+static int _parse_args( struct settings *s, int argc, char **argv, enum sink_type *sink_type )
+{
+  memset( s, 0, sizeof( *s ) );
+  zip_options_init( &s->opts );
+  zip_dir_options_init( &s->dir_opts );
+  s->stdin_name = "stdin";
+  s->read_size = DEFAULT_READ_SIZE;
+  s->stats = true;
+  *sink_type = SINK_FD;
+
+  const zip_rule_t *defaults;
+  size_t num_defaults = zip_get_default_rules( &defaults );
+  bool use_defaults = true;
+  int level = Z_DEFAULT_COMPRESSION;
+  bool store = false;
+
+  int c;
+  uint64_t value;
+  while( ( c = getopt( argc, argv, "o:L:n:l:m:Ra:eVD:j:p:Stb:M:r:k:qh" ) ) != -1 )
+  {
+    bool valid = true;
+    switch( c )
+    {
+      case 'o':
+        s->output = optarg;
+        break;
+
+      case 'L':
+        s->list = optarg;
+        break;
+
+      case 'n':
+        s->stdin_name = optarg;
+        break;
+
+      case 'l':
+        valid = ( sscanf( optarg, "%d", &level ) == 1 && level >= 0 && level <= 9 );
+        break;
+
+      case 'm':
+        store = ( strcmp( optarg, "store" ) == 0 );
+        valid = store || strcmp( optarg, "deflate" ) == 0;
+        break;
+
+      case 'R':
+        use_defaults = false;
+        break;
+
+      case 'a':
+        s->opts.adaptive = true;
+        valid = ( sscanf( optarg, "%d:%d", &s->opts.min_level, &s->opts.max_level ) == 2 );
+        break;
+
+      case 'e':
+        s->opts.password = getenv( "ZIPSTREAM_PASSWORD" );
+        valid = ( s->opts.password != NULL && s->opts.password[0] != '\0' );
+        break;
+
+      case 'V':
+        s->opts.verify = true;
+        break;
+
+      case 'D':
+        s->opts.manifest = optarg;
+        break;
+
+      case 'j':
+        valid = _parse_size( optarg, &value ) && value > 0;
+        s->dir_opts.num_readers = value;
+        break;
+
+      case 'p':
+        valid = _parse_size( optarg, &value ) && value > 0;
+        s->dir_opts.prefetch = value;
+        break;
+
+      case 'S':
+        s->dir_opts.sorted = true;
+        break;
+
+      case 't':
+        s->async = true;
+        break;
+
+      case 'b':
+        valid = _parse_size( optarg, &value ) && value > 0;
+        s->read_size = value;
+        break;
+
+      case 'M':
+        valid = _parse_size( optarg, &value );
+        s->opts.memory_budget = value;
+        break;
+
+      case 'r':
+        valid = _parse_size( optarg, &value );
+        s->opts.rate_limit = value;
+        break;
+
+      case 'k':
+        *sink_type = ( strcmp( optarg, "direct" ) == 0 ) ? SINK_DIRECT
+                     : ( strcmp( optarg, "uring" ) == 0 ) ? SINK_URING
+                                                          : SINK_FD;
+        valid = ( *sink_type != SINK_FD || strcmp( optarg, "fd" ) == 0 );
+        break;
+
+      case 'q':
+        s->stats = false;
+        break;
+
+      default:
+        valid = false;
+        break;
+    }
+
+    if( !valid )
+    {
+      _usage( argv[0] );
+      return -1;
+    }
+  }
+
+  /* storing everything takes a single rule, other levels apply after the defaults */
+  s->opts.num_rules = 0;
+  if( !store && use_defaults )
+    for( size_t i = 0; i < num_defaults && i < sizeof( s->rules ) / sizeof( s->rules[0] ) - 1; i++ )
+      s->rules[s->opts.num_rules++] = defaults[i];
+  if( store || level != Z_DEFAULT_COMPRESSION )
+    s->rules[s->opts.num_rules++] = ( zip_rule_t ){ NULL, NULL, 0, store ? 0 : level };
+  s->opts.rules = s->rules;
+
+  if( optind == argc && s->list == NULL )
+  {
+    _usage( argv[0] );
+    return -1;
+  }
+
+  return optind;
+}
+
+
+/*-----------------------------------------------------------------------------
+   Main
+-----------------------------------------------------------------------------*/
+
+int main( int argc, char **argv )
+{
+  struct settings s;
+  enum sink_type sink_type;
+  int first = _parse_args( &s, argc, argv, &sink_type );
+  if( first < 0 )
+    return EXIT_FAILURE;
+
+  struct sink sink;
+  if( !_sink_open( &sink, sink_type, s.output ) )
+    return EXIT_FAILURE;
+
+  /* regular files get complete local headers */
+  struct stat st;
+  if( sink_type == SINK_FD && fstat( sink.fd, &st ) == 0 && S_ISREG( st.st_mode ) &&
+      lseek( sink.fd, 0, SEEK_CUR ) == 0 )
+    s.opts.pwrite_cb = _sink_pwrite;
+
+  struct run r = { .s = &s };
+  if( !zip_init_ex( &r.z, _sink_write, &sink, &s.opts ) )
+  {
+    fprintf( stderr, "Invalid options\n" );
+    _sink_close( &sink );
+    return EXIT_FAILURE;
+  }
+
+  if( s.async && !zip_async_init( &r.a, &r.z, 0 ) )
+  {
+    zip_release( &r.z );
+    _sink_close( &sink );
+    return EXIT_FAILURE;
+  }
+
+  double start = _now();
+  bool rv = ( s.list == NULL ) || _add_list( &r, s.list );
+  for( int i = first; rv && i < argc; i++ )
+    rv = _add_input( &r, argv[i] );
+
+  if( s.async )
+    rv = zip_async_release( &r.a ) && rv;
+  rv = rv && zip_end( &r.z );
+  rv = _sink_close( &sink ) && rv;
+  double elapsed = _now() - start;
+
+  /* the archive has no central directory if an entry failed the verification */
+  zip_verify_stats_t verify;
+  zip_get_verify_stats( &r.z, &verify );
+  if( verify.failures > 0 )
+    fprintf( stderr, "%llu entries failed the verification (last: %s)\n", ( unsigned long long )verify.failures,
+             verify.last_failure );
+
+  if( !rv )
+    fprintf( stderr, "Failed to write the archive\n" );
+  else if( s.stats )
+    _print_stats( &r, &sink, elapsed );
+
+  zip_release( &r.z );
+  return rv ? EXIT_SUCCESS : EXIT_FAILURE;
+}